@@ -21,8 +21,6 @@
 // partition may work better for the majority of cases.
 #define PICK_LARGEST_PART 1
 
-static BYTE MBR[512];
-
 /*.....................................................*/
 
 #if !PICK_LARGEST_PART
@@ -131,7 +129,7 @@ LBA2CHS(BYTE *pC, BYTE *pH, BYTE *pS, UINT LBA, UINT cHeads)
 /*....................................................*/
 
 static void
-SlideOtherPartitions(UINT iMainPart, UINT cSlideSectors, UINT cHeads)
+SlideOtherPartitions(BYTE *MBR, UINT iMainPart, UINT cSlideSectors, UINT cHeads)
 // Partitions after the main one are moved out of the way using the COW
 // API. All this function does it correct the partition table entries
 // in the MBR.
@@ -153,7 +151,7 @@ SlideOtherPartitions(UINT iMainPart, UINT cSlideSectors, UINT cHeads)
 /*.....................................................*/
 
 static UINT
-PartitionMaxSize(UINT iPart, UINT DiskSectors)
+PartitionMaxSize(BYTE *MBR, UINT iPart, UINT DiskSectors)
 // iPart is the offset into the boot sector of a partition. This
 // function returns the size (in sectors) which that partition
 // can grow to.
@@ -183,6 +181,7 @@ Enlarge_Drive(HVDDR hVDI, UINT NewDiskSize)
    UINT  LBA_part_start,part_sectors,ExtraSectors,Residue,iEndDisk;
    UINT  iMainPart,cHeads;
    PPART pPart;
+   BYTE  MBR[512];
    
    // Find main partition info.
    hVDI->ReadSectors(hVDI,MBR,0,1);
@@ -231,7 +230,7 @@ Enlarge_Drive(HVDDR hVDI, UINT NewDiskSize)
       }
 
       // Patch MBR to adjust position of any partitions beyond the main partition.
-      if (ExtraSectors) SlideOtherPartitions(iMainPart,ExtraSectors,cHeads);
+      if (ExtraSectors) SlideOtherPartitions(MBR,iMainPart,ExtraSectors,cHeads);
    }
 
    // Now grow the main partition to fill the available space.
@@ -241,7 +240,7 @@ Enlarge_Drive(HVDDR hVDI, UINT NewDiskSize)
    // the enlarge disk option but don't actually enlarge it, the main partition is also not enlarged, even if it only
    // occupies half of the drive. I should fix that.
    //
-   part_sectors = FSys_GrowPartition(pPart->PartType,(HVDDR)cow,LBA_part_start,part_sectors,PartitionMaxSize(iMainPart,NewDiskSize),cHeads);
+   part_sectors = FSys_GrowPartition(pPart->PartType,(HVDDR)cow,LBA_part_start,part_sectors,PartitionMaxSize(MBR,iMainPart,NewDiskSize),cHeads);
 
    // Record adjusted main partition size in MBR then write the MBR back to the (COW) drive.
    pPart->loNumSectors = (WORD)(part_sectors);
@@ -19,6 +19,7 @@
 #include "filename.h"
 #include "djfile.h"
 #include "mem.h"
+#include "scache.h"
 #include "hexview.h"
 #include "env.h"
 #include "ids.h"
@@ -514,6 +515,8 @@ SectorViewer_Show(HINSTANCE hInstRes, HWND hWndParent, HVDDR hVDI)
 {
    if (hVDI) {
       HUGE DriveSize;
+      HVDDR hCache = SCache_Create(hVDI,0,0); // scrolling through sectors one at a time gets read ahead.
+      if (hCache) hVDI = hCache;
       hVDI->GetDriveSize(hVDI, &DriveSize);
       DriveSize >>= 9;
       nSector = 0;
@@ -521,6 +524,7 @@ SectorViewer_Show(HINSTANCE hInstRes, HWND hWndParent, HVDDR hVDI)
       hVDI->ReadSectors(hVDI, MBR, 0, 1);
       hInstDlg = hInstRes;
       DialogBoxParam(hInstRes,RSTR(DLG_ALT_SECTOR_VIEWER),hWndParent,SectorViewerDlgProc,(LPARAM)hVDI);
+      if (hCache) hCache->Close(hCache);
    }
 }
 
@@ -28,6 +28,8 @@
 #include "env.h"
 #include "djstring.h"
 #include "cmdline.h"
+#include "bench.h"
+#include "batch.h"
 #include "ids.h"
 
 // fixed strings, these don't get localized
@@ -476,8 +478,18 @@ WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR szCmdLine, int nCmdSh
       AttachConsole(ATTACH_PARENT_PROCESS);
       rslt = 1;
       if (CmdLine_Parse(&parm)) {
-         VDDR_OpenMediaRegistry(parm.srcfn);
-         if (DoItForHeavensSake(NULL)) rslt = 0;
+         if (parm.SynthMB) {
+            if (Bench_Synthesize(&parm)) rslt = 0;
+         } else if (parm.batchfn[0]) {
+            if (Batch_Run(hInstApp,&parm)) rslt = 0;
+         } else {
+            VDDR_OpenMediaRegistry(parm.srcfn);
+            if (parm.flags & PARM_FLAG_BENCH) {
+               if (Bench_Run(hInstApp,&parm)) rslt = 0;
+            } else if (parm.flags & PARM_FLAG_DRYRUN) {
+               if (Clone_Estimate(&parm)) rslt = 0;
+            } else if (DoItForHeavensSake(NULL)) rslt = 0;
+         }
       }
    }
 
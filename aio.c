@@ -0,0 +1,177 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Asynchronous read queue. Each queued read is an overlapped ReadFile() whose
+ * completion is delivered to a private I/O completion port. File handles are tied to
+ * the port the first time they are used. Windows only allows a handle to be tied to
+ * one port in its lifetime, so if that fails the submit fails, and the caller falls
+ * back to ordinary synchronous reads.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include "aio.h"
+#include "mem.h"
+
+#define AIO_MAX_FILES 64
+
+// completion keys.
+#define AIO_KEY_IO     1  /* completion of a queued read */
+#define AIO_KEY_FAILED 2  /* read which failed before it could be queued */
+#define AIO_KEY_WAKE   3  /* posted by AIO_Wake() */
+
+typedef struct {
+   OVERLAPPED ov;    // must be first, GetQueuedCompletionStatus() gives me a pointer to this.
+   PVOID tag;
+   UINT len;
+   BOOL bInUse;
+} AIO_REQ;
+
+typedef struct t_AIO {
+   HANDLE hPort;
+   UINT QueueDepth;
+   UINT nPending;
+   UINT nFiles;
+   FILE files[AIO_MAX_FILES];  // handles already tied to hPort.
+   AIO_REQ req[1];             // actually QueueDepth elements.
+} AIO_INFO;
+
+/*.....................................................*/
+
+static BOOL
+AttachFile(HAIO h, FILE f)
+{
+   UINT i;
+   for (i=0; i<h->nFiles; i++) {
+      if (h->files[i]==f) return TRUE;
+   }
+   if (h->nFiles>=AIO_MAX_FILES) return FALSE;
+   if (!CreateIoCompletionPort((HANDLE)f,h->hPort,AIO_KEY_IO,0)) return FALSE;
+   h->files[h->nFiles++] = f;
+   return TRUE;
+}
+
+/*.....................................................*/
+
+PUBLIC HAIO
+AIO_Create(UINT QueueDepth)
+{
+   HAIO h;
+   if (QueueDepth<1) QueueDepth = 1;
+   if (QueueDepth>AIO_MAX_DEPTH) QueueDepth = AIO_MAX_DEPTH;
+   h = Mem_Alloc(MEMF_ZEROINIT,sizeof(AIO_INFO)+(QueueDepth-1)*sizeof(AIO_REQ));
+   if (h) {
+      h->QueueDepth = QueueDepth;
+      h->hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE,NULL,0,1);
+      if (!h->hPort) h = Mem_Free(h);
+   }
+   return h;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+AIO_Submit(HAIO h, FILE f, HUGE pos, PVOID buffer, UINT len, PVOID tag)
+{
+   AIO_REQ *pReq = NULL;
+   UINT i;
+
+   if (!h || f==NULLFILE || !tag || h->nPending>=h->QueueDepth) return FALSE;
+   if (!AttachFile(h,f)) return FALSE;
+   for (i=0; i<h->QueueDepth; i++) {
+      if (!h->req[i].bInUse) {
+         pReq = h->req+i;
+         break;
+      }
+   }
+   if (!pReq) return FALSE;
+
+   Mem_Zero(&pReq->ov,sizeof(OVERLAPPED));
+   pReq->ov.Offset = LO32(pos);
+   pReq->ov.OffsetHigh = HI32(pos);
+   pReq->tag = tag;
+   pReq->len = len;
+   pReq->bInUse = TRUE;
+   h->nPending++;
+
+   if (!ReadFile((HANDLE)f,buffer,len,NULL,&pReq->ov)) {
+      DWORD err = GetLastError();
+      if (err==ERROR_INVALID_PARAMETER) {
+         // an unbuffered handle refuses reads which aren't sector aligned. Hand this
+         // one back so that the caller does a normal (buffered) read instead.
+         pReq->bInUse = FALSE;
+         h->nPending--;
+         return FALSE;
+      }
+      if (err!=ERROR_IO_PENDING) {
+         // nothing will arrive at the port for this one, so post the failure myself.
+         PostQueuedCompletionStatus(h->hPort,0,AIO_KEY_FAILED,&pReq->ov);
+      }
+   }
+   return TRUE;
+}
+
+/*.....................................................*/
+
+PUBLIC PVOID
+AIO_Reap(HAIO h, BOOL bWait, BOOL *pbOK)
+{
+   DWORD nBytes=0;
+   ULONG_PTR key=0;
+   LPOVERLAPPED pov=NULL;
+   AIO_REQ *pReq;
+   BOOL bResult;
+
+   *pbOK = FALSE;
+   if (!h) return NULL;
+   bResult = GetQueuedCompletionStatus(h->hPort,&nBytes,&key,&pov,(bWait ? INFINITE : 0));
+   if (!pov || key==AIO_KEY_WAKE) return NULL;
+
+   pReq = (AIO_REQ *)pov;
+   *pbOK = (bResult && key==AIO_KEY_IO && nBytes==pReq->len);
+   pReq->bInUse = FALSE;
+   h->nPending--;
+   return pReq->tag;
+}
+
+/*.....................................................*/
+
+PUBLIC void
+AIO_Wake(HAIO h)
+{
+   if (h) PostQueuedCompletionStatus(h->hPort,0,AIO_KEY_WAKE,NULL);
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+AIO_Pending(HAIO h)
+{
+   if (h) return h->nPending;
+   return 0;
+}
+
+/*.....................................................*/
+
+PUBLIC HAIO
+AIO_Destroy(HAIO h)
+{
+   if (h) {
+      BOOL bOK;
+      // the buffers belong to the caller and are about to be freed, so every read
+      // must have landed before I return.
+      while (h->nPending) AIO_Reap(h,TRUE,&bOK);
+      CloseHandle(h->hPort);
+      Mem_Free(h);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+/* end of aio.c */
+
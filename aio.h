@@ -0,0 +1,56 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef AIO_H
+#define AIO_H
+
+/*======================================================================*/
+/* Asynchronous file read queue, built on a Win32 I/O completion port.  */
+/* Keeps up to QueueDepth reads in flight, so that the OS and the drive */
+/* can reorder and overlap them.                                        */
+/*======================================================================*/
+
+#include "djtypes.h"
+#include "djfile.h"
+
+#define AIO_MAX_DEPTH 256
+
+typedef struct t_AIO *HAIO;
+
+HAIO AIO_Create(UINT QueueDepth);
+/* Creates a read queue allowing up to QueueDepth reads in flight at once. Returns
+ * NULL if the queue could not be created. Apart from AIO_Wake(), the functions below
+ * must all be called from the same thread.
+ */
+
+BOOL AIO_Submit(HAIO h, FILE f, HUGE pos, PVOID buffer, UINT len, PVOID tag);
+/* Queues a read of len bytes from byte offset pos in file f (which must have been
+ * opened with File_OpenReadAsync()). The tag is returned by AIO_Reap() when the read
+ * completes, and must not be NULL. Returns FALSE if the read could not be queued,
+ * e.g. because the queue is full or the file can't be used with a completion port,
+ * in which case the caller should do a normal read instead. The same goes for a read
+ * which an unbuffered handle rejects because pos, len or buffer is not sector aligned.
+ * The buffer must stay valid until the read has been reaped.
+ */
+
+PVOID AIO_Reap(HAIO h, BOOL bWait, BOOL *pbOK);
+/* Collects one completed read, returning its tag and setting *pbOK to FALSE if the
+ * read failed or was short. If bWait is FALSE then this returns NULL immediately when
+ * no reads have completed. If bWait is TRUE then this blocks until a read completes
+ * or until another thread calls AIO_Wake(), returning NULL in the latter case.
+ */
+
+void AIO_Wake(HAIO h);
+/* Wakes the thread blocked in AIO_Reap(). Can be called from any thread. */
+
+UINT AIO_Pending(HAIO h);
+/* Returns the number of reads submitted and not yet reaped. */
+
+HAIO AIO_Destroy(HAIO h);
+/* Waits for any reads still in flight, then destroys the queue. Always returns NULL. */
+
+#endif
+
@@ -0,0 +1,435 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Batch mode. The manifest is read and parsed up front into an array of jobs, then a
+ * pool of worker threads runs them through Clone_Proceed(). Each worker takes the first
+ * pending job whose source and dest volumes have a free slot, so one busy disk doesn't
+ * hold up jobs on the others. The jobs share nothing but the console, and the setup
+ * lock inside clone.c.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include <winuser.h>
+#include "batch.h"
+#include "clone.h"
+#include "cmdline.h"
+#include "djfile.h"
+#include "filename.h"
+#include "mem.h"
+#include "stats.h"
+#include "env.h"
+#include "ids.h"
+
+#define BATCH_DEFAULT_JOBS 4
+#define BATCH_MAX_JOBS     64  /* WaitForMultipleObjects() limit */
+
+#define JOB_PENDING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+typedef struct {
+   s_CLONEPARMS parm;
+   CLONE_STATS  stats;
+   UINT iLine;          // manifest line number, for messages.
+   UINT iSrcDev;        // index of the source volume in BATCH.dev[].
+   UINT iDstDev;        // index of the dest volume, may be the same as iSrcDev.
+   UINT state;          // JOB_xxx.
+   BOOL bSuccess;
+   HUGE ticks;          // wall time of the job, in Stats_Now() units.
+} BATCH_JOB;
+
+typedef struct {
+   FNCHAR root[MAX_PATH];
+   UINT nActive;        // running jobs which use this volume.
+} BATCH_DEVICE;
+
+typedef struct {
+   HINSTANCE hInstRes;
+   BATCH_JOB *job;
+   UINT nJobs;
+   UINT nPending;
+   BATCH_DEVICE *dev;
+   UINT nDevs;
+   UINT nPerDevice;
+   CRITICAL_SECTION cs; // guards the job states, nPending and the device counts.
+   HANDLE hWake;        // manual reset, set when a job finishes so that idle workers look again.
+} BATCH;
+
+// localization strings
+static PSTR pszBATCHREAD /* = "Could not read the batch manifest ""%s""" */;
+static PSTR pszBATCHLINE /* = "(manifest line %lu)" */;
+static PSTR pszBATCHOK   /* = "Done: %s" */;
+static PSTR pszBATCHFAIL /* = "FAILED: %s" */;
+static PSTR pszBATCHSUM  /* = "%lu of %lu batch jobs succeeded" */;
+
+/*.....................................................*/
+
+static void
+Print(DWORD nStdHandle, PSTR pszMsg)
+// Writes one line to the console. The line goes in a single write so that lines from
+// different workers don't get mixed up.
+{
+   FILE f = (FILE)GetStdHandle(nStdHandle);
+   if (f && f!=NULLFILE) {
+      CHAR sz[1200];
+      UINT len = lstrlen(pszMsg);
+      if (len>(sizeof(sz)-3)) len = sizeof(sz)-3;
+      CopyMemory(sz,pszMsg,len);
+      sz[len++] = '\r';
+      sz[len++] = '\n';
+      File_WrBin(f,sz,len);
+   }
+}
+
+/*.....................................................*/
+
+static PSTR
+ReadManifest(CPFN fn)
+// Returns the whole file as a NUL terminated string, or NULL on failure.
+{
+   PSTR pszBuff = NULL;
+   HUGE size;
+   FILE f = File_OpenRead(fn);
+   if (f!=NULLFILE) {
+      File_Size(f,&size);
+      if (size<0x1000000) { // 16MB is a lot of command lines.
+         pszBuff = Mem_Alloc(0,(UINT)size+1);
+         if (pszBuff) {
+            if (File_RdBin(f,pszBuff,(UINT)size)==(UINT)size) pszBuff[size] = (CHAR)0;
+            else pszBuff = Mem_Free(pszBuff);
+         }
+      }
+      File_Close(f);
+   }
+   return pszBuff;
+}
+
+/*.....................................................*/
+
+static PSTR
+NextLine(PSTR *ppsz)
+// Returns the next line of the manifest (NUL terminated in place, without the CR/LF), and
+// advances *ppsz past it. Returns NULL at the end of the file.
+{
+   PSTR psz = *ppsz,pszLine = psz;
+   if (!*psz) return NULL;
+   while (*psz && *psz!='\n') psz++;
+   if (*psz) *psz++ = (CHAR)0;
+   *ppsz = psz;
+   psz = pszLine+lstrlen(pszLine);
+   while (psz>pszLine && (psz[-1]=='\r' || psz[-1]==' ' || psz[-1]==9)) *(--psz) = (CHAR)0;
+   return pszLine;
+}
+
+/*.....................................................*/
+
+static BOOL
+IsJobLine(PSTR pszLine)
+{
+   while (*pszLine==' ' || *pszLine==9) pszLine++;
+   return (*pszLine && *pszLine!='#' && *pszLine!=';');
+}
+
+/*.....................................................*/
+
+static void
+FixDestExtension(PFN dstfn)
+// Same rule as the interactive mode: the clone is always a VDI.
+{
+   if (!Filename_IsExtension(dstfn,"vdi")) {
+      if (Filename_IsExtension(dstfn,"vhd") || Filename_IsExtension(dstfn,"vmdk") ||
+          Filename_IsExtension(dstfn,"raw") || Filename_IsExtension(dstfn,"img")  ||
+          Filename_IsExtension(dstfn,"hdd")) {
+         Filename_ChangeExtension(dstfn,"vdi");
+      } else {
+         Filename_AddExtension(dstfn,"vdi");
+      }
+   }
+}
+
+/*.....................................................*/
+
+static UINT
+FindDevice(BATCH *pBatch, CPFN fn)
+// Returns the index of the volume which fn is on, adding it to the table if it is new.
+// A file whose volume can't be found is treated as being on a volume of its own.
+{
+   FNCHAR root[MAX_PATH];
+   UINT i;
+   if (!GetVolumePathName(fn,root,MAX_PATH)) lstrcpyn(root,fn,MAX_PATH);
+   for (i=0; i<pBatch->nDevs; i++) {
+      if (lstrcmpi(pBatch->dev[i].root,root)==0) return i;
+   }
+   lstrcpy(pBatch->dev[i].root,root);
+   pBatch->nDevs++;
+   return i;
+}
+
+/*.....................................................*/
+
+static BOOL
+HasRoom(BATCH *pBatch, BATCH_JOB *pJob)
+{
+   if (pBatch->dev[pJob->iSrcDev].nActive >= pBatch->nPerDevice) return FALSE;
+   return (pBatch->dev[pJob->iDstDev].nActive < pBatch->nPerDevice);
+}
+
+/*.....................................................*/
+
+static void
+SetDeviceActive(BATCH *pBatch, BATCH_JOB *pJob, BOOL bActive)
+// A job whose source and dest are on the same volume only takes one slot there.
+{
+   if (bActive) {
+      pBatch->dev[pJob->iSrcDev].nActive++;
+      if (pJob->iDstDev!=pJob->iSrcDev) pBatch->dev[pJob->iDstDev].nActive++;
+   } else {
+      pBatch->dev[pJob->iSrcDev].nActive--;
+      if (pJob->iDstDev!=pJob->iSrcDev) pBatch->dev[pJob->iDstDev].nActive--;
+   }
+}
+
+/*.....................................................*/
+
+static BATCH_JOB *
+TakeJob(BATCH *pBatch)
+// Called with the lock held. Returns the first pending job which can start now, or NULL.
+{
+   UINT i;
+   for (i=0; i<pBatch->nJobs; i++) {
+      BATCH_JOB *pJob = pBatch->job+i;
+      if (pJob->state==JOB_PENDING && HasRoom(pBatch,pJob)) {
+         pJob->state = JOB_RUNNING;
+         SetDeviceActive(pBatch,pJob,TRUE);
+         pBatch->nPending--;
+         return pJob;
+      }
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+static void
+RunJob(BATCH *pBatch, BATCH_JOB *pJob)
+{
+   CHAR szMsg[1100];
+   HUGE tStart = Stats_Now();
+
+   pJob->bSuccess = Clone_Proceed(pBatch->hInstRes,NULL,&pJob->parm);
+   pJob->ticks = Stats_Now()-tStart;
+   wsprintf(szMsg,(pJob->bSuccess ? RSTR(BATCHOK) : RSTR(BATCHFAIL)),pJob->parm.srcfn);
+   Print(STD_OUTPUT_HANDLE,szMsg);
+}
+
+/*.....................................................*/
+
+static DWORD WINAPI
+WorkerThread(LPVOID pUser)
+{
+   BATCH *pBatch = (BATCH*)pUser;
+   BATCH_JOB *pJob;
+
+   for (;;) {
+      EnterCriticalSection(&pBatch->cs);
+      if (!pBatch->nPending) {
+         LeaveCriticalSection(&pBatch->cs);
+         break;
+      }
+      pJob = TakeJob(pBatch);
+      // reset under the lock, so that a job finishing after this can't be missed.
+      if (!pJob) ResetEvent(pBatch->hWake);
+      LeaveCriticalSection(&pBatch->cs);
+
+      if (!pJob) {
+         // every pending job wants a volume which is busy. Something is running, so
+         // something will finish and wake us.
+         WaitForSingleObject(pBatch->hWake,INFINITE);
+      } else {
+         RunJob(pBatch,pJob);
+         EnterCriticalSection(&pBatch->cs);
+         pJob->state = JOB_DONE;
+         SetDeviceActive(pBatch,pJob,FALSE);
+         SetEvent(pBatch->hWake);
+         LeaveCriticalSection(&pBatch->cs);
+      }
+   }
+   return 0;
+}
+
+/*.....................................................*/
+
+static BOOL
+LoadJobs(BATCH *pBatch, s_CLONEPARMS *parm)
+// Reads and parses the whole manifest. Returns FALSE, after reporting the error, if the
+// manifest could not be read or any line is bad.
+{
+   CHAR szMsg[1200];
+   FNCHAR dir[1024];
+   PSTR pszBuff,psz,pszLine;
+   UINT iLine,nJobs=0;
+   BOOL bOK = TRUE;
+
+   pszBuff = ReadManifest(parm->batchfn);
+   if (!pszBuff) {
+      wsprintf(szMsg,RSTR(BATCHREAD),parm->batchfn);
+      Print(STD_ERROR_HANDLE,szMsg);
+      return FALSE;
+   }
+
+   // count the jobs, so that the arrays can be allocated in one go.
+   for (psz=pszBuff; *psz; psz++) if (*psz=='\n') nJobs++;
+   nJobs++;
+   pBatch->job = Mem_Alloc(MEMF_ZEROINIT,nJobs*sizeof(BATCH_JOB));
+   pBatch->dev = Mem_Alloc(MEMF_ZEROINIT,2*nJobs*sizeof(BATCH_DEVICE));
+   if (!pBatch->job || !pBatch->dev) {
+      Mem_Free(pszBuff);
+      return FALSE;
+   }
+
+   // relative paths in the manifest are relative to the manifest, not to the current directory.
+   Filename_SplitPath(parm->batchfn,dir,NULL);
+   psz = pszBuff;
+   for (iLine=1; (pszLine = NextLine(&psz)) != NULL; iLine++) {
+      BATCH_JOB *pJob = pBatch->job+pBatch->nJobs;
+      if (!IsJobLine(pszLine)) continue;
+      if (!CmdLine_ParseLine(&pJob->parm,pszLine,dir)) {
+         wsprintf(szMsg,RSTR(BATCHLINE),iLine);
+         Print(STD_ERROR_HANDLE,szMsg);
+         bOK = FALSE;
+         continue; // report every bad line, not just the first one.
+      }
+      FixDestExtension(pJob->parm.dstfn);
+      if (!pJob->parm.MaxMemoryMB) pJob->parm.MaxMemoryMB = parm->MaxMemoryMB; // the batch limit is per job.
+      pJob->parm.flags |= PARM_FLAG_BATCHJOB;
+      pJob->parm.pStats = &pJob->stats;
+      pJob->iLine = iLine;
+      pJob->iSrcDev = FindDevice(pBatch,pJob->parm.srcfn);
+      pJob->iDstDev = FindDevice(pBatch,pJob->parm.dstfn);
+      pBatch->nJobs++;
+   }
+   Mem_Free(pszBuff);
+   return bOK;
+}
+
+/*.....................................................*/
+
+static BOOL
+WriteReport(BATCH *pBatch, s_CLONEPARMS *parm, UINT nThreads, UINT nOK, HUGE ticks)
+// Writes the JSON summary of the whole batch. The per-job figures are the same ones
+// Stats_WriteReport() gives for a single clone, use --report on a manifest line to get
+// the detail.
+{
+   PSTR pszBuff,psz;
+   HUGE BytesRead=0,BytesWritten=0;
+   UINT i;
+   BOOL bOK = FALSE;
+   FILE f;
+
+   pszBuff = psz = Mem_Alloc(0,4096+pBatch->nJobs*5120);
+   if (!pszBuff) return FALSE;
+
+   for (i=0; i<pBatch->nJobs; i++) {
+      BytesRead += pBatch->job[i].stats.BytesRead;
+      BytesWritten += ((HUGE)pBatch->job[i].stats.nCopied)*pBatch->job[i].stats.BlockSize;
+   }
+
+   psz += wsprintf(psz,"{\r\n  \"manifest\": ");
+   psz = Stats_JsonString(psz,parm->batchfn);
+   psz += wsprintf(psz,",\r\n  \"workers\": %lu,\r\n  \"per_device\": %lu,\r\n",nThreads,pBatch->nPerDevice);
+   psz += wsprintf(psz,"  \"jobs\": %lu,\r\n  \"succeeded\": %lu,\r\n  \"wall_ms\": ",pBatch->nJobs,nOK);
+   psz = Stats_HugeToStr(psz,Stats_Microseconds(ticks)/1000);
+   psz += wsprintf(psz,",\r\n  \"bytes_read\": ");
+   psz = Stats_HugeToStr(psz,BytesRead);
+   psz += wsprintf(psz,",\r\n  \"bytes_written\": ");
+   psz = Stats_HugeToStr(psz,BytesWritten);
+   psz += wsprintf(psz,",\r\n  \"results\": [");
+
+   for (i=0; i<pBatch->nJobs; i++) {
+      BATCH_JOB *pJob = pBatch->job+i;
+      psz += wsprintf(psz,"%s\r\n    {\"line\": %lu, \"source\": ",(i ? "," : ""),pJob->iLine);
+      psz = Stats_JsonString(psz,pJob->parm.srcfn);
+      psz += wsprintf(psz,", \"dest\": ");
+      psz = Stats_JsonString(psz,pJob->parm.dstfn);
+      psz += wsprintf(psz,", \"success\": %s, \"ms\": ",(pJob->bSuccess ? "true" : "false"));
+      psz = Stats_HugeToStr(psz,Stats_Microseconds(pJob->ticks)/1000);
+      psz += wsprintf(psz,", \"bytes_read\": ");
+      psz = Stats_HugeToStr(psz,pJob->stats.BytesRead);
+      psz += wsprintf(psz,", \"bytes_written\": ");
+      psz = Stats_HugeToStr(psz,((HUGE)pJob->stats.nCopied)*pJob->stats.BlockSize);
+      psz += wsprintf(psz,"}");
+   }
+   psz += wsprintf(psz,"\r\n  ]\r\n}\r\n");
+
+   f = File_Create(parm->reportfn,DJFILE_FLAG_OVERWRITE);
+   if (f!=NULLFILE) {
+      UINT len = (UINT)(psz-pszBuff);
+      bOK = (File_WrBin(f,pszBuff,len)==len);
+      File_Close(f);
+   }
+   Mem_Free(pszBuff);
+   return bOK;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Batch_Run(HINSTANCE hInstRes, s_CLONEPARMS *parm)
+{
+   HANDLE hThread[BATCH_MAX_JOBS];
+   CHAR szMsg[128];
+   BATCH batch;
+   UINT i,nThreads,nStarted=0,nOK=0;
+   DWORD tid;
+   HUGE tStart;
+   BOOL bOK;
+
+   Mem_Zero(&batch,sizeof(batch));
+   batch.hInstRes = hInstRes;
+   batch.nPerDevice = (parm->nPerDevice ? parm->nPerDevice : 1);
+   bOK = LoadJobs(&batch,parm);
+   if (bOK && batch.nJobs) {
+      nThreads = (parm->nJobs ? parm->nJobs : BATCH_DEFAULT_JOBS);
+      if (nThreads>BATCH_MAX_JOBS) nThreads = BATCH_MAX_JOBS;
+      if (nThreads>batch.nJobs) nThreads = batch.nJobs;
+      batch.nPending = batch.nJobs;
+      InitializeCriticalSection(&batch.cs);
+      batch.hWake = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+      tStart = Stats_Now();
+      if (batch.hWake) {
+         for (i=0; i<nThreads; i++) {
+            hThread[nStarted] = CreateThread(NULL,0,WorkerThread,&batch,0,&tid);
+            if (hThread[nStarted]) nStarted++;
+         }
+      }
+      if (nStarted) {
+         WaitForMultipleObjects(nStarted,hThread,TRUE,INFINITE);
+         for (i=0; i<nStarted; i++) CloseHandle(hThread[i]);
+      } else {
+         WorkerThread(&batch); // no threads to be had, run the jobs one at a time.
+         nStarted = 1;
+      }
+
+      for (i=0; i<batch.nJobs; i++) if (batch.job[i].bSuccess) nOK++;
+      wsprintf(szMsg,RSTR(BATCHSUM),nOK,batch.nJobs);
+      Print(STD_OUTPUT_HANDLE,szMsg);
+      if (parm->reportfn[0]) WriteReport(&batch,parm,nStarted,nOK,Stats_Now()-tStart);
+      bOK = (nOK==batch.nJobs);
+
+      if (batch.hWake) CloseHandle(batch.hWake);
+      DeleteCriticalSection(&batch.cs);
+   }
+   if (batch.job) Mem_Free(batch.job);
+   if (batch.dev) Mem_Free(batch.dev);
+   return bOK;
+}
+
+/*.....................................................*/
+
+/* end of batch.c */
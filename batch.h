@@ -0,0 +1,30 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+/*======================================================================*/
+/* Command line batch mode: runs the clone jobs listed in a manifest    */
+/* file, several at once, and reports on them all.                      */
+/*======================================================================*/
+
+#include "parms.h"
+
+BOOL Batch_Run(HINSTANCE hInstRes, s_CLONEPARMS *parm);
+/* Runs the clone jobs listed in manifest file parm->batchfn. Each line of the manifest is
+ * a command line (source, then options), parsed with CmdLine_ParseLine(). Blank lines and
+ * lines starting with '#' or ';' are ignored. Every line is checked before any job starts.
+ *
+ * parm->nJobs worker threads (default 4) take jobs from the manifest in order, but a job
+ * is held back while parm->nPerDevice (default 1) running jobs already use the volume its
+ * source or dest is on, since parallel clones on one hard disk only make it seek. One line
+ * is written to the console as each job finishes, and a JSON summary of every job goes to
+ * parm->reportfn if that is not empty. Returns FALSE if any job failed.
+ */
+
+#endif
+
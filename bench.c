@@ -0,0 +1,627 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Benchmark modes, run from the command line so that they can be scripted and the
+ * results compared between builds. Each phase records wall time and the CPU time of
+ * the whole process (the clone phase is multi-threaded), and the results are written
+ * as one JSON object.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include <wingdi.h>
+#include <winuser.h>
+#include "bench.h"
+#include "clone.h"
+#include "vddr.h"
+#include "vdiw.h"
+#include "fsys.h"
+#include "scache.h"
+#include "partinfo.h"
+#include "djfile.h"
+#include "filename.h"
+#include "djstring.h"
+#include "mem.h"
+#include "random.h"
+#include "stats.h"
+#include "env.h"
+#include "ids.h"
+
+#define BLOCK_SIZE   1048576
+#define SPB_SHIFT    11
+#define SYNTH_SEED   0x5EED1234
+#define BENCH_PHASES 4
+
+// layout of the FAT volume on a synthetic image.
+#define SYNTH_RESERVED       32       /* minimum reserved sectors (boot sector, FSInfo) */
+#define SYNTH_ROOT_ENTRIES   512      /* FAT16 root directory size */
+#define SYNTH_FAT12_MAX      0xFF4    /* most clusters a FAT12 volume has */
+#define SYNTH_FAT16_MAX      0xFFF4   /* most clusters a FAT16 volume has */
+#define SYNTH_MAX_VOL_BLOCKS (0xFFFFFFFF>>SPB_SHIFT) /* an MBR can't describe more */
+#define SYNTH_ZERO_EVERY     8        /* VDI: one in this many blocks without data is a zero block */
+
+// clone options under which the clone statistics can't be predicted from the source alone.
+#define VERIFY_SKIP_FLAGS    (PARM_FLAG_COMPACT|PARM_FLAG_ENLARGE|PARM_FLAG_NOMERGE|PARM_FLAG_RESUME)
+
+typedef struct {
+   BOOL bChecked;          // FALSE if the clone options made the counts unpredictable.
+   BOOL bOK;
+   UINT NotAlloc[2];       // expected and actual blocks skipped as not allocated.
+   UINT Zero[2];           // expected and actual blocks stored as zero because the source said so.
+   UINT Data[2];           // expected and actual blocks which were read (copied, found zero, or unchanged).
+} BENCH_VERIFY;
+
+typedef struct {
+   UINT FATtype;           // 16 or 32, 0 if the drive is too small for a volume.
+   UINT nMetaBlocks;       // blocks 1..nMetaBlocks hold the boot sector, FSInfo, FAT (and FAT16 root dir).
+   UINT FirstDataBlock;    // block holding cluster 2.
+   UINT nSectors;          // in the volume, which starts at block 1.
+   UINT SectorsPerCluster;
+   UINT ReservedSectors;
+   UINT SectorsPerFAT;
+   UINT RootDirSectors;
+   UINT nClusters;
+} SYNTH_VOLUME;
+
+typedef struct {
+   PSTR pszName;
+   HUGE tWall;     // wall time, in Stats_Now() ticks.
+   HUGE tCPU;      // process CPU time, in 100ns units.
+   HUGE nBytes;    // bytes processed, for the throughput figures.
+   UINT nItems;    // blocks, partitions etc, depending on the phase.
+   BOOL bOK;
+} BENCH_PHASE;
+
+// localization strings
+static PSTR pszBENCHCREATE /* = "Could not create the synthetic image file" */;
+
+/*.....................................................*/
+
+static BOOL
+Error(PSTR pszMsg)
+{
+   FILE f = (FILE)GetStdHandle(STD_ERROR_HANDLE);
+   if (f && f!=NULLFILE) {
+      File_WrBin(f,pszMsg,lstrlen(pszMsg));
+      File_WrBin(f,"\r\n",2);
+   }
+   return FALSE;
+}
+
+/*.....................................................*/
+
+static HUGE
+CPUTime(void)
+// Returns the user+kernel time used so far by all threads of this process, in 100ns units.
+{
+   FILETIME tCreate,tExit,tKernel,tUser;
+   if (!GetProcessTimes(GetCurrentProcess(),&tCreate,&tExit,&tKernel,&tUser)) return 0;
+   return MAKEHUGE(tKernel.dwLowDateTime,tKernel.dwHighDateTime)+MAKEHUGE(tUser.dwLowDateTime,tUser.dwHighDateTime);
+}
+
+/*.....................................................*/
+
+static void
+BeginPhase(BENCH_PHASE *pPhase, PSTR pszName)
+{
+   Mem_Zero(pPhase,sizeof(BENCH_PHASE));
+   pPhase->pszName = pszName;
+   pPhase->tCPU = CPUTime();
+   pPhase->tWall = Stats_Now();
+}
+
+/*.....................................................*/
+
+static void
+EndPhase(BENCH_PHASE *pPhase, BOOL bOK)
+{
+   pPhase->tWall = Stats_Now()-pPhase->tWall;
+   pPhase->tCPU = CPUTime()-pPhase->tCPU;
+   pPhase->bOK = bOK;
+}
+
+/*.....................................................*/
+
+static void
+FillSynthBlock(UINT *p, UINT iPage)
+// Fills a block with pseudo random data which won't compress or look like zeros.
+{
+   UINT i,x = (iPage*2654435761u) | 1;
+   for (i=0; i<(BLOCK_SIZE/sizeof(UINT)); i++) {
+      x ^= x<<13; x ^= x>>17; x ^= x<<5; // xorshift32
+      p[i] = x;
+   }
+   p[0] = iPage|0x80000000;
+   ((BYTE*)p)[510] = 0; // a data block mustn't look like an MBR or a boot sector.
+}
+
+/*.....................................................*/
+
+static BOOL
+PlanVolume(SYNTH_VOLUME *pv, UINT nBlocks)
+// Lays out a FAT volume which fills the drive after the first block (up to the 2TB an MBR
+// can describe), with the metadata ending on a block boundary so that every block after it
+// holds whole clusters. FAT32 is used where there are enough clusters for it, FAT16 on
+// smaller drives. Returns FALSE if the drive is too small even for FAT16.
+{
+   UINT FATtype,spc,EntryBytes,MetaSectors;
+
+   Mem_Zero(pv,sizeof(SYNTH_VOLUME));
+   if (nBlocks<2) return FALSE;
+   nBlocks--;
+   if (nBlocks>SYNTH_MAX_VOL_BLOCKS) nBlocks = SYNTH_MAX_VOL_BLOCKS;
+   pv->nSectors = (nBlocks<<SPB_SHIFT);
+   for (FATtype=32; FATtype>=16; FATtype-=16) {
+      EntryBytes = (FATtype>>3);
+      pv->RootDirSectors = (FATtype==16 ? ((SYNTH_ROOT_ENTRIES*32)>>9) : 0);
+      for (spc=64; spc; spc>>=1) {
+         pv->SectorsPerFAT = ((pv->nSectors/spc + 2)*EntryBytes + 511) >> 9;
+         MetaSectors = SYNTH_RESERVED + pv->SectorsPerFAT + pv->RootDirSectors;
+         pv->nMetaBlocks = (MetaSectors + ((1<<SPB_SHIFT)-1)) >> SPB_SHIFT;
+         if (pv->nMetaBlocks>=nBlocks) continue;
+         pv->ReservedSectors = (pv->nMetaBlocks<<SPB_SHIFT) - pv->SectorsPerFAT - pv->RootDirSectors;
+         pv->nClusters = (pv->nSectors - (pv->nMetaBlocks<<SPB_SHIFT)) / spc;
+         if (FATtype==32 && pv->nClusters<=SYNTH_FAT16_MAX) continue;
+         if (FATtype==16 && (pv->nClusters<=SYNTH_FAT12_MAX || pv->nClusters>SYNTH_FAT16_MAX)) continue;
+         pv->FATtype = FATtype;
+         pv->SectorsPerCluster = spc;
+         pv->FirstDataBlock = pv->nMetaBlocks+1;
+         return TRUE;
+      }
+   }
+   Mem_Zero(pv,sizeof(SYNTH_VOLUME));
+   return FALSE;
+}
+
+/*.....................................................*/
+
+static void
+PutUINT(BYTE *p, UINT x)
+{
+   p[0] = (BYTE)x; p[1] = (BYTE)(x>>8); p[2] = (BYTE)(x>>16); p[3] = (BYTE)(x>>24);
+}
+
+/*.....................................................*/
+
+static void
+PutWORD(BYTE *p, UINT x)
+{
+   p[0] = (BYTE)x; p[1] = (BYTE)(x>>8);
+}
+
+/*.....................................................*/
+
+static void
+FillBootSector(BYTE *pb, SYNTH_VOLUME *pv)
+{
+   Mem_Copy(pb,"\xEB\x58\x90MSWIN4.1",11);
+   PutWORD(pb+0x0B,512);
+   pb[0x0D] = (BYTE)pv->SectorsPerCluster;
+   PutWORD(pb+0x0E,pv->ReservedSectors);
+   pb[0x10] = 1; // one FAT, there's no point in a backup copy here.
+   pb[0x15] = 0xF8;
+   PutWORD(pb+0x18,63);
+   PutWORD(pb+0x1A,255);
+   PutUINT(pb+0x1C,1<<SPB_SHIFT); // hidden sectors, the volume starts at block 1.
+   PutUINT(pb+0x20,pv->nSectors);
+   if (pv->FATtype==32) {
+      PutUINT(pb+0x24,pv->SectorsPerFAT);
+      PutUINT(pb+0x2C,2); // root directory cluster.
+      PutWORD(pb+0x30,1); // FSInfo sector.
+      pb[0x40] = 0x80;
+      pb[0x42] = 0x29;
+      PutUINT(pb+0x43,SYNTH_SEED);
+      Mem_Copy(pb+0x47,"NO NAME    FAT32   ",19);
+   } else {
+      PutWORD(pb+0x11,SYNTH_ROOT_ENTRIES);
+      PutWORD(pb+0x16,pv->SectorsPerFAT);
+      pb[0x24] = 0x80;
+      pb[0x26] = 0x29;
+      PutUINT(pb+0x27,SYNTH_SEED);
+      Mem_Copy(pb+0x2B,"NO NAME    FAT16   ",19);
+   }
+   pb[510] = 0x55;
+   pb[511] = 0xAA;
+}
+
+/*.....................................................*/
+
+static void
+FillMetaBlock(BYTE *buffer, UINT iBlock, SYNTH_VOLUME *pv, BYTE *bUsed)
+// Fills block iBlock (0..pv->nMetaBlocks) with the MBR, or with the part of the FAT volume's
+// boot sector, FSInfo sector and FAT which falls in it. A cluster is marked used in the FAT
+// if its block holds data.
+{
+   UINT i,j,iSector,iEntry,EntriesPerSector,iCluster,mark,EOC;
+   BYTE *pb;
+
+   Mem_Zero(buffer,BLOCK_SIZE);
+   if (iBlock==0) {
+      PPART pPart = (PPART)(buffer+446);
+      PutUINT(buffer+440,SYNTH_SEED); // disk signature.
+      pPart->PartType = (BYTE)(pv->FATtype==32 ? 0x0C : 0x0E); // FAT32 or FAT16, LBA addressed.
+      pPart->pstart_chs_head = pPart->pend_chs_head = 0xFE;
+      pPart->pstart_chs_sect = pPart->pend_chs_sect = 0xFF;
+      pPart->pstart_chs_cyl  = pPart->pend_chs_cyl  = 0xFF;
+      pPart->loStartLBA   = LOWORD(1<<SPB_SHIFT);
+      pPart->hiStartLBA   = HIWORD(1<<SPB_SHIFT);
+      pPart->loNumSectors = LOWORD(pv->nSectors);
+      pPart->hiNumSectors = HIWORD(pv->nSectors);
+      buffer[510] = 0x55;
+      buffer[511] = 0xAA;
+      return;
+   }
+
+   EntriesPerSector = (512*8)/pv->FATtype;
+   EOC = (pv->FATtype==32 ? 0x0FFFFFFF : 0xFFFF); // end of chain: every used cluster is a one cluster file.
+   for (i=0; i<(1<<SPB_SHIFT); i++) {
+      pb = buffer+(i<<9);
+      iSector = ((iBlock-1)<<SPB_SHIFT)+i; // within the volume.
+      if (iSector==0) {
+         FillBootSector(pb,pv);
+      } else if (iSector==1 && pv->FATtype==32) {
+         PutUINT(pb,0x41615252);
+         PutUINT(pb+0x1E4,0x61417272);
+         PutUINT(pb+0x1E8,0xFFFFFFFF); // free count and next free not known.
+         PutUINT(pb+0x1EC,0xFFFFFFFF);
+         PutUINT(pb+0x1FC,0xAA550000);
+      } else if (iSector>=pv->ReservedSectors && iSector<(pv->ReservedSectors+pv->SectorsPerFAT)) {
+         for (j=0; j<EntriesPerSector; j++) {
+            iEntry = (iSector-pv->ReservedSectors)*EntriesPerSector + j;
+            if (iEntry>=2) {
+               iCluster = iEntry-2;
+               if (iCluster>=pv->nClusters) break;
+               if (!bUsed[pv->FirstDataBlock+((iCluster*pv->SectorsPerCluster)>>SPB_SHIFT)] &&
+                   !(pv->FATtype==32 && iCluster==0)) continue; // the FAT32 root directory is always in use.
+            }
+            mark = (iEntry==0 ? (EOC & (~7)) : EOC); // entry 0 holds the media byte.
+            if (pv->FATtype==32) PutUINT(pb+j*4,mark);
+            else PutWORD(pb+j*2,mark);
+         }
+      }
+   }
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Bench_Synthesize(s_CLONEPARMS *parm)
+{
+   UINT i,j,t,nBlocks,nData,nAlloc,nZero,nEmpty,*order;
+   UINT density = (parm->SynthDensity ? parm->SynthDensity : 100);
+   UINT frag = parm->SynthFrag;
+   BOOL bRaw,bOK = FALSE;
+   SYNTH_VOLUME vol;
+   BYTE *buffer,*bUsed;
+
+   if (density>100) density = 100;
+   if (frag>100) frag = 100;
+   nBlocks = parm->SynthMB;
+   bRaw = (Filename_IsExtension(parm->srcfn,"raw") || Filename_IsExtension(parm->srcfn,"img"));
+
+   // the MBR and the volume metadata are always stored, the density applies to the rest.
+   PlanVolume(&vol,nBlocks);
+   nData = (vol.FATtype ? vol.FirstDataBlock : 0);
+
+   // choose the allocated blocks, then shuffle frag% of them out of place.
+   Random_Randomize(SYNTH_SEED);
+   order = Mem_Alloc(0,(nBlocks+1)*sizeof(UINT));
+   bUsed = Mem_Alloc(MEMF_ZEROINIT,nBlocks+1);
+   buffer = Mem_AllocAligned(BLOCK_SIZE);
+   if (!order || !bUsed || !buffer) {
+      Mem_Free(order);
+      Mem_Free(bUsed);
+      Mem_FreeAligned(buffer);
+      return Error(RSTR(BENCHCREATE));
+   }
+   for (i=nData,nAlloc=nZero=nEmpty=0; i<nBlocks; i++) {
+      if (Random_Integer(100)<density) {
+         order[nAlloc++] = i;
+         bUsed[i] = TRUE;
+      } else if (!bRaw && ((++nEmpty)%SYNTH_ZERO_EVERY)==0) {
+         bUsed[i] = 2; // a zero block: in use by the guest, but known to hold zeros.
+         nZero++;
+      }
+   }
+   if (!bRaw) {
+      for (i=0; i<nAlloc; i++) {
+         if (Random_Integer(100)<frag) {
+            j = i+Random_Integer(nAlloc-i);
+            t = order[i]; order[i] = order[j]; order[j] = t;
+         }
+      }
+   }
+
+   if (bRaw) {
+      // a raw image has no allocation, so "unallocated" blocks are simply left as zeros.
+      FILE f = File_Create(parm->srcfn,DJFILE_FLAG_OVERWRITE|DJFILE_FLAG_SEQUENTIAL);
+      if (f!=NULLFILE) {
+         bOK = File_SetSize(f,((HUGE)nBlocks)<<20);
+         for (i=0; bOK && i<nData; i++) {
+            FillMetaBlock(buffer,i,&vol,bUsed);
+            bOK = (File_WriteAt(f,buffer,BLOCK_SIZE,((HUGE)i)<<20)==BLOCK_SIZE);
+         }
+         for (i=0; bOK && i<nAlloc; i++) {
+            FillSynthBlock((UINT*)buffer,order[i]);
+            bOK = (File_WriteAt(f,buffer,BLOCK_SIZE,((HUGE)order[i])<<20)==BLOCK_SIZE);
+         }
+         File_Close(f);
+         if (!bOK) File_Erase(parm->srcfn);
+      }
+      if (!bOK) Error(RSTR(BENCHCREATE));
+   } else {
+      HVDIW hVDI = VDIW_Create(parm->srcfn,BLOCK_SIZE,nBlocks,nData+nAlloc,VDIW_FLAG_SYNC_END);
+      if (hVDI) {
+         bOK = TRUE;
+         for (i=0; bOK && i<nData; i++) {
+            FillMetaBlock(buffer,i,&vol,bUsed);
+            bOK = VDIW_WritePage(hVDI,buffer,i,VDIW_ZERO_UNKNOWN);
+         }
+         for (i=nData; bOK && nZero && i<nBlocks; i++) {
+            if (bUsed[i]==2) bOK = VDIW_WritePage(hVDI,buffer,i,VDIW_ZERO_YES); // only the block map changes.
+         }
+         for (i=0; bOK && i<nAlloc; i++) {
+            FillSynthBlock((UINT*)buffer,order[i]);
+            bOK = VDIW_WritePage(hVDI,buffer,order[i],VDIW_ZERO_NO);
+         }
+         if (!bOK) VDIW_Discard(hVDI);
+         else {
+            VDIW_Close(hVDI);
+            bOK = (VDIW_GetLastError()==0);
+         }
+      }
+      if (!bOK) Error(VDIW_GetErrorString(0xFFFFFFFF));
+   }
+   Mem_FreeAligned(buffer);
+   Mem_Free(bUsed);
+   Mem_Free(order);
+   return bOK;
+}
+
+/*.....................................................*/
+
+static BOOL
+BenchBlockStatus(HVDDR hVDI, UINT nBlocks, BYTE *status, BENCH_PHASE *pPhase)
+// Times a BlockStatus() scan of the whole drive, keeping the results for the read phase.
+{
+   HUGE LBA;
+   UINT i;
+   BeginPhase(pPhase,"block_status");
+   for (i=0; i<nBlocks; i++) {
+      LBA = ((HUGE)i)<<SPB_SHIFT;
+      status[i] = (BYTE)hVDI->BlockStatus(hVDI,LBA,LBA+((1<<SPB_SHIFT)-1));
+   }
+   pPhase->nItems = nBlocks;
+   pPhase->nBytes = ((HUGE)nBlocks)*BLOCK_SIZE;
+   EndPhase(pPhase,TRUE);
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static BOOL
+BenchOpenVolumes(HVDDR hVDI, BENCH_PHASE *pPhase)
+// Times FSys_OpenVolume() (which loads the allocation bitmap) on each MBR partition,
+// reading through a sector cache as the clone does.
+{
+   BYTE MBR[512];
+   PPART pPart = (PPART)(MBR+446);
+   HVDDR hCache;
+   HFSYS h;
+   HUGE cLBA;
+   UINT i;
+
+   BeginPhase(pPhase,"fsys_open");
+   hCache = SCache_Create(hVDI,0,0);
+   if (hCache) hVDI = hCache;
+   if (hVDI->ReadSectors(hVDI,MBR,0,1)!=VDDR_RSLT_FAIL && MBR[510]==0x55 && MBR[511]==0xAA) {
+      for (i=0; i<4; i++,pPart++) {
+         cLBA = (HUGE)MAKELONG(pPart->loNumSectors,pPart->hiNumSectors);
+         if (!cLBA) continue;
+         h = FSys_OpenVolume(pPart->PartType,hVDI,(UINT)MAKELONG(pPart->loStartLBA,pPart->hiStartLBA),cLBA,512);
+         if (h) {
+            pPhase->nItems++;
+            pPhase->nBytes += (cLBA<<9);
+            h->CloseVolume(h);
+         }
+      }
+   }
+   if (hCache) hCache->Close(hCache);
+   EndPhase(pPhase,TRUE);
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static BOOL
+BenchReadPages(HVDDR hVDI, UINT nBlocks, BYTE *status, BENCH_PHASE *pPhase)
+// Times ReadPage() of every block which holds data, in drive order.
+{
+   BYTE *buffer = Mem_AllocAligned(BLOCK_SIZE);
+   BOOL bOK = (buffer!=NULL);
+   UINT i;
+
+   BeginPhase(pPhase,"read_page");
+   for (i=0; bOK && i<nBlocks; i++) {
+      if (status[i]!=VDDR_RSLT_NORMAL) continue;
+      bOK = (hVDI->ReadPage(hVDI,buffer,i,SPB_SHIFT)!=VDDR_RSLT_FAIL);
+      pPhase->nItems++;
+      pPhase->nBytes += BLOCK_SIZE;
+   }
+   EndPhase(pPhase,bOK);
+   Mem_FreeAligned(buffer);
+   return bOK;
+}
+
+/*.....................................................*/
+
+static BOOL
+BenchClone(HINSTANCE hInstRes, s_CLONEPARMS *parm, CLONE_STATS *pStats, BENCH_PHASE *pPhase)
+// Times a complete clone with the options the user gave, then deletes the clone. The
+// clone statistics go to *pStats. The caller must make sure that dstfn isn't srcfn.
+{
+   FNCHAR reportfn[1024];
+   BOOL bOK;
+
+   if (!Filename_IsExtension(parm->dstfn,"vdi")) Filename_ChangeExtension(parm->dstfn,"vdi");
+   String_Copy(reportfn,parm->reportfn,1024);
+   parm->reportfn[0] = 0; // the clone mustn't write its own report over mine.
+
+   Mem_Zero(pStats,sizeof(CLONE_STATS));
+   parm->pStats = pStats;
+   BeginPhase(pPhase,"clone");
+   bOK = Clone_Proceed(hInstRes,NULL,parm);
+   parm->pStats = NULL;
+   pPhase->nItems = parm->dst_nBlocksAllocated;
+   pPhase->nBytes = ((HUGE)parm->dst_nBlocksAllocated)*BLOCK_SIZE;
+   EndPhase(pPhase,bOK);
+
+   String_Copy(parm->reportfn,reportfn,1024);
+   if (bOK) File_Erase(parm->dstfn);
+   return bOK;
+}
+
+/*.....................................................*/
+
+static BOOL
+VerifyClone(s_CLONEPARMS *parm, CLONE_STATS *pStats, BYTE *status, UINT nBlocks, BENCH_VERIFY *pVerify)
+// Checks that the clone accounted for every block the way the source's BlockStatus() said it
+// should: each unallocated block skipped, each zero block stored as zero without being read,
+// and each other block read exactly once. A block counted twice, or under the wrong heading,
+// means the pipeline misreported a read result. Returns FALSE if the counts don't match.
+{
+   UINT i;
+
+   Mem_Zero(pVerify,sizeof(BENCH_VERIFY));
+   pVerify->bOK = TRUE;
+   if ((parm->flags & VERIFY_SKIP_FLAGS) || pStats->nBlocks!=nBlocks) return TRUE;
+   for (i=0; i<nBlocks; i++) {
+      if (status[i]==VDDR_RSLT_NOTALLOC) pVerify->NotAlloc[0]++;
+      else if (status[i]==VDDR_RSLT_BLANKPAGE) pVerify->Zero[0]++;
+      else pVerify->Data[0]++;
+   }
+   pVerify->NotAlloc[1] = pStats->nNotAlloc;
+   pVerify->Zero[1] = pStats->nZeroPlanned;
+   pVerify->Data[1] = pStats->nCopied+pStats->nZeroFound+pStats->nUnchanged;
+   pVerify->bChecked = TRUE;
+   pVerify->bOK = (pVerify->NotAlloc[0]==pVerify->NotAlloc[1] && pVerify->Zero[0]==pVerify->Zero[1] &&
+                   pVerify->Data[0]==pVerify->Data[1]);
+   return pVerify->bOK;
+}
+
+/*.....................................................*/
+
+static PSTR
+WriteCount(PSTR psz, PSTR pszName, UINT *pCount, BOOL bLast)
+{
+   return psz + wsprintf(psz,"    \"%s\": {\"expected\": %lu, \"actual\": %lu}%s\r\n",
+                         pszName,pCount[0],pCount[1],(bLast ? "" : ","));
+}
+
+/*.....................................................*/
+
+static PSTR
+WritePhase(PSTR psz, BENCH_PHASE *pPhase, BOOL bLast)
+{
+   HUGE us = Stats_Microseconds(pPhase->tWall);
+   psz += wsprintf(psz,"    \"%s\": {\"ok\": %s, \"items\": %lu, \"bytes\": ",pPhase->pszName,
+                   (pPhase->bOK ? "true" : "false"),pPhase->nItems);
+   psz = Stats_HugeToStr(psz,pPhase->nBytes);
+   psz += wsprintf(psz,", \"wall_us\": ");
+   psz = Stats_HugeToStr(psz,us);
+   psz += wsprintf(psz,", \"cpu_us\": ");
+   psz = Stats_HugeToStr(psz,pPhase->tCPU/10);
+   psz += wsprintf(psz,", \"mb_per_s\": ");
+   psz = Stats_HugeToStr(psz,(us ? (pPhase->nBytes/us) : 0)); // bytes per us is MB/s.
+   psz += wsprintf(psz,", \"cpu_ps_per_byte\": ");
+   psz = Stats_HugeToStr(psz,(pPhase->nBytes ? (pPhase->tCPU*100000)/pPhase->nBytes : 0));
+   psz += wsprintf(psz,(bLast ? "}\r\n" : "},\r\n"));
+   return psz;
+}
+
+/*.....................................................*/
+
+static BOOL
+WriteResults(s_CLONEPARMS *parm, BENCH_PHASE *phase, UINT nPhases, BENCH_VERIFY *pVerify)
+{
+   PSTR pszBuff,psz;
+   BOOL bOK = FALSE;
+   FILE f;
+   UINT i;
+
+   pszBuff = psz = Mem_Alloc(0,16384);
+   if (!pszBuff) return FALSE;
+   psz += wsprintf(psz,"{\r\n  \"source\": ");
+   psz = Stats_JsonString(psz,parm->srcfn);
+   psz += wsprintf(psz,",\r\n  \"phases\": {\r\n");
+   for (i=0; i<nPhases; i++) psz = WritePhase(psz,phase+i,(i==nPhases-1));
+   psz += wsprintf(psz,"  },\r\n  \"verify\": {\r\n    \"checked\": %s, \"ok\": %s",
+                   (pVerify->bChecked ? "true" : "false"),(pVerify->bOK ? "true" : "false"));
+   if (pVerify->bChecked) {
+      psz += wsprintf(psz,",\r\n");
+      psz = WriteCount(psz,"skipped_not_allocated",pVerify->NotAlloc,FALSE);
+      psz = WriteCount(psz,"zero_in_source",pVerify->Zero,FALSE);
+      psz = WriteCount(psz,"read",pVerify->Data,TRUE);
+   } else {
+      psz += wsprintf(psz,"\r\n");
+   }
+   psz += wsprintf(psz,"  }\r\n}\r\n");
+
+   if (parm->reportfn[0]) f = File_Create(parm->reportfn,DJFILE_FLAG_OVERWRITE);
+   else f = (FILE)GetStdHandle(STD_OUTPUT_HANDLE);
+   if (f && f!=NULLFILE) {
+      UINT len = (UINT)(psz-pszBuff);
+      bOK = (File_WrBin(f,pszBuff,len)==len);
+      if (parm->reportfn[0]) File_Close(f);
+   }
+   Mem_Free(pszBuff);
+   return bOK;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Bench_Run(HINSTANCE hInstRes, s_CLONEPARMS *parm)
+{
+   BENCH_PHASE phase[BENCH_PHASES];
+   BENCH_VERIFY verify;
+   CLONE_STATS stats;
+   UINT nBlocks,nPhases=0;
+   BYTE *status;
+   BOOL bOK;
+   HVDDR hVDI;
+
+   hVDI = VDDR_Open(parm->srcfn,0);
+   if (!hVDI) return Error(VDDR_GetErrorString(0xFFFFFFFF));
+   nBlocks = hVDI->GetDriveBlockCount(hVDI,SPB_SHIFT);
+   status = Mem_Alloc(0,nBlocks+1);
+   bOK = (status!=NULL);
+   if (bOK) {
+      BenchBlockStatus(hVDI,nBlocks,status,phase+nPhases++);
+      BenchOpenVolumes(hVDI,phase+nPhases++);
+      bOK = BenchReadPages(hVDI,nBlocks,status,phase+nPhases++);
+   }
+   hVDI->Close(hVDI);
+
+   // the clone opens the source itself. Its statistics are then checked against the block
+   // status scan, which makes the benchmark a regression test of the clone's accounting.
+   // There is no clone phase at all if it would overwrite the source.
+   Mem_Zero(&verify,sizeof(verify));
+   verify.bOK = TRUE;
+   if (bOK && Filename_Compare(parm->srcfn,parm->dstfn)!=0) {
+      bOK = BenchClone(hInstRes,parm,&stats,phase+nPhases++);
+      if (bOK) bOK = VerifyClone(parm,&stats,status,nBlocks,&verify);
+   }
+   Mem_Free(status);
+   if (nPhases) WriteResults(parm,phase,nPhases,&verify);
+   return bOK;
+}
+
+/*.....................................................*/
+
+/* end of bench.c */
+
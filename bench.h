@@ -0,0 +1,46 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/*======================================================================*/
+/* Command line benchmark modes: a synthetic test image generator, and  */
+/* a harness which times the source reader and the clone engine.        */
+/*======================================================================*/
+
+#include "parms.h"
+
+BOOL Bench_Synthesize(s_CLONEPARMS *parm);
+/* Creates a synthetic disk image of parm->SynthMB megabytes, named parm->srcfn. The file
+ * extension picks the format: ".raw" or ".img" give a flat raw image, anything else gives
+ * a dynamic VDI. parm->SynthDensity is the percentage of 1MB blocks which hold data (the
+ * rest are left unallocated), and parm->SynthFrag is the percentage of those blocks which
+ * are stored out of order, which fragments the VDI the way a long lived guest would. The
+ * drive gets an MBR with one FAT32 (or, below 34MB, FAT16) partition filling it, whose
+ * FAT marks the clusters of the data blocks as used, so that the FSys_OpenVolume() phase of
+ * Bench_Run() has a real volume to load. The MBR and volume metadata blocks are always
+ * stored; a drive under 4MB is too small for a volume and gets neither. In a VDI, one in eight
+ * of the blocks without data is stored as a zero block (and counts as used in the FAT), so
+ * that the image has both unallocated and zero blocks. The random generator is seeded with a
+ * constant, so the same parameters always give the same image. Returns FALSE on failure, after reporting the error.
+ */
+
+BOOL Bench_Run(HINSTANCE hInstRes, s_CLONEPARMS *parm);
+/* Benchmarks the source image parm->srcfn in four phases: a BlockStatus() scan of every
+ * block, FSys_OpenVolume() on each partition, ReadPage() of every allocated block, and
+ * finally a full Clone_Proceed() to parm->dstfn using the other clone options given. The
+ * clone is deleted again afterwards. Wall time, CPU time (all threads) and throughput for
+ * each phase are written as JSON to parm->reportfn, or to the console if that is empty.
+ * The clone's statistics are then checked against the BlockStatus() scan: the blocks skipped
+ * as not allocated, stored as zero, and read must each match what the source reported. The
+ * check is skipped (and reported as such) with the compact, enlarge, nomerge or resume options,
+ * which change those counts. Returns FALSE if the source could not be opened, a phase
+ * failed, or the check found a mismatch.
+ */
+
+#endif
+
@@ -26,23 +26,67 @@
 #include "env.h"
 #include "ids.h"
 #include "enlarge.h"
-
-#define BURST_BLOCKS 16
+#include "pipeline.h"
+#include "plan.h"
+#include "stats.h"
+#include "throttle.h"
+#include "scache.h"
 
 #define BLOCK_SIZE             1048576 /* must be a power of 2, and at least 512 */
 #define SECTORS_PER_BLOCK      2048
-#define SECTORS_PER_BURST      (2048*BURST_BLOCKS)
 #define SPB_SHIFT              11      /* sectors per block again, but expressed as a shift */
 #define MAX_MAPPED_PARTITIONS  8
-
-static FILE          stderr;
-
-static char          szfnSrc[4096];
-static char          szfnDest[4096];
-static HVDDR         SourceDisk;
-static HVDIW         hVDIdst;
-static HFSYS         pFSys[MAX_MAPPED_PARTITIONS];
-static ProgInfo      prog;
+#define DRYRUN_PROBE_BLOCKS    32      /* blocks read to time the source, if no sample was asked for */
+#define MIN_RING_BYTES         (2*BLOCK_SIZE) /* smallest pipeline ring, see Pipe_Run() */
+
+// Everything one clone needs, so that a batch can run several clones at once.
+typedef struct {
+   s_CLONEPARMS *parm;
+   FILE         stderr;          // console error output, or 0 to report errors with a MessageBox.
+   char         szfnSrc[4096];
+   char         szfnDest[4096];
+   HVDDR        SourceDisk;
+   HVDDR        hFSCache;        // sector cache over SourceDisk for the filesystem mappers, or NULL.
+   HVDIW        hVDIdst;
+   HFSYS        pFSys[MAX_MAPPED_PARTITIONS];
+   UINT         nMappedParts;
+   HPLAN        hPlan;
+   HTHROTTLE    hThrottle;       // NULL if the clone isn't rate limited.
+   HBUDGET      hBudget;         // NULL if the clone has no memory limit.
+   UINT         dst_nBlocks;
+   UINT         dst_MaxBlocks;
+   UINT         dst_nBlocksAllocated;
+   ProgInfo     prog;
+   CLONE_STATS  stats;
+   UINT nBlocksWritten;
+   UINT iResume;        // pages below this were done by an earlier, interrupted, run.
+   BOOL bUpdate;        // updating an existing clone, see VDIW_UpdatePage().
+} CLONE_JOB;
+
+// The media registry and the random number generator (used for new UUIDs and disk
+// signatures) keep their state in module statics, so opening the source and creating the
+// dest is done by one job at a time (VDIW draws every UUID it will need at that point, so
+// closing the dest needs no lock). The readers keep their error state per thread, and
+// the filesystem mappers and Enlarge_Drive() work in their own buffers, so everything
+// else (mapping the source, the plan and the pipeline) runs unlocked.
+static volatile LONG SetupLock;
+
+// identifies a clone job to the resume journal. If any of this changes then the
+// partial clone can't be trusted, and the clone starts again.
+typedef struct {
+   S_UUID uuidCreate;
+   S_UUID uuidModify;   // VDI sources only, zero otherwise.
+   HUGE   DriveSize;
+   HUGE   FileSize;     // size and date of the source file, which catch changes to
+   UINT   FileDate;     // formats which have no modify UUID.
+   UINT   flags;        // those user options which change what is written.
+   UINT   DestSectors;
+   UINT   nMaxBlocks;
+   UINT   nBlocks;
+   UINT   nCopy;
+} RESUME_KEY;
+
+#define RESUME_KEY_FLAGS (PARM_FLAG_KEEPUUID|PARM_FLAG_ENLARGE|PARM_FLAG_REPART|PARM_FLAG_COMPACT|PARM_FLAG_FIXMBR|PARM_FLAG_NOMERGE)
 
 // localized strings
 static PSTR pszERROR           /* = "Error" */ ;
@@ -58,25 +102,47 @@ static PSTR pszSIZEERR3        /* = "Bad number format, or number too large, in
 static PSTR pszSIZEERR4        /* = "The new drive size must be at least as large as the old drive size" */ ;
 static PSTR pszSIZEERR5        /* = "This utility cannot create virtual drives larger than 2047.00 GB" */ ;
 static PSTR pszBADNUM          /* = "Bad number in new drive size field" */ ;
+static PSTR pszVWEXISTSQ       /* = "Destination already exists. Are you sure you want to overwrite it?" */ ;
+static PSTR pszVWEXISTSC       /* = "File Exists" */ ;
 static PSTR pszERRRENAME       /* = "Could not rename old VDI - a backup file of the intended name already exists! Therefore the clone will keep its temp filename of ""%s""" */ ;
 
 /*.....................................................*/
 
 static BOOL
-Error(PSTR sz)
+Error(CLONE_JOB *pJob, PSTR sz)
 {
-   if (stderr) {
-      File_WrBin(stderr,sz,lstrlen(sz));
-      File_WrBin(stderr,"\r\n",2);
+   if (pJob->stderr) {
+      if (pJob->parm->flags & PARM_FLAG_BATCHJOB) { // several jobs may be reporting, say which one this is.
+         File_WrBin(pJob->stderr,pJob->szfnSrc,lstrlen(pJob->szfnSrc));
+         File_WrBin(pJob->stderr,": ",2);
+      }
+      File_WrBin(pJob->stderr,sz,lstrlen(sz));
+      File_WrBin(pJob->stderr,"\r\n",2);
    } else {
       MessageBox(GetFocus(),sz,RSTR(ERROR),MB_ICONSTOP|MB_OK);
    }
-   prog.bUserCancel = TRUE;
+   pJob->prog.bUserCancel = TRUE;
    return FALSE;
 }
 
 /*.....................................................*/
 
+static void
+Setup_Lock(void)
+{
+   while (InterlockedExchange(&SetupLock,1)) Sleep(1);
+}
+
+/*.....................................................*/
+
+static void
+Setup_Unlock(void)
+{
+   InterlockedExchange(&SetupLock,0);
+}
+
+/*.....................................................*/
+
 static UINT
 PowerOfTwo(UINT x)
 // Returns the base 2 log of x, same as the index of the most significant 1 bit in x.
@@ -94,7 +160,7 @@ PowerOfTwo(UINT x)
 /*.....................................................*/
 
 static UINT
-MapPartitions(HFSYS pFSys[MAX_MAPPED_PARTITIONS], s_CLONEPARMS *parm)
+MapPartitions(CLONE_JOB *pJob)
 // This function checks each partition in turn, and if it uses a supported guest filesystem
 // then I create a filesystem object which maps that partition into used/unused clusters. The
 // maps are used during cloning to detect unused blocks.
@@ -111,6 +177,9 @@ MapPartitions(HFSYS pFSys[MAX_MAPPED_PARTITIONS], s_CLONEPARMS *parm)
 // is still valid. In future versions if I repartition before cloning, or fix the MBR in other
 // ways then I need to make sure the updated MBR arrives here.
 {
+   s_CLONEPARMS *parm = pJob->parm;
+   HVDDR SourceDisk = (pJob->hFSCache ? pJob->hFSCache : pJob->SourceDisk);
+   HFSYS *pFSys = pJob->pFSys;
    int i,j=0;
    for (i=0; i<MAX_MAPPED_PARTITIONS; i++) pFSys[i] = NULL;
    if (parm->flags & PARM_FLAG_COMPACT) { // if we don't need to detect unused blocks then we don't need to know the filesystems.
@@ -141,14 +210,19 @@ MapPartitions(HFSYS pFSys[MAX_MAPPED_PARTITIONS], s_CLONEPARMS *parm)
 /*.....................................................*/
 
 static BOOL
-IsBlockUsed(UINT iPage, UINT nMappedParts)
+IsBlockUsed(CLONE_JOB *pJob, UINT iPage, UINT *piPart)
+// Returns FALSE if the block is unused by the guest filesystem, setting *piPart to the
+// index of the mapped partition it belongs to.
 {
+   UINT nMappedParts = pJob->nMappedParts;
+   HFSYS *pFSys = pJob->pFSys;
    if (nMappedParts) { // if we don't need to detect unused blocks then we don't need to know the filesystems.
       UINT j;
       for (j=0; j<nMappedParts; j++) {
          UINT BlockUsedCode = pFSys[j]->IsBlockUsed(pFSys[j],iPage,SPB_SHIFT);
          if (BlockUsedCode!=FSYS_BLOCK_OUTSIDE) {   // if block falls inside this partition
             if (BlockUsedCode==FSYS_BLOCK_UNUSED) { // ... and blocks are unused by guest filesystem.
+               *piPart = j;
                return FALSE;                        // then reduce the count of blocks we need to copy.
             }
             break;
@@ -161,112 +235,192 @@ IsBlockUsed(UINT iPage, UINT nMappedParts)
 /*.....................................................*/
 
 static UINT
-CountUsedBlocks(UINT nMappedParts, UINT dst_nBlocks, BOOL nomerge)
+PlanBlock(PVOID pUser, UINT iPage)
+// Plan_Build() callback: decide what the clone will do with one block. This runs on
+// several threads at once, so it must only use the (read only) block maps.
 {
-   UINT iPage,nUsedBlocks=0;
-   UINT blkstat;
-   HUGE LBA = 0;
-
-   for (iPage=0; iPage<dst_nBlocks; iPage++) {
-      blkstat = (nomerge && SourceDisk->IsInheritedPage(SourceDisk, iPage) ? VDDR_RSLT_NOTALLOC
-                 : SourceDisk->BlockStatus(SourceDisk,LBA,LBA+(SECTORS_PER_BLOCK-1)));
-      LBA += (SECTORS_PER_BLOCK);
-      if (blkstat==VDDR_RSLT_NORMAL) {
-         if (IsBlockUsed(iPage,nMappedParts)) nUsedBlocks++;
-      }
+   CLONE_JOB *pJob = (CLONE_JOB*)pUser;
+   HVDDR SourceDisk = pJob->SourceDisk;
+   HUGE LBA = (((HUGE)iPage)<<SPB_SHIFT);
+   UINT blkstat,iPart;
+
+   if ((pJob->parm->flags & PARM_FLAG_NOMERGE) && SourceDisk->IsInheritedPage &&
+       SourceDisk->IsInheritedPage(SourceDisk, iPage)) return PLAN_INHERITED;
+   blkstat = SourceDisk->BlockStatus(SourceDisk,LBA,LBA+(SECTORS_PER_BLOCK-1));
+   if (blkstat==VDDR_RSLT_NOTALLOC) return PLAN_SKIP;
+   if (!IsBlockUsed(pJob,iPage,&iPart)) {
+      InterlockedIncrement(&pJob->stats.nUnused[iPart]); // for the run report, which says what compaction saved.
+      return PLAN_SKIP;
    }
-   return nUsedBlocks;
+   if (blkstat==VDDR_RSLT_BLANKPAGE) return PLAN_ZERO;
+   return PLAN_COPY;
 }
 
 /*.....................................................*/
 
 static BOOL
-DoClone(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm)
-// This is the actual cloning function. Quite simple, it just reads a bunch
-// of blocks from the source drive, (optionally) checks if they are used, and
-// and writes them to the dest drive if so.
+ClassifyPage(PVOID pUser, UINT iPage)
+// Pipeline classify callback: decide whether a block needs to be read at all. The
+// hard work was already done when the clone plan was built.
 {
-   UINT  i,iBurst,iPage,nBlocksWritten,DestPage,blkstat,nPages=parm->dst_nBlocks;
-   BYTE  *buffer,*block;
-   int   BlockStatus[BURST_BLOCKS];
-   HUGE  LBA = 0;
-
-   // to reduce seek overheads I read a "burst" of blocks then write
-   // them as a burst too.
-   buffer = Mem_Alloc(0,BLOCK_SIZE*BURST_BLOCKS);
-   if (!buffer) {
-      Error(RSTR(LOMEM));
-      return FALSE;
-   }
+   CLONE_JOB *pJob = (CLONE_JOB*)pUser;
+   UINT state;
+   if (iPage < pJob->iResume) return FALSE; // already in the dest.
+   state = Plan_GetState(pJob->hPlan,iPage);
+   // zero blocks still get "read" (which costs nothing) so that the writer marks them
+   // as zero blocks in the dest, rather than leaving them unallocated.
+   return (state==PLAN_COPY || state==PLAN_ZERO);
+}
 
-   // init progress stats and show progress window.
-   FillMemory(&prog, sizeof(prog), 0);
-   prog.pszFn = szfnSrc;
-   prog.pszMsg = RSTR(CLONEWAIT);
-   prog.pszCaption = RSTR(CLONINGVHD);
-   prog.BytesTotal = parm->dst_nBlocksAllocated*(1.0*BLOCK_SIZE);
-   prog.bPrintToConsole = (parm->flags & PARM_FLAG_CLIMODE);
-   Progress.Begin(hInstRes, hWndParent, &prog);
-   Progress.UpdateStats(&prog);
+/*.....................................................*/
 
-   // loop over all copy blocks
-   nBlocksWritten = 0;
-   block = buffer;
-   DestPage = 0;
-   LBA = 0;
+static int
+ReadPage(PVOID pUser, BYTE *buffer, UINT iPage)
+// Pipeline read callback, called on the reader thread only.
+{
+   HVDDR SourceDisk = ((CLONE_JOB*)pUser)->SourceDisk;
+   return SourceDisk->ReadPage(SourceDisk,buffer,iPage,SPB_SHIFT);
+}
 
-   for (iPage=iBurst=0; iPage<nPages; iPage++) { // iPage a.k.a. block number.
+/*.....................................................*/
 
-      blkstat = VDDR_RSLT_NOTALLOC;
-      if (!((parm->flags & PARM_FLAG_NOMERGE) && SourceDisk->IsInheritedPage(SourceDisk, iPage)) && IsBlockUsed(iPage, parm->nMappedParts))
-         blkstat = SourceDisk->ReadPage(SourceDisk,block,iPage,SPB_SHIFT);
+static int
+ReadPages(PVOID pUser, BYTE *buffer, UINT iPage, UINT nPages, int *pResults)
+// Pipeline read callback for a run of blocks, called on the reader thread only. Only
+// used if the source format has a ReadPages method.
+{
+   HVDDR SourceDisk = ((CLONE_JOB*)pUser)->SourceDisk;
+   return SourceDisk->ReadPages(SourceDisk,buffer,iPage,nPages,SPB_SHIFT,pResults);
+}
 
-      BlockStatus[iBurst] = blkstat;
-      if (blkstat==VDDR_RSLT_FAIL) {
-         // We could have some kind of error recovery in here: abort, or "recover and continue". The
-         // dialog should also have a "don't show this again" checkbox.
-         Error(VDDR_GetErrorString(0xFFFFFFFF));
-         break;
+/*.....................................................*/
+
+static int
+LocatePage(PVOID pUser, UINT iPage, VDDR_EXTENT *pExt)
+// Pipeline locate callback, called on the reader thread only. Formats which can't
+// tell me where a block lives just get read with ReadPage().
+{
+   HVDDR SourceDisk = ((CLONE_JOB*)pUser)->SourceDisk;
+   if (!SourceDisk->LocatePage) return VDDR_RSLT_INDIRECT;
+   return SourceDisk->LocatePage(SourceDisk,iPage,SPB_SHIFT,pExt);
+}
+
+/*.....................................................*/
+
+static BOOL
+WritePage(PVOID pUser, BYTE *block, UINT iPage, int blkstat, BOOL bZero, UINT ErrCode, PSTR pszErr)
+// Pipeline write callback. This runs on the thread which called DoClone(), in page
+// order, so it is safe to report errors and update the progress window from here.
+{
+   CLONE_JOB *pJob = (CLONE_JOB*)pUser;
+
+   if (blkstat==VDDR_RSLT_FAIL) {
+      // We could have some kind of error recovery in here: abort, or "recover and continue". The
+      // dialog should also have a "don't show this again" checkbox.
+      return Error(pJob,pszErr);
+   }
+   if ((pJob->parm->flags & PARM_FLAG_FIXMBR) && iPage==0) { // if fixmbr needed, and this is the first block...
+      VDIW_FixMBR(pJob->hVDIdst,block);
+   }
+   if (blkstat != VDDR_RSLT_NOTALLOC || pJob->bUpdate) {
+      // the pipeline has already checked the block for zeros, so the writer needn't.
+      HUGE tStart;
+      UINT action = VDIW_UPDATE_WRITTEN;
+      BOOL bOK;
+      // a zero or skipped block only changes the blockmap, which is written at the end.
+      if (blkstat==VDDR_RSLT_NORMAL && !bZero) Throttle_Wait(pJob->hThrottle,THROTTLE_WRITE,BLOCK_SIZE);
+      tStart = Stats_Now();
+      if (pJob->bUpdate) { // skipped pages have to be freed in the dest, in case they were used before.
+         bOK = VDIW_UpdatePage(pJob->hVDIdst,(blkstat==VDDR_RSLT_NOTALLOC ? NULL : block),iPage,
+                               (bZero ? VDIW_ZERO_YES : VDIW_ZERO_NO),&action);
+      } else {
+         bOK = VDIW_WritePage(pJob->hVDIdst,block,iPage,(bZero ? VDIW_ZERO_YES : VDIW_ZERO_NO));
+      }
+      Stats_AddTime(&pJob->stats.Write,tStart);
+      if (!bOK) return Error(pJob,VDIW_GetErrorString(0xFFFFFFFF));
+      if (action==VDIW_UPDATE_FREED) pJob->stats.nFreed++;
+      if (blkstat==VDDR_RSLT_NORMAL) {
+         if (bZero) pJob->stats.nZeroFound++;
+         else if (action==VDIW_UPDATE_SAME) pJob->stats.nUnchanged++;
+         else pJob->stats.nCopied++;
       }
-      block += BLOCK_SIZE;
-      iBurst++;
 
-      if (iBurst==BURST_BLOCKS || (iPage+1)==nPages) {
-         if ((parm->flags & PARM_FLAG_FIXMBR) && DestPage==0) { // if fixmbr needed, and this is the first block...
-            VDIW_FixMBR(hVDIdst,buffer);
-         }
-         block = buffer;
-         for (i=0; i<iBurst; i++,DestPage++) {
-
-            if (BlockStatus[i] != VDDR_RSLT_NOTALLOC) {
-               if (!VDIW_WritePage(hVDIdst,block,DestPage,BlockStatus[i]==VDDR_RSLT_BLANKPAGE)) {
-                  Error(VDIW_GetErrorString(0xFFFFFFFF));
-                  goto _error_out;
-               }
-
-               // update the progress when we process a normal block of data. Note that the condition below
-               // must test BlockStatus[i], not blkstat, otherwise the progress bar may not reach 100%.
-               if (BlockStatus[i]==VDDR_RSLT_NORMAL) {
-                  nBlocksWritten++;
-                  prog.BytesDone = nBlocksWritten * (1.0*BLOCK_SIZE);
-                  Progress.UpdateStats(&prog);
-                  if (prog.bUserCancel) {
-                     Error(RSTR(USERABORT));
-                     goto _error_out;
-                  }
-               }
-            }
-            block += BLOCK_SIZE;
+      // update the progress when we process a normal block of data. Note that the condition below
+      // must test blkstat, not bZero, otherwise the progress bar may not reach 100%.
+      if (blkstat==VDDR_RSLT_NORMAL) {
+         pJob->nBlocksWritten++;
+         pJob->prog.BytesDone = pJob->nBlocksWritten * (1.0*BLOCK_SIZE);
+         Progress.UpdateStats(&pJob->prog);
+         if (pJob->prog.bUserCancel) {
+            return Error(pJob,RSTR(USERABORT));
          }
-         block = buffer;
-         iBurst = 0;
       }
    }
+   return TRUE;
+}
+
+/*.....................................................*/
 
-_error_out:
+static BOOL
+DoClone(HINSTANCE hInstRes, HWND hWndParent, CLONE_JOB *pJob)
+// This is the actual cloning function. Quite simple, it just reads a bunch
+// of blocks from the source drive, (optionally) checks if they are used, and
+// and writes them to the dest drive if so.
+//
+// The work is done by a pipeline (see pipeline.h) so that source reads, block
+// classification and dest writes can overlap. The callbacks above do the real work.
+// If the clone is being resumed then pages below pJob->iResume are skipped. If pJob->bUpdate
+// is set then the dest is an existing clone, which is brought up to date instead.
+{
+   s_CLONEPARMS *parm = pJob->parm;
+   ProgInfo *prog = &pJob->prog;
+   PIPE_PARMS pp;
+   PIPE_STATS ps;
+   UINT i;
+
+   pJob->nBlocksWritten = 0;
+   for (i=0; i<pJob->iResume; i++) {
+      if (Plan_GetState(pJob->hPlan,i)==PLAN_COPY) pJob->nBlocksWritten++;
+   }
 
-   Mem_Free(buffer);
-   return !(prog.bUserCancel);
+   // init progress stats and show progress window.
+   FillMemory(prog, sizeof(ProgInfo), 0);
+   prog->pszFn = pJob->szfnSrc;
+   prog->pszMsg = RSTR(CLONEWAIT);
+   prog->pszCaption = RSTR(CLONINGVHD);
+   prog->BytesTotal = parm->dst_nBlocksAllocated*(1.0*BLOCK_SIZE);
+   prog->BytesDone = pJob->nBlocksWritten*(1.0*BLOCK_SIZE);
+   prog->bPrintToConsole = (parm->flags & PARM_FLAG_CLIMODE);
+   prog->bSilent = ((parm->flags & PARM_FLAG_BATCHJOB) != 0);
+   Progress.Begin(hInstRes, hWndParent, prog);
+   Progress.UpdateStats(prog);
+
+   FillMemory(&pp, sizeof(pp), 0);
+   pp.nPages    = parm->dst_nBlocks;
+   pp.BlockSize = BLOCK_SIZE;
+   pp.Depth     = parm->PipeDepth;
+   pp.QueueDepth = (parm->QueueDepth ? parm->QueueDepth : PIPE_DEFAULT_QDEPTH);
+   pp.bPhysOrder = ((parm->flags & PARM_FLAG_PHYSORDER) != 0);
+   pp.bMapped   = ((parm->flags & (PARM_FLAG_MMAP|PARM_FLAG_DIRECTIO|PARM_FLAG_PHYSORDER)) == PARM_FLAG_MMAP);
+   pp.pUser     = pJob;
+   pp.pStats    = &ps;
+   pp.hThrottle = pJob->hThrottle;
+   pp.Classify  = ClassifyPage;
+   pp.Locate    = LocatePage;
+   pp.Read      = ReadPage;
+   if (pJob->SourceDisk->ReadPages) pp.ReadRun = ReadPages;
+   pp.Write     = WritePage;
+
+   FillMemory(&ps, sizeof(ps), 0);
+   if (!Pipe_Run(&pp)) {
+      // if the pipeline stopped without a callback reporting why, then it never got started.
+      if (!prog->bUserCancel) Error(pJob,RSTR(LOMEM));
+   }
+   pJob->stats.Read = ps.Read;
+   pJob->stats.ReadLatency = ps.ReadLatency;
+   pJob->stats.ZeroScan = ps.ZeroScan;
+   pJob->stats.BytesRead = ps.BytesRead;
+   return !(prog->bUserCancel);
 }
 
 /*.....................................................*/
@@ -274,8 +428,8 @@ _error_out:
 static void
 GenerateName(PFN dstfn, CPFN srcfn, PSTR pszPrefix)
 {
-   static FNCHAR path[4096];
-   static FNCHAR tail[4096];
+   FNCHAR path[4096];
+   FNCHAR tail[4096];
    lstrcpy(tail,pszPrefix);
    Filename_SplitPath(srcfn,path,tail+lstrlen(pszPrefix));
    Filename_MakePath(dstfn,path,tail);
@@ -371,7 +525,7 @@ ParseDestSize(HVDDR SourceDisk, s_CLONEPARMS *parm)
 /*....................................................*/
 
 static BOOL
-DestSizeOK(HVDDR SourceDisk, s_CLONEPARMS *parm)
+DestSizeOK(CLONE_JOB *pJob, HVDDR SourceDisk, s_CLONEPARMS *parm)
 {
    if (parm->flags & PARM_FLAG_ENLARGE) {
       int err = ParseDestSize(SourceDisk,parm);
@@ -379,16 +533,16 @@ DestSizeOK(HVDDR SourceDisk, s_CLONEPARMS *parm)
          case 0:
             break;
          case 2:
-            return Error(RSTR(SIZEERR2));
+            return Error(pJob,RSTR(SIZEERR2));
          case 1:
          case 3:
-            return Error(RSTR(SIZEERR3));
+            return Error(pJob,RSTR(SIZEERR3));
          case 4:
-            return Error(RSTR(SIZEERR4));
+            return Error(pJob,RSTR(SIZEERR4));
          case 5:
-            return Error(RSTR(SIZEERR5));
+            return Error(pJob,RSTR(SIZEERR5));
          default:
-            return Error(RSTR(BADNUM));
+            return Error(pJob,RSTR(BADNUM));
       }
    }
    return TRUE;
@@ -396,41 +550,100 @@ DestSizeOK(HVDDR SourceDisk, s_CLONEPARMS *parm)
 
 /*....................................................*/
 
-PUBLIC BOOL
-Clone_Proceed(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm)
-// Open the source file, create the dest file, calculate how much work we have to
-// do (so we can animate the progress meter), then call the DoClone() function. We also
-// clean up appropriately when the work is done.
+static UINT
+VDIWFlags(s_CLONEPARMS *parm)
+// Translates the user's I/O options into VDIW_Create() flags.
 {
-   BOOL bNameMatch,bSuccess;
-   UINT i,dst_nBlocks,dst_nBlocksAllocated,dst_MaxBlocks,ParmFlags,nMappedParts;
-// HVDDR cow;
+   UINT flags = 0;
+   if (parm->flags & PARM_FLAG_DIRECTIO) flags |= VDIW_FLAG_DIRECTIO;
+   if (parm->SyncMode==PARM_SYNC_CHECKPOINT) flags |= VDIW_FLAG_SYNC_CHECKPOINT;
+   else if (parm->SyncMode==PARM_SYNC_END) flags |= VDIW_FLAG_SYNC_END;
+   if (parm->flags & PARM_FLAG_RESUME) flags |= VDIW_FLAG_JOURNAL;
+   return flags;
+}
 
-   ParmFlags = parm->flags;
-   if (ParmFlags & PARM_FLAG_CLIMODE) {
-      stderr = (FILE)GetStdHandle(STD_ERROR_HANDLE);
-      if (!stderr || stderr==NULLFILE) ParmFlags &= (~PARM_FLAG_CLIMODE); // happens if app is not run from a console window.
+/*....................................................*/
+
+static void
+MakeResumeKey(CLONE_JOB *pJob, RESUME_KEY *pKey, UINT nMaxBlocks, UINT nBlocks, UINT nCopy)
+{
+   HVDDR SourceDisk = pJob->SourceDisk;
+   FILE f;
+   Mem_Zero(pKey,sizeof(RESUME_KEY));
+   SourceDisk->GetDriveUUID(SourceDisk,&pKey->uuidCreate);
+   if (SourceDisk->GetDriveType(SourceDisk)==VDD_TYPE_VDI) {
+      SourceDisk->GetDriveUUIDs(SourceDisk,&pKey->uuidCreate,&pKey->uuidModify);
    }
-   if (!(ParmFlags & PARM_FLAG_CLIMODE)) stderr = 0;
-   
-   lstrcpy(szfnSrc, parm->srcfn);
-   if (Filename_Compare(parm->srcfn,parm->dstfn)==0) {
-      // If source and destination names are the same then generate a temp name
-      // for the clone.
-      FNCHAR path[256];
-      bNameMatch = TRUE;
-      Filename_SplitPath(parm->dstfn,path,NULL);
-      GetTempFileName(path,"Clo",0,szfnDest);
-      File_Erase(szfnDest);
-      Filename_ChangeExtension(szfnDest,"vdi");
-   } else {
-      bNameMatch = FALSE;
-      lstrcpy(szfnDest, parm->dstfn);
+   SourceDisk->GetDriveSize(SourceDisk,&pKey->DriveSize);
+   f = File_OpenRead(pJob->szfnSrc);
+   if (f!=NULLFILE) {
+      File_Size(f,&pKey->FileSize);
+      pKey->FileDate = File_GetDate(f);
+      File_Close(f);
    }
+   pKey->flags = (pJob->parm->flags & RESUME_KEY_FLAGS);
+   pKey->DestSectors = pJob->parm->DestSectors;
+   pKey->nMaxBlocks = nMaxBlocks;
+   pKey->nBlocks = nBlocks;
+   pKey->nCopy = nCopy;
+}
+
+/*....................................................*/
+
+static void
+InitJob(CLONE_JOB *pJob, s_CLONEPARMS *parm)
+{
+   pJob->parm = parm;
+   if (parm->flags & PARM_FLAG_CLIMODE) {
+      pJob->stderr = (FILE)GetStdHandle(STD_ERROR_HANDLE);
+      if (pJob->stderr==NULLFILE) pJob->stderr = 0; // happens if app is not run from a console window.
+   }
+   lstrcpy(pJob->szfnSrc, parm->srcfn);
+}
 
-   SourceDisk = VDDR_Open(szfnSrc,0);
-   if (!SourceDisk) return Error(VDDR_GetErrorString(0xFFFFFFFF));
-   if (!DestSizeOK(SourceDisk,parm)) {
+/*....................................................*/
+
+static void
+CloseSource(CLONE_JOB *pJob)
+// destroy the partition usage map objects then close the source disk.
+{
+   UINT i;
+   for (i=0; i<pJob->nMappedParts; i++) pJob->pFSys[i]->CloseVolume(pJob->pFSys[i]);
+   if (pJob->hFSCache) pJob->hFSCache = pJob->hFSCache->Close(pJob->hFSCache);
+   pJob->SourceDisk->Close(pJob->SourceDisk);
+}
+
+/*....................................................*/
+
+static BOOL
+PlanClone(CLONE_JOB *pJob)
+// Opens the source, maps the guest filesystems and builds the clone plan, which says
+// what will be done with each block of the dest drive. On success the source is left
+// open, and the dest block counts and the plan counts in pJob->stats are filled in.
+{
+   s_CLONEPARMS *parm = pJob->parm;
+   UINT i,dst_nBlocks,dst_MaxBlocks,nMappedParts;
+   HVDDR SourceDisk;
+   HUGE tStart;
+
+   // The source maps and the pipeline ring are charged to the job's memory budget. Enough
+   // for the smallest ring is kept back while the source is opened, so that the maps
+   // (which can page themselves instead) don't leave too little to run the clone.
+   if (parm->MaxMemoryMB && !pJob->hBudget) {
+      pJob->hBudget = Mem_CreateBudget(((HUGE)parm->MaxMemoryMB)<<20);
+      if (!pJob->hBudget || !Mem_Charge(pJob->hBudget,MIN_RING_BYTES)) return Error(pJob,RSTR(LOMEM));
+   }
+   Mem_SetThreadBudget(pJob->hBudget);
+
+   Setup_Lock();
+   // a batch job finds the parents of a snapshot in its own VirtualBox folder.
+   if (parm->flags & PARM_FLAG_BATCHJOB) VDDR_OpenMediaRegistry(parm->srcfn);
+   // direct mode: the async reads of the source bypass the OS file cache as well.
+   File_SetAsyncFlags((parm->flags & PARM_FLAG_DIRECTIO) ? DJFILE_FLAG_NOBUFFERING : 0);
+   SourceDisk = pJob->SourceDisk = VDDR_Open(pJob->szfnSrc,0);
+   Setup_Unlock();
+   if (!SourceDisk) return Error(pJob,VDDR_GetErrorString(0xFFFFFFFF));
+   if (!DestSizeOK(pJob,SourceDisk,parm)) {
       SourceDisk->Close(SourceDisk);
       return FALSE;
    }
@@ -440,7 +653,7 @@ Clone_Proceed(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm)
       dst_MaxBlocks = (parm->DestSectors>>SPB_SHIFT);
       if (parm->DestSectors & (SECTORS_PER_BLOCK-1)) dst_MaxBlocks++; // note that adding (SECTORS_PER_BLOCK-1) before the shift might cause overflow of UINT.
       if (parm->flags & PARM_FLAG_REPART) { // if we are expanding the partition as well...
-         SourceDisk = Enlarge_Drive(SourceDisk, dst_MaxBlocks);
+         SourceDisk = pJob->SourceDisk = Enlarge_Drive(SourceDisk, dst_MaxBlocks);
          parm->flags &= (~PARM_FLAG_FIXMBR); // in this case the Enlarge_Drive() function has already fixed the MBR.
       }
       dst_nBlocks = SourceDisk->GetDriveBlockCount(SourceDisk,SPB_SHIFT);
@@ -449,19 +662,111 @@ Clone_Proceed(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm)
       dst_MaxBlocks = dst_nBlocks;
    }
 
-   // Calculate number of allocated blocks on source drive, express in units of dest blocks.
-   // This is needed to calculate disk space requirements, and for the progress meter.
-   // get used/unused cluster maps for partitions on source drive.
+   // Work out what to do with each block of the dest drive. The number of blocks to copy,
+   // in units of dest blocks, is needed to calculate disk space requirements, and for the
+   // progress meter. First get used/unused cluster maps for partitions on source drive.
    SourceDisk->ReadSectors(SourceDisk, parm->MBR, 0, 1); // read MBR sector.
-   nMappedParts = MapPartitions(pFSys,parm);
-   dst_nBlocksAllocated = CountUsedBlocks(nMappedParts, dst_nBlocks, parm->flags & PARM_FLAG_NOMERGE);
+   tStart = Stats_Now();
+   // the mappers make lots of small reads, so they read through a cache. The cache goes
+   // over the COW overlay if there is one, since Enlarge_Drive() is done writing to it.
+   if (parm->flags & PARM_FLAG_COMPACT) pJob->hFSCache = SCache_Create(SourceDisk,0,0);
+   nMappedParts = MapPartitions(pJob);
+   Stats_AddTime(&pJob->stats.MapFS,tStart);
+   Mem_Uncharge(pJob->hBudget,MIN_RING_BYTES);
+   pJob->nMappedParts = parm->nMappedParts = nMappedParts;
+   tStart = Stats_Now();
+   pJob->hPlan = Plan_Build(dst_nBlocks, PlanBlock, pJob, 0);
+   Stats_AddTime(&pJob->stats.Plan,tStart);
+   if (!pJob->hPlan) {
+      CloseSource(pJob);
+      return Error(pJob,RSTR(LOMEM));
+   }
+   pJob->dst_nBlocks = dst_nBlocks;
+   pJob->dst_MaxBlocks = dst_MaxBlocks;
+   pJob->dst_nBlocksAllocated = Plan_Count(pJob->hPlan,PLAN_COPY);
+   pJob->stats.BlockSize = BLOCK_SIZE;
+   pJob->stats.nBlocks = dst_nBlocks;
+   pJob->stats.nParts = nMappedParts;
+   pJob->stats.nZeroPlanned = Plan_Count(pJob->hPlan,PLAN_ZERO);
+   pJob->stats.nInherited = Plan_Count(pJob->hPlan,PLAN_INHERITED);
+   pJob->stats.nNotAlloc = Plan_Count(pJob->hPlan,PLAN_SKIP);
+   for (i=0; i<nMappedParts; i++) pJob->stats.nNotAlloc -= (UINT)pJob->stats.nUnused[i];
+   return TRUE;
+}
+
+/*....................................................*/
+
+static BOOL
+CloneJob(HINSTANCE hInstRes, HWND hWndParent, CLONE_JOB *pJob)
+// Open the source file, create the dest file, calculate how much work we have to
+// do (so we can animate the progress meter), then call the DoClone() function. We also
+// clean up appropriately when the work is done.
+{
+   s_CLONEPARMS *parm = pJob->parm;
+   BOOL bNameMatch,bSuccess,bUpdate;
+   UINT dst_nBlocks,dst_nBlocksAllocated,dst_MaxBlocks;
+   HUGE tTotal;
+   HVDDR SourceDisk;
+   HVDIW hVDIdst;
+   RESUME_KEY key;
+// HVDDR cow;
+
+   tTotal = Stats_Now();
+   if (Filename_Compare(parm->srcfn,parm->dstfn)==0) {
+      // If source and destination names are the same then generate a temp name
+      // for the clone.
+      FNCHAR path[256];
+      bNameMatch = TRUE;
+      if (parm->flags & PARM_FLAG_RESUME) {
+         // a resumable clone needs a temp name which will be the same next time.
+         lstrcpy(pJob->szfnDest, parm->dstfn);
+         Filename_ChangeExtension(pJob->szfnDest,"partial.vdi");
+      } else {
+         Filename_SplitPath(parm->dstfn,path,NULL);
+         GetTempFileName(path,"Clo",0,pJob->szfnDest);
+         File_Erase(pJob->szfnDest);
+         Filename_ChangeExtension(pJob->szfnDest,"vdi");
+      }
+   } else {
+      bNameMatch = FALSE;
+      lstrcpy(pJob->szfnDest, parm->dstfn);
+   }
 
-   // Create the dest VDI.
-   hVDIdst = VDIW_Create(szfnDest,BLOCK_SIZE,dst_MaxBlocks,dst_nBlocksAllocated);
+   if (!PlanClone(pJob)) return FALSE;
+   SourceDisk = pJob->SourceDisk;
+   dst_nBlocks = pJob->dst_nBlocks;
+   dst_MaxBlocks = pJob->dst_MaxBlocks;
+   dst_nBlocksAllocated = pJob->dst_nBlocksAllocated;
+
+   // Create the dest VDI, or pick up the one an interrupted clone left behind, or (update
+   // mode) open the previous clone. An update with no previous clone is a normal clone.
+   // VDIW_Create() mustn't ask about an existing dest while the setup lock is held, since
+   // that would stall every other batch job, so the question is asked after unlocking.
+   Setup_Lock();
+   hVDIdst = NULL;
+   pJob->iResume = 0;
+   bUpdate = pJob->bUpdate = ((parm->flags & PARM_FLAG_UPDATE) && !bNameMatch && File_Exists(pJob->szfnDest));
+   if (bUpdate) {
+      hVDIdst = VDIW_Open(pJob->szfnDest,BLOCK_SIZE,dst_MaxBlocks,VDIWFlags(parm));
+   } else if (parm->flags & PARM_FLAG_RESUME) {
+      MakeResumeKey(pJob,&key,dst_MaxBlocks,dst_nBlocks,dst_nBlocksAllocated);
+      hVDIdst = VDIW_Resume(pJob->szfnDest,BLOCK_SIZE,dst_MaxBlocks,VDIWFlags(parm),&key,sizeof(key),&pJob->iResume);
+   }
+   if (!hVDIdst && !bUpdate) hVDIdst = VDIW_Create(pJob->szfnDest,BLOCK_SIZE,dst_MaxBlocks,dst_nBlocksAllocated,VDIWFlags(parm)|VDIW_FLAG_NOPROMPT);
+   Setup_Unlock();
+   if (!hVDIdst && !bUpdate && VDIW_GetLastError()==VDIW_ERR_EXISTS && !(parm->flags & PARM_FLAG_BATCHJOB)) {
+      // a batch job is unattended, so it just reports the error below.
+      if (Env_AskYN(RSTR(VWEXISTSQ), RSTR(VWEXISTSC))) {
+         Setup_Lock();
+         hVDIdst = VDIW_Create(pJob->szfnDest,BLOCK_SIZE,dst_MaxBlocks,dst_nBlocksAllocated,VDIWFlags(parm)|VDIW_FLAG_OVERWRITE);
+         Setup_Unlock();
+      }
+   }
+   pJob->hVDIdst = hVDIdst;
    if (!hVDIdst) {
-      if (VDIW_GetLastError()==VDIW_ERR_EXISTS) bSuccess = FALSE; // user already got an error message in this case.
-      else bSuccess = Error(VDIW_GetErrorString(0xFFFFFFFF));
-      SourceDisk->Close(SourceDisk);
+      if (VDIW_GetLastError()==VDIW_ERR_EXISTS && !(parm->flags & PARM_FLAG_BATCHJOB)) bSuccess = FALSE; // the user chose not to overwrite it.
+      else bSuccess = Error(pJob,VDIW_GetErrorString(0xFFFFFFFF));
+      CloseSource(pJob);
    } else {
       if (parm->flags & PARM_FLAG_KEEPUUID) {
          S_UUID uuidCreate;
@@ -482,46 +787,197 @@ Clone_Proceed(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm)
          VDIW_SetParentUUIDs(hVDIdst, &uuidCreate, &uuidModify);
       }
 
+      VDIW_SetCheckpoint(hVDIdst, parm->SyncMB);
+      if ((parm->flags & PARM_FLAG_RESUME) && !bUpdate) VDIW_SetJournalKey(hVDIdst, &key, sizeof(key));
+
+      // preallocate the dest file from the plan, so that it isn't grown 1MB at a time. This is
+      // only an optimization, so a failure here is ignored. A resumed clone has done this already.
+      if (!pJob->iResume && !bUpdate) VDIW_SetFileSize(hVDIdst, dst_nBlocksAllocated, (parm->flags & PARM_FLAG_RESERVE)!=0);
+
       parm->dst_nBlocks = dst_nBlocks;
       parm->dst_nBlocksAllocated = dst_nBlocksAllocated;
-      parm->nMappedParts = nMappedParts;
 
-      // start cloning!
-      bSuccess = DoClone(hInstRes, hWndParent, parm);
-
-      // destroy the partition usage map objects then close the source disk.
-      for (i=0; i<nMappedParts; i++) pFSys[i]->CloseVolume(pFSys[i]);
-      SourceDisk->Close(SourceDisk);
+      if (parm->ReadMB || parm->WriteMB || parm->ReadIOPS || parm->WriteIOPS || parm->throttlefn[0]) {
+         pJob->hThrottle = Throttle_Create(parm->throttlefn);
+         Throttle_SetLimit(pJob->hThrottle, THROTTLE_READ, parm->ReadMB, parm->ReadIOPS);
+         Throttle_SetLimit(pJob->hThrottle, THROTTLE_WRITE, parm->WriteMB, parm->WriteIOPS);
+      }
 
-      if (!bSuccess) VDIW_Discard(hVDIdst);
-      else {
+      // start cloning!
+      bSuccess = DoClone(hInstRes, hWndParent, pJob);
+      pJob->hThrottle = Throttle_Destroy(pJob->hThrottle);
+
+      CloseSource(pJob);
+
+      if (!bSuccess) {
+         // a resumable clone keeps what it has done so far, for next time. A failed update
+         // leaves a valid VDI which the next update will finish off.
+         if (bUpdate) VDIW_Close(hVDIdst);
+         else if (parm->flags & PARM_FLAG_RESUME) VDIW_Suspend(hVDIdst);
+         else VDIW_Discard(hVDIdst);
+      } else {
          VDIW_Close(hVDIdst);
-         // at this point we know the clone task was successful, the clone file now exists.
-         if (bNameMatch) {
+         if (VDIW_GetLastError()) {
+            // the final header, block map or flush didn't make it to the disk, so the clone
+            // can't be trusted. A resumable clone still has its journal for next time.
+            bSuccess = Error(pJob,VDIW_GetErrorString(0xFFFFFFFF));
+         } else if (bNameMatch) {
+            // at this point we know the clone task was successful, the clone file now exists.
             // if source and dest had conflicting filenames then we will have written the clone to a temp file. Now
             // that cloning has succeeded we want to juggle the filenames to get it all as the user wants.
-            GenerateName(szfnSrc, parm->srcfn, RSTR(ORIGINAL)); // rename the original to "Original <oldname>".
-            if (File_Rename(parm->srcfn, szfnSrc)) {        // that may fail in the rare case that "Original <oldname>" already exists.
-               File_Rename(szfnDest, parm->srcfn);          // ... if it worked then we rename the temp file to match <oldname>.
-            } else {                                        // ... if it didn't work then we give up and tell the user the bad news.
+            GenerateName(pJob->szfnSrc, parm->srcfn, RSTR(ORIGINAL)); // rename the original to "Original <oldname>".
+            if (File_Rename(parm->srcfn, pJob->szfnSrc)) {        // that may fail in the rare case that "Original <oldname>" already exists.
+               File_Rename(pJob->szfnDest, parm->srcfn);          // ... if it worked then we rename the temp file to match <oldname>.
+            } else {                                              // ... if it didn't work then we give up and tell the user the bad news.
                char szMsg[512];
                char tail[256];
-               Filename_SplitTail(szfnDest,tail);
+               Filename_SplitTail(pJob->szfnDest,tail);
                wsprintf(szMsg,RSTR(ERRRENAME),tail);
-               Error(szMsg);
+               Error(pJob,szMsg);
                bSuccess = FALSE;
             }
          }
       }
    }
 
+   pJob->hPlan = Plan_Free(pJob->hPlan);
+   Stats_AddTime(&pJob->stats.Total,tTotal);
+   if (parm->reportfn[0]) Stats_WriteReport(parm->reportfn,parm->srcfn,parm->dstfn,bSuccess,&pJob->stats);
    if (bSuccess) {
       if (!(parm->flags & PARM_FLAG_CLIMODE)) PlaySound("notify.wav", NULL, SND_FILENAME);
    }
-   Progress.End(&prog);
+   Progress.End(&pJob->prog);
+   return bSuccess;
+}
+
+/*....................................................*/
+
+PUBLIC BOOL
+Clone_Proceed(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm)
+{
+   CLONE_JOB *pJob = Mem_Alloc(MEMF_ZEROINIT,sizeof(CLONE_JOB));
+   BOOL bSuccess;
+   if (!pJob) {
+      CLONE_JOB job; // just enough of one to report the error.
+      Mem_Zero(&job,sizeof(job));
+      InitJob(&job,parm);
+      return Error(&job,RSTR(LOMEM));
+   }
+   InitJob(pJob,parm);
+   bSuccess = CloneJob(hInstRes, hWndParent, pJob);
+   if (parm->pStats) *parm->pStats = pJob->stats;
+   Mem_SetThreadBudget(NULL);
+   Mem_FreeBudget(pJob->hBudget);
+   Mem_Free(pJob);
    return bSuccess;
 }
 
+/*....................................................*/
+
+static void
+WriteEstimate(CLONE_JOB *pJob, UINT nSampled, UINT nZero, HUGE ticks)
+// Writes the dry run results as JSON, to the --report file or else the console.
+{
+   s_CLONEPARMS *parm = pJob->parm;
+   CLONE_STATS *pStats = &pJob->stats;
+   UINT i,nCopy,nPredicted,nUnused=0;
+   double BytesPerSec = 0;
+   CHAR *pszBuff,*psz;
+   FILE f;
+
+   pszBuff = psz = Mem_Alloc(0,8192);
+   if (!pszBuff) return;
+
+   // blocks which the sample found to be zero are expected to be zero in the same
+   // proportion over the whole drive, they won't be stored.
+   nCopy = pJob->dst_nBlocksAllocated;
+   nPredicted = nCopy;
+   if (nSampled) nPredicted -= (UINT)((((HUGE)nCopy)*nZero)/nSampled);
+   if (Stats_Microseconds(ticks)) BytesPerSec = (nSampled*(1.0*BLOCK_SIZE)*1e6)/(double)Stats_Microseconds(ticks);
+   for (i=0; i<pStats->nParts; i++) nUnused += (UINT)pStats->nUnused[i];
+
+   psz += wsprintf(psz,"{\r\n  \"source\": ");
+   psz = Stats_JsonString(psz,parm->srcfn);
+   psz += wsprintf(psz,",\r\n  \"dest\": ");
+   psz = Stats_JsonString(psz,parm->dstfn);
+   psz += wsprintf(psz,",\r\n  \"block_size\": %lu,\r\n",BLOCK_SIZE);
+   psz += wsprintf(psz,"  \"blocks\": {\r\n    \"total\": %lu,\r\n    \"allocated\": %lu,\r\n",
+                   pStats->nBlocks,pStats->nBlocks-pStats->nNotAlloc);
+   psz += wsprintf(psz,"    \"unused_by_filesystem\": %lu,\r\n    \"inherited\": %lu,\r\n",nUnused,pStats->nInherited);
+   psz += wsprintf(psz,"    \"zero_in_source\": %lu,\r\n    \"to_copy\": %lu\r\n  },\r\n",pStats->nZeroPlanned,nCopy);
+   psz += wsprintf(psz,"  \"sample\": {\"blocks\": %lu, \"zero\": %lu, \"ms\": ",nSampled,nZero);
+   psz = Stats_HugeToStr(psz,Stats_Microseconds(ticks)/1000);
+   psz += wsprintf(psz,"},\r\n  \"read_bytes_per_sec\": ");
+   psz = Stats_HugeToStr(psz,(HUGE)BytesPerSec);
+   psz += wsprintf(psz,",\r\n  \"output_bytes\": ");
+   psz = Stats_HugeToStr(psz,VDIW_FileSize(BLOCK_SIZE,pJob->dst_MaxBlocks,nPredicted));
+   psz += wsprintf(psz,",\r\n  \"output_bytes_max\": ");
+   psz = Stats_HugeToStr(psz,VDIW_FileSize(BLOCK_SIZE,pJob->dst_MaxBlocks,nCopy));
+   // every block to be copied gets read, zero or not.
+   psz += wsprintf(psz,",\r\n  \"estimated_ms\": ");
+   psz = Stats_HugeToStr(psz,(HUGE)(BytesPerSec>0 ? (nCopy*(1.0*BLOCK_SIZE)*1000.0)/BytesPerSec : 0));
+   psz += wsprintf(psz,"\r\n}\r\n");
+
+   if (parm->reportfn[0]) f = File_Create(parm->reportfn,DJFILE_FLAG_OVERWRITE);
+   else f = (FILE)GetStdHandle(STD_OUTPUT_HANDLE);
+   if (f && f!=NULLFILE) {
+      File_WrBin(f,pszBuff,(UINT)(psz-pszBuff));
+      if (parm->reportfn[0]) File_Close(f);
+   }
+   Mem_Free(pszBuff);
+}
+
+/*....................................................*/
+
+PUBLIC BOOL
+Clone_Estimate(s_CLONEPARMS *parm)
+{
+   CLONE_JOB *pJob;
+   BYTE *buffer;
+   UINT i,k,nCopy,nSample,nSampled=0,nZero=0;
+   HUGE tStart,ticks=0;
+   BOOL bOK = FALSE;
+   int rslt;
+
+   pJob = Mem_Alloc(MEMF_ZEROINIT,sizeof(CLONE_JOB));
+   if (!pJob) return FALSE;
+   InitJob(pJob,parm);
+   if (PlanClone(pJob)) {
+      buffer = Mem_Alloc(0,BLOCK_SIZE);
+      if (!buffer) Error(pJob,RSTR(LOMEM));
+      else {
+         nCopy = pJob->dst_nBlocksAllocated;
+         if (parm->SamplePct) nSample = (UINT)((((HUGE)nCopy)*parm->SamplePct+99)/100);
+         else nSample = (nCopy<DRYRUN_PROBE_BLOCKS ? nCopy : DRYRUN_PROBE_BLOCKS);
+
+         // sample evenly spaced blocks from those to be copied, so that the sample
+         // (and the seeks it costs) covers the whole drive.
+         bOK = TRUE;
+         for (i=k=0; i<pJob->dst_nBlocks && nSampled<nSample; i++) {
+            if (Plan_GetState(pJob->hPlan,i)!=PLAN_COPY) continue;
+            if (((HUGE)k++)*nSample < ((HUGE)nSampled)*nCopy) continue;
+            tStart = Stats_Now();
+            rslt = pJob->SourceDisk->ReadPage(pJob->SourceDisk,buffer,i,SPB_SHIFT);
+            ticks += Stats_Now()-tStart;
+            if (rslt==VDDR_RSLT_FAIL) {
+               bOK = Error(pJob,VDDR_GetErrorString(0xFFFFFFFF));
+               break;
+            }
+            if (rslt!=VDDR_RSLT_NORMAL || Mem_IsZero(buffer,BLOCK_SIZE)) nZero++;
+            nSampled++;
+         }
+         Mem_Free(buffer);
+         if (bOK) WriteEstimate(pJob,nSampled,nZero,ticks);
+      }
+      CloseSource(pJob);
+      Plan_Free(pJob->hPlan);
+   }
+   Mem_SetThreadBudget(NULL);
+   Mem_FreeBudget(pJob->hBudget);
+   Mem_Free(pJob);
+   return bOK;
+}
+
 /*.....................................................*/
 
 #if 0
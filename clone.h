@@ -21,6 +21,16 @@ BOOL Clone_Proceed(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm);
  * leaving the new clone with old name (the old file "xxx" is renamed to "Original xxx").
  */
 
+BOOL Clone_Estimate(s_CLONEPARMS *parm);
+/* Dry run: opens the source and works out what Clone_Proceed() would do with every block,
+ * without creating the dest. The exact block counts (allocated, unused by the guest
+ * filesystem, inherited, to be copied) are written as JSON to parm->reportfn, or to the
+ * console if that is empty, along with the predicted size of the clone and how long it
+ * should take. Those two come from reading parm->SamplePct percent of the blocks to be
+ * copied, which are checked for zeros and timed. With no sample percentage a few blocks
+ * are read just to time the source, and the size estimate is nearly an upper bound.
+ */
+
 BOOL Clone_CompareImages(HINSTANCE hInstRes, HWND hWndParent, s_CLONEPARMS *parm);
 /* Debug function not used by release app.
  */
@@ -13,11 +13,17 @@
 #include "cmdline.h"
 #include "env.h"
 #include "djfile.h"
+#include "filename.h"
 #include "djstring.h"
 #include "version.h"
 #include "ids.h"
 
+#define MAX_LINE_ARGS 64
+
 static FNCHAR tmpfn[1024];
+static PSTR   *pLineArgs; // if not NULL, the arguments come from a batch manifest line, not the command line.
+static UINT   nLineArgs;
+static CPFN   pszLineDir; // folder which relative paths on a manifest line are relative to.
 
 // localized strings
 static PSTR pszERROR          /* = "Error" */ ;
@@ -32,6 +38,11 @@ static PSTR pszUNKOPT         /* = "unknown option." */ ;
 static PSTR pszINVOPT         /* = "Invalid option format (embedded space?)" */ ;
 static PSTR pszSRCTWICE       /* = "Source name given twice? Dest file should be specified using --output <fn> option" */ ;
 static PSTR pszNEEDSRC        /* = "Source filename is missing" */ ;
+static PSTR pszNONUMBER       /* = "a number should follow the %s option" */ ;
+static PSTR pszBADSYNC        /* = "sync mode should be writethrough, checkpoint or end" */ ;
+static PSTR pszNOREPFN        /* = "report option specified, no filename provided" */ ;
+static PSTR pszNOBATFN        /* = "batch option specified, no filename provided" */ ;
+static PSTR pszNOTHRFN        /* = "throttle option specified, no filename provided" */ ;
 
 // I decided not to allow localisation of command line option names
 // after all, as it could break scripts.
@@ -41,11 +52,63 @@ static PSTR pszVOPTENLARGE    = "enlarge";
 static PSTR pszVOPTCOMPACT    = "compact";
 static PSTR pszVOPTREPART     = "repart";
 static PSTR pszVOPTNOMERGE    = "nomerge";
+static PSTR pszVOPTDEPTH      = "depth";
+static PSTR pszVOPTQDEPTH     = "qdepth";
+static PSTR pszVOPTPHYSORDER  = "physorder";
+static PSTR pszVOPTRESERVE    = "reserve";
+static PSTR pszVOPTDIRECT     = "direct";
+static PSTR pszVOPTMMAP       = "mmap";
+static PSTR pszVOPTSYNC       = "sync";
+static PSTR pszVOPTSYNCMB     = "syncmb";
+static PSTR pszVOPTREPORT     = "report";
+static PSTR pszVOPTBENCH      = "bench";
+static PSTR pszVOPTRESUME     = "resume";
+static PSTR pszVOPTUPDATE     = "update";
+static PSTR pszVOPTSYNTH      = "synth";
+static PSTR pszVOPTDENSITY    = "density";
+static PSTR pszVOPTFRAG       = "frag";
+static PSTR pszVOPTDRYRUN     = "dryrun";
+static PSTR pszVOPTSAMPLE     = "sample";
+static PSTR pszVOPTREADMB     = "readmb";
+static PSTR pszVOPTWRITEMB    = "writemb";
+static PSTR pszVOPTREADIOPS   = "readiops";
+static PSTR pszVOPTWRITEIOPS  = "writeiops";
+static PSTR pszVOPTTHROTTLE   = "throttle";
+static PSTR pszVOPTMAXMEM     = "max-memory";
+static PSTR pszVOPTBATCH      = "batch";
+static PSTR pszVOPTJOBS       = "jobs";
+static PSTR pszVOPTPERDEV     = "perdev";
+static PSTR pszSYNCMODE[3]    = {"writethrough","checkpoint","end"};
 static PSTR pszVOPTHELP       = "help";
 static PSTR pszCHAROPT        = "okechr";
 
 /*.....................................................*/
 
+static PSTR
+ParamStr(UINT iArg)
+// Same as Env_ParamStr(), except when a manifest line is being parsed.
+{
+   if (pLineArgs) return (iArg>=1 && iArg<=nLineArgs ? pLineArgs[iArg-1] : NULL);
+   return Env_ParamStr(iArg);
+}
+
+/*.....................................................*/
+
+static void
+FullPathName(PFN fn, CPFN pszArg)
+// Same as GetFullPathName(), except that a relative path on a manifest line is taken
+// to be relative to the manifest's folder, not to the current directory.
+{
+   FNCHAR path[1024];
+   if (pLineArgs && pszArg[0]!='\\' && pszArg[0]!='/' && !(pszArg[0] && pszArg[1]==':')) {
+      Filename_MakePath(path,pszLineDir,pszArg);
+      pszArg = path;
+   }
+   GetFullPathName(pszArg,1024,fn,0);
+}
+
+/*.....................................................*/
+
 static BOOL
 Error(PSTR pszMsg)
 {
@@ -66,6 +129,7 @@ static BOOL
 Usage(BOOL bShowBanner)
 {
    FILE stdout = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (pLineArgs) return FALSE; // one error per bad manifest line is enough.
    if (stdout) {
       UINT ids;
       if (bShowBanner) {
@@ -92,7 +156,7 @@ static BOOL
 ArgError(PSTR pszErr, UINT iArg)
 {
    CHAR szErr[256];
-   wsprintf(szErr,RSTR(ARGERR),iArg);
+   wsprintf(szErr,RSTR(ARGERR),iArg,pszErr);
    Error(szErr);
    return Usage(FALSE);
 }
@@ -113,7 +177,7 @@ ErrOptionSetTwice(PSTR pszOptName, UINT iArg)
 static UINT
 GetOutputOption(s_CLONEPARMS *parm, UINT iArg, BOOL gotDstFn)
 {
-   PSTR pszArg = Env_ParamStr(iArg);
+   PSTR pszArg = ParamStr(iArg);
    if (gotDstFn) return ErrOptionSetTwice(pszVOPTOUTPUT,iArg-1);
    if (!pszArg) return ArgError(RSTR(NOFILEN),iArg-1);
    String_Copy(parm->dstfn, pszArg, 1024);
@@ -122,10 +186,46 @@ GetOutputOption(s_CLONEPARMS *parm, UINT iArg, BOOL gotDstFn)
 
 /*.......................................................................*/
 
+static UINT
+GetReportOption(s_CLONEPARMS *parm, UINT iArg)
+{
+   PSTR pszArg = ParamStr(iArg);
+   if (parm->reportfn[0]) return ErrOptionSetTwice(pszVOPTREPORT,iArg-1);
+   if (!pszArg) return ArgError(RSTR(NOREPFN),iArg-1);
+   FullPathName(parm->reportfn,pszArg);
+   return (iArg+1);
+}
+
+/*.......................................................................*/
+
+static UINT
+GetBatchOption(s_CLONEPARMS *parm, UINT iArg)
+{
+   PSTR pszArg = ParamStr(iArg);
+   if (parm->batchfn[0]) return ErrOptionSetTwice(pszVOPTBATCH,iArg-1);
+   if (!pszArg) return ArgError(RSTR(NOBATFN),iArg-1);
+   GetFullPathName(pszArg,1024,parm->batchfn,0);
+   return (iArg+1);
+}
+
+/*.......................................................................*/
+
+static UINT
+GetThrottleOption(s_CLONEPARMS *parm, UINT iArg)
+{
+   PSTR pszArg = ParamStr(iArg);
+   if (parm->throttlefn[0]) return ErrOptionSetTwice(pszVOPTTHROTTLE,iArg-1);
+   if (!pszArg) return ArgError(RSTR(NOTHRFN),iArg-1);
+   FullPathName(parm->throttlefn,pszArg);
+   return (iArg+1);
+}
+
+/*.......................................................................*/
+
 static UINT
 GetEnlargeOption(s_CLONEPARMS *parm, UINT iArg)
 {
-   PSTR pszArg = Env_ParamStr(iArg);
+   PSTR pszArg = ParamStr(iArg);
    if (parm->flags & PARM_FLAG_ENLARGE) return ErrOptionSetTwice(pszVOPTENLARGE,iArg-1);
    if (!pszArg) return ArgError(RSTR(NODSIZE),iArg-1);
    String_Copy(parm->szDestSize, pszArg, 32);
@@ -135,6 +235,54 @@ GetEnlargeOption(s_CLONEPARMS *parm, UINT iArg)
 
 /*.......................................................................*/
 
+static UINT
+GetNumberOption(UINT *pValue, UINT iArg, PSTR pszOptName)
+// Get an option whose parameter is an unsigned decimal number, supplied as the
+// next argument. As with the other options, specifying it twice is an error (a
+// zero value is taken to mean "not set").
+{
+   PSTR pszArg = ParamStr(iArg);
+   UINT c,n=0;
+   if (*pValue) return ErrOptionSetTwice(pszOptName,iArg-1);
+   if (pszArg) {
+      c = *pszArg++;
+      while (c>='0' && c<='9' && n<100000000) {
+         n = n*10 + (c-'0');
+         c = *pszArg++;
+      }
+      if (c) n = 0;
+   }
+   if (!n) {
+      CHAR szErr[256];
+      wsprintf(szErr,RSTR(NONUMBER),pszOptName);
+      return ArgError(szErr,iArg-1);
+   }
+   *pValue = n;
+   return (iArg+1);
+}
+
+/*.......................................................................*/
+
+static UINT
+GetSyncOption(s_CLONEPARMS *parm, UINT iArg)
+// Get the durability policy, one of the mode names in pszSYNCMODE[].
+{
+   PSTR pszArg = ParamStr(iArg);
+   UINT i;
+   if (parm->SyncMode) return ErrOptionSetTwice(pszVOPTSYNC,iArg-1);
+   if (pszArg) {
+      for (i=0; i<3; i++) {
+         if (String_Compare(pszArg,pszSYNCMODE[i])==0) {
+            parm->SyncMode = PARM_SYNC_WRITETHROUGH+i;
+            return (iArg+1);
+         }
+      }
+   }
+   return ArgError(RSTR(BADSYNC),iArg-1);
+}
+
+/*.......................................................................*/
+
 static BOOL
 GetOption(s_CLONEPARMS *parm, UINT iArg, UINT flag, PSTR pszOptName)
 // Get generic option which has no parameters.
@@ -163,19 +311,19 @@ VerboseSubOption(PSTR pszDest, UINT len, PSTR psz)
 
 /*.....................................................*/
 
-PUBLIC BOOL
-CmdLine_Parse(s_CLONEPARMS *parm)
+static BOOL
+ParseArgs(s_CLONEPARMS *parm, UINT argc)
+// Parses arguments 1..argc, as returned by ParamStr().
 {
    BOOL gotSrcFn=FALSE,gotDstFn=FALSE;
    PSTR pszArg;
-   UINT argc = Env_ParamCount();
    UINT iArg = 1;
 
    ZeroMemory(parm,sizeof(s_CLONEPARMS));
    parm->flags = PARM_FLAG_CLIMODE;
 
    while (iArg <= argc) {
-      pszArg = Env_ParamStr(iArg);
+      pszArg = ParamStr(iArg);
       if (!pszArg) break; // can't happen.
       
       iArg++;
@@ -199,11 +347,82 @@ CmdLine_Parse(s_CLONEPARMS *parm)
                   if (!GetOption(parm,iArg,PARM_FLAG_COMPACT,pszVOPTCOMPACT)) return FALSE;
                } else if  (String_Compare(szItem,pszVOPTNOMERGE)==0) {
                   if (!GetOption(parm,iArg,PARM_FLAG_NOMERGE,pszVOPTNOMERGE)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTPHYSORDER)==0) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_PHYSORDER,pszVOPTPHYSORDER)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTRESERVE)==0) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_RESERVE,pszVOPTRESERVE)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTDIRECT)==0) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_DIRECTIO,pszVOPTDIRECT)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTMMAP)==0) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_MMAP,pszVOPTMMAP)) return FALSE;
                } else if  (String_Compare(szItem,pszVOPTREPART)==0) {
                   if (!GetOption(parm,iArg,PARM_FLAG_REPART,pszVOPTREPART)) return FALSE;
                } else if  (String_Compare(szItem,pszVOPTENLARGE)==0) {
                   iArg = GetEnlargeOption(parm,iArg);
                   if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTDEPTH)==0) {
+                  iArg = GetNumberOption(&parm->PipeDepth,iArg,pszVOPTDEPTH);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTQDEPTH)==0) {
+                  iArg = GetNumberOption(&parm->QueueDepth,iArg,pszVOPTQDEPTH);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTSYNC)==0) {
+                  iArg = GetSyncOption(parm,iArg);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTSYNCMB)==0) {
+                  iArg = GetNumberOption(&parm->SyncMB,iArg,pszVOPTSYNCMB);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTREPORT)==0) {
+                  iArg = GetReportOption(parm,iArg);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTBENCH)==0 && !pLineArgs) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_BENCH,pszVOPTBENCH)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTRESUME)==0) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_RESUME,pszVOPTRESUME)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTUPDATE)==0) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_UPDATE,pszVOPTUPDATE)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTSYNTH)==0 && !pLineArgs) {
+                  iArg = GetNumberOption(&parm->SynthMB,iArg,pszVOPTSYNTH);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTDENSITY)==0) {
+                  iArg = GetNumberOption(&parm->SynthDensity,iArg,pszVOPTDENSITY);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTFRAG)==0) {
+                  iArg = GetNumberOption(&parm->SynthFrag,iArg,pszVOPTFRAG);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTDRYRUN)==0 && !pLineArgs) {
+                  if (!GetOption(parm,iArg,PARM_FLAG_DRYRUN,pszVOPTDRYRUN)) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTSAMPLE)==0) {
+                  iArg = GetNumberOption(&parm->SamplePct,iArg,pszVOPTSAMPLE);
+                  if (iArg==0) return FALSE;
+                  if (parm->SamplePct>100) parm->SamplePct = 100;
+               } else if  (String_Compare(szItem,pszVOPTREADMB)==0) {
+                  iArg = GetNumberOption(&parm->ReadMB,iArg,pszVOPTREADMB);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTWRITEMB)==0) {
+                  iArg = GetNumberOption(&parm->WriteMB,iArg,pszVOPTWRITEMB);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTREADIOPS)==0) {
+                  iArg = GetNumberOption(&parm->ReadIOPS,iArg,pszVOPTREADIOPS);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTWRITEIOPS)==0) {
+                  iArg = GetNumberOption(&parm->WriteIOPS,iArg,pszVOPTWRITEIOPS);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTTHROTTLE)==0) {
+                  iArg = GetThrottleOption(parm,iArg);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTMAXMEM)==0) {
+                  iArg = GetNumberOption(&parm->MaxMemoryMB,iArg,pszVOPTMAXMEM);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTBATCH)==0 && !pLineArgs) {
+                  iArg = GetBatchOption(parm,iArg);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTJOBS)==0 && !pLineArgs) {
+                  iArg = GetNumberOption(&parm->nJobs,iArg,pszVOPTJOBS);
+                  if (iArg==0) return FALSE;
+               } else if  (String_Compare(szItem,pszVOPTPERDEV)==0 && !pLineArgs) {
+                  iArg = GetNumberOption(&parm->nPerDevice,iArg,pszVOPTPERDEV);
+                  if (iArg==0) return FALSE;
                } else {
                   return ArgError(RSTR(UNKOPT),iArg-1);
                }
@@ -239,17 +458,18 @@ CmdLine_Parse(s_CLONEPARMS *parm)
       } else if (gotSrcFn) {
          return ArgError(RSTR(SRCTWICE),iArg-1);
       } else {
-         GetFullPathName(pszArg,1024,parm->srcfn,0);
+         FullPathName(parm->srcfn,pszArg);
          gotSrcFn = TRUE;
       }
    }
    if (!gotSrcFn) {
+      if (parm->batchfn[0]) return TRUE; // the manifest supplies the sources.
       return ArgError(RSTR(NEEDSRC),iArg-1);
    }
    if (!gotDstFn) {
       Env_GenerateCloneName(parm->dstfn,parm->srcfn);
    }
-   GetFullPathName(parm->dstfn,1024,tmpfn,0);
+   FullPathName(tmpfn,parm->dstfn);
    String_Copy(parm->dstfn, tmpfn, 1024);
 
    if (!(parm->flags & PARM_FLAG_ENLARGE)) parm->flags &= ~PARM_FLAG_REPART;
@@ -257,6 +477,50 @@ CmdLine_Parse(s_CLONEPARMS *parm)
    return TRUE;
 }
 
+/*.....................................................*/
+
+PUBLIC BOOL
+CmdLine_Parse(s_CLONEPARMS *parm)
+{
+   pLineArgs = NULL;
+   return ParseArgs(parm,Env_ParamCount());
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+CmdLine_ParseLine(s_CLONEPARMS *parm, PSTR pszLine, CPFN pszDir)
+// Splits the line into arguments the way the C runtime splits a command line (spaces
+// separate arguments unless quoted), then parses those. The line is modified.
+{
+   PSTR args[MAX_LINE_ARGS];
+   UINT n = 0;
+   BOOL bOK;
+   CHAR c;
+
+   for (;;) {
+      while (*pszLine==' ' || *pszLine==9) pszLine++;
+      if (!*pszLine) break;
+      if (n==MAX_LINE_ARGS) return ArgError(RSTR(INVOPT),n);
+      if (*pszLine=='"') {
+         args[n++] = ++pszLine;
+         while (*pszLine && *pszLine!='"') pszLine++;
+      } else {
+         args[n++] = pszLine;
+         while (*pszLine && *pszLine!=' ' && *pszLine!=9) pszLine++;
+      }
+      c = *pszLine;
+      *pszLine = (CHAR)0;
+      if (c) pszLine++;
+   }
+   pLineArgs = args;
+   nLineArgs = n;
+   pszLineDir = pszDir;
+   bOK = ParseArgs(parm,n);
+   pLineArgs = NULL;
+   return bOK;
+}
+
 /*.......................................................................*/
 
 /* end of cmdline.c */
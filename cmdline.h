@@ -16,5 +16,15 @@
 
 BOOL CmdLine_Parse(s_CLONEPARMS *parm);
 
+BOOL CmdLine_ParseLine(s_CLONEPARMS *parm, PSTR pszLine, CPFN pszDir);
+/* Parses one line of a batch manifest into parm. The line holds the same arguments as
+ * a command line, minus the program name and the options which don't make sense for a
+ * single job of a batch (--batch, --jobs, --perdev, --bench, --synth and --dryrun), which
+ * are rejected as unknown options. The line is modified. Relative paths are taken to be
+ * relative to pszDir, normally the manifest's folder. Errors are reported the same way
+ * as for CmdLine_Parse(), but without the usage text.
+ * Not reentrant.
+ */
+
 #endif
 
@@ -72,22 +72,7 @@ typedef struct {
    BYTE buff[COW_BLOCK_SIZE];
 } COW_INFO, *PCOW;
 
-static UINT OSLastError;
-
-/*...................................................................*/
-
-static UINT
-DoSeek(FILE f, HUGE pos)
-{
-   HUGE currpos;
-   UINT err = 0;
-   if (File_GetPos(f,&currpos)==0xFFFFFFFF) err = File_IOresult();
-   else if (pos!=currpos) {
-      File_Seek(f,pos);
-      err = File_IOresult();
-   }
-   return err;
-}
+static __declspec(thread) UINT OSLastError;
 
 /*.....................................................*/
 
@@ -152,7 +137,7 @@ PUBLIC PSTR
 COW_GetErrorString(UINT nErr)
 {
    PSTR pszErr;
-   static char sz[256];
+   static __declspec(thread) char sz[256];
    if (nErr==0xFFFFFFFF) nErr = VDDR_LastError;
    switch (nErr) {
       case COW_ERR_NONE:
@@ -322,15 +307,12 @@ RawReadSectors(PCOW pCOW, PEXTENT pe, BYTE *buffer, HUGE LBA, UINT offset_sector
          } else {
             pos += offset_sector;
             pos <<= 9;
-            VDDR_LastError = COW_ERR_SEEK;
-            if (DoSeek(pCOW->fCOW,pos)==0) {
-               File_RdBin(pCOW->fCOW,buffer,nSectors<<9);
-               VDDR_LastError = COW_ERR_READ;
-               if (File_IOresult()==0) {
-                  VDDR_LastError = 0;
-                  return VDDR_RSLT_NORMAL;
-               }
+            VDDR_LastError = COW_ERR_READ;
+            if (File_ReadAt(pCOW->fCOW,buffer,nSectors<<9,pos)==(nSectors<<9)) {
+               VDDR_LastError = 0;
+               return VDDR_RSLT_NORMAL;
             }
+            OSLastError = File_IOresult();
          }
          return VDDR_RSLT_FAIL;
       }
@@ -431,8 +413,7 @@ FlushCowCache(PCOW pCOW)
          Env_GetTempFileName(NULL, "COW", 0, pCOW->fnCow);
          pCOW->fCOW = File_Create(pCOW->fnCow,DJFILE_FLAG_OVERWRITE|DJFILE_FLAG_READWRITE);
       }
-      DoSeek(pCOW->fCOW,pCOW->cow_seekpos);
-      File_WrBin(pCOW->fCOW,pCOW->buff,COW_BLOCK_SIZE);
+      File_WriteAt(pCOW->fCOW,pCOW->buff,COW_BLOCK_SIZE,pCOW->cow_seekpos);
       pCOW->bCowCacheDirty = FALSE;
    }
    return TRUE;
@@ -546,8 +527,7 @@ COW_WriteSectors(HCOW pThis, void *buffer, HUGE LBA, UINT nSectors)
             HUGE seekpos = pe->ExtentBase;
             seekpos <<= 9;
             seekpos += offset;
-            DoSeek(pCOW->fCOW,seekpos);
-            File_WrBin(pCOW->fCOW,pSrc,SectorsToCopy<<9);
+            File_WriteAt(pCOW->fCOW,pSrc,SectorsToCopy<<9,seekpos);
          }
          if (nSectors) {
             // find and map the next extent.
@@ -13,7 +13,8 @@
 
 #define PUBLIC
 
-static UINT IOR;
+static __declspec(thread) UINT IOR; // per thread, so that concurrent positional I/O reports its own errors.
+static __declspec(thread) UINT AsyncFlags;
 
 /*.....................................................*/
 
@@ -42,14 +43,18 @@ File_Create(CPFN fn, UINT flags)
    DWORD dwOpenMode=CREATE_NEW;
    DWORD dwAccess=GENERIC_WRITE;
    DWORD dwflags=0;
+   DWORD dwShare=0;
    FILE h;
    
    if (flags & DJFILE_FLAG_OVERWRITE) dwOpenMode = CREATE_ALWAYS;
+   if (flags & DJFILE_FLAG_OPENEXISTING) dwOpenMode = OPEN_EXISTING;
    if (flags & DJFILE_FLAG_DELETEONCLOSE) dwflags |= FILE_FLAG_DELETE_ON_CLOSE;
    if (flags & DJFILE_FLAG_WRITETHROUGH) dwflags |= FILE_FLAG_WRITE_THROUGH;
    if (flags & DJFILE_FLAG_SEQUENTIAL) dwflags |= FILE_FLAG_SEQUENTIAL_SCAN;
    if (flags & DJFILE_FLAG_READWRITE) dwAccess |= GENERIC_READ;
-   h = CreateFile(fn,dwAccess,0,0,dwOpenMode,dwflags,0);
+   if (flags & DJFILE_FLAG_NOBUFFERING) dwflags |= FILE_FLAG_NO_BUFFERING;
+   if (flags & DJFILE_FLAG_SHAREWRITE) dwShare = FILE_SHARE_READ|FILE_SHARE_WRITE;
+   h = CreateFile(fn,dwAccess,dwShare,0,dwOpenMode,dwflags,0);
    if (h!=NULLFILE) IOR=0;
    else IOR = GetLastError();
    return h;
@@ -79,6 +84,42 @@ File_OpenReadShared(CPFN fn)
 
 /*.....................................................*/
 
+PUBLIC void
+File_SetAsyncFlags(UINT flags)
+{
+   AsyncFlags = flags;
+}
+
+/*.....................................................*/
+
+PUBLIC FILE
+File_OpenReadAsync(CPFN fn)
+{
+   DWORD dwflags = FILE_FLAG_OVERLAPPED;
+   HANDLE h;
+   if (AsyncFlags & DJFILE_FLAG_NOBUFFERING) dwflags |= FILE_FLAG_NO_BUFFERING;
+   h = CreateFile(fn,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,dwflags,0);
+   if (h!=NULLFILE) IOR=0;
+   else IOR = GetLastError();
+   return (FILE)h;
+}
+
+/*.....................................................*/
+
+PUBLIC FILE
+File_OpenWriteDirect(CPFN fn, UINT flags)
+{
+   DWORD dwflags = FILE_FLAG_NO_BUFFERING;
+   HANDLE h;
+   if (flags & DJFILE_FLAG_WRITETHROUGH) dwflags |= FILE_FLAG_WRITE_THROUGH;
+   h = CreateFile(fn,GENERIC_WRITE,FILE_SHARE_READ|FILE_SHARE_WRITE,NULL,OPEN_EXISTING,dwflags,0);
+   if (h!=NULLFILE) IOR=0;
+   else IOR = GetLastError();
+   return (FILE)h;
+}
+
+/*.....................................................*/
+
 PUBLIC void
 File_Close(FILE f)
 {
@@ -110,6 +151,85 @@ File_WrBin(FILE f, PVOID buf, UINT Size)
 
 /*.....................................................*/
 
+static void
+SetOffset(OVERLAPPED *ov, HUGE pos)
+{
+   ZeroMemory(ov,sizeof(OVERLAPPED));
+   ov->Offset = LO32(pos);
+   ov->OffsetHigh = HI32(pos);
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+File_ReadAt(FILE f, PVOID buf, UINT Size, HUGE pos)
+{
+   OVERLAPPED ov;
+   DWORD BytesRead = 0;
+   SetOffset(&ov,pos);
+   if (ReadFile(f,buf,Size,&BytesRead,&ov)) IOR = 0;
+   else {
+      IOR = GetLastError();
+      if (IOR==ERROR_HANDLE_EOF) IOR = 0; // a short read, the same as File_RdBin() gives.
+   }
+   return BytesRead;
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+File_WriteAt(FILE f, PVOID buf, UINT Size, HUGE pos)
+{
+   OVERLAPPED ov;
+   DWORD BytesWritten = 0;
+   SetOffset(&ov,pos);
+   if (WriteFile(f,buf,Size,&BytesWritten,&ov)) IOR = 0;
+   else IOR = GetLastError();
+   return BytesWritten;
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+File_ReadAtV(FILE f, DJFILE_IOVEC *iov, UINT nVec, HUGE pos)
+{
+   UINT i,len,total = 0;
+   for (i=0; i<nVec; i++) {
+      len = File_ReadAt(f,iov[i].buf,iov[i].len,pos);
+      total += len;
+      pos += len;
+      if (len!=iov[i].len) break;
+   }
+   return total;
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+File_WriteAtV(FILE f, DJFILE_IOVEC *iov, UINT nVec, HUGE pos)
+{
+   UINT i,len,total = 0;
+   for (i=0; i<nVec; i++) {
+      len = File_WriteAt(f,iov[i].buf,iov[i].len,pos);
+      total += len;
+      pos += len;
+      if (len!=iov[i].len) break;
+   }
+   return total;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+File_Flush(FILE f)
+{
+   if (FlushFileBuffers(f)) IOR = 0;
+   else IOR = GetLastError();
+   return (IOR==0);
+}
+
+/*.....................................................*/
+
 PUBLIC void
 File_Seek(FILE f, HUGE pos)
 {
@@ -146,6 +266,48 @@ File_Size(FILE f, HUGE *size)
 
 /*.....................................................*/
 
+PUBLIC BOOL
+File_SetSize(FILE f, HUGE size)
+{
+   HUGE pos;
+   UINT err = 0;
+   File_GetPos(f,&pos);
+   File_Seek(f,size);
+   if (IOR==0 && !SetEndOfFile(f)) err = GetLastError();
+   else err = IOR;
+   File_Seek(f,pos);
+   IOR = err;
+   return (IOR==0);
+}
+
+/*.....................................................*/
+
+// SetFileInformationByHandle() only exists on Vista and later, so I look it up at runtime.
+typedef BOOL (WINAPI *SETFILEINFO)(HANDLE hFile, int InfoClass, LPVOID lpInfo, DWORD dwBufferSize);
+#define DJFILE_ALLOCATION_INFO_CLASS 5 /* FileAllocationInfo */
+
+PUBLIC BOOL
+File_Reserve(FILE f, HUGE size)
+{
+   static SETFILEINFO pfnSetFileInfo;
+   static BOOL bLookedUp;
+   LARGE_INTEGER AllocationSize;
+
+   if (!bLookedUp) {
+      HMODULE hMod = GetModuleHandle("kernel32.dll");
+      if (hMod) pfnSetFileInfo = (SETFILEINFO)GetProcAddress(hMod,"SetFileInformationByHandle");
+      bLookedUp = TRUE;
+   }
+   IOR = ERROR_NOT_SUPPORTED;
+   if (!pfnSetFileInfo) return FALSE;
+   AllocationSize.QuadPart = size;
+   if (pfnSetFileInfo(f,DJFILE_ALLOCATION_INFO_CLASS,&AllocationSize,sizeof(AllocationSize))) IOR = 0;
+   else IOR = GetLastError();
+   return (IOR==0);
+}
+
+/*.....................................................*/
+
 PUBLIC void
 File_Erase(CPFN fn)
 {
@@ -165,6 +327,16 @@ File_Rename(CPFN oldfn, CPFN fn)
 
 /*.....................................................*/
 
+PUBLIC BOOL
+File_Replace(CPFN oldfn, CPFN fn)
+{
+   if (MoveFileEx(oldfn, fn, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)) IOR = 0;
+   else IOR = GetLastError();
+   return (IOR==0);
+}
+
+/*.....................................................*/
+
 PUBLIC UINT
 File_GetDate(FILE f)
 {
@@ -212,6 +384,100 @@ File_Exists(CPFN path)
 
 /*.....................................................*/
 
+PUBLIC HANDLE
+File_CreateMapping(FILE f)
+{
+   // PAGE_WRITECOPY only needs read access to the file.
+   HANDLE hMap = CreateFileMapping(f,NULL,PAGE_WRITECOPY,0,0,NULL);
+   if (hMap) IOR = 0;
+   else IOR = GetLastError();
+   return hMap;
+}
+
+/*.....................................................*/
+
+// PrefetchVirtualMemory() only exists on Windows 8 and later, so I look it up at runtime.
+typedef struct {
+   PVOID  VirtualAddress;
+   SIZE_T NumberOfBytes;
+} DJFILE_MEMORY_RANGE;
+typedef BOOL (WINAPI *PREFETCHVM)(HANDLE hProcess, ULONG_PTR nEntries, DJFILE_MEMORY_RANGE *pRanges, ULONG Flags);
+
+static BOOL
+TouchPages(volatile BYTE *p, UINT len)
+// Reads one byte from each page, so that the pages are brought in now. Windows reports an
+// I/O error on a mapped page as an exception, which is turned into a FALSE return.
+{
+   UINT i;
+   __try {
+      for (i=0; i<len; i+=4096) p[i];
+      if (len) p[len-1];
+   } __except (GetExceptionCode()==EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/*.....................................................*/
+
+PUBLIC PBYTE
+File_MapView(HANDLE hMap, HUGE pos, UINT len, PVOID *ppView)
+{
+   static PREFETCHVM pfnPrefetch;
+   static UINT Granularity;
+   DJFILE_MEMORY_RANGE range;
+   PBYTE pView;
+   UINT skip;
+   HUGE base;
+
+   if (!Granularity) {
+      SYSTEM_INFO si;
+      HMODULE hMod = GetModuleHandle("kernel32.dll");
+      if (hMod) pfnPrefetch = (PREFETCHVM)GetProcAddress(hMod,"PrefetchVirtualMemory");
+      GetSystemInfo(&si);
+      Granularity = si.dwAllocationGranularity; // views must start on a multiple of this.
+   }
+
+   skip = (UINT)(pos % Granularity);
+   base = pos-skip;
+   *ppView = pView = MapViewOfFile(hMap,FILE_MAP_COPY,HI32(base),LO32(base),skip+len);
+   if (!pView) {
+      IOR = GetLastError();
+      return NULL;
+   }
+   if (pfnPrefetch) {
+      range.VirtualAddress = pView+skip;
+      range.NumberOfBytes = len;
+      pfnPrefetch(GetCurrentProcess(),1,&range,0);
+   }
+   if (!TouchPages(pView+skip,len)) {
+      UnmapViewOfFile(pView);
+      *ppView = NULL;
+      IOR = ERROR_READ_FAULT;
+      return NULL;
+   }
+   IOR = 0;
+   return pView+skip;
+}
+
+/*.....................................................*/
+
+PUBLIC void
+File_UnmapView(PVOID pView)
+{
+   if (pView) UnmapViewOfFile(pView);
+}
+
+/*.....................................................*/
+
+PUBLIC void
+File_CloseMapping(HANDLE hMap)
+{
+   if (hMap) CloseHandle(hMap);
+}
+
+/*.....................................................*/
+
 /* end of module djfile.c */
 
 
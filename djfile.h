@@ -24,10 +24,15 @@ typedef struct {UINT dummy;} *FILE;
 #define DJFILE_FLAG_WRITETHROUGH     4
 #define DJFILE_FLAG_SEQUENTIAL       8
 #define DJFILE_FLAG_READWRITE        16
+#define DJFILE_FLAG_NOBUFFERING      32  /* bypass the OS file cache, see File_OpenWriteDirect() */
+#define DJFILE_FLAG_SHAREWRITE       64  /* let a second (e.g. unbuffered) handle write to the file */
+#define DJFILE_FLAG_OPENEXISTING     128 /* open an existing file (without truncating it) instead */
 
 FILE   File_Create(CPFN fn, UINT flags);
 // Opens a file in create mode, exclusive access. Creation will fail if the
-// file already exists, unless the DJFILE_FLAG_OVERWRITE flag is set.
+// file already exists, unless the DJFILE_FLAG_OVERWRITE flag is set. With
+// DJFILE_FLAG_OPENEXISTING the file must exist already, and is opened for writing
+// with its contents intact (the other flags have their usual meaning).
 //
 
 FILE   File_OpenRead(CPFN fn);
@@ -38,6 +43,28 @@ FILE   File_OpenReadShared(CPFN fn);
 // Opens an existing file in read-only mode, allowing read/write access to other apps.
 //
 
+FILE   File_OpenReadAsync(CPFN fn);
+// Opens an existing file for overlapped (asynchronous) reads, with the same sharing
+// mode as File_OpenRead(), so it can coexist with a normal handle on the same file.
+// Such a handle has no useful file pointer: it is only meant to be passed to the
+// AIO module (see aio.h), don't use File_RdBin() on it. If File_SetAsyncFlags() has
+// been passed DJFILE_FLAG_NOBUFFERING then the handle bypasses the OS file cache.
+//
+
+void   File_SetAsyncFlags(UINT flags);
+// Sets the DJFILE_FLAG_xxx flags applied by all later File_OpenReadAsync() calls made
+// on the calling thread. Only DJFILE_FLAG_NOBUFFERING means anything here. Defaults to 0.
+//
+
+FILE   File_OpenWriteDirect(CPFN fn, UINT flags);
+// Opens a second, unbuffered, write handle on a file which was created with the
+// DJFILE_FLAG_SHAREWRITE flag. Writes through this handle bypass the OS file cache,
+// so they must start at a file offset which is a multiple of the volume sector size,
+// be a multiple of the sector size long, and come from a sector aligned buffer (see
+// Mem_AllocAligned()). Windows rejects anything else with ERROR_INVALID_PARAMETER.
+// The only flag which means anything here is DJFILE_FLAG_WRITETHROUGH.
+//
+
 FILE   File_Open(CPFN fn);
 // This opens an existing file in read/write mode, exclusive access.
 
@@ -46,6 +73,32 @@ void   File_Close(FILE f);
 UINT   File_RdBin(FILE f, PVOID Buf, UINT Size);
 UINT   File_WrBin(FILE f, PVOID Buf, UINT Size);
 
+UINT   File_ReadAt(FILE f, PVOID Buf, UINT Size, HUGE pos);
+UINT   File_WriteAt(FILE f, PVOID Buf, UINT Size, HUGE pos);
+// Positional versions of File_RdBin() and File_WrBin(), which read or write at byte
+// offset pos in one call, without a seek. Several threads may use one handle at once,
+// and File_IOresult() is kept per thread, so each sees its own result. Windows still
+// moves the file pointer, so after using these on a handle, File_Seek() before going
+// back to File_RdBin() or File_WrBin() on it. Not for File_OpenReadAsync() handles.
+//
+
+typedef struct {
+   PVOID buf;
+   UINT  len;
+} DJFILE_IOVEC;
+
+UINT   File_ReadAtV(FILE f, DJFILE_IOVEC *iov, UINT nVec, HUGE pos);
+UINT   File_WriteAtV(FILE f, DJFILE_IOVEC *iov, UINT nVec, HUGE pos);
+// Vectored versions of the above: the nVec buffers in iov[] are read from, or written
+// to, consecutive bytes of the file starting at pos. Returns the total transferred, and
+// stops at the first short transfer. Windows only has scatter/gather I/O for unbuffered
+// overlapped handles, so this is one call per buffer, but it does save the seeks.
+//
+
+BOOL   File_Flush(FILE f);
+// Waits until everything written to the file so far is on the disk, drive write
+// cache included (this is Windows' fsync). Not needed with DJFILE_FLAG_WRITETHROUGH.
+
 void   File_Seek(FILE f, HUGE pos);
 
 UINT   File_GetPos(FILE f, HUGE *pos);
@@ -56,9 +109,24 @@ UINT   File_Size(FILE f, HUGE *size);
 // Return value is low dword of file size. Full 64bit size is returned in size argument.
 // size argument may be NULL if you know the file size is less than 4GB.
 
+BOOL   File_SetSize(FILE f, HUGE size);
+// Truncates or extends the file to the given size. The file pointer is left where it was.
+// Extending the file makes Windows allocate the clusters up front, the new part of the
+// file reads as zeros.
+
+BOOL   File_Reserve(FILE f, HUGE size);
+// Reserves disk space for a file of the given size without changing the file size, so
+// that later appends land in space which was allocated in one go. Returns FALSE (IOR is
+// ERROR_NOT_SUPPORTED) on Windows versions before Vista. Windows frees any reserved space
+// which is still past the end of the file when the file is closed.
+
 void   File_Erase(CPFN fn);
 BOOL   File_Exists(CPFN fn);
 BOOL   File_Rename(CPFN oldname, CPFN name);
+BOOL   File_Replace(CPFN oldname, CPFN name);
+// Renames a file like File_Rename(), but if the new name exists already then it is
+// replaced, in one step. Either the old or the new file will be found there afterwards,
+// even if the machine crashes (as long as the new file was flushed first).
 
 UINT   File_GetDate(FILE f);         // for legacy reasons, returns date in DOS format.
 void   File_SetDate(FILE f, UINT d); // for legacy reasons, expects date in DOS format.
@@ -66,5 +134,22 @@ void   File_SetDate(FILE f, UINT d); // for legacy reasons, expects date in DOS
 UINT   File_IOresult(void);
 void   File_SetIOR(UINT err);
 
+HANDLE File_CreateMapping(FILE f);
+// Creates a copy on write mapping of the whole of a file which is open for reading, for
+// use with File_MapView(). Returns NULL on failure. Free it with File_CloseMapping().
+//
+
+PBYTE  File_MapView(HANDLE hMap, HUGE pos, UINT len, PVOID *ppView);
+// Maps len bytes of the file, from byte offset pos, into memory and returns a pointer to
+// them, or NULL on failure. *ppView receives the view to pass to File_UnmapView() later.
+// Writes to the view are private, they never reach the file. The pages are read in before
+// this returns (by one prefetch request, on Windows 8 and later), so a read error shows up
+// as a failure here, not as an exception when the data is used. This is also what makes
+// the reads happen on the calling thread.
+//
+
+void   File_UnmapView(PVOID pView);
+void   File_CloseMapping(HANDLE hMap);
+
 #endif
 
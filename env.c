@@ -36,6 +36,7 @@ static HINSTANCE hInstRes,hInstLang;
 static UINT   SlimVDI_Language_Code;
 static LANGID idDefaultLanguage;
 static STRING_CACHE *pStrCache;
+static volatile LONG StrCacheLock; // batch clones load strings from several threads.
 static BOOL   bCOMInitDone;
 
 static PSTR pszSELECT_SOURCE /* = "Select source file..." */ ;
@@ -196,8 +197,8 @@ static PSTR pszCLONEOF;
 PUBLIC void
 Env_GenerateCloneName(PFN pfnClone, CPFN pfnSource)
 {
-   static FNCHAR path[4096];
-   static FNCHAR tail[4096];
+   FNCHAR path[4096];
+   FNCHAR tail[4096];
    //lstrcpy(tail,RSTR(CLONEOF)); // rstr() also inits pszCLONEOF
    tail[0] = 0;
    Filename_SplitPath(pfnSource,path,tail+lstrlen(tail));
@@ -276,8 +277,11 @@ Env_LoadString(PSTR *psz, UINT ids)
 // Note I assume that string table entries are no longer than STR_CACHE_INCR chars in length, including terminating NUL).
 {
    if (*psz == NULL) {
-      LPCWSTR pwsz = (ids==0 ? NULL : FindStringResourceEx(hInstLang, ids, idDefaultLanguage));
-      if (pwsz==NULL || pwsz[0]==0) *psz = "";
+      LPCWSTR pwsz;
+      while (InterlockedExchange(&StrCacheLock,1)) Sleep(1);
+      pwsz = (*psz!=NULL || ids==0 ? NULL : FindStringResourceEx(hInstLang, ids, idDefaultLanguage));
+      if (*psz!=NULL) ; // another thread loaded it while we waited.
+      else if (pwsz==NULL || pwsz[0]==0) *psz = "";
       else {
          UINT i,len,alloc;
          len = pwsz[0];
@@ -292,6 +296,7 @@ Env_LoadString(PSTR *psz, UINT ids)
          *psz = pStrCache->buff + pStrCache->BytesUsed;
          pStrCache->BytesUsed += alloc;
       }
+      InterlockedExchange(&StrCacheLock,0);
    }
    return *psz;
 }
@@ -74,9 +74,6 @@ ReadClusters(PEXTXVOL pExt2, PVOID dest, HUGE LCN, UINT nClusters)
 
 #if DUMP_BLOCK_GROUPS
 
-static char sz[1024];
-static BGD  bgd[32]; // 1024 bytes.
-
 static void
 DumpBlockInfo(HVDDR hVDI, HUGE iLBA, SUPERBLK *sblk, UINT *Bitmap)
 {
@@ -85,6 +82,8 @@ DumpBlockInfo(HVDDR hVDI, HUGE iLBA, SUPERBLK *sblk, UINT *Bitmap)
    UINT nBlockGroups = (sblk->s_blocks_count + (sblk->s_blocks_per_group-1)) / sblk->s_blocks_per_group;
    UINT nLastGroupClust = sblk->s_blocks_count % sblk->s_blocks_per_group;
    UINT i,j,k,grpbase,tmp,BlocksInGroup,bgdt_block;
+   char sz[1024];
+   BGD  bgd[32]; // 1024 bytes.
    
    if (!nLastGroupClust) nLastGroupClust = sblk->s_blocks_per_group;
    if (sblk->s_log_block_size==0) bgdt_block = 2;
@@ -140,16 +139,15 @@ DumpBlockInfo(HVDDR hVDI, HUGE iLBA, SUPERBLK *sblk, UINT *Bitmap)
 
 /*.....................................................*/
 
-static SUPERBLK sblk;
-
-PUBLIC BOOL
-Extx_IsLinuxVolume(HVDDR hVDI, HUGE iLBA)
+static BOOL
+ReadSuperBlock(HVDDR hVDI, SUPERBLK *sblk, HUGE iLBA)
+// Reads the superblock into the caller's buffer, returns TRUE if it looks like an ext2/3/4 one.
 {
-   if (hVDI->ReadSectors(hVDI, &sblk, iLBA+2, 2)) {
-      if ((sblk.s_magic == EXT2_SUPER_MAGIC) &&
-          (sblk.s_first_data_block<2) &&
-          (sblk.s_log_block_size<=5) &&
-          (sblk.s_blocks_per_group>0)) {
+   if (hVDI->ReadSectors(hVDI, sblk, iLBA+2, 2)) {
+      if ((sblk->s_magic == EXT2_SUPER_MAGIC) &&
+          (sblk->s_first_data_block<2) &&
+          (sblk->s_log_block_size<=5) &&
+          (sblk->s_blocks_per_group>0)) {
          return TRUE;
       }
    }
@@ -158,6 +156,15 @@ Extx_IsLinuxVolume(HVDDR hVDI, HUGE iLBA)
 
 /*.....................................................*/
 
+PUBLIC BOOL
+Extx_IsLinuxVolume(HVDDR hVDI, HUGE iLBA)
+{
+   SUPERBLK sblk;
+   return ReadSuperBlock(hVDI,&sblk,iLBA);
+}
+
+/*.....................................................*/
+
 static BOOL
 ReadBitmap(PEXTXVOL pExt2)
 {
@@ -199,7 +206,8 @@ _err_abort:
 PUBLIC HFSYS
 Extx_OpenVolume(HVDDR hVDI, HUGE iLBA, HUGE cLBA, UINT cSectorSize)
 {
-   if (Extx_IsLinuxVolume(hVDI,iLBA)) {
+   SUPERBLK sblk;
+   if (ReadSuperBlock(hVDI,&sblk,iLBA)) {
       PEXTXVOL pExt2 = Mem_Alloc(MEMF_ZEROINIT, sizeof(EXTXVOLINF));
       if (pExt2) {
          HUGE volume_sectors;
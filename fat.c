@@ -70,8 +70,6 @@ typedef struct {
 //   | Inaccessible region (usually less than one cluster)   |
 //   +------+------+------+------+------+------+------+------+
 
-static BYTE raw_boot_sector[512];
-
 /*.....................................................*/
 
 #define IS_POWER_OF_2(x) (((x) & ((x)-1))==0)
@@ -97,7 +95,7 @@ static BOOL
 ReadBootSector(HVDDR hVDIsrc, FAT_BOOT_SECTOR *boots, HUGE iLBA)
 {
    BOOL success = FALSE;
-   BYTE *sector = raw_boot_sector;
+   BYTE sector[512];
 
    if (hVDIsrc->ReadSectors(hVDIsrc, sector, iLBA, 1)) {
       if (sector[510]==0x55 && sector[511]==0xAA) {
@@ -429,9 +427,9 @@ CountFreeClusters(PFATVOL pFAT, UINT nClusters)
 /*.....................................................*/
 
 static void
-PatchBootSector(PFATVOL pFAT, HCOW cow, UINT iLBA, UINT SectorsInVolume, UINT SectorsPerFAT, UINT cHeads)
+PatchBootSector(PFATVOL pFAT, HCOW cow, BYTE *pb, UINT iLBA, UINT SectorsInVolume, UINT SectorsPerFAT, UINT cHeads)
+// pb holds the boot sector as read from iLBA.
 {
-   BYTE *pb = raw_boot_sector;
    *((WORD*)(pb+26)) = (WORD)cHeads;
    if (pFAT->boots.FATtype==FAT_TYPE_FAT16 && SectorsInVolume<0x10000) {
       *((WORD*)(pb+19)) = (WORD)SectorsInVolume;
@@ -443,22 +441,22 @@ PatchBootSector(PFATVOL pFAT, HCOW cow, UINT iLBA, UINT SectorsInVolume, UINT Se
          *((UINT*)(pb+36)) = SectorsPerFAT;
       }
    }
-   cow->WriteSectors(cow,raw_boot_sector,iLBA,1);
+   cow->WriteSectors(cow,pb,iLBA,1);
    if (pFAT->boots.FATtype==FAT_TYPE_FAT32) {
-      cow->WriteSectors(cow,raw_boot_sector,iLBA+6,1);
+      cow->WriteSectors(cow,pb,iLBA+6,1);
    }
 }
 
 /*.....................................................*/
 
 static void
-PatchFSInfoSector(PFATVOL pFAT, HCOW cow, UINT iLBA, UINT nClusters)
+PatchFSInfoSector(PFATVOL pFAT, HCOW cow, BYTE *pb, UINT iLBA, UINT nClusters)
+// pb holds the FSInfo sector as read from iLBA.
 {
-   BYTE *pb = raw_boot_sector;
    *((UINT*)(pb+488)) = CountFreeClusters(pFAT,nClusters); // free cluster count needs to be recalculated.
-   cow->WriteSectors(cow,raw_boot_sector,iLBA,1);
+   cow->WriteSectors(cow,pb,iLBA,1);
    if (pFAT->boots.FATtype==FAT_TYPE_FAT32) {
-      cow->WriteSectors(cow,raw_boot_sector,iLBA+6,1);
+      cow->WriteSectors(cow,pb,iLBA+6,1);
    }
 }
 
@@ -473,6 +471,7 @@ FAT_GrowPartition(HVDDR hVDI, UINT iLBA, UINT OldSectors, UINT NewSectors, UINT
       UINT newSectorsPerFAT = CalcSolution(pFAT,NewSectors);
       if (newSectorsPerFAT) {
          HCOW cow = (HCOW)hVDI;
+         BYTE sector[512];
          UINT extraFAT = ((newSectorsPerFAT - pFAT->boots.SectorsPerFAT)*pFAT->boots.NumFATs);
          UINT i,iInsert,nReserved,newClusters;
 
@@ -502,10 +501,11 @@ FAT_GrowPartition(HVDDR hVDI, UINT iLBA, UINT OldSectors, UINT NewSectors, UINT
             iInsert += newSectorsPerFAT;
          }
 
-         PatchBootSector(pFAT,cow,iLBA,nReserved+(newClusters<<pFAT->SectorsPerClusterShift),newSectorsPerFAT,cHeads);
+         hVDI->ReadSectors(hVDI,sector,iLBA,1);
+         PatchBootSector(pFAT,cow,sector,iLBA,nReserved+(newClusters<<pFAT->SectorsPerClusterShift),newSectorsPerFAT,cHeads);
          if (pFAT->boots.FSInfoSector) {
-            hVDI->ReadSectors(hVDI,raw_boot_sector,iLBA+pFAT->boots.FSInfoSector,1);
-            PatchFSInfoSector(pFAT,cow,iLBA+pFAT->boots.FSInfoSector,newClusters);
+            hVDI->ReadSectors(hVDI,sector,iLBA+pFAT->boots.FSInfoSector,1);
+            PatchFSInfoSector(pFAT,cow,sector,iLBA+pFAT->boots.FSInfoSector,newClusters);
          }
 
          OldSectors = NewSectors;
@@ -29,12 +29,13 @@
 
 PUBLIC PSTR HEADER_MAGIC    = "WithoutFreeSpace";
 
-static UINT OSLastError;
+static __declspec(thread) UINT OSLastError;
 
 typedef struct {
    CLASS(VDDR) Base;
    HDD_HEADER hdr;
    FILE f;
+   FILE fa; // second handle on the same file, for the async reads used by LocatePage() callers.
    UINT *blockmap;
 } HDD_INFO, *PHDD;
 
@@ -81,7 +82,7 @@ PUBLIC PSTR
 HDDR_GetErrorString(UINT nErr)
 {
    PSTR pszErr;
-   static char sz[256];
+   static __declspec(thread) char sz[256];
    if (nErr==0xFFFFFFFF) nErr = VDDR_LastError;
    switch (nErr) {
       case HDDR_ERR_NONE:
@@ -127,21 +128,6 @@ HDDR_GetErrorString(UINT nErr)
 
 /*.....................................................*/
 
-static UINT
-DoSeek(FILE f, HUGE pos)
-{
-   HUGE currpos;
-   UINT err = 0;
-   if (File_GetPos(f,&currpos)==0xFFFFFFFF) err = File_IOresult();
-   else if (pos!=currpos) {
-      File_Seek(f,pos);
-      err = File_IOresult();
-   }
-   return err;
-}
-
-/*.....................................................*/
-
 static BOOL
 ReadHeader(FILE f, HDD_HEADER *hdr)
 {
@@ -204,6 +190,9 @@ HDDR_Open(CPFN fn, UINT iChain)
             pHDD->Base.ReadPage           = HDDR_ReadPage;
             pHDD->Base.ReadSectors        = HDDR_ReadSectors;
             pHDD->Base.Close              = HDDR_Close;
+            pHDD->Base.LocatePage         = HDDR_LocatePage;
+            pHDD->Base.ReadPages          = HDDR_ReadPages;
+            pHDD->fa = NULLFILE;
 
             // read the blocks map into a buffer.
             mapsize = pHDD->hdr.nBlocks*sizeof(UINT);
@@ -220,6 +209,7 @@ HDDR_Open(CPFN fn, UINT iChain)
             }
 
             if (VDDR_LastError) pHDD = Mem_Free(pHDD);
+            else pHDD->fa = File_OpenReadAsync(fn); // failure is not an error, LocatePage() just won't help.
          }
       }
       if (!pHDD) File_Close(f);
@@ -274,17 +264,13 @@ RawReadSectors(PHDD pHDD, void *buffer, UINT iBlock, UINT offset_sector, UINT nS
          seekpos = SID+offset_sector;
          seekpos <<= 9;
 
-         VDDR_LastError = HDDR_ERR_SEEK;
-         OSLastError = DoSeek(pHDD->f,seekpos);
-         if (OSLastError==0) {
-            UINT bytes = nSectors<<9;
-            VDDR_LastError = HDDR_ERR_READ;
-            if (File_RdBin(pHDD->f, buffer, bytes)==bytes) {
-               VDDR_LastError = 0;
-               return VDDR_RSLT_NORMAL;
-            }
-            OSLastError = File_IOresult();
+         UINT bytes = nSectors<<9;
+         VDDR_LastError = HDDR_ERR_READ;
+         if (File_ReadAt(pHDD->f, buffer, bytes, seekpos)==bytes) {
+            VDDR_LastError = 0;
+            return VDDR_RSLT_NORMAL;
          }
+         OSLastError = File_IOresult();
       }
    }
    return VDDR_RSLT_FAIL;
@@ -356,6 +342,7 @@ HDDR_Close(HVDDR pThis)
    if (pThis) { // we silently handle closing of an already closed file.
       PHDD pHDD = (PHDD)pThis;
       File_Close(pHDD->f);
+      if (pHDD->fa!=NULLFILE) File_Close(pHDD->fa);
       Mem_Free(pHDD->blockmap);
       Mem_Free(pHDD);
    }
@@ -443,5 +430,52 @@ HDDR_BlockStatus(HVDDR pThis, HUGE LBA_start, HUGE LBA_end)
 
 /*....................................................*/
 
+static int
+PageLocation(HVDDR pThis, UINT iPage, UINT SPBshift, FILE *pf, HUGE *pos)
+// Shared by LocatePage() and ReadPages(): finds the byte offset of a page in this file.
+// HDD block sizes needn't be a power of two, so a page may straddle two blocks, in
+// which case (or beyond the end of the drive) this returns VDDR_RSLT_INDIRECT.
+{
+   PHDD pHDD = (PHDD)pThis;
+   HUGE LBA = (((HUGE)iPage)<<SPBshift);
+   UINT iBlock,offset_sector,SID;
+
+   *pf = pHDD->f;
+   if (pHDD->hdr.u32BlockSize==0) return VDDR_RSLT_INDIRECT;
+   iBlock = (UINT)(LBA/pHDD->hdr.u32BlockSize);
+   offset_sector = (UINT)(LBA-(((HUGE)iBlock)*pHDD->hdr.u32BlockSize));
+   if (iBlock>=pHDD->hdr.nBlocks || (offset_sector+(1<<SPBshift))>pHDD->hdr.u32BlockSize) return VDDR_RSLT_INDIRECT;
+
+   SID = pHDD->blockmap[iBlock];
+   if (SID == HDD_PAGE_FREE) return VDDR_RSLT_NOTALLOC;
+   *pos = ((((HUGE)SID)+offset_sector)<<9);
+   return VDDR_RSLT_NORMAL;
+}
+
+/*....................................................*/
+
+PUBLIC int
+HDDR_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt)
+{
+   PHDD pHDD = (PHDD)pThis;
+   int rslt;
+
+   VDDR_LastError = 0;
+   if (pHDD->fa==NULLFILE) return VDDR_RSLT_INDIRECT;
+   rslt = PageLocation(pThis,iPage,SPBshift,&pExt->f,&pExt->pos);
+   pExt->f = pHDD->fa;
+   return rslt;
+}
+
+/*....................................................*/
+
+PUBLIC int
+HDDR_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults)
+{
+   return VDDR_ReadPageRuns(pThis,buffer,iPage,nPages,SPBshift,pResults,PageLocation,HDDR_ERR_READ,&OSLastError);
+}
+
+/*....................................................*/
+
 /* end of module hddr.c */
 
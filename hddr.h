@@ -75,6 +75,16 @@ HVDDR HDDR_Close(HVDDR pThis);
  * when the file was opened.
  */
 
+int  HDDR_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt);
+/* Returns the file position of a page instead of reading it, see the LocatePage
+ * method in vddr.h.
+ */
+
+int  HDDR_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults);
+/* Reads a run of pages, see the ReadPages method in vddr.h. Pages which are stored
+ * consecutively in the HDD file are read together.
+ */
+
 /*----------------------------------------------------------------------*/
 
 #endif
@@ -97,6 +97,17 @@
 #define IDS_VOPTCOMPACT     (IDS_CMDLINE+34)  /* = "compact" */
 #define IDS_VOPTHELP        (IDS_CMDLINE+35)  /* = "help" */
 #define IDS_CHAROPT         (IDS_CMDLINE+36)  /* = "okech"  */
+#define IDS_NONUMBER        (IDS_CMDLINE+37)  /* = "a number should follow the %s option" */
+#define IDS_BADSYNC         (IDS_CMDLINE+38)  /* = "sync mode should be writethrough, checkpoint or end" */
+#define IDS_NOREPFN         (IDS_CMDLINE+39)  /* = "report option specified, no filename provided" */
+#define IDS_BENCHCREATE     (IDS_CMDLINE+40)  /* = "Could not create the synthetic image file" */
+#define IDS_NOBATFN         (IDS_CMDLINE+41)  /* = "batch option specified, no filename provided" */
+#define IDS_BATCHREAD       (IDS_CMDLINE+42)  /* = "Could not read the batch manifest ""%s""" */
+#define IDS_BATCHLINE       (IDS_CMDLINE+43)  /* = "(manifest line %lu)" */
+#define IDS_BATCHOK         (IDS_CMDLINE+44)  /* = "Done: %s" */
+#define IDS_BATCHFAIL       (IDS_CMDLINE+45)  /* = "FAILED: %s" */
+#define IDS_BATCHSUM        (IDS_CMDLINE+46)  /* = "%lu of %lu batch jobs succeeded" */
+#define IDS_NOTHRFN         (IDS_CMDLINE+47)  /* = "throttle option specified, no filename provided" */
 
 /* strings from env.c */
 #define IDS_ENV (IDS_CMDLINE+50)
@@ -158,7 +169,7 @@
 #define IDS_VDINVDESC       (IDS_VDXR+13)     /* = "Invalid VMDK disk descriptor" */
 #define IDS_VDBADVER        (IDS_VDXR+14)     /* = "VMDK version number was not recognized" */
 #define IDS_VDMISSING       (IDS_VDXR+15)     /* = "Required parameters are missing from the VMDK descriptor" */
-#define IDS_VDERRCOMP       (IDS_VDXR+16)     /* = "Compressed VMDKs are not currently supported" */
+#define IDS_VDERRCOMP       (IDS_VDXR+16)     /* = "This VMDK uses a compression algorithm which is not supported" */
 #define IDS_VDNOEXTENT      (IDS_VDXR+17)     /* = "A descriptor referenced extent file is missing (renamed?)" */
 #define IDS_VDNOTHDD        (IDS_VDXR+18)     /* = "Source file is not a recognized HDD file format" */
 
@@ -174,6 +185,9 @@
 #define IDS_VWBLOCK         (IDS_VDIW+7)      /* = "Attempted block write past end of virtual disk" */
 #define IDS_VWEXISTSQ       (IDS_VDIW+8)      /* = "Destination already exists. Are you sure you want to overwrite it?" */
 #define IDS_VWEXISTSC       (IDS_VDIW+9)      /* = "File Exists" */
+#define IDS_VWJOURNAL       (IDS_VDIW+10)     /* = "No resume journal which matches this job was found" */
+#define IDS_VWRDERR         (IDS_VDIW+11)     /* = "Error reading the existing destination VDI" */
+#define IDS_VWNOTSAME       (IDS_VDIW+12)     /* = "Destination is not a dynamic VDI of the same size, so it can't be updated" */
 
 #endif
 
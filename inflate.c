@@ -0,0 +1,383 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Deflate decoder. Huffman codes are decoded through a table indexed by the next
+ * INF_FAST_BITS bits of input, which covers nearly every code in practice, and codes
+ * longer than that are decoded a bit at a time in canonical order. Input is read a
+ * byte at a time into a 32 bit buffer. When the input runs out the buffer is padded
+ * with zeros, and the decoder only fails if it actually uses any of the padding.
+ */
+
+#include "djwarning.h"
+#include "djtypes.h"
+#include "inflate.h"
+#include "mem.h"
+
+#define INF_MAXBITS   15  /* longest code */
+#define INF_MAXLCODES 288 /* literal/length codes */
+#define INF_MAXDCODES 30  /* distance codes */
+#define INF_FIXLCODES 288 /* literal/length codes in the fixed code */
+#define INF_FAST_BITS 9   /* codes up to this length are decoded by table lookup */
+
+typedef struct {
+   WORD count[INF_MAXBITS+1];    // number of codes of each length.
+   WORD symbol[INF_MAXLCODES];   // symbols, ordered by code.
+   WORD fast[1<<INF_FAST_BITS];  // (length<<9)+symbol for each short code, 0 for long ones.
+} HUFFMAN;
+
+typedef struct {
+   const BYTE *in,*inEnd;
+   BYTE *out,*outStart,*outEnd;
+   UINT bitbuf;      // unused input bits, the next one is bit 0 ...
+   UINT bitcnt;      // ... and there are this many.
+   UINT nPad;        // zero bytes added to bitbuf after the input ran out.
+} INFSTATE;
+
+static const WORD lbase[29] = { // length base for codes 257..285
+   3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const BYTE lext[29] = {  // extra bits for codes 257..285
+   0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const WORD dbase[30] = { // distance base for codes 0..29
+   1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+   1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const BYTE dext[30] = {  // extra bits for distance codes 0..29
+   0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+static const BYTE clorder[19] = { // order in which code length code lengths are stored
+   16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+/*.....................................................*/
+
+static _inline void
+Fill(INFSTATE *s)
+// Tops the bit buffer up to at least 25 bits.
+{
+   while (s->bitcnt<=24) {
+      if (s->in<s->inEnd) s->bitbuf |= ((UINT)(*s->in++))<<s->bitcnt;
+      else s->nPad++;
+      s->bitcnt += 8;
+   }
+}
+
+/*.....................................................*/
+
+static _inline BOOL
+Overrun(INFSTATE *s)
+// TRUE if any of the zero padding has been used as input.
+{
+   return ((s->nPad<<3) > s->bitcnt);
+}
+
+/*.....................................................*/
+
+static _inline UINT
+Bits(INFSTATE *s, UINT n)
+// Takes the next n (<=16) bits of input.
+{
+   UINT v;
+   Fill(s);
+   v = s->bitbuf & ((1U<<n)-1);
+   s->bitbuf >>= n;
+   s->bitcnt -= n;
+   return v;
+}
+
+/*.....................................................*/
+
+static int
+Construct(HUFFMAN *h, const BYTE *length, UINT n)
+// Builds the decoding tables for the code with the given code lengths. Returns 0 for a
+// complete code, a positive number for an incomplete one, and a negative number for one
+// which is over-subscribed (and so not a valid code at all).
+{
+   WORD offs[INF_MAXBITS+1],next[INF_MAXBITS+1];
+   UINT len,sym,code,r,i;
+   int left;
+
+   for (len=0; len<=INF_MAXBITS; len++) h->count[len] = 0;
+   for (sym=0; sym<n; sym++) h->count[length[sym]]++;
+   Mem_Zero(h->fast,sizeof(h->fast));
+   if (h->count[0]==n) return 0; // no codes at all: complete, but decoding will fail.
+
+   left = 1;
+   for (len=1; len<=INF_MAXBITS; len++) {
+      left <<= 1;
+      left -= h->count[len];
+      if (left<0) return left;
+   }
+
+   // symbols in canonical order, for the slow decode.
+   offs[1] = 0;
+   for (len=1; len<INF_MAXBITS; len++) offs[len+1] = (WORD)(offs[len] + h->count[len]);
+   for (sym=0; sym<n; sym++) {
+      if (length[sym]) h->symbol[offs[length[sym]]++] = (WORD)sym;
+   }
+
+   // the fast table. Codes are stored first bit first, so each code is bit reversed to
+   // index the table, and fills every entry whose low bits match it.
+   code = 0;
+   next[0] = 0;
+   for (len=1; len<=INF_MAXBITS; len++) {
+      code = (code + (len>1 ? h->count[len-1] : 0))<<1;
+      next[len] = (WORD)code;
+   }
+   for (sym=0; sym<n; sym++) {
+      len = length[sym];
+      if (len==0) continue;
+      code = next[len]++;
+      if (len>INF_FAST_BITS) continue;
+      for (r=0,i=0; i<len; i++) r = (r<<1) | ((code>>i)&1);
+      for (; r<(1U<<INF_FAST_BITS); r+=(1U<<len)) h->fast[r] = (WORD)((len<<9)|sym);
+   }
+   return left;
+}
+
+/*.....................................................*/
+
+static int
+Decode(INFSTATE *s, const HUFFMAN *h)
+// Returns the next symbol, or -1 if the input is not a valid code.
+{
+   UINT e,len;
+   int code,first,count,index;
+
+   Fill(s);
+   e = h->fast[s->bitbuf & ((1U<<INF_FAST_BITS)-1)];
+   if (e) {
+      len = (e>>9);
+      s->bitbuf >>= len;
+      s->bitcnt -= len;
+      return (int)(e & 0x1FF);
+   }
+   code = first = index = 0;
+   for (len=1; len<=INF_MAXBITS; len++) {
+      code |= (s->bitbuf & 1);
+      s->bitbuf >>= 1;
+      s->bitcnt--;
+      count = h->count[len];
+      if (code-count < first) return h->symbol[index+(code-first)];
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+   }
+   return -1;
+}
+
+/*.....................................................*/
+
+static UINT
+Codes(INFSTATE *s, const HUFFMAN *lencode, const HUFFMAN *distcode)
+// Decodes one block of literals and length/distance pairs.
+{
+   int sym;
+   UINT len,dist;
+   BYTE *from;
+
+   for (;;) {
+      sym = Decode(s,lencode);
+      if (sym<256) {
+         if (sym<0) return INFLATE_ERR_DATA;
+         if (s->out==s->outEnd) return INFLATE_ERR_SPACE;
+         *s->out++ = (BYTE)sym;
+      } else if (sym==256) {
+         break;
+      } else {
+         sym -= 257;
+         if (sym>=29) return INFLATE_ERR_DATA;
+         len = lbase[sym] + Bits(s,lext[sym]);
+         sym = Decode(s,distcode);
+         if (sym<0 || sym>=30) return INFLATE_ERR_DATA;
+         dist = dbase[sym] + Bits(s,dext[sym]);
+         if (dist > (UINT)(s->out-s->outStart)) return INFLATE_ERR_DATA;
+         if (len > (UINT)(s->outEnd-s->out)) return INFLATE_ERR_SPACE;
+         from = s->out-dist;
+         while (len--) *s->out++ = *from++; // may overlap, so byte by byte.
+      }
+      if (Overrun(s)) return INFLATE_ERR_INPUT;
+   }
+   return INFLATE_OK;
+}
+
+/*.....................................................*/
+
+static UINT
+Stored(INFSTATE *s)
+{
+   UINT len,nlen;
+
+   // the length follows on the next byte boundary.
+   s->bitbuf >>= (s->bitcnt & 7);
+   s->bitcnt -= (s->bitcnt & 7);
+   len  = Bits(s,16);
+   nlen = Bits(s,16);
+   if (Overrun(s)) return INFLATE_ERR_INPUT;
+   if (len != (~nlen & 0xFFFF)) return INFLATE_ERR_DATA;
+   if (len > (UINT)(s->outEnd-s->out)) return INFLATE_ERR_SPACE;
+
+   // bytes already in the bit buffer come first, then the rest straight from the input.
+   while (len && s->bitcnt>=8) {
+      *s->out++ = (BYTE)s->bitbuf;
+      s->bitbuf >>= 8;
+      s->bitcnt -= 8;
+      len--;
+   }
+   if (Overrun(s)) return INFLATE_ERR_INPUT;
+   if (len > (UINT)(s->inEnd-s->in)) return INFLATE_ERR_INPUT;
+   Mem_Copy(s->out,s->in,len);
+   s->out += len;
+   s->in  += len;
+   return INFLATE_OK;
+}
+
+/*.....................................................*/
+
+static UINT
+Fixed(INFSTATE *s)
+{
+   HUFFMAN lencode,distcode;
+   BYTE lengths[INF_FIXLCODES];
+   UINT sym;
+
+   for (sym=0; sym<144; sym++) lengths[sym] = 8;
+   for (; sym<256; sym++) lengths[sym] = 9;
+   for (; sym<280; sym++) lengths[sym] = 7;
+   for (; sym<INF_FIXLCODES; sym++) lengths[sym] = 8;
+   Construct(&lencode,lengths,INF_FIXLCODES);
+   for (sym=0; sym<INF_MAXDCODES; sym++) lengths[sym] = 5;
+   Construct(&distcode,lengths,INF_MAXDCODES);
+   return Codes(s,&lencode,&distcode);
+}
+
+/*.....................................................*/
+
+static UINT
+Dynamic(INFSTATE *s)
+{
+   HUFFMAN lencode,distcode;
+   BYTE lengths[INF_MAXLCODES+INF_MAXDCODES];
+   UINT nlen,ndist,ncode,index,len,rep;
+   int sym,err;
+
+   nlen  = Bits(s,5) + 257;
+   ndist = Bits(s,5) + 1;
+   ncode = Bits(s,4) + 4;
+   if (nlen>286 || ndist>INF_MAXDCODES) return INFLATE_ERR_DATA;
+
+   // the code length code, which must be complete.
+   for (index=0; index<ncode; index++) lengths[clorder[index]] = (BYTE)Bits(s,3);
+   for (; index<19; index++) lengths[clorder[index]] = 0;
+   if (Construct(&lencode,lengths,19)!=0) return INFLATE_ERR_DATA;
+
+   // the literal/length and distance code lengths, which are run length encoded together.
+   index = 0;
+   while (index < nlen+ndist) {
+      sym = Decode(s,&lencode);
+      if (sym<0) return INFLATE_ERR_DATA;
+      if (sym<16) {
+         lengths[index++] = (BYTE)sym;
+      } else {
+         len = 0;
+         if (sym==16) {
+            if (index==0) return INFLATE_ERR_DATA; // nothing to repeat.
+            len = lengths[index-1];
+            rep = 3 + Bits(s,2);
+         } else if (sym==17) {
+            rep = 3 + Bits(s,3);
+         } else {
+            rep = 11 + Bits(s,7);
+         }
+         if (index+rep > nlen+ndist) return INFLATE_ERR_DATA;
+         while (rep--) lengths[index++] = (BYTE)len;
+      }
+      if (Overrun(s)) return INFLATE_ERR_INPUT;
+   }
+   if (lengths[256]==0) return INFLATE_ERR_DATA; // a block with no end code can't end.
+
+   // incomplete codes are only allowed if they have a single code.
+   err = Construct(&lencode,lengths,nlen);
+   if (err<0 || (err>0 && nlen-lencode.count[0]!=1)) return INFLATE_ERR_DATA;
+   err = Construct(&distcode,lengths+nlen,ndist);
+   if (err<0 || (err>0 && ndist-distcode.count[0]!=1)) return INFLATE_ERR_DATA;
+
+   return Codes(s,&lencode,&distcode);
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+Inflate_Raw(BYTE *dest, UINT *pDestLen, CPVOID src, UINT *pSrcLen)
+{
+   INFSTATE s;
+   UINT rslt,bFinal,type;
+
+   s.in = (const BYTE*)src;
+   s.inEnd = s.in + *pSrcLen;
+   s.out = s.outStart = dest;
+   s.outEnd = dest + *pDestLen;
+   s.bitbuf = s.bitcnt = s.nPad = 0;
+
+   do {
+      bFinal = Bits(&s,1);
+      type = Bits(&s,2);
+      if (type==0) rslt = Stored(&s);
+      else if (type==1) rslt = Fixed(&s);
+      else if (type==2) rslt = Dynamic(&s);
+      else rslt = INFLATE_ERR_DATA;
+      if (rslt==INFLATE_OK && Overrun(&s)) rslt = INFLATE_ERR_INPUT;
+   } while (rslt==INFLATE_OK && !bFinal);
+
+   // whole bytes left in the bit buffer were not used.
+   *pDestLen = (UINT)(s.out - s.outStart);
+   *pSrcLen  = (UINT)(s.in - (const BYTE*)src) + s.nPad - (s.bitcnt>>3);
+   return rslt;
+}
+
+/*.....................................................*/
+
+static UINT
+Adler32(const BYTE *p, UINT len)
+{
+   UINT a=1,b=0,n;
+   while (len) {
+      n = (len<5552 ? len : 5552); // the most bytes before b can overflow.
+      len -= n;
+      while (n--) {
+         a += *p++;
+         b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+   }
+   return (b<<16)|a;
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+Inflate_Zlib(BYTE *dest, UINT *pDestLen, CPVOID src, UINT SrcLen)
+{
+   const BYTE *p = (const BYTE*)src;
+   UINT rslt,nRaw,adler;
+
+   if (SrcLen<6) return INFLATE_ERR_INPUT; // header and trailer.
+   if ((p[0]&0x0F)!=8 || (p[0]>>4)>7) return INFLATE_ERR_DATA; // deflate, window no bigger than 32K.
+   if ((((UINT)p[0]<<8)|p[1]) % 31) return INFLATE_ERR_DATA;
+   if (p[1] & 0x20) return INFLATE_ERR_DATA; // preset dictionary.
+
+   nRaw = SrcLen-2;
+   rslt = Inflate_Raw(dest,pDestLen,p+2,&nRaw);
+   if (rslt==INFLATE_OK) {
+      p += 2+nRaw;
+      if (nRaw+6 > SrcLen) return INFLATE_ERR_INPUT;
+      adler = ((UINT)p[0]<<24) | ((UINT)p[1]<<16) | ((UINT)p[2]<<8) | p[3];
+      if (adler != Adler32(dest,*pDestLen)) rslt = INFLATE_ERR_DATA;
+   }
+   return rslt;
+}
+
+/*.....................................................*/
+
+/* end of inflate.c */
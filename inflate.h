@@ -0,0 +1,37 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef INFLATE_H
+#define INFLATE_H
+
+/*======================================================================*/
+/* Decoder for deflate (RFC 1951) compressed data, and for the zlib     */
+/* (RFC 1950) wrapper around it which compressed VMDK grains use. The   */
+/* whole input and output are in memory, there is no streaming. Holds   */
+/* no state between calls, so it can be used from several threads.     */
+/*======================================================================*/
+
+#include "djtypes.h"
+
+#define INFLATE_OK        0
+#define INFLATE_ERR_DATA  1 /* the compressed data is corrupt, or uses a feature not supported here */
+#define INFLATE_ERR_SPACE 2 /* the output buffer is too small */
+#define INFLATE_ERR_INPUT 3 /* the compressed data ends before the last block does */
+
+UINT Inflate_Raw(BYTE *dest, UINT *pDestLen, CPVOID src, UINT *pSrcLen);
+/* Decodes raw deflate data. On entry *pDestLen is the size of the dest buffer and *pSrcLen
+ * the number of bytes at src. On return *pDestLen is the number of bytes decoded and *pSrcLen
+ * the number of input bytes used, which may be less than was passed. Returns INFLATE_OK or
+ * one of the INFLATE_ERR_xxx codes.
+ */
+
+UINT Inflate_Zlib(BYTE *dest, UINT *pDestLen, CPVOID src, UINT SrcLen);
+/* As Inflate_Raw(), but the data has a zlib header and an Adler-32 trailer, both of which
+ * are checked. A stream which needs a preset dictionary gives INFLATE_ERR_DATA.
+ */
+
+#endif
+
@@ -8,8 +8,20 @@
 #include <stdarg.h>
 #include <windef.h>
 #include <winbase.h>
+#include <intrin.h>
 #include "mem.h"
 
+typedef BOOL (*ZEROTEST)(const BYTE *p, UINT nBytes);
+static ZEROTEST pfnIsZero; // picked on first use of Mem_IsZero(), to suit the CPU.
+
+typedef struct t_MEMBUDGET {
+   CRITICAL_SECTION cs;
+   HUGE limit;
+   HUGE used;
+} MEMBUDGET;
+
+static __declspec(thread) HBUDGET hThreadBudget;
+
 /*.....................................................*/
 
 PUBLIC PVOID
@@ -59,6 +71,23 @@ Mem_Free(PVOID p)
 
 /*.....................................................*/
 
+PUBLIC PVOID
+Mem_AllocAligned(UINT size)
+{
+   return VirtualAlloc(NULL,size,MEM_RESERVE|MEM_COMMIT,PAGE_READWRITE);
+}
+
+/*.....................................................*/
+
+PUBLIC PVOID
+Mem_FreeAligned(PVOID p)
+{
+   if (p) VirtualFree(p,0,MEM_RELEASE);
+   return NULL;
+}
+
+/*.....................................................*/
+
 PUBLIC void
 Mem_Copy(PVOID pDest, CPVOID pSrc, UINT nBytes)
 {
@@ -108,5 +137,184 @@ Mem_Compare(CPVOID pBlock1, CPVOID pBlock2, UINT nBytes)
 
 /*.....................................................*/
 
+static BOOL
+IsZeroWords(const BYTE *p, UINT nBytes)
+// Portable version, for CPUs without SSE2 and for the odd bytes at either end of a buffer.
+{
+   const UINT *pdw;
+   UINT i;
+
+   for (; nBytes && (((UINT_PTR)p)&3); nBytes--) {
+      if (*p++) return FALSE;
+   }
+   pdw = (const UINT *)p;
+   for (i=(nBytes>>2); i; i--) {
+      if (*pdw++) return FALSE;
+   }
+   p = (const BYTE *)pdw;
+   for (i=(nBytes&3); i; i--) {
+      if (*p++) return FALSE;
+   }
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static BOOL
+IsZeroSSE2(const BYTE *p, UINT nBytes)
+{
+   __m128i acc,zero = _mm_setzero_si128();
+   UINT n;
+
+   // get to a 16 byte boundary so I can use aligned loads.
+   n = ((16-(((UINT_PTR)p)&15))&15);
+   if (n>nBytes) n = nBytes;
+   if (!IsZeroWords(p,n)) return FALSE;
+   p += n;
+   nBytes -= n;
+
+   // test 64 bytes per step, bailing out as soon as a non-zero step is seen.
+   for (n=(nBytes>>6); n; n--) {
+      acc = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i *)p),     _mm_load_si128((const __m128i *)(p+16))),
+                         _mm_or_si128(_mm_load_si128((const __m128i *)(p+32)), _mm_load_si128((const __m128i *)(p+48))));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc,zero))!=0xFFFF) return FALSE;
+      p += 64;
+   }
+   return IsZeroWords(p,nBytes&63);
+}
+
+/*.....................................................*/
+
+static BOOL
+IsZeroAVX2(const BYTE *p, UINT nBytes)
+{
+   __m256i acc;
+   UINT n;
+
+   n = ((32-(((UINT_PTR)p)&31))&31);
+   if (n>nBytes) n = nBytes;
+   if (!IsZeroWords(p,n)) return FALSE;
+   p += n;
+   nBytes -= n;
+
+   // test 128 bytes per step.
+   for (n=(nBytes>>7); n; n--) {
+      acc = _mm256_or_si256(_mm256_or_si256(_mm256_load_si256((const __m256i *)p),     _mm256_load_si256((const __m256i *)(p+32))),
+                            _mm256_or_si256(_mm256_load_si256((const __m256i *)(p+64)), _mm256_load_si256((const __m256i *)(p+96))));
+      if (!_mm256_testz_si256(acc,acc)) {
+         _mm256_zeroupper();
+         return FALSE;
+      }
+      p += 128;
+   }
+   _mm256_zeroupper();
+   return IsZeroWords(p,nBytes&127);
+}
+
+/*.....................................................*/
+
+static ZEROTEST
+PickZeroTest(void)
+// Choose the widest zero test which the CPU (and for AVX, the OS) supports.
+{
+   int info[4];
+   UINT nLeaves,ecx1,edx1;
+
+   __cpuid(info,0);
+   nLeaves = (UINT)info[0];
+   if (nLeaves<1) return IsZeroWords;
+   __cpuid(info,1);
+   ecx1 = (UINT)info[2];
+   edx1 = (UINT)info[3];
+   if (nLeaves>=7 && (ecx1 & (1<<27)) && (ecx1 & (1<<28))) { // OSXSAVE and AVX
+      if ((_xgetbv(0) & 6)==6) {                             // OS saves the YMM registers
+         __cpuidex(info,7,0);
+         if (info[1] & (1<<5)) return IsZeroAVX2;
+      }
+   }
+   if (edx1 & (1<<26)) return IsZeroSSE2;
+   return IsZeroWords;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Mem_IsZero(CPVOID p, UINT nBytes)
+{
+   // two threads racing through here would both pick the same function, so no lock needed.
+   if (!pfnIsZero) pfnIsZero = PickZeroTest();
+   return pfnIsZero((const BYTE *)p,nBytes);
+}
+
+/*.....................................................*/
+
+PUBLIC HBUDGET
+Mem_CreateBudget(HUGE limit)
+{
+   HBUDGET h = Mem_Alloc(MEMF_ZEROINIT,sizeof(MEMBUDGET));
+   if (h) {
+      InitializeCriticalSection(&h->cs);
+      h->limit = limit;
+   }
+   return h;
+}
+
+/*.....................................................*/
+
+PUBLIC HBUDGET
+Mem_FreeBudget(HBUDGET h)
+{
+   if (h) {
+      DeleteCriticalSection(&h->cs);
+      Mem_Free(h);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+PUBLIC void
+Mem_SetThreadBudget(HBUDGET h)
+{
+   hThreadBudget = h;
+}
+
+/*.....................................................*/
+
+PUBLIC HBUDGET
+Mem_GetThreadBudget(void)
+{
+   return hThreadBudget;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Mem_Charge(HBUDGET h, UINT size)
+{
+   BOOL bOK = TRUE;
+   if (h) {
+      EnterCriticalSection(&h->cs);
+      bOK = ((h->used+size)<=h->limit);
+      if (bOK) h->used += size;
+      LeaveCriticalSection(&h->cs);
+   }
+   return bOK;
+}
+
+/*.....................................................*/
+
+PUBLIC void
+Mem_Uncharge(HBUDGET h, UINT size)
+{
+   if (h) {
+      EnterCriticalSection(&h->cs);
+      h->used = (h->used>size ? h->used-size : 0);
+      LeaveCriticalSection(&h->cs);
+   }
+}
+
+/*.....................................................*/
+
 /* end of mem.c */
 
@@ -32,12 +32,29 @@ PVOID Mem_Free(PVOID p);
 /* Frees a memory block. This is a nop (no crash) if the p argument is NULL.
  */
 
+PVOID Mem_AllocAligned(UINT size);
+/* Allocates a zero filled block which starts on a page boundary, and so is aligned
+ * well enough for unbuffered (DJFILE_FLAG_NOBUFFERING) file I/O. Returns NULL on
+ * failure. Blocks from this function must be freed with Mem_FreeAligned(), not
+ * Mem_Free().
+ */
+
+PVOID Mem_FreeAligned(PVOID p);
+/* Frees a block from Mem_AllocAligned(). This is a nop if p is NULL. Always returns NULL.
+ */
+
 void Mem_Copy(PVOID pDest, CPVOID pSrc, UINT nBytes);
 void Mem_Move(PVOID pDest, CPVOID pSrc, UINT nBytes);
 
 void Mem_Zero(PVOID pDest, UINT nBytes);
 void Mem_Fill(PVOID pDest, UINT nBytes, BYTE FillByte);
 
+BOOL Mem_IsZero(CPVOID p, UINT nBytes);
+/* Returns TRUE if the nBytes at p are all zero. This is used on every block being
+ * cloned, so it uses the widest vector instructions the CPU supports (chosen on
+ * first use), and returns as soon as a non-zero byte is found.
+ */
+
 int  Mem_Compare(CPVOID pBlock1, CPVOID pBlock2, UINT nBytes);
 /* Works like a string compare, except no NUL terminator is expected, instead
  * the compare length is bounded by nBytes argument. Returns 0 if the memory
@@ -45,5 +62,35 @@ int  Mem_Compare(CPVOID pBlock1, CPVOID pBlock2, UINT nBytes);
  * in block 1 is less than the same byte in block 2, positive if greater.
  */
 
+typedef struct t_MEMBUDGET *HBUDGET;
+
+HBUDGET Mem_CreateBudget(HUGE limit);
+/* Creates a memory budget of limit bytes, used to put a ceiling on the memory one clone
+ * job may use. Only the big allocations which grow with the size of the disk (block maps,
+ * filesystem bitmaps, the pipeline ring) are charged to a budget, and a module which is
+ * refused a charge falls back on a slower way of working which needs less memory, rather
+ * than failing. Returns NULL if out of memory.
+ */
+
+HBUDGET Mem_FreeBudget(HBUDGET h);
+/* Frees a budget. Anything still charged to it is forgotten. Always returns NULL. */
+
+void    Mem_SetThreadBudget(HBUDGET h);
+HBUDGET Mem_GetThreadBudget(void);
+/* Sets or gets the budget which applies to the calling thread. The disk readers pick
+ * this up when they are opened, so that the clone code doesn't have to pass a budget
+ * down through every layer. The default is NULL, ie. no budget.
+ */
+
+BOOL Mem_Charge(HBUDGET h, UINT size);
+/* Charges size bytes to budget h, returning FALSE (and charging nothing) if that would
+ * take the budget over its limit. A NULL budget accepts every charge. Mem_Charge() does
+ * not allocate anything itself, and a charge must be returned with Mem_Uncharge() when
+ * the memory is freed. Thread safe.
+ */
+
+void Mem_Uncharge(HBUDGET h, UINT size);
+/* Returns a charge made with Mem_Charge(). h may be NULL. */
+
 #endif
 
@@ -5,6 +5,8 @@
 /*================================================================================*/
 
 #include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
 #include "djtypes.h"
 #include "ntfs.h"
 #include "vddr.h"
@@ -25,11 +27,18 @@ typedef struct {
    UINT ClusterSize;
    UINT BitmapBytes;
    BYTE *cluster; // buffer for reading clusters.
-   UINT *Bitmap;
+   UINT *Bitmap;  // the whole $Bitmap file, or NULL if it is paged, see BitmapWord().
+   HBUDGET hBudget;
+   UINT BitmapCharge; // bytes charged to hBudget for Bitmap.
+
+   // paged $Bitmap, used when the memory budget has no room for the whole file.
+   UINT *RunList;    // $Bitmap runlist, in GetRunList() format.
+   BYTE *window;     // CLUSTERS_PER_BUFF clusters of the file ...
+   UINT WindowVCN;   // ... starting at this cluster of the file ...
+   UINT nWindow;     // ... of which this many are valid.
+   CRITICAL_SECTION csWindow; // the planner asks about blocks from several threads.
 } NTFSVOLINF, *PNTFSVOL;
 
-static BYTE raw_boot_sector[512];
-
 /*.....................................................*/
 #if 0
 static void
@@ -334,27 +343,104 @@ DoReadFile(PNTFSVOL pNTFS, PNTFS_FILE_RECORD pFile, UINT *filelen)
 
 /*.....................................................*/
 
-PUBLIC BOOL
-NTFS_IsNTFSVolume(HVDDR hVDI, HUGE iLBA)
+static BOOL
+OpenPagedBitmap(PNTFSVOL pNTFS, PNTFS_FILE_RECORD pFile, PMFT_ATTRIBUTE pAttr)
+// Sets up to read the $Bitmap a window at a time. Each run takes at least two bytes of
+// the attribute, which bounds the size of the runlist.
+{
+   pNTFS->RunList = Mem_Alloc(0,((pAttr->len>>1)+1)*2*sizeof(UINT));
+   pNTFS->window = Mem_Alloc(0,pNTFS->ClusterSize*CLUSTERS_PER_BUFF);
+   if (pNTFS->RunList && pNTFS->window) {
+      GetRunList(pNTFS,pFile,pAttr,pNTFS->RunList);
+      pNTFS->BitmapBytes = LO32(pAttr->u.nonres.AttrSizeReal);
+      pNTFS->nWindow = 0;
+      InitializeCriticalSection(&pNTFS->csWindow);
+      return TRUE;
+   }
+   pNTFS->RunList = Mem_Free(pNTFS->RunList);
+   pNTFS->window = Mem_Free(pNTFS->window);
+   return FALSE;
+}
+
+/*.....................................................*/
+
+static void
+LoadWindow(PNTFSVOL pNTFS, UINT VCN)
+// Reads the window of $Bitmap clusters starting at VCN. Must be called inside csWindow.
+{
+   UINT i,RunVCN=0,nClusters;
+   pNTFS->nWindow = 0;
+   for (i=0; pNTFS->RunList[i]!=0xFFFFFFFF; i+=2) {
+      if (VCN < RunVCN+pNTFS->RunList[i+1]) {
+         nClusters = RunVCN+pNTFS->RunList[i+1]-VCN;
+         if (nClusters>CLUSTERS_PER_BUFF) nClusters = CLUSTERS_PER_BUFF;
+         if (ReadClusters(pNTFS,pNTFS->window,(HUGE)(pNTFS->RunList[i]+(VCN-RunVCN)),nClusters)) {
+            pNTFS->WindowVCN = VCN;
+            pNTFS->nWindow = nClusters;
+         }
+         return;
+      }
+      RunVCN += pNTFS->RunList[i+1];
+   }
+}
+
+/*.....................................................*/
+
+static UINT
+BitmapWord(PNTFSVOL pNTFS, UINT iWord)
+// Returns 32 bits of the $Bitmap, starting at cluster iWord*32. Past the end of the file
+// this gives 0, as the padding on the end of the loaded bitmap does. If part of a paged
+// bitmap can't be read then the clusters are reported as in use, which is the safe answer.
+{
+   UINT VCN,ByteOffset,w;
+
+   if (pNTFS->Bitmap) return pNTFS->Bitmap[iWord];
+
+   ByteOffset = iWord*sizeof(UINT);
+   if (ByteOffset>=pNTFS->BitmapBytes) return 0;
+   VCN = ByteOffset/pNTFS->ClusterSize;
+   EnterCriticalSection(&pNTFS->csWindow);
+   if (pNTFS->nWindow==0 || VCN<pNTFS->WindowVCN || VCN>=(pNTFS->WindowVCN+pNTFS->nWindow)) LoadWindow(pNTFS,VCN);
+   if (pNTFS->nWindow) w = *(UINT*)(pNTFS->window + (ByteOffset - pNTFS->WindowVCN*pNTFS->ClusterSize));
+   else w = 0xFFFFFFFF;
+   LeaveCriticalSection(&pNTFS->csWindow);
+   return w;
+}
+
+/*.....................................................*/
+
+static BOOL
+ReadBootSector(HVDDR hVDI, BYTE *sector, HUGE iLBA)
+// Reads the volume boot sector into the caller's 512 byte buffer, returns TRUE if it is an NTFS one.
 {
-   if (hVDI->ReadSectors(hVDI, raw_boot_sector, iLBA, 1)) {
-      return (Mem_Compare(raw_boot_sector+3,"NTFS    ",8)==0);
+   if (hVDI->ReadSectors(hVDI, sector, iLBA, 1)) {
+      return (Mem_Compare(sector+3,"NTFS    ",8)==0);
    }
    return FALSE;
 }
 
 /*.....................................................*/
 
+PUBLIC BOOL
+NTFS_IsNTFSVolume(HVDDR hVDI, HUGE iLBA)
+{
+   BYTE sector[512];
+   return ReadBootSector(hVDI,sector,iLBA);
+}
+
+/*.....................................................*/
+
 PUBLIC HFSYS
 NTFS_OpenVolume(HVDDR hVDI, HUGE iLBA, HUGE cLBA, UINT cSectorSize)
 {
-   if (NTFS_IsNTFSVolume(hVDI,iLBA)) { // this also reads the boot sector into the static "raw_boot_sector" buffer.
+   BYTE sector[512];
+   if (ReadBootSector(hVDI,sector,iLBA)) {
       PNTFSVOL pNTFS = Mem_Alloc(MEMF_ZEROINIT, sizeof(NTFSVOLINF));
       if (pNTFS) {
          pNTFS->Base.CloseVolume = NTFS_CloseVolume;
          pNTFS->Base.IsBlockUsed = NTFS_IsBlockUsed;
          pNTFS->hVDIsrc = hVDI;
-         UnpackBootSector(&pNTFS->boots, raw_boot_sector, iLBA, cLBA);
+         UnpackBootSector(&pNTFS->boots, sector, iLBA, cLBA);
          pNTFS->ClusterSize = pNTFS->boots.BytesPerSector*pNTFS->boots.SectorsPerCluster;
          pNTFS->cluster     = Mem_Alloc(0,pNTFS->ClusterSize*16);
          if (pNTFS->cluster) {
@@ -363,10 +449,24 @@ NTFS_OpenVolume(HVDDR hVDI, HUGE iLBA, HUGE cLBA, UINT cSectorSize)
             pFile = MFTFindFile(pNTFS, L"$Bitmap", pNTFS->cluster, pNTFS->ClusterSize*16);
 //          DumpData("c:\\dj2\\MFT_original.bin",pNTFS->cluster,9*1024);
             if (pFile) {
-               pNTFS->Bitmap = DoReadFile(pNTFS, pFile, &pNTFS->BitmapBytes);
-//             DumpData("c:\\dj2\\Bitmap_after.bin",pNTFS->Bitmap,pNTFS->BitmapBytes-4);
-               if (pNTFS->Bitmap) {
-                  return (HFSYS)pNTFS;
+               PMFT_ATTRIBUTE pAttr;
+               DoMstFixups(pFile);
+               pAttr = MFTFindAttribute(pFile,MFT_ATTR_DATA);
+               if (pAttr && pAttr->bNonResident) {
+                  // the bitmap is one bit per cluster, so 32MB for a 1TB volume with 4K clusters. If
+                  // the memory budget won't allow that then read it a window at a time instead.
+                  pNTFS->hBudget = Mem_GetThreadBudget();
+                  pNTFS->BitmapCharge = LO32(pAttr->u.nonres.AttrSizeAlloc)+4;
+                  if (Mem_Charge(pNTFS->hBudget,pNTFS->BitmapCharge)) {
+                     pNTFS->Bitmap = DoReadFile(pNTFS, pFile, &pNTFS->BitmapBytes);
+//                   DumpData("c:\\dj2\\Bitmap_after.bin",pNTFS->Bitmap,pNTFS->BitmapBytes-4);
+                     if (pNTFS->Bitmap) {
+                        return (HFSYS)pNTFS;
+                     }
+                     Mem_Uncharge(pNTFS->hBudget,pNTFS->BitmapCharge);
+                  } else if (OpenPagedBitmap(pNTFS,pFile,pAttr)) {
+                     return (HFSYS)pNTFS;
+                  }
                }
             }
             pNTFS->cluster = Mem_Free(pNTFS->cluster);
@@ -385,7 +485,15 @@ NTFS_CloseVolume(HFSYS hNTFS)
    if (hNTFS) {
       PNTFSVOL pNTFS = (PNTFSVOL)hNTFS;
       Mem_Free(pNTFS->cluster);
-      Mem_Free(pNTFS->Bitmap);
+      if (pNTFS->Bitmap) {
+         Mem_Free(pNTFS->Bitmap);
+         Mem_Uncharge(pNTFS->hBudget,pNTFS->BitmapCharge);
+      }
+      if (pNTFS->RunList) {
+         Mem_Free(pNTFS->RunList);
+         Mem_Free(pNTFS->window);
+         DeleteCriticalSection(&pNTFS->csWindow);
+      }
       Mem_Free(pNTFS);
    }
    return NULL;
@@ -398,13 +506,13 @@ SomeClustersUsed(PNTFSVOL pNTFS, UINT i, UINT nClusters)
 // Return TRUE if any cluster LCN in the range from i to i+nClusters-1
 // is in use.
 {
-   UINT *Bitmap = pNTFS->Bitmap + (i>>5);
+   UINT iWord = (i>>5);
    UINT nBits = (i & 0x1F); // count of unwanted lsbs
-   UINT mask = (*Bitmap++) & (~((1<<nBits)-1)); // zero bit range from 0..[startbit-1] for first UINT only
+   UINT mask = BitmapWord(pNTFS,iWord++) & (~((1<<nBits)-1)); // zero bit range from 0..[startbit-1] for first UINT only
    nClusters += nBits; // let main loop treat mask.bit0 onwards as valid
    for (; nClusters>=32; nClusters-=32) {
       if (mask) return TRUE;
-      mask = (*Bitmap++);
+      mask = BitmapWord(pNTFS,iWord++);
    }
    if (nClusters) {
       if (mask & ((1<<nClusters)-1)) return TRUE;
@@ -622,14 +730,21 @@ NTFS_GrowPartition(HVDDR hVDI, UINT iLBA, UINT OldSectors, UINT NewSectors, UINT
       PNTFSVOL pNTFS = (PNTFSVOL)hNTFS;
       PNTFS_FILE_RECORD pFile;
       HUGE SectorsInVolume;
+      BYTE sector[512];
+
+      if (!pNTFS->Bitmap) { // growing the volume rewrites the whole bitmap, so a paged one is no use.
+         NTFS_CloseVolume(hNTFS);
+         return OldSectors;
+      }
       
       // patch boot sector and write to standard and backup locations.
-      raw_boot_sector[26] = (BYTE)cHeads;
-      raw_boot_sector[27] = (BYTE)0;
+      ReadBootSector(hVDI,sector,iLBA);
+      sector[26] = (BYTE)cHeads;
+      sector[27] = (BYTE)0;
       SectorsInVolume = ((NewSectors-1)>>pNTFS->boots.SectorsPerClusterShift)<<pNTFS->boots.SectorsPerClusterShift;
-      Mem_Copy(raw_boot_sector+0x28,&SectorsInVolume,8);
-      cow->WriteSectors(cow,raw_boot_sector,iLBA,1);
-      cow->WriteSectors(cow,raw_boot_sector,iLBA+NewSectors-1,1);
+      Mem_Copy(sector+0x28,&SectorsInVolume,8);
+      cow->WriteSectors(cow,sector,iLBA,1);
+      cow->WriteSectors(cow,sector,iLBA+NewSectors-1,1);
       NewSectors--;
       
       pFile = MFTFindFile(pNTFS, L"$Bitmap", pNTFS->cluster, pNTFS->ClusterSize*16);
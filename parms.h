@@ -9,6 +9,7 @@
 
 #include "djtypes.h"
 #include "vddr.h"
+#include "stats.h"
 
 // bits in 'flags' field of parameters structure.
 #define PARM_FLAG_KEEPUUID   1 /* copy the creation UUID from the source drive */
@@ -17,16 +18,50 @@
 #define PARM_FLAG_COMPACT    8 /* discard unused blocks from guest filesystem */
 #define PARM_FLAG_FIXMBR    16 /* flag automatically set if enlarging a VDI which starts off less than 8GB */
 #define PARM_FLAG_NOMERGE   32 /* do not merge snapshot chain */
+#define PARM_FLAG_PHYSORDER 64 /* read source blocks in file offset order rather than drive order */
+#define PARM_FLAG_RESERVE  128 /* reserve dest disk space up front, but grow the file as it is written */
+#define PARM_FLAG_DIRECTIO 256 /* bypass the OS file cache for block reads and writes */
+#define PARM_FLAG_BENCH    512 /* benchmark the source reader and clone engine instead of a plain clone */
+#define PARM_FLAG_RESUME  1024 /* keep a journal so that an interrupted clone can be resumed, and resume one */
+#define PARM_FLAG_UPDATE  2048 /* bring an existing dest VDI up to date, rewriting only changed blocks */
+#define PARM_FLAG_BATCHJOB 4096 /* set by the batch runner: no progress output, and the media registry is per job */
+#define PARM_FLAG_DRYRUN  8192 /* predict the size of the clone and how long it will take, without writing it */
+#define PARM_FLAG_MMAP   16384 /* map source blocks into memory instead of reading them into buffers */
 #define PARM_FLAG_CLIMODE   0x80000000 /* command line interface mode - errors written to stdout instead of MessageBox() */
 
+// values for SyncMode
+#define PARM_SYNC_DEFAULT      0 /* not specified: same as write-through */
+#define PARM_SYNC_WRITETHROUGH 1 /* every block write goes straight to disk */
+#define PARM_SYNC_CHECKPOINT   2 /* flush to disk every SyncMB megabytes, and before the header is written */
+#define PARM_SYNC_END          3 /* flush to disk once, before the final header is written */
+
 typedef struct {
    UINT flags;                  // see above flags.
    FNCHAR srcfn[1024];          // source filename and path.
    FNCHAR dstfn[1024];          // dest filename. If this has no path then "same as source path" is assumed.
+   FNCHAR reportfn[1024];       // if not empty, a JSON report of the clone statistics is written here.
+   FNCHAR batchfn[1024];        // if not empty, run the clone jobs listed in this manifest file instead.
+   FNCHAR throttlefn[1024];     // if not empty, a control file which can change the I/O limits during a clone.
    BYTE MBR[512];               // The source disk MBR is read validation, and kept around for later checks.
    HVDDR hVDIsrc;               // The cloning code makes no used of this source disk handle, it's a legacy of validation.
    CHAR  szDestSize[32];        // Destination disk size supplied by user. Ignored if ENLARGE flag not set.
    UINT  DestSectors;           // clone code internally converts szDestSize[] string into this.
+   UINT  PipeDepth;             // number of blocks buffered between clone read and write stages (0=default).
+   UINT  QueueDepth;            // max source block reads in flight during a clone (0=default, 1=no async reads).
+   UINT  SyncMode;              // dest durability policy, one of the PARM_SYNC_xxx values.
+   UINT  SyncMB;                // checkpoint interval in MB for PARM_SYNC_CHECKPOINT (0=default).
+   UINT  SynthMB;               // if non-zero, create a synthetic test image of this size instead of cloning.
+   UINT  SynthDensity;          // percentage of synthetic image blocks which hold data (0=default, 100%).
+   UINT  SynthFrag;             // percentage of synthetic VDI blocks stored out of order (0=none).
+   UINT  ReadMB;                // source read limit in MB/s (0=none).
+   UINT  WriteMB;               // dest write limit in MB/s (0=none).
+   UINT  ReadIOPS;              // source read operations per second (0=none).
+   UINT  WriteIOPS;             // dest write operations per second (0=none).
+   UINT  SamplePct;             // dry run: percentage of the blocks to be copied which are read (0=just a timing probe).
+   UINT  MaxMemoryMB;           // memory budget for the clone, in MB (0=unlimited).
+   UINT  nJobs;                 // batch mode: number of clones run at once (0=default).
+   UINT  nPerDevice;            // batch mode: max clones at once touching any one volume (0=default, 1).
+   CLONE_STATS *pStats;         // if not NULL, Clone_Proceed() copies the clone statistics here.
    UINT  dst_nBlocks;           // clone code calculates this: private.
    UINT  dst_nBlocksAllocated;  // clone code calculates this: private.
    UINT  nMappedParts;          // clone code calculates this: private.
@@ -0,0 +1,692 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Staged block copy engine used by the clone code. The source reads, the zero/usage
+ * checks and the dest writes used to be done one after another on a single thread,
+ * so the two drives took turns being idle. Here they overlap:
+ *
+ *   classify workers --> reader thread --> classify workers --> writer (caller's thread)
+ *   (is block needed?)   (ReadPage)        (is block zero?)     (in page order)
+ *
+ * All stages share one ring of Depth block buffers. Page iPage always lives in slot
+ * (iPage % Depth), so the ring order is the page order, and a slot is only recycled
+ * (for page iPage+Depth) once the writer has finished with it.
+ *
+ * If the caller supplies a Locate callback then the reader doesn't wait for each read
+ * to finish before starting the next: it queues up to QueueDepth reads with the AIO
+ * module (aio.h) and hands each block on as its read completes.
+ *
+ * Reads normally start in page order. In physical order mode (bPhysOrder) the reader
+ * instead sweeps through the blocks waiting in the ring in order of file offset, which
+ * turns a fragmented image back into mostly sequential reads. The ring already puts
+ * blocks back into page order for the writer, so it doubles as the reorder buffer.
+ *
+ * In mapped mode the reader maps blocks instead of reading them, and the slot's data
+ * pointer is aimed at the view rather than the slot's buffer until the writer is done.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include "pipeline.h"
+#include "vddr.h"
+#include "aio.h"
+#include "mem.h"
+#include "djfile.h"
+#include "djstring.h"
+
+// slot states, in the order a slot moves through them.
+#define SLOT_FREE       0  /* assigned a page, waiting for a worker to classify it */
+#define SLOT_CLASSIFY   1  /* a worker is checking whether the block is needed */
+#define SLOT_CLASSIFIED 2  /* waiting for the reader */
+#define SLOT_READING    3  /* an async read of the block is in flight */
+#define SLOT_LOADED     4  /* block was read, waiting for a worker to check it for zeros */
+#define SLOT_SCANNING   5  /* a worker is checking the block for zeros */
+#define SLOT_READY      6  /* waiting for the writer */
+#define SLOT_IDLE       7  /* no more pages for this slot */
+
+typedef struct {
+   BYTE *buffer;
+   BYTE *data;   // the block: buffer, or a mapped view of the source in mapped mode.
+   PVOID pView;  // view to unmap once the writer is done, or NULL.
+   UINT iPage;
+   UINT state;
+   BOOL bRead;   // result of the Classify callback.
+   int  blkstat; // result of the Read callback.
+   UINT ErrCode; // if that failed, VDDR_GetLastError() on the reader thread ...
+   CHAR szErr[256]; // ... and the error message, since the error state is per thread.
+   BOOL bZero;
+   UINT nRun;    // number of slots (starting with this one) covered by its async read.
+   HUGE tStart;  // when its async read was submitted.
+   BOOL bLocated; // TRUE once the reader has called the Locate callback for this page ...
+   int  locrslt;  // ... which returned this ...
+   VDDR_EXTENT ext; // ... and this extent. See LocateSlot().
+} PIPE_SLOT;
+
+typedef struct {
+   PIPE_PARMS *pp;
+   PIPE_SLOT *slot;
+   BYTE *buffers;
+   HBUDGET hBudget;       // the budget which the ring was charged to.
+   UINT Depth;
+   UINT QueueDepth;       // max async reads in flight.
+   UINT nWorkers;
+   BOOL bAbort;
+   CRITICAL_SECTION cs;   // guards the slot states and bAbort.
+   HANDLE hWorkSem;       // count of slots waiting for a classify worker.
+   HANDLE hReadEvent;     // set when a slot may have become ready for the reader.
+   HAIO hAIO;             // async read queue, NULL if the reader uses only synchronous reads.
+   HANDLE hWriteEvent;    // set when a slot may have become ready for the writer.
+   HANDLE hThread[PIPE_MAX_WORKERS+1];
+   UINT nThreads;
+   FILE fMapped[PIPE_MAX_MAPS];  // mapped mode: the source files seen so far ...
+   HANDLE hMap[PIPE_MAX_MAPS];   // ... and their mappings, used by the reader thread only.
+   UINT nMaps;
+   PIPE_STATS stats;      // read stats belong to the reader thread, ZeroScan is guarded by cs.
+} PIPE_INFO, *PPIPE;
+
+/*.....................................................*/
+
+static UINT
+DefaultWorkerCount(void)
+{
+   SYSTEM_INFO si;
+   UINT n;
+   GetSystemInfo(&si);
+   n = si.dwNumberOfProcessors;
+   if (n<1) n = 1;
+   if (n>PIPE_MAX_WORKERS) n = PIPE_MAX_WORKERS;
+   return n;
+}
+
+/*.....................................................*/
+
+static PIPE_SLOT *
+FindJob(PPIPE pPipe)
+// Pick the next job for a classify worker. Must be called inside the critical section.
+// Zero scans are preferred over classification since the writer is waiting on those,
+// and among each kind the lowest page number goes first.
+{
+   PIPE_SLOT *pSlot,*pBest=NULL;
+   UINT i;
+   for (i=0; i<pPipe->Depth; i++) {
+      pSlot = pPipe->slot+i;
+      if (pSlot->state==SLOT_LOADED) {
+         if (!pBest || pBest->state!=SLOT_LOADED || pSlot->iPage<pBest->iPage) pBest = pSlot;
+      } else if (pSlot->state==SLOT_FREE) {
+         if (!pBest || (pBest->state==SLOT_FREE && pSlot->iPage<pBest->iPage)) pBest = pSlot;
+      }
+   }
+   if (pBest) pBest->state = (pBest->state==SLOT_LOADED ? SLOT_SCANNING : SLOT_CLASSIFY);
+   return pBest;
+}
+
+/*.....................................................*/
+
+static void
+WakeReader(PPIPE pPipe)
+// The async reader sleeps in AIO_Reap() rather than on hReadEvent, so it needs a
+// different kind of nudge.
+{
+   if (pPipe->hAIO) AIO_Wake(pPipe->hAIO);
+   else SetEvent(pPipe->hReadEvent);
+}
+
+/*.....................................................*/
+
+static DWORD WINAPI
+WorkerThread(LPVOID lpParam)
+{
+   PPIPE pPipe = (PPIPE)lpParam;
+   PIPE_PARMS *pp = pPipe->pp;
+   PIPE_SLOT *pSlot;
+   UINT state;
+   BOOL bResult;
+   HUGE tStart;
+
+   for (;;) {
+      WaitForSingleObject(pPipe->hWorkSem,INFINITE);
+      EnterCriticalSection(&pPipe->cs);
+      if (pPipe->bAbort) {
+         LeaveCriticalSection(&pPipe->cs);
+         break;
+      }
+      pSlot = FindJob(pPipe);
+      state = (pSlot ? pSlot->state : SLOT_IDLE);
+      LeaveCriticalSection(&pPipe->cs);
+
+      if (state==SLOT_CLASSIFY) {
+         bResult = pp->Classify(pp->pUser,pSlot->iPage);
+         EnterCriticalSection(&pPipe->cs);
+         pSlot->bRead = bResult;
+         pSlot->state = SLOT_CLASSIFIED;
+         LeaveCriticalSection(&pPipe->cs);
+         WakeReader(pPipe);
+      } else if (state==SLOT_SCANNING) {
+         tStart = Stats_Now();
+         bResult = Mem_IsZero(pSlot->data,pp->BlockSize);
+         EnterCriticalSection(&pPipe->cs);
+         Stats_AddTime(&pPipe->stats.ZeroScan,tStart);
+         pSlot->bZero = bResult;
+         pSlot->state = SLOT_READY;
+         LeaveCriticalSection(&pPipe->cs);
+         SetEvent(pPipe->hWriteEvent);
+      }
+   }
+   return 0;
+}
+
+/*.....................................................*/
+
+static BOOL
+WaitForSlot(PPIPE pPipe, PIPE_SLOT *pSlot, UINT iPage, UINT state, HANDLE hEvent)
+// Block until the slot holding iPage reaches the given state. Returns FALSE if the
+// pipeline was aborted while we were waiting.
+{
+   BOOL bReady,bAbort;
+   for (;;) {
+      EnterCriticalSection(&pPipe->cs);
+      bAbort = pPipe->bAbort;
+      bReady = (pSlot->state==state && pSlot->iPage==iPage);
+      LeaveCriticalSection(&pPipe->cs);
+      if (bAbort) return FALSE;
+      if (bReady) return TRUE;
+      WaitForSingleObject(hEvent,INFINITE);
+   }
+}
+
+/*.....................................................*/
+
+static void
+SetReadResult(PPIPE pPipe, PIPE_SLOT *pSlot, int blkstat)
+// Pass a block which the reader has finished with on to the next stage. Only called
+// on the reader thread, so a failure's error code and message can be picked up here.
+{
+   if (blkstat==VDDR_RSLT_FAIL) {
+      pSlot->ErrCode = VDDR_GetLastError();
+      String_Copy(pSlot->szErr,VDDR_GetErrorString(0xFFFFFFFF),256);
+   }
+   EnterCriticalSection(&pPipe->cs);
+   pSlot->blkstat = blkstat;
+   pSlot->bZero = (blkstat==VDDR_RSLT_BLANKPAGE);
+   if (blkstat==VDDR_RSLT_NORMAL) {
+      pSlot->state = SLOT_LOADED;
+      ReleaseSemaphore(pPipe->hWorkSem,1,NULL);
+   } else {
+      pSlot->state = SLOT_READY;
+      SetEvent(pPipe->hWriteEvent);
+   }
+   LeaveCriticalSection(&pPipe->cs);
+}
+
+/*.....................................................*/
+
+static void
+CountRead(PPIPE pPipe, HUGE tStart, UINT nPages)
+// Reader thread helper: record the time taken by one (possibly coalesced) read.
+{
+   HUGE ticks = Stats_AddTime(&pPipe->stats.Read,tStart);
+   Stats_AddLatency(&pPipe->stats.ReadLatency,ticks);
+   pPipe->stats.BytesRead += ((HUGE)nPages)*pPipe->pp->BlockSize;
+}
+
+/*.....................................................*/
+
+static UINT
+CountRun(PPIPE pPipe, UINT iPage)
+// Counts how many blocks, starting with iPage (whose slot must already be classified),
+// could be fetched with one read: they must all be classified, needed, and sit in
+// adjacent ring slots (a run can't wrap around the end of the ring).
+{
+   PIPE_SLOT *pSlot;
+   UINT n,iSlot = (iPage % pPipe->Depth);
+
+   EnterCriticalSection(&pPipe->cs);
+   for (n=1; n<PIPE_MAX_RUN && (iPage+n)<pPipe->pp->nPages && (iSlot+n)<pPipe->Depth; n++) {
+      pSlot = pPipe->slot+iSlot+n;
+      if (pSlot->state!=SLOT_CLASSIFIED || pSlot->iPage!=(iPage+n) || !pSlot->bRead) break;
+   }
+   LeaveCriticalSection(&pPipe->cs);
+   return n;
+}
+
+/*.....................................................*/
+
+static int
+LocateSlot(PPIPE pPipe, PIPE_SLOT *pSlot)
+// Reader thread helper: find the block for a classified slot. The Locate callback is
+// only called the first time, after that the slot remembers the answer until the writer
+// recycles it. Physical order mode would otherwise locate every waiting block on every
+// pick.
+{
+   if (!pSlot->bLocated) {
+      pSlot->locrslt = pPipe->pp->Locate(pPipe->pp->pUser,pSlot->iPage,&pSlot->ext);
+      pSlot->bLocated = TRUE;
+   }
+   return pSlot->locrslt;
+}
+
+/*.....................................................*/
+
+static BOOL
+MapBlock(PPIPE pPipe, PIPE_SLOT *pSlot)
+// Mapped mode reader helper: map the block for a slot instead of reading it. Returns
+// FALSE if the block can't be mapped, in which case it should be read as usual.
+{
+   PIPE_PARMS *pp = pPipe->pp;
+   HANDLE hMap = NULL;
+   HUGE tStart;
+   UINT i;
+
+   if (LocateSlot(pPipe,pSlot)!=VDDR_RSLT_NORMAL) return FALSE;
+   for (i=0; i<pPipe->nMaps; i++) {
+      if (pPipe->fMapped[i]==pSlot->ext.f) hMap = pPipe->hMap[i];
+   }
+   if (i==pPipe->nMaps) {
+      if (i==PIPE_MAX_MAPS) return FALSE;
+      hMap = File_CreateMapping(pSlot->ext.f);
+      pPipe->fMapped[i] = pSlot->ext.f; // a failure is remembered too, so that it isn't retried.
+      pPipe->hMap[i] = hMap;
+      pPipe->nMaps++;
+   }
+   if (!hMap) return FALSE;
+
+   Throttle_Wait(pp->hThrottle,THROTTLE_READ,pp->BlockSize);
+   tStart = Stats_Now();
+   pSlot->data = File_MapView(hMap,pSlot->ext.pos,pp->BlockSize,&pSlot->pView);
+   if (!pSlot->data) {
+      pSlot->data = pSlot->buffer; // the Read callback can report the error properly.
+      return FALSE;
+   }
+   CountRead(pPipe,tStart,1);
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static DWORD WINAPI
+ReaderThread(LPVOID lpParam)
+{
+   PPIPE pPipe = (PPIPE)lpParam;
+   PIPE_PARMS *pp = pPipe->pp;
+   PIPE_SLOT *pSlot;
+   UINT i,iPage,nRun;
+   int blkstat,results[PIPE_MAX_RUN];
+   HUGE tStart;
+
+   for (iPage=0; iPage<pp->nPages; iPage+=nRun) {
+      pSlot = pPipe->slot + (iPage % pPipe->Depth);
+      if (!WaitForSlot(pPipe,pSlot,iPage,SLOT_CLASSIFIED,pPipe->hReadEvent)) break;
+
+      nRun = 1;
+      blkstat = results[0] = VDDR_RSLT_NOTALLOC;
+      if (pSlot->bRead && pp->bMapped && MapBlock(pPipe,pSlot)) {
+         blkstat = results[0] = VDDR_RSLT_NORMAL;
+      } else if (pSlot->bRead) {
+         // take any following blocks which are also ready, the source may be able to
+         // fetch them all with one seek.
+         if (pp->ReadRun) nRun = CountRun(pPipe,iPage);
+         Throttle_Wait(pp->hThrottle,THROTTLE_READ,nRun*pp->BlockSize);
+         tStart = Stats_Now();
+         if (pp->ReadRun) {
+            // results[] has the real result for each page, blkstat only says if any failed.
+            blkstat = pp->ReadRun(pp->pUser,pSlot->buffer,iPage,nRun,results);
+         } else {
+            blkstat = pp->Read(pp->pUser,pSlot->buffer,iPage);
+            results[0] = blkstat;
+         }
+         CountRead(pPipe,tStart,nRun);
+      }
+      for (i=0; i<nRun; i++) SetReadResult(pPipe,pSlot+i,results[i]);
+
+      // the writer reports the failure, after writing everything which came before.
+      if (blkstat==VDDR_RSLT_FAIL) break;
+   }
+   return 0;
+}
+
+/*.....................................................*/
+
+static int
+StartRead(PPIPE pPipe, PIPE_SLOT *pSlot, UINT *pnPages)
+// Async reader helper: start reading the block for a classified slot, along with any
+// following blocks which are ready and lie directly after it in the same file. If the
+// read can't be queued then the block is read (or skipped) right away and passed on.
+// Returns the VDDR_RSLT_xxx result so far, which is VDDR_RSLT_NORMAL for a queued read
+// since any failure will only show up when the read is reaped. *pnPages receives the
+// number of blocks dealt with.
+{
+   PIPE_PARMS *pp = pPipe->pp;
+   VDDR_EXTENT *pExt = &pSlot->ext;
+   int blkstat = VDDR_RSLT_NOTALLOC;
+   BOOL bCharged = FALSE;
+   UINT i,nRun;
+
+   *pnPages = 1;
+   if (pSlot->bRead) {
+      blkstat = LocateSlot(pPipe,pSlot);
+      if (blkstat==VDDR_RSLT_NORMAL) {
+         nRun = CountRun(pPipe,pSlot->iPage);
+         for (i=1; i<nRun; i++) {
+            if (LocateSlot(pPipe,pSlot+i)!=VDDR_RSLT_NORMAL || pSlot[i].ext.f!=pExt->f ||
+                pSlot[i].ext.pos!=(pExt->pos+((HUGE)i)*pp->BlockSize)) break;
+         }
+         nRun = i;
+         Throttle_Wait(pp->hThrottle,THROTTLE_READ,nRun*pp->BlockSize);
+         bCharged = TRUE;
+         pSlot->tStart = Stats_Now();
+         if (AIO_Submit(pPipe->hAIO,pExt->f,pExt->pos,pSlot->buffer,nRun*pp->BlockSize,pSlot)) {
+            EnterCriticalSection(&pPipe->cs);
+            pSlot->nRun = nRun;
+            for (i=0; i<nRun; i++) pSlot[i].state = SLOT_READING;
+            LeaveCriticalSection(&pPipe->cs);
+            *pnPages = nRun;
+            return VDDR_RSLT_NORMAL;
+         }
+         blkstat = VDDR_RSLT_INDIRECT;
+      }
+      if (blkstat==VDDR_RSLT_INDIRECT) {
+         HUGE tStart;
+         if (!bCharged) Throttle_Wait(pp->hThrottle,THROTTLE_READ,pp->BlockSize);
+         tStart = Stats_Now();
+         blkstat = pp->Read(pp->pUser,pSlot->buffer,pSlot->iPage);
+         CountRead(pPipe,tStart,1);
+      } else if (blkstat!=VDDR_RSLT_FAIL) {
+         // ReadPage() would have given the writer a zeroed buffer, e.g. for the MBR fixup.
+         Mem_Zero(pSlot->buffer,pp->BlockSize);
+      }
+   }
+   SetReadResult(pPipe,pSlot,blkstat);
+   return blkstat;
+}
+
+/*.....................................................*/
+
+static BOOL
+ExtentBefore(const VDDR_EXTENT *pA, const VDDR_EXTENT *pB)
+// Physical order: by file first (a snapshot chain spans several), then by offset.
+{
+   if (pA->f!=pB->f) return (((UINT_PTR)pA->f)<((UINT_PTR)pB->f));
+   return (pA->pos<pB->pos);
+}
+
+/*.....................................................*/
+
+static PIPE_SLOT *
+PickSlot(PPIPE pPipe, VDDR_EXTENT *pLast)
+// Physical order mode: of the classified slots, pick the one whose block comes next
+// after *pLast in physical order, wrapping round to the first when there is nothing
+// further on. This is a one-way elevator sweep, so no block waits longer than one pass
+// over the ring. Blocks which don't need an async read at all are picked first, since
+// they cost little or nothing. Returns NULL if no slot is ready.
+{
+   PIPE_SLOT *pSlot,*pAhead=NULL,*pLowest=NULL;
+   BOOL bReady;
+   UINT i;
+
+   for (i=0; i<pPipe->Depth; i++) {
+      pSlot = pPipe->slot+i;
+      // only the reader moves a slot on from SLOT_CLASSIFIED, so it stays ready after I leave.
+      EnterCriticalSection(&pPipe->cs);
+      bReady = (pSlot->state==SLOT_CLASSIFIED);
+      LeaveCriticalSection(&pPipe->cs);
+      if (!bReady) continue;
+      if (!pSlot->bRead || LocateSlot(pPipe,pSlot)!=VDDR_RSLT_NORMAL) return pSlot;
+      if (!ExtentBefore(&pSlot->ext,pLast) && (!pAhead || ExtentBefore(&pSlot->ext,&pAhead->ext))) pAhead = pSlot;
+      if (!pLowest || ExtentBefore(&pSlot->ext,&pLowest->ext)) pLowest = pSlot;
+   }
+   if (pAhead) pLowest = pAhead;
+   if (pLowest) *pLast = pLowest->ext;
+   return pLowest;
+}
+
+/*.....................................................*/
+
+static DWORD WINAPI
+AsyncReaderThread(LPVOID lpParam)
+// Reader stage used when async reads are enabled. Up to QueueDepth reads can be in
+// flight at once. This thread sleeps in AIO_Reap(), which returns when a read completes
+// or when WakeReader() is called.
+//
+// In page order, a failed read stops the reader: the writer reports the failure after
+// writing everything which came before. In physical order that would leave the writer
+// waiting for earlier pages which were never read, so the reader carries on until the
+// writer aborts the pipeline.
+{
+   PPIPE pPipe = (PPIPE)lpParam;
+   PIPE_PARMS *pp = pPipe->pp;
+   PIPE_SLOT *pSlot;
+   UINT i,nStarted=0,nRun;
+   BOOL bStop=FALSE,bReady,bOK;
+   VDDR_EXTENT Last;
+   int blkstat;
+
+   Mem_Zero(&Last,sizeof(Last));
+
+   for (;;) {
+      // start reads for as many classified slots as the queue allows.
+      while (!bStop && nStarted<pp->nPages && AIO_Pending(pPipe->hAIO)<pPipe->QueueDepth) {
+         if (pp->bPhysOrder) {
+            EnterCriticalSection(&pPipe->cs);
+            bStop = pPipe->bAbort;
+            LeaveCriticalSection(&pPipe->cs);
+            if (bStop) break;
+            pSlot = PickSlot(pPipe,&Last);
+            if (!pSlot) break;
+            StartRead(pPipe,pSlot,&nRun);
+         } else {
+            pSlot = pPipe->slot + (nStarted % pPipe->Depth);
+            EnterCriticalSection(&pPipe->cs);
+            bStop = pPipe->bAbort;
+            bReady = (pSlot->state==SLOT_CLASSIFIED && pSlot->iPage==nStarted);
+            LeaveCriticalSection(&pPipe->cs);
+            if (bStop || !bReady) break;
+            if (StartRead(pPipe,pSlot,&nRun)==VDDR_RSLT_FAIL) bStop = TRUE;
+         }
+         nStarted += nRun;
+      }
+
+      // the buffers belong to the ring, so I can't leave while reads are in flight.
+      if (AIO_Pending(pPipe->hAIO)==0 && (bStop || nStarted>=pp->nPages)) break;
+
+      pSlot = AIO_Reap(pPipe->hAIO,TRUE,&bOK);
+      while (pSlot) {
+         EnterCriticalSection(&pPipe->cs);
+         if (pPipe->bAbort) bStop = TRUE;
+         LeaveCriticalSection(&pPipe->cs);
+         nRun = pSlot->nRun;
+         CountRead(pPipe,pSlot->tStart,nRun);
+         for (i=0; i<nRun; i++) {
+            blkstat = VDDR_RSLT_NORMAL;
+            if (!bOK) blkstat = (bStop ? VDDR_RSLT_FAIL : pp->Read(pp->pUser,pSlot[i].buffer,pSlot[i].iPage));
+            SetReadResult(pPipe,pSlot+i,blkstat);
+            if (blkstat==VDDR_RSLT_FAIL && !pp->bPhysOrder) bStop = TRUE;
+         }
+         pSlot = AIO_Reap(pPipe->hAIO,FALSE,&bOK);
+      }
+   }
+   return 0;
+}
+
+/*.....................................................*/
+
+static void
+StopThreads(PPIPE pPipe)
+{
+   EnterCriticalSection(&pPipe->cs);
+   pPipe->bAbort = TRUE;
+   LeaveCriticalSection(&pPipe->cs);
+   ReleaseSemaphore(pPipe->hWorkSem,pPipe->nWorkers,NULL);
+   Throttle_Cancel(pPipe->pp->hThrottle); // the reader may be sleeping off its read quota.
+   WakeReader(pPipe);
+   if (pPipe->nThreads) {
+      UINT i;
+      WaitForMultipleObjects(pPipe->nThreads,pPipe->hThread,TRUE,INFINITE);
+      for (i=0; i<pPipe->nThreads; i++) CloseHandle(pPipe->hThread[i]);
+   }
+}
+
+/*.....................................................*/
+
+static BOOL
+StartThreads(PPIPE pPipe)
+{
+   HANDLE h;
+   DWORD tid;
+   UINT i;
+
+   h = CreateThread(NULL,0,(pPipe->hAIO ? AsyncReaderThread : ReaderThread),pPipe,0,&tid);
+   if (!h) return FALSE;
+   pPipe->hThread[pPipe->nThreads++] = h;
+   for (i=0; i<pPipe->nWorkers; i++) {
+      h = CreateThread(NULL,0,WorkerThread,pPipe,0,&tid);
+      if (!h) return FALSE;
+      pPipe->hThread[pPipe->nThreads++] = h;
+   }
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static PPIPE
+CreatePipe(PIPE_PARMS *pp)
+{
+   PPIPE pPipe = Mem_Alloc(MEMF_ZEROINIT,sizeof(PIPE_INFO));
+   if (pPipe) {
+      UINT i;
+      pPipe->pp = pp;
+      pPipe->QueueDepth = pp->QueueDepth;
+      if (pPipe->QueueDepth<1) pPipe->QueueDepth = 1;
+      if (pPipe->QueueDepth>AIO_MAX_DEPTH) pPipe->QueueDepth = AIO_MAX_DEPTH;
+      pPipe->Depth = pp->Depth;
+      if (pPipe->Depth==0) {
+         // a deep read queue is no use unless the ring can hold the blocks being read.
+         pPipe->Depth = PIPE_DEFAULT_DEPTH;
+         if (pp->Locate && pPipe->Depth<2*pPipe->QueueDepth) pPipe->Depth = 2*pPipe->QueueDepth;
+      }
+      if (pPipe->Depth>PIPE_MAX_DEPTH) pPipe->Depth = PIPE_MAX_DEPTH;
+      pPipe->nWorkers = pp->nWorkers;
+      if (pPipe->nWorkers==0) pPipe->nWorkers = DefaultWorkerCount();
+      if (pPipe->nWorkers>PIPE_MAX_WORKERS) pPipe->nWorkers = PIPE_MAX_WORKERS;
+
+      // if the full ring won't fit in memory, or in the memory budget, then settle for a
+      // shallower one. The ring is page aligned so that async reads can go straight into it
+      // on an unbuffered handle.
+      pPipe->hBudget = Mem_GetThreadBudget();
+      for (;;) {
+         if (Mem_Charge(pPipe->hBudget,pPipe->Depth*pp->BlockSize)) {
+            pPipe->buffers = Mem_AllocAligned(pPipe->Depth*pp->BlockSize);
+            if (pPipe->buffers) break;
+            Mem_Uncharge(pPipe->hBudget,pPipe->Depth*pp->BlockSize);
+         }
+         if (pPipe->Depth<=2) break;
+         pPipe->Depth >>= 1;
+      }
+      pPipe->slot = Mem_Alloc(MEMF_ZEROINIT,pPipe->Depth*sizeof(PIPE_SLOT));
+      if (pPipe->buffers && pPipe->slot) {
+         for (i=0; i<pPipe->Depth; i++) {
+            pPipe->slot[i].buffer = pPipe->slot[i].data = pPipe->buffers + i*pp->BlockSize;
+            pPipe->slot[i].iPage = i;
+            pPipe->slot[i].state = (i<pp->nPages ? SLOT_FREE : SLOT_IDLE);
+         }
+         InitializeCriticalSection(&pPipe->cs);
+         pPipe->hWorkSem = CreateSemaphore(NULL,0,pPipe->Depth+pPipe->nWorkers,NULL);
+         pPipe->hReadEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+         pPipe->hWriteEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+         if (pp->Locate && (pPipe->QueueDepth>1 || pp->bPhysOrder) && !pp->bMapped) {
+            // not being able to create the queue isn't fatal, I just fall back on sync reads.
+            pPipe->hAIO = AIO_Create(pPipe->QueueDepth);
+         }
+         if (pPipe->hWorkSem && pPipe->hReadEvent && pPipe->hWriteEvent) return pPipe;
+         pPipe->hAIO = AIO_Destroy(pPipe->hAIO);
+         if (pPipe->hWorkSem) CloseHandle(pPipe->hWorkSem);
+         if (pPipe->hReadEvent) CloseHandle(pPipe->hReadEvent);
+         if (pPipe->hWriteEvent) CloseHandle(pPipe->hWriteEvent);
+         DeleteCriticalSection(&pPipe->cs);
+      }
+      Mem_Free(pPipe->slot);
+      if (pPipe->buffers) {
+         Mem_FreeAligned(pPipe->buffers);
+         Mem_Uncharge(pPipe->hBudget,pPipe->Depth*pp->BlockSize);
+      }
+      pPipe = Mem_Free(pPipe);
+   }
+   return pPipe;
+}
+
+/*.....................................................*/
+
+static void
+DestroyPipe(PPIPE pPipe)
+{
+   UINT i;
+   for (i=0; i<pPipe->Depth; i++) File_UnmapView(pPipe->slot[i].pView);
+   for (i=0; i<pPipe->nMaps; i++) File_CloseMapping(pPipe->hMap[i]);
+   CloseHandle(pPipe->hWorkSem);
+   CloseHandle(pPipe->hReadEvent);
+   CloseHandle(pPipe->hWriteEvent);
+   AIO_Destroy(pPipe->hAIO);
+   DeleteCriticalSection(&pPipe->cs);
+   Mem_Free(pPipe->slot);
+   Mem_FreeAligned(pPipe->buffers);
+   Mem_Uncharge(pPipe->hBudget,pPipe->Depth*pPipe->pp->BlockSize);
+   Mem_Free(pPipe);
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Pipe_Run(PIPE_PARMS *pp)
+{
+   BOOL bSuccess = FALSE;
+   PPIPE pPipe = CreatePipe(pp);
+
+   if (pPipe) {
+      if (StartThreads(pPipe)) {
+         PIPE_SLOT *pSlot;
+         UINT iPage,nFirst;
+
+         // give the workers the first ring's worth of pages to classify.
+         nFirst = (pp->nPages<pPipe->Depth ? pp->nPages : pPipe->Depth);
+         if (nFirst) ReleaseSemaphore(pPipe->hWorkSem,nFirst,NULL);
+
+         // the writer stage runs on this thread.
+         for (iPage=0; iPage<pp->nPages; iPage++) {
+            pSlot = pPipe->slot + (iPage % pPipe->Depth);
+            if (!WaitForSlot(pPipe,pSlot,iPage,SLOT_READY,pPipe->hWriteEvent)) break;
+            if (!pp->Write(pp->pUser,pSlot->data,iPage,pSlot->blkstat,pSlot->bZero,pSlot->ErrCode,pSlot->szErr)) break;
+            if (pSlot->pView) {
+               File_UnmapView(pSlot->pView);
+               pSlot->pView = NULL;
+               pSlot->data = pSlot->buffer;
+            }
+
+            // recycle the slot for the page one ring further on.
+            EnterCriticalSection(&pPipe->cs);
+            if ((iPage+pPipe->Depth)<pp->nPages) {
+               pSlot->iPage = iPage+pPipe->Depth;
+               pSlot->bLocated = FALSE;
+               pSlot->state = SLOT_FREE;
+               ReleaseSemaphore(pPipe->hWorkSem,1,NULL);
+            } else {
+               pSlot->state = SLOT_IDLE;
+            }
+            LeaveCriticalSection(&pPipe->cs);
+            WakeReader(pPipe);
+         }
+         bSuccess = (iPage==pp->nPages);
+      }
+      StopThreads(pPipe);
+      if (pp->pStats) *pp->pStats = pPipe->stats;
+      DestroyPipe(pPipe);
+   }
+   return bSuccess;
+}
+
+/*.....................................................*/
+
+/* end of pipeline.c */
+
@@ -0,0 +1,102 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/*======================================================================*/
+/* Staged block copy engine: reader thread, classify workers, and an    */
+/* in-order writer, connected by a bounded ring of block buffers.       */
+/*======================================================================*/
+
+#include "djtypes.h"
+#include "vddr.h"
+#include "stats.h"
+#include "throttle.h"
+
+#define PIPE_DEFAULT_DEPTH  16  /* ring depth in blocks, if caller passes 0 */
+#define PIPE_MAX_DEPTH      1024
+#define PIPE_MAX_WORKERS    16
+#define PIPE_DEFAULT_QDEPTH 16  /* source reads in flight, for callers which want async reads */
+#define PIPE_MAX_RUN        16  /* most blocks fetched by one coalesced read */
+#define PIPE_MAX_MAPS       16  /* most source files mapped at once in bMapped mode */
+
+typedef struct {
+   STAT_TIMER Read;        // source reads. Async reads are timed from submit to completion.
+   STAT_HIST  ReadLatency; // one entry per read, a coalesced read counts once.
+   STAT_TIMER ZeroScan;    // zero detection, summed over the worker threads.
+   HUGE       BytesRead;
+} PIPE_STATS;
+
+typedef struct {
+   UINT  nPages;     // number of blocks to process, numbered 0..nPages-1.
+   UINT  BlockSize;  // size of one block buffer, in bytes.
+   UINT  Depth;      // number of block buffers in the ring (0 means PIPE_DEFAULT_DEPTH).
+   UINT  nWorkers;   // number of classify worker threads (0 means one per CPU).
+   UINT  QueueDepth; // max number of source reads in flight (0 or 1 means no async reads).
+   BOOL  bPhysOrder; // start reads in file offset order rather than page order (needs Locate).
+   BOOL  bMapped;    // map blocks into memory rather than reading them (needs Locate, not with bPhysOrder).
+   PVOID pUser;      // passed back to all of the callbacks below.
+   PIPE_STATS *pStats; // OPTIONAL, may be NULL. Receives the stage timings when Pipe_Run() returns.
+   HTHROTTLE hThrottle; // OPTIONAL, may be NULL. Every source read (sync, async or coalesced) is
+                       // charged to its read side, as one operation, before it starts.
+
+   BOOL PUBLIC_METHOD(Classify)(PVOID pUser, UINT iPage);
+   // Called from a classify worker, in no particular page order, possibly from several
+   // threads at once. Must return TRUE if the block needs to be read from the source,
+   // FALSE if it can be skipped (e.g. unused by the guest filesystem).
+
+   int PUBLIC_METHOD(Read)(PVOID pUser, BYTE *buffer, UINT iPage);
+   // Called from the reader thread only, for each block that the Classify callback asked
+   // for, in ascending page order unless bPhysOrder is set. Returns a VDDR_RSLT_xxx code.
+
+   int PUBLIC_METHOD(ReadRun)(PVOID pUser, BYTE *buffer, UINT iPage, UINT nPages, int *pResults);
+   // OPTIONAL, may be NULL. Called from the reader thread only, instead of the Read callback,
+   // when nPages (up to PIPE_MAX_RUN) consecutive blocks are waiting to be read. The buffers of
+   // consecutive pages are adjacent in memory. Works like the ReadPages method in vddr.h.
+
+   int PUBLIC_METHOD(Locate)(PVOID pUser, UINT iPage, VDDR_EXTENT *pExt);
+   // OPTIONAL, may be NULL. Called from the reader thread only, before the Read callback.
+   // Works like the LocatePage method in vddr.h: if this returns VDDR_RSLT_NORMAL then the
+   // pipeline reads BlockSize bytes from *pExt asynchronously, keeping up to QueueDepth such
+   // reads in flight. VDDR_RSLT_INDIRECT means use the Read callback. Blocks which turn out
+   // to be adjacent in the same file are fetched with a single read. If bPhysOrder is set
+   // then this is called for every block waiting in the ring, in no particular order, so
+   // that the reads can be sorted by file and offset. It is called at most once per block.
+
+   BOOL PUBLIC_METHOD(Write)(PVOID pUser, BYTE *buffer, UINT iPage, int blkstat, BOOL bZero, UINT ErrCode, PSTR pszErr);
+   // Called from the thread which called Pipe_Run(), in ascending page order, once
+   // for every page. blkstat is the VDDR_RSLT_xxx code from the Read callback
+   // (VDDR_RSLT_NOTALLOC if the page was skipped), and bZero is TRUE if the buffer is
+   // all zeros. If blkstat is VDDR_RSLT_FAIL then ErrCode and pszErr are the VDDR error
+   // code and message, which the pipeline picked up on the reader thread (calling
+   // VDDR_GetErrorString() here would only see this thread's error state). Every VDDR_RSLT_NORMAL block is checked with Mem_IsZero() by a worker
+   // thread, so the writer never needs to check again. Return FALSE to abort the
+   // pipeline. Since this runs on the caller's thread it is the natural place to update
+   // progress and report errors. In bMapped mode the buffer may be a view of the source
+   // file rather than a ring buffer. It may still be written to, the changes stay private.
+} PIPE_PARMS;
+
+BOOL Pipe_Run(PIPE_PARMS *pp);
+/* Runs the pipeline until every page has been written, or until the Write callback
+ * returns FALSE. Returns TRUE if all pages were passed to the Write callback, FALSE
+ * if the pipeline was aborted or could not be started (not enough memory for the
+ * ring buffers, or thread creation failed).
+ *
+ * Async reads may complete out of order, but the Write callback still sees the pages
+ * in order. If an async read fails then the page is read again with the Read callback,
+ * so that the failure gets reported with a proper error code.
+ *
+ * In bMapped mode the reader maps each block which Locate can find straight into memory
+ * (see File_MapView()), and the zero check and the Write callback work on the mapped
+ * pages, which saves copying every block into the ring. Other blocks are read as usual.
+ *
+ * The ring is charged to the calling thread's memory budget (see Mem_SetThreadBudget()),
+ * and is made shallower, down to two buffers, until it fits.
+ */
+
+#endif
+
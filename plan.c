@@ -0,0 +1,150 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Clone plan. The block range is cut into one slice per thread, each slice starting
+ * on a byte boundary of the state map (four blocks per byte), so that no two threads
+ * ever write to the same byte. Each thread keeps its own state counts, which are
+ * added up once all threads have finished.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include "plan.h"
+#include "mem.h"
+
+typedef struct {
+   HPLAN hPlan;
+   UINT iFirst,iEnd;          // slice of blocks handled by this thread.
+   UINT count[PLAN_NSTATES];  // blocks found in each state.
+} PLAN_SLICE;
+
+typedef struct t_PLAN {
+   UINT nBlocks;
+   PLAN_CLASSIFY Classify;
+   PVOID pUser;
+   UINT count[PLAN_NSTATES];
+   BYTE *map;                 // two bits per block, four blocks per byte.
+} PLAN_INFO;
+
+/*.....................................................*/
+
+static UINT
+DefaultThreadCount(void)
+{
+   SYSTEM_INFO si;
+   UINT n;
+   GetSystemInfo(&si);
+   n = si.dwNumberOfProcessors;
+   if (n<1) n = 1;
+   if (n>PLAN_MAX_THREADS) n = PLAN_MAX_THREADS;
+   return n;
+}
+
+/*.....................................................*/
+
+static DWORD WINAPI
+SliceThread(LPVOID lpParam)
+{
+   PLAN_SLICE *pSlice = (PLAN_SLICE *)lpParam;
+   HPLAN hPlan = pSlice->hPlan;
+   UINT iBlock,state;
+
+   for (iBlock=pSlice->iFirst; iBlock<pSlice->iEnd; iBlock++) {
+      state = (hPlan->Classify(hPlan->pUser,iBlock) & 3);
+      hPlan->map[iBlock>>2] |= (BYTE)(state<<((iBlock&3)<<1));
+      pSlice->count[state]++;
+   }
+   return 0;
+}
+
+/*.....................................................*/
+
+PUBLIC HPLAN
+Plan_Build(UINT nBlocks, PLAN_CLASSIFY Classify, PVOID pUser, UINT nThreads)
+{
+   HPLAN hPlan = Mem_Alloc(MEMF_ZEROINIT,sizeof(PLAN_INFO));
+   if (hPlan) {
+      hPlan->nBlocks = nBlocks;
+      hPlan->Classify = Classify;
+      hPlan->pUser = pUser;
+      hPlan->map = Mem_Alloc(MEMF_ZEROINIT,(nBlocks>>2)+1);
+      if (!hPlan->map) hPlan = Mem_Free(hPlan);
+   }
+   if (hPlan) {
+      PLAN_SLICE slice[PLAN_MAX_THREADS];
+      HANDLE hThread[PLAN_MAX_THREADS];
+      UINT i,j,nPerSlice,nStarted=0;
+      DWORD tid;
+
+      if (nThreads==0) nThreads = DefaultThreadCount();
+      if (nThreads>PLAN_MAX_THREADS) nThreads = PLAN_MAX_THREADS;
+
+      // slices must start on a map byte boundary, hence the rounding up to a multiple of 4.
+      nPerSlice = ((nBlocks/nThreads)+4) & (~3);
+      for (i=0; i<nThreads; i++) {
+         Mem_Zero(slice+i,sizeof(PLAN_SLICE));
+         slice[i].hPlan = hPlan;
+         slice[i].iFirst = (i*nPerSlice<nBlocks ? i*nPerSlice : nBlocks);
+         slice[i].iEnd = (slice[i].iFirst+nPerSlice<nBlocks ? slice[i].iFirst+nPerSlice : nBlocks);
+      }
+
+      // the first slice is done on this thread, the others get one thread each.
+      for (i=1; i<nThreads; i++) {
+         if (slice[i].iFirst==slice[i].iEnd) break;
+         hThread[nStarted] = CreateThread(NULL,0,SliceThread,slice+i,0,&tid);
+         if (!hThread[nStarted]) break;
+         nStarted++;
+      }
+      SliceThread(slice);
+      if (nStarted) {
+         WaitForMultipleObjects(nStarted,hThread,TRUE,INFINITE);
+         for (i=0; i<nStarted; i++) CloseHandle(hThread[i]);
+      }
+      // any slices whose thread could not be started are done here.
+      for (i=nStarted+1; i<nThreads; i++) SliceThread(slice+i);
+
+      for (i=0; i<nThreads; i++) {
+         for (j=0; j<PLAN_NSTATES; j++) hPlan->count[j] += slice[i].count[j];
+      }
+   }
+   return hPlan;
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+Plan_GetState(HPLAN hPlan, UINT iBlock)
+{
+   if (!hPlan || iBlock>=hPlan->nBlocks) return PLAN_SKIP;
+   return ((hPlan->map[iBlock>>2]>>((iBlock&3)<<1)) & 3);
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+Plan_Count(HPLAN hPlan, UINT state)
+{
+   if (!hPlan || state>=PLAN_NSTATES) return 0;
+   return hPlan->count[state];
+}
+
+/*.....................................................*/
+
+PUBLIC HPLAN
+Plan_Free(HPLAN hPlan)
+{
+   if (hPlan) {
+      Mem_Free(hPlan->map);
+      Mem_Free(hPlan);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+/* end of plan.c */
+
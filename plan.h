@@ -0,0 +1,51 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef PLAN_H
+#define PLAN_H
+
+/*======================================================================*/
+/* Clone plan: the fate of every block of the dest drive, worked out    */
+/* once before cloning starts (in parallel) and stored two bits per     */
+/* block. The plan gives both the space estimate and the copy decisions.*/
+/*======================================================================*/
+
+#include "djtypes.h"
+
+// Block states.
+#define PLAN_SKIP       0 /* block is unallocated or unused by the guest, leave it out */
+#define PLAN_COPY       1 /* block holds data which must be copied */
+#define PLAN_ZERO       2 /* block is allocated, but known to be all zeros */
+#define PLAN_INHERITED  3 /* block belongs to a parent image (clone is not merging snapshots) */
+#define PLAN_NSTATES    4
+
+#define PLAN_MAX_THREADS 16
+
+typedef struct t_PLAN *HPLAN;
+
+typedef UINT (*PLAN_CLASSIFY)(PVOID pUser, UINT iBlock);
+/* Callback which decides the state of one block, returning one of the PLAN_xxx codes
+ * above. It is called from several threads at once, in no particular block order, so
+ * it may only use read-only data.
+ */
+
+HPLAN Plan_Build(UINT nBlocks, PLAN_CLASSIFY Classify, PVOID pUser, UINT nThreads);
+/* Builds the plan for blocks 0..nBlocks-1, splitting the block range between nThreads
+ * threads (0 means one per CPU). Returns NULL if there is not enough memory. If threads
+ * can't be created then the work is done on the calling thread instead.
+ */
+
+UINT Plan_GetState(HPLAN hPlan, UINT iBlock);
+/* Returns the PLAN_xxx state of a block. Safe to call from any thread. */
+
+UINT Plan_Count(HPLAN hPlan, UINT state);
+/* Returns the number of blocks in the given PLAN_xxx state. */
+
+HPLAN Plan_Free(HPLAN hPlan);
+/* Discards the plan. Always returns NULL. */
+
+#endif
+
@@ -102,7 +102,7 @@ Progress_Begin(HINSTANCE hInstRes, HWND hWndOwner, PPROGINF pProg)
    pProg->StartTime = GetCurrentTimeInSeconds();
    pProg->bUserCancel = FALSE;
 
-   if (!pProg->bPrintToConsole && !hWndProgress) {
+   if (!pProg->bPrintToConsole && !pProg->bSilent && !hWndProgress) {
       while (YieldCPU());
       hWndProgress = CreateDialogParam(hInstRes,RSTR(DLG_ALT_PROGRESS),hWndOwner,ProgressDlgProc,(LPARAM)pProg);
       if (hWndProgress) SetWindowText(hWndProgress, pProg->pszCaption);
@@ -170,6 +170,7 @@ ShowTime(HWND hWnd, UINT idCtl, double t)
 static void
 Progress_UpdateStats(PPROGINF pProg)
 {
+   if (pProg->bSilent) return;
    if (pProg->bPrintToConsole) {
       int pcent = (pProg->BytesTotal <= 1 ? 100 : (int)((pProg->BytesDone * 100.0 / pProg->BytesTotal) + 0.5));
       int deltaPcent = pcent - pProg->old_pcent;
@@ -234,6 +235,7 @@ Progress_UpdateStats(PPROGINF pProg)
 static void
 Progress_End(PPROGINF pProg)
 {
+   if (pProg->bSilent) return;
    if (pProg->bPrintToConsole) {
       FILE stdout = GetStdHandle(STD_OUTPUT_HANDLE);
       if (stdout) File_WrBin(stdout, "\r\n", 2);
@@ -17,6 +17,7 @@ typedef struct {
    BOOL bUserCancel;   // Either the app or the progress module can set this.
    int  old_pcent;     // app should ignore this.
    BOOL bPrintToConsole;
+   BOOL bSilent;       // no progress output at all, eg. for a clone which is one of a batch.
 } ProgInfo, *PPROGINF;
 
 /*
@@ -0,0 +1,363 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Sector cache. The cache is a fixed array of lines, each holding one aligned run of
+ * LineSectors sectors from the source drive. Lookups are a linear search, which is
+ * nothing next to the cost of the source read a miss saves, and eviction takes the
+ * line with the oldest use stamp. A miss on the line after the previous miss is taken
+ * to mean a sequential scan, and each such miss fetches twice as many lines as the last
+ * one did (up to SCACHE_MAX_RUN), all with one source read.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include "djtypes.h"
+#include "scache.h"
+#include "vddr.h"
+#include "mem.h"
+
+#define SCACHE_MAX_RUN    8   /* most lines fetched by one source read */
+#define SCACHE_MIN_LINES  16  /* smallest cache worth having */
+
+#define NO_LINE ((HUGE)(-1))
+
+typedef struct {
+   HUGE iLine;   // source LBA of the line >> LineShift, or NO_LINE if the line is empty.
+   UINT tUsed;   // use stamp, the smallest is evicted first.
+   int  rslt;    // VDDR_RSLT_xxx from the source read which filled the line.
+} SCACHE_LINE;
+
+typedef struct {
+   CLASS(VDDR) Base;
+   HVDDR SourceDisk;     // underlying virtual disk, not owned by the cache.
+   HBUDGET hBudget;      // budget the buffers are charged to.
+   CRITICAL_SECTION cs;  // guards everything below, and serializes the source reads.
+   HUGE DriveSectors;
+   UINT LineShift;       // log2(sectors per line).
+   UINT LineBytes;
+   UINT nLines;
+   SCACHE_LINE *line;
+   BYTE *data;           // nLines lines of data, followed by a read buffer of SCACHE_MAX_RUN lines.
+   UINT tNow;
+   HUGE iLastMiss;
+   UINT nReadAhead;      // lines the next sequential miss will fetch.
+} SCACHE_INFO, *PSCACHE;
+
+/*...................................................................*/
+
+static UINT
+SCache_GetDriveType(HVDDR pThis)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->GetDriveType(SourceDisk);
+}
+
+/*...................................................................*/
+
+static BOOL
+SCache_GetDriveSize(HVDDR pThis, HUGE *drive_size)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->GetDriveSize(SourceDisk,drive_size);
+}
+
+/*...................................................................*/
+
+static UINT
+SCache_GetDriveBlockCount(HVDDR pThis, UINT SPBshift)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->GetDriveBlockCount(SourceDisk,SPBshift);
+}
+
+/*...................................................................*/
+
+static UINT
+SCache_BlockStatus(HVDDR pThis, HUGE LBA_start, HUGE LBA_end)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->BlockStatus(SourceDisk,LBA_start,LBA_end);
+}
+
+/*...................................................................*/
+
+static BOOL
+SCache_GetDriveUUIDs(HVDDR pThis, S_UUID *uuid, S_UUID *modifyUUID)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->GetDriveUUIDs(SourceDisk,uuid,modifyUUID);
+}
+
+/*...................................................................*/
+
+static BOOL
+SCache_GetParentUUIDs(HVDDR pThis, S_UUID *parentUUID, S_UUID *parentModifyUUID)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->GetParentUUIDs(SourceDisk,parentUUID,parentModifyUUID);
+}
+
+/*...................................................................*/
+
+static BOOL
+SCache_GetDriveUUID(HVDDR pThis, S_UUID *drvuuid)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->GetDriveUUID(SourceDisk,drvuuid);
+}
+
+/*...................................................................*/
+
+static BOOL
+SCache_IsSnapshot(HVDDR pThis)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->IsSnapshot(SourceDisk);
+}
+
+/*...................................................................*/
+
+static int
+SCache_ReadPage(HVDDR pThis, void *buffer, UINT iPage, UINT SPBshift)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->ReadPage(SourceDisk,buffer,iPage,SPBshift);
+}
+
+/*...................................................................*/
+
+static BOOL
+SCache_IsInheritedPage(HVDDR pThis, UINT iPage)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->IsInheritedPage(SourceDisk,iPage);
+}
+
+/*...................................................................*/
+
+static int
+SCache_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->LocatePage(SourceDisk,iPage,SPBshift,pExt);
+}
+
+/*...................................................................*/
+
+static int
+SCache_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults)
+{
+   HVDDR SourceDisk = ((PSCACHE)pThis)->SourceDisk;
+   return SourceDisk->ReadPages(SourceDisk,buffer,iPage,nPages,SPBshift,pResults);
+}
+
+/*...................................................................*/
+
+static UINT
+FindLine(PSCACHE pCache, HUGE iLine)
+// Returns the index of the cache line holding source line iLine, or nLines if none does.
+{
+   UINT i;
+   for (i=0; i<pCache->nLines; i++) {
+      if (pCache->line[i].iLine==iLine) break;
+   }
+   return i;
+}
+
+/*...................................................................*/
+
+static UINT
+OldestLine(PSCACHE pCache)
+{
+   UINT i,iOldest=0;
+   for (i=1; i<pCache->nLines; i++) {
+      if (pCache->line[i].iLine==NO_LINE) return i;
+      if (pCache->line[i].tUsed<pCache->line[iOldest].tUsed) iOldest = i;
+   }
+   return iOldest;
+}
+
+/*...................................................................*/
+
+static BYTE *
+GetLine(PSCACHE pCache, HUGE iLine, int *pRslt)
+// Must be called inside the critical section. Returns the data for source line iLine,
+// reading it (and perhaps the lines after it) into the cache if need be. Returns NULL
+// if the source read fails, in which case nothing is cached.
+{
+   HVDDR SourceDisk = pCache->SourceDisk;
+   UINT i,iCache,nRun,nSectors;
+   HUGE LBA,LinesOnDrive;
+   BYTE *pRead;
+   int rslt;
+
+   iCache = FindLine(pCache,iLine);
+   if (iCache==pCache->nLines) {
+      // a miss. If it follows on from the last one then read further ahead each time.
+      if (iLine==pCache->iLastMiss+1) {
+         if (pCache->nReadAhead<SCACHE_MAX_RUN) pCache->nReadAhead <<= 1;
+      } else {
+         pCache->nReadAhead = 1;
+      }
+      LinesOnDrive = (pCache->DriveSectors+((1<<pCache->LineShift)-1))>>pCache->LineShift;
+      for (nRun=1; nRun<pCache->nReadAhead && nRun<(pCache->nLines>>1); nRun++) {
+         if ((iLine+nRun)>=LinesOnDrive || FindLine(pCache,iLine+nRun)<pCache->nLines) break;
+      }
+      pCache->iLastMiss = iLine+(nRun-1);
+
+      LBA = iLine<<pCache->LineShift;
+      nSectors = (nRun<<pCache->LineShift);
+      if ((LBA+nSectors)>pCache->DriveSectors) nSectors = (UINT)(pCache->DriveSectors-LBA);
+      pRead = pCache->data + pCache->nLines*pCache->LineBytes;
+      rslt = SourceDisk->ReadSectors(SourceDisk,pRead,LBA,nSectors);
+      if (rslt==VDDR_RSLT_FAIL) return NULL;
+      if ((nSectors<<9)<(nRun*pCache->LineBytes)) Mem_Zero(pRead+(nSectors<<9),nRun*pCache->LineBytes-(nSectors<<9));
+
+      // one result covers the whole run, which is less specific but never wrong.
+      for (i=0; i<nRun; i++) {
+         iCache = OldestLine(pCache);
+         pCache->line[iCache].iLine = iLine+i;
+         pCache->line[iCache].tUsed = pCache->tNow++;
+         pCache->line[iCache].rslt = rslt;
+         Mem_Copy(pCache->data+iCache*pCache->LineBytes,pRead+i*pCache->LineBytes,pCache->LineBytes);
+      }
+      iCache = FindLine(pCache,iLine);
+   }
+   pCache->line[iCache].tUsed = pCache->tNow++;
+   *pRslt = pCache->line[iCache].rslt;
+   return pCache->data + iCache*pCache->LineBytes;
+}
+
+/*...................................................................*/
+
+static int
+SCache_ReadSectors(HVDDR pThis, void *buffer, HUGE LBA, UINT nSectors)
+{
+   PSCACHE pCache = (PSCACHE)pThis;
+   HVDDR SourceDisk = pCache->SourceDisk;
+   UINT SectorsPerLine = (1<<pCache->LineShift);
+   UINT SectorOffset,SectorsToCopy;
+   BYTE *pDest = buffer;
+   BYTE *pLine;
+   int rslt,LineRslt;
+
+   if (nSectors==0) return VDDR_RSLT_NORMAL;
+
+   EnterCriticalSection(&pCache->cs);
+   if (nSectors>(SCACHE_MAX_RUN<<pCache->LineShift) || (LBA+nSectors)>pCache->DriveSectors) {
+      rslt = SourceDisk->ReadSectors(SourceDisk,buffer,LBA,nSectors);
+   } else {
+      rslt = VDDR_RSLT_NOTALLOC;
+      SectorOffset = (UINT)(LBA & (SectorsPerLine-1));
+      while (nSectors) {
+         pLine = GetLine(pCache,LBA>>pCache->LineShift,&LineRslt);
+         if (!pLine) {
+            rslt = VDDR_RSLT_FAIL;
+            break;
+         }
+         SectorsToCopy = SectorsPerLine-SectorOffset;
+         if (SectorsToCopy>nSectors) SectorsToCopy = nSectors;
+         Mem_Copy(pDest,pLine+(SectorOffset<<9),SectorsToCopy<<9);
+         if (rslt>LineRslt) rslt = LineRslt;
+         pDest += (SectorsToCopy<<9);
+         LBA += SectorsToCopy;
+         nSectors -= SectorsToCopy;
+         SectorOffset = 0;
+      }
+   }
+   LeaveCriticalSection(&pCache->cs);
+   return rslt;
+}
+
+/*...................................................................*/
+
+static HVDDR
+SCache_Close(HVDDR pThis)
+{
+   if (pThis) {
+      PSCACHE pCache = (PSCACHE)pThis;
+      DeleteCriticalSection(&pCache->cs);
+      Mem_Free(pCache->line);
+      Mem_Free(pCache->data);
+      Mem_Uncharge(pCache->hBudget,(pCache->nLines+SCACHE_MAX_RUN)*pCache->LineBytes);
+      Mem_Free(pCache);
+   }
+   return NULL;
+}
+
+/*...................................................................*/
+
+PUBLIC HVDDR
+SCache_Create(HVDDR SourceDisk, UINT CacheKB, UINT LineKB)
+{
+   PSCACHE pCache;
+   UINT i;
+
+   if (!SourceDisk) return NULL;
+   if (CacheKB==0) CacheKB = SCACHE_DEFAULT_KB;
+   if (LineKB==0) LineKB = SCACHE_DEFAULT_LINEKB;
+   pCache = Mem_Alloc(MEMF_ZEROINIT, sizeof(SCACHE_INFO));
+   if (!pCache) return NULL;
+
+   pCache->LineShift = 0;
+   while ((1U<<(pCache->LineShift+1))<=(LineKB*2)) pCache->LineShift++; // LineKB*2 sectors.
+   pCache->LineBytes = (1<<(pCache->LineShift+9));
+   pCache->nLines = (CacheKB/(pCache->LineBytes>>10));
+   if (pCache->nLines<SCACHE_MIN_LINES) pCache->nLines = SCACHE_MIN_LINES;
+
+   // settle for fewer lines if the memory budget won't run to the full cache.
+   pCache->hBudget = Mem_GetThreadBudget();
+   for (;;) {
+      if (Mem_Charge(pCache->hBudget,(pCache->nLines+SCACHE_MAX_RUN)*pCache->LineBytes)) {
+         pCache->data = Mem_Alloc(0,(pCache->nLines+SCACHE_MAX_RUN)*pCache->LineBytes);
+         if (pCache->data) break;
+         Mem_Uncharge(pCache->hBudget,(pCache->nLines+SCACHE_MAX_RUN)*pCache->LineBytes);
+      }
+      if (pCache->nLines<=SCACHE_MIN_LINES) {
+         Mem_Free(pCache);
+         return NULL;
+      }
+      pCache->nLines >>= 1;
+   }
+   pCache->line = Mem_Alloc(0,pCache->nLines*sizeof(SCACHE_LINE));
+   if (!pCache->line) {
+      Mem_Free(pCache->data);
+      Mem_Uncharge(pCache->hBudget,(pCache->nLines+SCACHE_MAX_RUN)*pCache->LineBytes);
+      Mem_Free(pCache);
+      return NULL;
+   }
+   for (i=0; i<pCache->nLines; i++) pCache->line[i].iLine = NO_LINE;
+
+   pCache->Base.GetDriveType       = SCache_GetDriveType;
+   pCache->Base.GetDriveSize       = SCache_GetDriveSize;
+   pCache->Base.GetDriveBlockCount = SCache_GetDriveBlockCount;
+   pCache->Base.BlockStatus        = SCache_BlockStatus;
+   pCache->Base.ReadPage           = SCache_ReadPage;
+   pCache->Base.ReadSectors        = SCache_ReadSectors;
+   pCache->Base.Close              = SCache_Close;
+
+   // the optional methods are only offered if the source has them.
+   if (SourceDisk->GetDriveUUIDs)   pCache->Base.GetDriveUUIDs   = SCache_GetDriveUUIDs;
+   if (SourceDisk->GetParentUUIDs)  pCache->Base.GetParentUUIDs  = SCache_GetParentUUIDs;
+   if (SourceDisk->GetDriveUUID)    pCache->Base.GetDriveUUID    = SCache_GetDriveUUID;
+   if (SourceDisk->IsSnapshot)      pCache->Base.IsSnapshot      = SCache_IsSnapshot;
+   if (SourceDisk->IsInheritedPage) pCache->Base.IsInheritedPage = SCache_IsInheritedPage;
+   if (SourceDisk->LocatePage)      pCache->Base.LocatePage      = SCache_LocatePage;
+   if (SourceDisk->ReadPages)       pCache->Base.ReadPages       = SCache_ReadPages;
+
+   pCache->SourceDisk = SourceDisk;
+   SourceDisk->GetDriveSize(SourceDisk,&pCache->DriveSectors);
+   pCache->DriveSectors >>= 9;
+   pCache->iLastMiss = NO_LINE-1; // so that a first miss on line 0 isn't taken as sequential.
+   pCache->nReadAhead = 1;
+   InitializeCriticalSection(&pCache->cs);
+   return (HVDDR)pCache;
+}
+
+/*...................................................................*/
+
+/* end of scache.c */
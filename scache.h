@@ -0,0 +1,47 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef SCACHE_H
+#define SCACHE_H
+
+/*================================================================================*/
+/* Sector cache which can be layered over any virtual drive object. Filesystem    */
+/* analysis makes many small ReadSectors() calls (boot sectors, FAT regions, ext2 */
+/* group bitmaps a cluster at a time, NTFS bitmap runs), each of which would cost */
+/* a seek, and in a snapshot chain a walk down the chain as well. The cache reads */
+/* the source in larger aligned lines instead, keeps the most recently used ones, */
+/* and reads further ahead while the reads stay sequential.                       */
+/*--------------------------------------------------------------------------------*/
+/* Like the COW overlay, the cache is itself a VDDR object. Only ReadSectors() is */
+/* cached, the other methods go straight to the underlying drive.                 */
+/*================================================================================*/
+
+#include "vddr.h"
+
+#define SCACHE_DEFAULT_KB      16384 /* default cache size */
+#define SCACHE_DEFAULT_LINEKB  64    /* default line size, the smallest source read */
+
+HVDDR SCache_Create(HVDDR SourceDisk, UINT CacheKB, UINT LineKB);
+/* Creates a cache of CacheKB over SourceDisk, which is read LineKB at a time (0 for
+ * either gives the defaults above, LineKB is rounded down to a power of 2). The cache is
+ * charged to the calling thread's memory budget (see Mem_Charge()), and is made smaller
+ * if the budget won't cover it. Returns NULL if even a small cache can't be had, in which
+ * case the caller should just use SourceDisk directly.
+ *
+ * The cache borrows SourceDisk: closing the cache does not close SourceDisk, which must
+ * stay open for as long as the cache is. The underlying drive must not change while the
+ * cache is open, so the cache should not be layered under a COW overlay which is being
+ * written to (layering it over one is fine, once the writes are done).
+ *
+ * A read from the cache returns the same data as the underlying drive, but a read which
+ * was filled by read-ahead may return a less specific VDDR_RSLT_xxx code, e.g. it may say
+ * VDDR_RSLT_NORMAL for sectors which are in fact unallocated. Reads larger than the
+ * read-ahead limit, or which run past the end of the drive, bypass the cache. The cache
+ * may be read from several threads at once.
+ */
+
+#endif
+
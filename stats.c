@@ -0,0 +1,199 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Clone statistics. The timers are just sums of QueryPerformanceCounter() deltas, so
+ * they cost next to nothing and are always on. The report is plain JSON built with
+ * wsprintf(), which can't format 64 bit numbers, hence Stats_HugeToStr().
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include <winuser.h>
+#include "stats.h"
+#include "djfile.h"
+#include "mem.h"
+
+static HUGE TicksPerSec;
+
+/*.....................................................*/
+
+PUBLIC HUGE
+Stats_Microseconds(HUGE ticks)
+{
+   if (!TicksPerSec) {
+      LARGE_INTEGER freq;
+      QueryPerformanceFrequency(&freq);
+      TicksPerSec = freq.QuadPart;
+      if (TicksPerSec<=0) TicksPerSec = 1000;
+   }
+   // split the multiply to avoid overflow on long runs with a fast counter.
+   return (ticks/TicksPerSec)*1000000 + ((ticks%TicksPerSec)*1000000)/TicksPerSec;
+}
+
+/*.....................................................*/
+
+PUBLIC HUGE
+Stats_Now(void)
+{
+   LARGE_INTEGER t;
+   QueryPerformanceCounter(&t);
+   return t.QuadPart;
+}
+
+/*.....................................................*/
+
+PUBLIC HUGE
+Stats_AddTime(STAT_TIMER *pTimer, HUGE tStart)
+{
+   HUGE ticks = Stats_Now()-tStart;
+   pTimer->ticks += ticks;
+   pTimer->count++;
+   return ticks;
+}
+
+/*.....................................................*/
+
+PUBLIC void
+Stats_AddLatency(STAT_HIST *pHist, HUGE ticks)
+{
+   HUGE us = Stats_Microseconds(ticks)>>6;
+   UINT i = 0;
+   while (us && i<(STAT_HIST_BUCKETS-1)) {
+      us >>= 1;
+      i++;
+   }
+   pHist->count[i]++;
+}
+
+/*.....................................................*/
+
+PUBLIC PSTR
+Stats_HugeToStr(PSTR psz, HUGE n)
+{
+   CHAR tmp[24];
+   UI64 u = (UI64)n;
+   UINT i = 0;
+   do {
+      tmp[i++] = (CHAR)('0'+(UINT)(u%10));
+      u /= 10;
+   } while (u);
+   while (i) *psz++ = tmp[--i];
+   *psz = (CHAR)0;
+   return psz;
+}
+
+/*.....................................................*/
+
+PUBLIC PSTR
+Stats_JsonString(PSTR psz, CPFN s)
+// Filenames are the only strings I write, and the only characters in those which need
+// escaping are backslash and quote.
+{
+   *psz++ = '"';
+   while (*s) {
+      if (*s=='\\' || *s=='"') *psz++ = '\\';
+      *psz++ = (CHAR)(*s++);
+   }
+   *psz++ = '"';
+   *psz = (CHAR)0;
+   return psz;
+}
+
+/*.....................................................*/
+
+static PSTR
+JsonTimer(PSTR psz, PSTR pszName, STAT_TIMER *pTimer)
+{
+   psz += wsprintf(psz,"    \"%s\": {\"ms\": ",pszName);
+   psz = Stats_HugeToStr(psz,Stats_Microseconds(pTimer->ticks)/1000);
+   psz += wsprintf(psz,", \"count\": %lu},\r\n",pTimer->count);
+   return psz;
+}
+
+/*.....................................................*/
+
+static PSTR
+JsonBytes(PSTR psz, PSTR pszName, UINT nBlocks, UINT BlockSize, PSTR pszTail)
+{
+   psz += wsprintf(psz,"    \"%s\": ",pszName);
+   psz = Stats_HugeToStr(psz,((HUGE)nBlocks)*BlockSize);
+   psz += wsprintf(psz,"%s\r\n",pszTail);
+   return psz;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+Stats_WriteReport(CPFN fn, CPFN srcfn, CPFN dstfn, BOOL bSuccess, CLONE_STATS *pStats)
+{
+   PSTR pszBuff,psz;
+   UINT i,nUnused=0;
+   BOOL bOK = FALSE;
+   FILE f;
+
+   pszBuff = psz = Mem_Alloc(0,32768);
+   if (!pszBuff) return FALSE;
+
+   psz += wsprintf(psz,"{\r\n  \"source\": ");
+   psz = Stats_JsonString(psz,srcfn);
+   psz += wsprintf(psz,",\r\n  \"dest\": ");
+   psz = Stats_JsonString(psz,dstfn);
+   psz += wsprintf(psz,",\r\n  \"success\": %s,\r\n",(bSuccess ? "true" : "false"));
+   psz += wsprintf(psz,"  \"block_size\": %lu,\r\n  \"blocks\": %lu,\r\n",pStats->BlockSize,pStats->nBlocks);
+
+   psz += wsprintf(psz,"  \"timers\": {\r\n");
+   psz = JsonTimer(psz,"total",&pStats->Total);
+   psz = JsonTimer(psz,"fs_map",&pStats->MapFS);
+   psz = JsonTimer(psz,"classify",&pStats->Plan);
+   psz = JsonTimer(psz,"read",&pStats->Read);
+   psz = JsonTimer(psz,"zero_detect",&pStats->ZeroScan);
+   psz = JsonTimer(psz,"write",&pStats->Write);
+   psz -= 3; // drop the trailing comma.
+   psz += wsprintf(psz,"\r\n  },\r\n");
+
+   psz += wsprintf(psz,"  \"bytes\": {\r\n    \"read\": ");
+   psz = Stats_HugeToStr(psz,pStats->BytesRead);
+   psz += wsprintf(psz,",\r\n");
+   psz = JsonBytes(psz,"written",pStats->nCopied,pStats->BlockSize,",");
+   psz = JsonBytes(psz,"zero_in_source",pStats->nZeroPlanned,pStats->BlockSize,",");
+   psz = JsonBytes(psz,"zero_detected",pStats->nZeroFound,pStats->BlockSize,",");
+   psz = JsonBytes(psz,"skipped_not_allocated",pStats->nNotAlloc,pStats->BlockSize,",");
+   psz = JsonBytes(psz,"skipped_inherited",pStats->nInherited,pStats->BlockSize,",");
+   psz = JsonBytes(psz,"unchanged",pStats->nUnchanged,pStats->BlockSize,",");
+   psz = JsonBytes(psz,"freed",pStats->nFreed,pStats->BlockSize,",");
+   for (i=0; i<pStats->nParts; i++) nUnused += (UINT)pStats->nUnused[i];
+   psz = JsonBytes(psz,"skipped_unused",nUnused,pStats->BlockSize,",");
+   psz += wsprintf(psz,"    \"skipped_unused_by_partition\": [");
+   for (i=0; i<pStats->nParts; i++) {
+      if (i) psz += wsprintf(psz,", ");
+      psz = Stats_HugeToStr(psz,((HUGE)pStats->nUnused[i])*pStats->BlockSize);
+   }
+   psz += wsprintf(psz,"]\r\n  },\r\n");
+
+   psz += wsprintf(psz,"  \"read_latency_us\": {\r\n");
+   for (i=0; i<STAT_HIST_BUCKETS; i++) {
+      if (i==0) psz += wsprintf(psz,"    \"<64\": %lu",pStats->ReadLatency.count[i]);
+      else if (i==STAT_HIST_BUCKETS-1) psz += wsprintf(psz,"    \">=%lu\": %lu",32UL<<i,pStats->ReadLatency.count[i]);
+      else psz += wsprintf(psz,"    \"<%lu\": %lu",64UL<<i,pStats->ReadLatency.count[i]);
+      psz += wsprintf(psz,(i==STAT_HIST_BUCKETS-1 ? "\r\n" : ",\r\n"));
+   }
+   psz += wsprintf(psz,"  }\r\n}\r\n");
+
+   f = File_Create(fn,DJFILE_FLAG_OVERWRITE);
+   if (f!=NULLFILE) {
+      UINT len = (UINT)(psz-pszBuff);
+      bOK = (File_WrBin(f,pszBuff,len)==len);
+      File_Close(f);
+   }
+   Mem_Free(pszBuff);
+   return bOK;
+}
+
+/*.....................................................*/
+
+/* end of stats.c */
+
@@ -0,0 +1,86 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef STATS_H
+#define STATS_H
+
+/*======================================================================*/
+/* Clone statistics: cheap stage timers and a read latency histogram,   */
+/* plus the JSON run report which the command line mode can write.      */
+/*======================================================================*/
+
+#include "djtypes.h"
+
+#define STAT_HIST_BUCKETS 16
+#define STATS_MAX_PARTS   8  /* same as MAX_MAPPED_PARTITIONS in clone.c */
+
+typedef struct {
+   HUGE ticks;   // accumulated time, in Stats_Now() units.
+   UINT count;   // number of operations timed.
+} STAT_TIMER;
+
+typedef struct {
+   UINT count[STAT_HIST_BUCKETS];
+   // bucket 0 counts operations faster than 64us, bucket i (i>0) those taking 2^(i+5)
+   // to 2^(i+6) microseconds. The last bucket also takes everything slower than that.
+} STAT_HIST;
+
+typedef struct {
+   STAT_TIMER Total;       // the whole clone, wall clock time.
+   STAT_TIMER MapFS;       // loading the guest filesystem allocation maps.
+   STAT_TIMER Plan;        // classifying every block (allocation, filesystem usage).
+   STAT_TIMER Read;        // source reads. Async reads are timed from submit to completion,
+                           // so with several in flight this can exceed the Total.
+   STAT_TIMER ZeroScan;    // zero detection, summed over all worker threads.
+   STAT_TIMER Write;       // dest writes.
+   STAT_HIST  ReadLatency; // one entry per source read (a coalesced read counts once).
+   HUGE BytesRead;
+   UINT BlockSize;
+   UINT nBlocks;           // blocks in the dest drive.
+   UINT nCopied;           // blocks written with data.
+   UINT nZeroPlanned;      // blocks which the source says are zero, stored as zero markers.
+   UINT nZeroFound;        // blocks which were read and turned out to be zero.
+   UINT nNotAlloc;         // skipped: not allocated in the source.
+   UINT nInherited;        // skipped: left in the parent image (no merge).
+   UINT nUnchanged;        // update mode: blocks which were already the same in the dest.
+   UINT nFreed;            // update mode: dest blocks released because the page is now zero or unused.
+   UINT nParts;            // number of mapped partitions, see below.
+   volatile LONG nUnused[STATS_MAX_PARTS]; // skipped: unused by the guest filesystem, by mapped
+                           // partition (the last one is the unpartitioned space). Updated with
+                           // InterlockedIncrement() since the plan is built by several threads.
+} CLONE_STATS;
+
+HUGE Stats_Now(void);
+/* Returns a high resolution timestamp, for passing to Stats_AddTime(). */
+
+HUGE Stats_AddTime(STAT_TIMER *pTimer, HUGE tStart);
+/* Adds the time since tStart (from Stats_Now()) to a timer, and counts one operation.
+ * Returns the elapsed ticks. Not thread safe, each timer must belong to one thread or
+ * be guarded by the caller.
+ */
+
+void Stats_AddLatency(STAT_HIST *pHist, HUGE ticks);
+/* Counts one operation taking the given number of ticks in the histogram. Not thread safe. */
+
+HUGE Stats_Microseconds(HUGE ticks);
+/* Converts a Stats_Now() difference to microseconds. */
+
+PSTR Stats_HugeToStr(PSTR psz, HUGE n);
+/* Writes n (taken as unsigned) in decimal at psz, which must have room for 21 chars.
+ * Returns a pointer to the terminating NUL, so that calls can be chained. wsprintf()
+ * can't do 64 bit numbers.
+ */
+
+PSTR Stats_JsonString(PSTR psz, CPFN s);
+/* Writes s at psz as a quoted and escaped JSON string. Returns a pointer to the NUL. */
+
+BOOL Stats_WriteReport(CPFN fn, CPFN srcfn, CPFN dstfn, BOOL bSuccess, CLONE_STATS *pStats);
+/* Writes the statistics for one clone to file fn, as a JSON object. Times are reported
+ * in milliseconds and sizes in bytes. Returns FALSE if the file could not be written.
+ */
+
+#endif
+
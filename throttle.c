@@ -0,0 +1,218 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* I/O rate limiter. There are four token buckets, bytes and operations for each
+ * direction. Each bucket fills at its rate, up to a burst of THROTTLE_BURST_MS worth
+ * of tokens. An operation takes its tokens up front, even if that puts a bucket into
+ * debt, and then waits until the bucket is back out of debt. Charging first means a
+ * large coalesced read can't be starved by its own size, and the debt makes the
+ * average rate come out right.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include <winuser.h>
+#include "throttle.h"
+#include "djfile.h"
+#include "stats.h"
+#include "mem.h"
+
+#define THROTTLE_BURST_MS 250   /* most tokens a bucket can save up */
+#define THROTTLE_SLICE_MS 100   /* longest single sleep, so cancels and new limits are seen */
+#define THROTTLE_POLL_MS  1000  /* how often the control file is re-read */
+
+#define BUCKET_BYTES 0
+#define BUCKET_OPS   1
+
+typedef struct {
+   double Rate;     // tokens per second, 0 means no limit.
+   double Tokens;   // may go negative.
+} BUCKET;
+
+typedef struct t_THROTTLE {
+   CRITICAL_SECTION cs;        // guards everything below, the directions run on different threads.
+   BUCKET bucket[2][2];        // [THROTTLE_xxx][BUCKET_xxx].
+   HUGE tLast;                 // when the buckets were last filled, in Stats_Now() units.
+   HUGE tPoll;                 // when the control file was last read.
+   volatile LONG bCancel;
+   FNCHAR fnControl[1024];
+} THROTTLE_INFO;
+
+static PSTR pszName[2][2] = {{"readmb","readiops"},{"writemb","writeiops"}};
+
+/*.....................................................*/
+
+static void
+SetBucket(BUCKET *pBucket, double Rate)
+{
+   pBucket->Rate = Rate;
+   if (pBucket->Tokens > Rate*(THROTTLE_BURST_MS/1000.0)) pBucket->Tokens = Rate*(THROTTLE_BURST_MS/1000.0);
+}
+
+/*.....................................................*/
+
+static void
+ReadControlFile(HTHROTTLE h)
+// Must be called inside the critical section. A control file which can't be read
+// (perhaps it is being rewritten) just leaves the limits alone until next time.
+{
+   CHAR sz[1024];
+   PSTR psz,pszItem;
+   UINT len,i,j,n;
+   FILE f;
+
+   f = File_OpenReadShared(h->fnControl);
+   if (f==NULLFILE) return;
+   len = File_RdBin(f,sz,sizeof(sz)-1);
+   File_Close(f);
+   sz[len] = (CHAR)0;
+
+   psz = sz;
+   for (;;) {
+      while (*psz && (UINT)(BYTE)*psz<=' ') psz++;
+      if (!*psz) break;
+      pszItem = psz;
+      while ((UINT)(BYTE)*psz>' ') psz++;
+      if (*psz) *psz++ = (CHAR)0;
+      while (*psz==' ' || *psz==9 || *psz=='=') psz++;
+      for (n=0; *psz>='0' && *psz<='9'; psz++) {
+         if (n<100000000) n = n*10 + (*psz-'0');
+      }
+      for (i=0; i<2; i++) {
+         for (j=0; j<2; j++) {
+            if (lstrcmpi(pszItem,pszName[i][j])==0) {
+               SetBucket(&h->bucket[i][j], (j==BUCKET_BYTES ? n*1048576.0 : (double)n));
+            }
+         }
+      }
+   }
+}
+
+/*.....................................................*/
+
+static void
+Refill(HTHROTTLE h)
+// Must be called inside the critical section.
+{
+   HUGE tNow = Stats_Now();
+   double dt = Stats_Microseconds(tNow-h->tLast)*1e-6;
+   UINT i,j;
+
+   h->tLast = tNow;
+   if (h->fnControl[0] && Stats_Microseconds(tNow-h->tPoll) >= THROTTLE_POLL_MS*1000) {
+      h->tPoll = tNow;
+      ReadControlFile(h);
+   }
+   for (i=0; i<2; i++) {
+      for (j=0; j<2; j++) {
+         BUCKET *pBucket = &h->bucket[i][j];
+         if (pBucket->Rate > 0) {
+            pBucket->Tokens += pBucket->Rate*dt;
+            if (pBucket->Tokens > pBucket->Rate*(THROTTLE_BURST_MS/1000.0)) pBucket->Tokens = pBucket->Rate*(THROTTLE_BURST_MS/1000.0);
+         } else {
+            pBucket->Tokens = 0; // no limit, and no debt carried over if a limit is set later.
+         }
+      }
+   }
+}
+
+/*.....................................................*/
+
+static UINT
+DelayMs(HTHROTTLE h, UINT iDir)
+// Returns how long direction iDir must wait before both its buckets are out of debt.
+// Must be called inside the critical section.
+{
+   double t,tMax = 0;
+   UINT j;
+   for (j=0; j<2; j++) {
+      BUCKET *pBucket = &h->bucket[iDir][j];
+      if (pBucket->Rate > 0 && pBucket->Tokens < 0) {
+         t = (-pBucket->Tokens*1000.0)/pBucket->Rate;
+         if (t>tMax) tMax = t;
+      }
+   }
+   return (UINT)(tMax+0.999);
+}
+
+/*.....................................................*/
+
+PUBLIC HTHROTTLE
+Throttle_Create(CPFN fnControl)
+{
+   HTHROTTLE h = Mem_Alloc(MEMF_ZEROINIT,sizeof(THROTTLE_INFO));
+   if (h) {
+      InitializeCriticalSection(&h->cs);
+      h->tLast = Stats_Now();
+      h->tPoll = 0; // so the control file is read by the first Throttle_Wait().
+      if (fnControl && fnControl[0]) lstrcpyn(h->fnControl,fnControl,1024);
+   }
+   return h;
+}
+
+/*.....................................................*/
+
+PUBLIC void
+Throttle_SetLimit(HTHROTTLE h, UINT iDir, UINT MBs, UINT IOPS)
+{
+   if (h && iDir<2) {
+      EnterCriticalSection(&h->cs);
+      SetBucket(&h->bucket[iDir][BUCKET_BYTES],MBs*1048576.0);
+      SetBucket(&h->bucket[iDir][BUCKET_OPS],(double)IOPS);
+      LeaveCriticalSection(&h->cs);
+   }
+}
+
+/*.....................................................*/
+
+PUBLIC void
+Throttle_Wait(HTHROTTLE h, UINT iDir, UINT nBytes)
+{
+   UINT ms;
+   if (!h || iDir>1) return;
+
+   EnterCriticalSection(&h->cs);
+   Refill(h);
+   h->bucket[iDir][BUCKET_BYTES].Tokens -= nBytes;
+   h->bucket[iDir][BUCKET_OPS].Tokens -= 1;
+   ms = DelayMs(h,iDir);
+   LeaveCriticalSection(&h->cs);
+
+   // sleep in slices, so that a cancel, or a limit raised in the control file, is
+   // noticed without waiting for the whole debt to be paid off.
+   while (ms && !h->bCancel) {
+      Sleep(ms<THROTTLE_SLICE_MS ? ms : THROTTLE_SLICE_MS);
+      EnterCriticalSection(&h->cs);
+      Refill(h);
+      ms = DelayMs(h,iDir);
+      LeaveCriticalSection(&h->cs);
+   }
+}
+
+/*.....................................................*/
+
+PUBLIC void
+Throttle_Cancel(HTHROTTLE h)
+{
+   if (h) InterlockedExchange(&h->bCancel,1);
+}
+
+/*.....................................................*/
+
+PUBLIC HTHROTTLE
+Throttle_Destroy(HTHROTTLE h)
+{
+   if (h) {
+      DeleteCriticalSection(&h->cs);
+      Mem_Free(h);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+/* end of throttle.c */
@@ -0,0 +1,51 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+/*======================================================================*/
+/* Token bucket rate limiter for clone I/O. Caps the read and write     */
+/* bandwidth and operation rates separately, so that a clone can run    */
+/* alongside busy VMs without starving them.                            */
+/*======================================================================*/
+
+#include "djtypes.h"
+
+#define THROTTLE_READ  0
+#define THROTTLE_WRITE 1
+
+typedef struct t_THROTTLE *HTHROTTLE;
+
+HTHROTTLE Throttle_Create(CPFN fnControl);
+/* Creates a limiter with no limits set. If fnControl is not NULL or empty then it names
+ * a control file which is read by the first Throttle_Wait() and then re-read about once
+ * a second, so the limits can be changed while a clone runs. Its settings override any
+ * made with Throttle_SetLimit() before then. The file holds "name value" pairs separated
+ * by white space, where the names are readmb, writemb (MB per second), readiops and
+ * writeiops (operations per second). A value of 0 removes that limit, and a name which
+ * is missing leaves it as it was. Returns NULL if out of memory.
+ */
+
+void Throttle_SetLimit(HTHROTTLE h, UINT iDir, UINT MBs, UINT IOPS);
+/* Sets the limits for THROTTLE_READ or THROTTLE_WRITE. 0 means unlimited. */
+
+void Throttle_Wait(HTHROTTLE h, UINT iDir, UINT nBytes);
+/* Accounts for one I/O operation of nBytes in direction iDir, and blocks until that fits
+ * within the limits. A coalesced read of several blocks is one operation. Each direction
+ * may be used from a different thread. h may be NULL, in which case this does nothing.
+ */
+
+void Throttle_Cancel(HTHROTTLE h);
+/* Wakes any thread blocked in Throttle_Wait(), and makes further waits return at once.
+ * Used when the clone is being aborted. h may be NULL.
+ */
+
+HTHROTTLE Throttle_Destroy(HTHROTTLE h);
+/* Frees the limiter. Always returns NULL. */
+
+#endif
+
@@ -19,7 +19,7 @@
 #include "djstring.h"
 #include "mediareg.h"
 
-UINT VDDR_LastError;
+__declspec(thread) UINT VDDR_LastError;
 
 static PSTR pszUNKERROR /* = "Unknown Error" */;
 static PSTR pszOK       /* = "Ok" */;
@@ -126,5 +126,42 @@ VDDR_QuickGetUUID(CPFN fn, S_UUID *UUID)
 
 /*...........................................................................*/
 
+PUBLIC int
+VDDR_ReadPageRuns(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults,
+                  VDDR_PAGELOC PageLocation, UINT ReadError, UINT *pOSError)
+{
+   BYTE *pDest = buffer;
+   UINT i,nRun,PageSize = (512<<SPBshift);
+   FILE f,nextf;
+   HUGE pos,nextpos;
+
+   while (nPages) {
+      nRun = 1;
+      if (PageLocation(pThis,iPage,SPBshift,&f,&pos)==VDDR_RSLT_NORMAL) {
+         // extend the run for as long as the next page follows on directly in the same file.
+         while (nRun<nPages && PageLocation(pThis,iPage+nRun,SPBshift,&nextf,&nextpos)==VDDR_RSLT_NORMAL &&
+                nextf==f && nextpos==(pos+((HUGE)nRun)*PageSize)) nRun++;
+
+         VDDR_LastError = ReadError;
+         if (File_ReadAt(f, pDest, nRun*PageSize, pos)==nRun*PageSize) VDDR_LastError = 0;
+         else *pOSError = File_IOresult();
+         for (i=0; i<nRun; i++) pResults[i] = (VDDR_LastError ? VDDR_RSLT_FAIL : VDDR_RSLT_NORMAL);
+      } else {
+         pResults[0] = pThis->ReadPage(pThis,pDest,iPage,SPBshift);
+      }
+      if (pResults[0]==VDDR_RSLT_FAIL) {
+         for (i=nRun; i<nPages; i++) pResults[i] = VDDR_RSLT_FAIL;
+         return VDDR_RSLT_FAIL;
+      }
+      pDest += nRun*PageSize;
+      pResults += nRun;
+      iPage += nRun;
+      nPages -= nRun;
+   }
+   return VDDR_RSLT_NORMAL;
+}
+
+/*...........................................................................*/
+
 /* end of vddr.c */
 
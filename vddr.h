@@ -18,6 +18,7 @@
 
 #include "djtypes.h"
 #include "filename.h"
+#include "djfile.h"
 
 typedef CLASS(VDDR) *HVDDR;
 
@@ -26,6 +27,13 @@ typedef CLASS(VDDR) *HVDDR;
 #define VDDR_RSLT_NORMAL    1 /* page was read successfully */
 #define VDDR_RSLT_BLANKPAGE 2 /* page was read successfully, and is filled with zeros */
 #define VDDR_RSLT_NOTALLOC  3 /* page was read successfully, but is not allocated (data needn't be stored in clone) */
+#define VDDR_RSLT_INDIRECT  4 /* LocatePage() only: page has no simple file location, use ReadPage() */
+
+// Physical location of a page, as returned by the LocatePage() method.
+typedef struct {
+   FILE f;     // handle opened with File_OpenReadAsync(), suitable for the AIO module.
+   HUGE pos;   // byte offset of the page within that file.
+} VDDR_EXTENT;
 
 // Supported Virtual Disk Types.
 #define VDD_TYPE_VDI        0 /* VirtualBox native format */
@@ -38,12 +46,14 @@ typedef CLASS(VDDR) *HVDDR;
 
 // Global LastError variable. I hate global variables, but there's no good way to
 // get an error code from an object instance if object creation is what failed.
-UINT VDDR_LastError;
+// It is per-thread, so that readers opened and used on different threads (batch
+// clones) don't report each other's errors.
+extern __declspec(thread) UINT VDDR_LastError;
 
 UINT VDDR_GetLastError(void);
 /* All disk read functions set an error code to provide information on any
  * failure. Always use this function, do not access the global variable
- * directly.
+ * directly. The code is that of the last failure on the calling thread.
  */
 
 PSTR VDDR_GetErrorString(UINT nErr);
@@ -93,6 +103,17 @@ BOOL VDDR_QuickGetUUID(CPFN fn, S_UUID *UUID);
  * work - without requiring the entire snapshot chain to be resolved.
  */
 
+typedef int (*VDDR_PAGELOC)(HVDDR pThis, UINT iPage, UINT SPBshift, FILE *pf, HUGE *pos);
+
+int  VDDR_ReadPageRuns(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults,
+                       VDDR_PAGELOC PageLocation, UINT ReadError, UINT *pOSError);
+/* Implements the ReadPages method (see below) for a reader whose pages map simply
+ * onto file offsets. PageLocation is the reader's own lookup: it returns
+ * VDDR_RSLT_NORMAL and the file handle and byte offset of a page, or any other
+ * code if the page has to go through the ReadPage method instead. If a read fails
+ * then VDDR_LastError is set to ReadError and *pOSError to the OS error code.
+ */
+
 /*----------------------------------------------------------------------*/
 
 // Remaining functions must be directed to an object instance. If the VDDR_Open()
@@ -167,6 +188,23 @@ HVDDR PUBLIC_METHOD(Close)(HVDDR pThis);
 
 BOOL PUBLIC_METHOD(IsInheritedPage)(HVDDR pThis, UINT iPage);
 
+int PUBLIC_METHOD(LocatePage)(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt);
+// OPTIONAL method (may be NULL, callers must check). Rather than reading a page, this tells
+// the caller where the page lives, so that the caller can queue an asynchronous read of it.
+// Returns VDDR_RSLT_NORMAL if the whole page is stored contiguously in one file, in which case
+// *pExt is filled in. Returns VDDR_RSLT_BLANKPAGE or VDDR_RSLT_NOTALLOC if the page needs no
+// read at all (these mean the same as they do for ReadPage()), or VDDR_RSLT_INDIRECT if the page is split across native blocks, compressed, or otherwise not
+// directly readable - the caller should then fall back to ReadPage(). SPBshift is as for ReadPage().
+//
+
+int PUBLIC_METHOD(ReadPages)(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults);
+// OPTIONAL method (may be NULL, callers must check). Reads nPages consecutive pages starting at
+// iPage into buffer, which must be big enough for all of them. Runs of pages which are stored
+// back to back in the source file are fetched with a single seek and read. The VDDR_RSLT_xxxx
+// code for each page is stored in pResults[]. Returns VDDR_RSLT_FAIL if a page could not be read
+// (that page and all pages after it are then marked VDDR_RSLT_FAIL), else VDDR_RSLT_NORMAL.
+//
+
 } /* End definition */ VDDR;
 
 /*----------------------------------------------------------------------*/
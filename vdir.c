@@ -5,6 +5,8 @@
 /*================================================================================*/
 
 #include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
 #include "djtypes.h"
 #include "vdir.h"
 #include "vdistructs.h"
@@ -21,7 +23,16 @@ PUBLIC PSTR pszVdiInfoSlimVDI = "<<< SlimVDI VirtualBox Disk Image >>>\n";
 PUBLIC PSTR pszQemuVdiInfo     = "<<< QEMU VM Virtual Disk Image >>>\n";
 PUBLIC PSTR pszVdiInfoOracle   = "<<< Oracle VM VirtualBox Disk Image >>>\n";
 
-static UINT OSLastError;
+static __declspec(thread) UINT OSLastError;
+
+// When the memory budget won't stretch to the whole block map it is paged in as needed,
+// through a small direct mapped cache.
+#define MAP_PAGE_ENTRIES 1024 /* map entries per page, must be a power of 2 */
+#define MAP_CACHE_PAGES  16   /* must be a power of 2 */
+#define MAP_BAD_SID      0xFFFFFFFD /* returned for a map page which couldn't be read */
+
+#define CHAIN_MAX  254  /* longest snapshot chain which gets a chain index */
+#define CHAIN_NONE 0xFF /* chain index owner of a block which is free in every link */
 
 typedef struct {
    CLASS(VDDR) Base;
@@ -29,10 +40,24 @@ typedef struct {
    VDI_HEADER hdr;
    HVDDR hVDIparent;
    FILE f;
+   FILE fa; // second handle on the same file, for the async reads used by LocatePage() callers.
    UINT BlockShift;
    UINT SectorsPerBlock,SPBshift;
    int  PageReadResult;
-   UINT *blockmap;
+   UINT *blockmap;   // NULL if the map is paged, see MapEntry().
+   HBUDGET hBudget;  // the budget which blockmap was charged to.
+
+   // paged block map.
+   UINT *mapcache;   // MAP_CACHE_PAGES pages of MAP_PAGE_ENTRIES entries.
+   UINT mapcachetag[MAP_CACHE_PAGES]; // page number+1 held in each cache slot, 0 if none.
+   CRITICAL_SECTION csMap; // the planner asks for block status from several threads.
+
+   // chain index, built by the child at the top of a snapshot chain, see BuildChainIndex().
+   UINT  *chainsid;  // per block: the SID in the link which holds it, or VDI_PAGE_ZERO/FREE.
+   BYTE  *chainlink; // per block: index into chain[] of that link, or CHAIN_NONE.
+   HVDDR *chain;     // the VDI links, chain[0] being this one.
+   UINT  nChain;
+   HVDDR hChainTail; // the first parent which isn't a VDI, or NULL.
 } VDI_INFO, *PVDI;
 
 static PSTR pszOK          /* = "Ok" */;
@@ -78,7 +103,7 @@ PUBLIC PSTR
 VDIR_GetErrorString(UINT nErr)
 {
    PSTR pszErr;
-   static char sz[256];
+   static __declspec(thread) char sz[256];
    if (nErr==0xFFFFFFFF) nErr = VDDR_LastError;
    switch (nErr) {
       case VDIR_ERR_NONE:
@@ -124,19 +149,6 @@ VDIR_GetErrorString(UINT nErr)
 
 /*.....................................................*/
 
-static UINT
-DoSeek(FILE f, HUGE pos)
-{
-   HUGE currpos;
-   UINT err = 0;
-   if (File_GetPos(f,&currpos)==0xFFFFFFFF) err = File_IOresult();
-   else if (pos!=currpos) {
-      File_Seek(f,pos);
-      err = File_IOresult();
-   }
-   return err;
-}
-
 /*.....................................................*/
 
 static BOOL
@@ -198,6 +210,167 @@ PreHeaderOK(VDI_PREHEADER *vph)
 
 /*.....................................................*/
 
+static UINT
+MapEntry(PVDI pVDI, UINT iBlock)
+// Returns the block map entry for block iBlock, which must be less than nBlocks. If the
+// map is paged and the page can't be read then MAP_BAD_SID is returned, which the callers
+// will report as a corrupt block map.
+{
+   UINT iMapPage,iSlot,nEntries,sid,*pPage;
+
+   if (pVDI->blockmap) return pVDI->blockmap[iBlock];
+
+   iMapPage = iBlock/MAP_PAGE_ENTRIES;
+   iSlot = (iMapPage & (MAP_CACHE_PAGES-1));
+   pPage = pVDI->mapcache + iSlot*MAP_PAGE_ENTRIES;
+   EnterCriticalSection(&pVDI->csMap);
+   if (pVDI->mapcachetag[iSlot]!=iMapPage+1) {
+      pVDI->mapcachetag[iSlot] = 0;
+      nEntries = pVDI->hdr.nBlocks - iMapPage*MAP_PAGE_ENTRIES;
+      if (nEntries>MAP_PAGE_ENTRIES) nEntries = MAP_PAGE_ENTRIES;
+      if (File_ReadAt(pVDI->f, pPage, nEntries*sizeof(UINT), pVDI->hdr.offset_Blocks + ((HUGE)iMapPage)*(MAP_PAGE_ENTRIES*sizeof(UINT)))==nEntries*sizeof(UINT)) {
+         pVDI->mapcachetag[iSlot] = iMapPage+1;
+      }
+   }
+   sid = (pVDI->mapcachetag[iSlot] ? pPage[iBlock & (MAP_PAGE_ENTRIES-1)] : MAP_BAD_SID);
+   LeaveCriticalSection(&pVDI->csMap);
+   return sid;
+}
+
+/*.....................................................*/
+
+static BOOL
+OpenPagedMap(PVDI pVDI)
+// Sets up the block map cache, used when the budget has no room for the whole map.
+{
+   pVDI->mapcache = Mem_Alloc(0, MAP_CACHE_PAGES*MAP_PAGE_ENTRIES*sizeof(UINT));
+   if (!pVDI->mapcache) {
+      VDDR_LastError = VDIR_ERR_OUTOFMEM;
+      return FALSE;
+   }
+   InitializeCriticalSection(&pVDI->csMap);
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static void
+FreeMap(PVDI pVDI)
+{
+   if (pVDI->blockmap) {
+      pVDI->blockmap = Mem_Free(pVDI->blockmap);
+      Mem_Uncharge(pVDI->hBudget, pVDI->hdr.nBlocks*sizeof(UINT));
+   }
+   if (pVDI->mapcache) {
+      pVDI->mapcache = Mem_Free(pVDI->mapcache);
+      DeleteCriticalSection(&pVDI->csMap);
+   }
+}
+
+/*.....................................................*/
+
+static BOOL
+BuildChainIndex(PVDI pVDI)
+// A read of a block which is free in a snapshot used to be passed down the chain one link
+// at a time, which for a deep chain costs a map lookup and a nested call per link for
+// every block. Instead the top of the chain resolves every block to the link which holds
+// it, once, at open time. Each link is a VDI of the same geometry, the walk stops at the
+// first parent which isn't. Returns FALSE (and the reads recurse as before) if there is
+// no room in the memory budget for the index, or the chain is not suitable.
+{
+   HVDDR hParent;
+   PVDI pLink;
+   UINT i,k,sid,nBlocks = pVDI->hdr.nBlocks;
+   UINT indexsize = nBlocks*(sizeof(UINT)+sizeof(BYTE));
+
+   // count the VDI links.
+   pVDI->nChain = 1;
+   for (pLink=pVDI; (hParent=pLink->hVDIparent)!=NULL; pLink=(PVDI)hParent) {
+      if (hParent->GetDriveType(hParent)!=VDD_TYPE_VDI) {
+         pVDI->hChainTail = hParent;
+         break;
+      }
+      if (((PVDI)hParent)->hdr.nBlocks!=nBlocks || ((PVDI)hParent)->hdr.BlockSize!=pVDI->hdr.BlockSize) return FALSE;
+      if (pVDI->nChain==CHAIN_MAX) return FALSE;
+      pVDI->nChain++;
+   }
+
+   if (!Mem_Charge(pVDI->hBudget,indexsize)) return FALSE;
+   pVDI->chain = Mem_Alloc(0,pVDI->nChain*sizeof(HVDDR));
+   pVDI->chainsid = Mem_Alloc(0,nBlocks*sizeof(UINT));
+   pVDI->chainlink = Mem_Alloc(0,nBlocks);
+   if (!pVDI->chain || !pVDI->chainsid || !pVDI->chainlink) {
+      pVDI->chain = Mem_Free(pVDI->chain);
+      pVDI->chainsid = Mem_Free(pVDI->chainsid);
+      pVDI->chainlink = Mem_Free(pVDI->chainlink);
+      Mem_Uncharge(pVDI->hBudget,indexsize);
+      return FALSE;
+   }
+
+   pLink = pVDI;
+   for (k=0; k<pVDI->nChain; k++) {
+      pVDI->chain[k] = (HVDDR)pLink;
+      pLink = (PVDI)pLink->hVDIparent;
+   }
+
+   // resolve each block from the top of the chain down, stopping at the first link which
+   // has the block allocated or marked as zero.
+   for (i=0; i<nBlocks; i++) {
+      pVDI->chainsid[i] = VDI_PAGE_FREE;
+      pVDI->chainlink[i] = CHAIN_NONE;
+      for (k=0; k<pVDI->nChain; k++) {
+         sid = MapEntry((PVDI)pVDI->chain[k],i);
+         if (sid!=VDI_PAGE_FREE) {
+            pVDI->chainsid[i] = sid;
+            pVDI->chainlink[i] = (BYTE)k;
+            break;
+         }
+      }
+   }
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static void
+FreeChainIndex(PVDI pVDI)
+{
+   if (pVDI->chainsid) {
+      pVDI->chain = Mem_Free(pVDI->chain);
+      pVDI->chainsid = Mem_Free(pVDI->chainsid);
+      pVDI->chainlink = Mem_Free(pVDI->chainlink);
+      Mem_Uncharge(pVDI->hBudget,pVDI->hdr.nBlocks*(sizeof(UINT)+sizeof(BYTE)));
+   }
+}
+
+/*.....................................................*/
+
+static UINT
+ResolveBlock(PVDI pVDI, UINT iBlock, PVDI *ppLink)
+// Returns the SID of block iBlock, and in *ppLink the VDI which the SID belongs to. With a
+// chain index VDI_PAGE_FREE means the block is free all the way down the VDI links (but
+// pVDI->hChainTail may still have it), otherwise it means free in this VDI only.
+{
+   if (pVDI->chainsid) {
+      UINT k = pVDI->chainlink[iBlock];
+      *ppLink = (k==CHAIN_NONE ? pVDI : (PVDI)pVDI->chain[k]);
+      return pVDI->chainsid[iBlock];
+   }
+   *ppLink = pVDI;
+   return MapEntry(pVDI,iBlock);
+}
+
+/*.....................................................*/
+
+static HVDDR
+NextParent(PVDI pVDI)
+// Returns the parent which has to be asked about a block which ResolveBlock() says is free.
+{
+   return (pVDI->chainsid ? pVDI->hChainTail : pVDI->hVDIparent);
+}
+
+/*.....................................................*/
+
 static BOOL
 ValidateMap(PVDI pVDI)
 {
@@ -206,7 +379,7 @@ ValidateMap(PVDI pVDI)
 
    nAlloc = nFree = nZero = 0;
    for (i=0; i<pVDI->hdr.nBlocks; i++) {
-      sid = pVDI->blockmap[i];
+      sid = MapEntry(pVDI,i);
       if (sid == VDI_PAGE_FREE) nFree++;
       else if (sid == VDI_PAGE_ZERO) nZero++;
       else if (sid<pVDI->hdr.nBlocksAllocated) nAlloc++;
@@ -256,6 +429,9 @@ VDIR_Open(CPFN fn, UINT iChain)
                   pVDI->Base.ReadSectors        = VDIR_ReadSectors;
                   pVDI->Base.Close              = VDIR_Close;
                   pVDI->Base.IsInheritedPage    = VDIR_IsInheritedPage;
+                  pVDI->Base.LocatePage         = VDIR_LocatePage;
+                  pVDI->Base.ReadPages          = VDIR_ReadPages;
+                  pVDI->fa = NULLFILE;
 
                   Mem_Copy(&pVDI->phdr, &vph, sizeof(vph));
 
@@ -280,27 +456,36 @@ VDIR_Open(CPFN fn, UINT iChain)
                   if (!VDDR_LastError) {
                      // read the blocks map into a buffer. Assuming 1MB blocks there are 1024 blocks per GB,
                      // 1048576 blocks per TB. Therefore the complete map for a 1TB drive would require only
-                     // 4MB for the map. It seems reasonable therefore to read the whole thing at once.
+                     // 4MB for the map. It seems reasonable therefore to read the whole thing at once,
+                     // unless the memory budget says otherwise (a long snapshot chain has a map per
+                     // link), in which case the map is paged in as needed.
                      //
                      UINT mapsize = pVDI->hdr.nBlocks*sizeof(UINT);
-                     pVDI->blockmap = Mem_Alloc(0, mapsize);
-                     VDDR_LastError = VDIR_ERR_OUTOFMEM;
-                     if (pVDI->blockmap) {
-                        VDDR_LastError = VDIR_ERR_SEEK;
-                        File_Seek(pVDI->f, pVDI->hdr.offset_Blocks);
-                        OSLastError = File_IOresult();
-                        if (OSLastError==0) {
+                     pVDI->hBudget = Mem_GetThreadBudget();
+                     if (Mem_Charge(pVDI->hBudget, mapsize)) {
+                        pVDI->blockmap = Mem_Alloc(0, mapsize);
+                        VDDR_LastError = VDIR_ERR_OUTOFMEM;
+                        if (!pVDI->blockmap) Mem_Uncharge(pVDI->hBudget, mapsize);
+                        else {
                            VDDR_LastError = VDIR_ERR_READ;
-                           if (File_RdBin(pVDI->f, pVDI->blockmap, mapsize)==mapsize) {
+                           if (File_ReadAt(pVDI->f, pVDI->blockmap, mapsize, pVDI->hdr.offset_Blocks)==mapsize) {
                               VDDR_LastError = VDIR_ERR_BLOCKMAP;
                               if (ValidateMap(pVDI)) VDDR_LastError = 0;
                            } else {
                               OSLastError = File_IOresult();
                            }
                         }
+                     } else if (OpenPagedMap(pVDI)) {
+                        VDDR_LastError = VDIR_ERR_BLOCKMAP;
+                        if (ValidateMap(pVDI)) VDDR_LastError = 0;
                      }
                   }
-                  if (VDDR_LastError) pVDI = Mem_Free(pVDI);
+                  if (!VDDR_LastError && iChain==0 && pVDI->hVDIparent) BuildChainIndex(pVDI);
+                  if (VDDR_LastError) {
+                     FreeMap(pVDI);
+                     pVDI = Mem_Free(pVDI);
+                  }
+                  else pVDI->fa = File_OpenReadAsync(fn); // failure is not an error, LocatePage() just won't help.
                }
             }
          }
@@ -384,33 +569,31 @@ RawReadPage(PVDI pVDI, void *buffer, UINT iPage, UINT SectorOffset, UINT length)
 {
    VDDR_LastError = VDIR_ERR_INVBLOCK;
    if (iPage<pVDI->hdr.nBlocks) {
-      UINT SID  = pVDI->blockmap[iPage];
+      PVDI pLink;
+      UINT SID  = ResolveBlock(pVDI,iPage,&pLink);
       VDDR_LastError = 0;
       if (SID == VDI_PAGE_FREE) {
-         if (pVDI->hVDIparent) { // reading from unallocated page in snapshot child: pass read request to parent VDI.
+         HVDDR hParent = NextParent(pVDI);
+         if (hParent) { // reading from unallocated page in snapshot child: pass read request to parent.
             HUGE LBA = iPage;
-            return pVDI->hVDIparent->ReadSectors(pVDI->hVDIparent,buffer,(LBA<<pVDI->SPBshift)+SectorOffset,length>>9);
+            return hParent->ReadSectors(hParent,buffer,(LBA<<pVDI->SPBshift)+SectorOffset,length>>9);
          }
          return VDDR_RSLT_NOTALLOC;
       } else if (SID == VDI_PAGE_ZERO) {
          return VDDR_RSLT_BLANKPAGE;
-      } else if (SID < pVDI->hdr.nBlocksAllocated) {
+      } else if (SID < pLink->hdr.nBlocksAllocated) {
          HUGE seekpos;
 
-         seekpos = (((HUGE)SID)<<pVDI->BlockShift);
-         seekpos += pVDI->hdr.offset_Image; // ... and add image base address.
+         seekpos = (((HUGE)SID)<<pLink->BlockShift);
+         seekpos += pLink->hdr.offset_Image; // ... and add image base address.
          seekpos += (SectorOffset<<9);
 
-         VDDR_LastError = VDIR_ERR_SEEK;
-         OSLastError = DoSeek(pVDI->f,seekpos);
-         if (OSLastError==0) {
-            VDDR_LastError = VDIR_ERR_READ;
-            if (File_RdBin(pVDI->f, buffer, length)==length) {
-               VDDR_LastError = 0;
-               return VDDR_RSLT_NORMAL;
-            }
-            OSLastError = File_IOresult();
+         VDDR_LastError = VDIR_ERR_READ;
+         if (File_ReadAt(pLink->f, buffer, length, seekpos)==length) {
+            VDDR_LastError = 0;
+            return VDDR_RSLT_NORMAL;
          }
+         OSLastError = File_IOresult();
       } else {
          VDDR_LastError = VDIR_ERR_BLOCKMAP;
       }
@@ -489,7 +672,9 @@ VDIR_Close(HVDDR pThis)
    if (pThis) { // we silently handle closing of an already closed file.
       PVDI pVDI = (PVDI)pThis;
       File_Close(pVDI->f);
-      Mem_Free(pVDI->blockmap);
+      if (pVDI->fa!=NULLFILE) File_Close(pVDI->fa);
+      FreeChainIndex(pVDI);
+      FreeMap(pVDI);
       Mem_Free(pVDI);
    }
    return NULL;
@@ -570,13 +755,15 @@ static UINT
 BlockStatus(PVDI pVDI, HUGE LBA_start, HUGE LBA_end)
 {
    UINT SID,LastSID,blks,rslt=VDDR_RSLT_NOTALLOC;
+   HVDDR hParent = NextParent(pVDI);
+   PVDI pLink;
    SID = LO32(LBA_start>>pVDI->SPBshift);   // convert start LBA into block number.
    LastSID = LO32(LBA_end>>pVDI->SPBshift); // convert end LBA into block number.
    for (; SID<=LastSID; SID++) {
       if (SID>=pVDI->hdr.nBlocks) break;
-      blks = pVDI->blockmap[SID];
-      if (blks==VDI_PAGE_FREE && pVDI->hVDIparent) {
-         blks = pVDI->hVDIparent->BlockStatus(pVDI->hVDIparent,LBA_start,LBA_end);
+      blks = ResolveBlock(pVDI,SID,&pLink);
+      if (blks==VDI_PAGE_FREE && hParent) {
+         blks = hParent->BlockStatus(hParent,LBA_start,LBA_end);
          if (blks==VDDR_RSLT_NORMAL) return blks;
          if (blks==VDDR_RSLT_BLANKPAGE) rslt = blks;
       } else {
@@ -657,7 +844,77 @@ PUBLIC BOOL
 VDIR_IsInheritedPage(HVDDR pThis, UINT iPage)
 {
    PVDI pVDI = (PVDI)pThis;
-   return (pVDI->hVDIparent && pVDI->blockmap[iPage] == VDI_PAGE_FREE);
+   if (pVDI->chainsid) return (pVDI->chainlink[iPage]!=0);
+   return (pVDI->hVDIparent && MapEntry(pVDI,iPage) == VDI_PAGE_FREE);
+}
+
+/*....................................................*/
+
+static int
+PageLocation(PVDI pVDI, UINT iPage, UINT SPBshift, HUGE *pos, PVDI *ppLink)
+// Shared by LocatePage() and ReadPages(): finds the byte offset of a page, and in *ppLink
+// the VDI of the chain which holds it. Pages larger than a native block, or beyond the end
+// of the drive, give VDDR_RSLT_INDIRECT. Note that a free page gives VDDR_RSLT_NOTALLOC
+// even in a snapshot, the caller must check NextParent().
+{
+   UINT iBlock,SectorOffset,SID;
+   PVDI pLink;
+
+   if (SPBshift>pVDI->SPBshift) return VDDR_RSLT_INDIRECT;
+   iBlock = (iPage>>(pVDI->SPBshift-SPBshift));
+   if (iBlock>=pVDI->hdr.nBlocks) return VDDR_RSLT_INDIRECT;
+   SectorOffset = ((iPage<<SPBshift) & (pVDI->SectorsPerBlock-1));
+
+   SID = ResolveBlock(pVDI,iBlock,&pLink);
+   *ppLink = pLink;
+   if (SID == VDI_PAGE_FREE) return VDDR_RSLT_NOTALLOC;
+   if (SID == VDI_PAGE_ZERO) return VDDR_RSLT_BLANKPAGE;
+   if (SID >= pLink->hdr.nBlocksAllocated) return VDDR_RSLT_INDIRECT; // let ReadPage() report the bad blockmap entry.
+   *pos = (((HUGE)SID)<<pLink->BlockShift) + pLink->hdr.offset_Image + (((HUGE)SectorOffset)<<9);
+   return VDDR_RSLT_NORMAL;
+}
+
+/*....................................................*/
+
+PUBLIC int
+VDIR_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt)
+{
+   PVDI pVDI = (PVDI)pThis;
+   PVDI pLink;
+   HVDDR hParent;
+   int rslt;
+
+   VDDR_LastError = 0;
+   if (pVDI->fa==NULLFILE) return VDDR_RSLT_INDIRECT;
+   rslt = PageLocation(pVDI,iPage,SPBshift,&pExt->pos,&pLink);
+   hParent = NextParent(pVDI);
+   if (rslt==VDDR_RSLT_NOTALLOC && hParent) {
+      if (hParent->LocatePage) return hParent->LocatePage(hParent,iPage,SPBshift,pExt);
+      return VDDR_RSLT_INDIRECT;
+   }
+   if (pLink->fa==NULLFILE) return VDDR_RSLT_INDIRECT;
+   pExt->f = pLink->fa;
+   return rslt;
+}
+
+/*....................................................*/
+
+static int
+RunLocation(HVDDR pThis, UINT iPage, UINT SPBshift, FILE *pf, HUGE *pos)
+// PageLocation() in the form which VDDR_ReadPageRuns() wants.
+{
+   PVDI pLink;
+   int rslt = PageLocation((PVDI)pThis,iPage,SPBshift,pos,&pLink);
+   if (rslt==VDDR_RSLT_NORMAL) *pf = pLink->f;
+   return rslt;
+}
+
+/*....................................................*/
+
+PUBLIC int
+VDIR_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults)
+{
+   return VDDR_ReadPageRuns(pThis,buffer,iPage,nPages,SPBshift,pResults,RunLocation,VDIR_ERR_READ,&OSLastError);
 }
 
 /*....................................................*/
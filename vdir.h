@@ -54,6 +54,11 @@ HVDDR VDIR_Open(CPFN fn, UINT iChain);
  * should be called even after success, as it may indicate a non-fatal error,
  * such as an inconsistency between the file size and the size indicated
  * by the header.
+ *
+ * If the VDI is a snapshot then its parents are opened too (iChain is the depth in
+ * the chain, 0 for the file the user asked for). The top of the chain also builds
+ * an index of which link holds each block, so that reads go straight to the right
+ * file however deep the chain is.
  */
 
 BOOL VDIR_QuickGetUUID(CPFN fn, S_UUID *UUID);
@@ -98,6 +103,16 @@ HVDDR VDIR_Close(HVDDR pThis);
 
 BOOL VDIR_IsInheritedPage(HVDDR pThis, UINT iPage);
 
+int  VDIR_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt);
+/* Returns the file position of a page instead of reading it, see the LocatePage
+ * method in vddr.h. Unallocated pages in a snapshot are located in the parent.
+ */
+
+int  VDIR_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults);
+/* Reads a run of pages, see the ReadPages method in vddr.h. Pages which are stored
+ * consecutively in the VDI file are read together.
+ */
+
 /*----------------------------------------------------------------------*/
 
 #endif
@@ -19,19 +19,51 @@
 
 #define DO_MBR_FIX        1
 
-static UINT LastError;
+static __declspec(thread) UINT LastError;
 
 #define FN_MAX 2048
 
+#define JOURNAL_SIG "SlimVDI journal"
+#define FNV_BASIS   0x811C9DC5
+
 typedef struct {
    VDI_HEADER hdr;
    FILE f;
+   FILE fd;                // unbuffered handle for block writes, NULLFILE if not used.
+   UINT SyncMode;          // VDIW_FLAG_SYNC_xxx durability policy, 0 means write-through.
+   UINT CheckpointBlocks;  // flush (and journal) interval for VDIW_FLAG_SYNC_CHECKPOINT.
+   UINT nUnsynced;         // blocks written since the last flush.
    UINT BlockSizeShift;
    UINT AlignLBA;
    UINT *blockmap;
+   BOOL bJournal;          // VDIW_FLAG_JOURNAL was given.
+   BOOL bJournaled;        // a journal has been saved at least once.
+   BOOL bFailed;           // a block write failed, so the block map no longer matches the file.
+   UINT iNextPage;         // one more than the highest page passed to VDIW_WritePage() so far.
+   BOOL bUpdate;           // opened by VDIW_Open(), see VDIW_UpdatePage().
+   BOOL bChanged;          // VDIW_UpdatePage() changed something.
+   BOOL bModifySet;        // the caller chose the modify UUID.
+   S_UUID uuidFresh;       // drawn when the handle is made, see InitInfo().
+   UINT *freelist;         // blocks released by VDIW_UpdatePage(), for reuse ...
+   UINT nFree;
+   UINT *pending;          // ... and the pages which released them, whose new block map
+   UINT nPending;          // entries aren't on the disk yet. See CommitFrees().
+   BYTE *scratch;          // one block, for reading back existing blocks.
+   UINT cbKey;
+   BYTE key[VDIW_MAX_JOURNAL_KEY];
    char fn[2048];
 } VDIW_INFO, *PVDI;
 
+// the resume journal file is one of these, followed by the block map.
+typedef struct {
+   CHAR szSig[16];         // JOURNAL_SIG
+   UINT cbKey;
+   BYTE key[VDIW_MAX_JOURNAL_KEY];
+   UINT iNextPage;
+   UINT checksum;          // of this struct (with checksum=0) plus the block map.
+   VDI_HEADER hdr;
+} VDIW_JOURNAL;
+
 // localization strings
 static PSTR pszOK        /* = "Ok" */;
 static PSTR pszUNKERROR  /* = "Unknown Error" */;
@@ -45,6 +77,9 @@ static PSTR pszVWWRERR   /* = "Drive write error" */;
 static PSTR pszVWBLOCK   /* = "Attempted block write past end of virtual disk" */;
 static PSTR pszVWEXISTSQ /* = "Destination already exists. Are you sure you want to overwrite it?" */;
 static PSTR pszVWEXISTSC /* = "File Exists" */;
+static PSTR pszVWJOURNAL /* = "No resume journal which matches this job was found" */;
+static PSTR pszVWRDERR   /* = "Error reading the existing destination VDI" */;
+static PSTR pszVWNOTSAME /* = "Destination is not a dynamic VDI of the same size, so it can't be updated" */;
 
 /*.....................................................*/
 
@@ -102,6 +137,15 @@ VDIW_GetErrorString(UINT nErr)
       case VDIW_ERR_BLOCKNO:
          pszErr = RSTR(VWBLOCK);
          break;
+      case VDIW_ERR_JOURNAL:
+         pszErr = RSTR(VWJOURNAL);
+         break;
+      case VDIW_ERR_READ:
+         pszErr = RSTR(VWRDERR);
+         break;
+      case VDIW_ERR_NOTSAME:
+         pszErr = RSTR(VWNOTSAME);
+         break;
       default:
          pszErr = RSTR(UNKERROR);
    }
@@ -110,28 +154,29 @@ VDIW_GetErrorString(UINT nErr)
 
 /*.....................................................*/
 
-static BOOL
-AllZero(BYTE *buffer, UINT len)
+static UINT
+ImageOffset(UINT nBlocks)
+// Offset of the first data block in a new VDI with nBlocks entries in the blockmap,
+// before any alignment WriteHeader() may add.
 {
-   UINT i,*pdw,ndw;
+   UINT offBlocks = ((sizeof(VDI_HEADER) + 511) & ~511);
+   return (((offBlocks + nBlocks*sizeof(UINT)) + 511) & ~511);
+}
 
-   pdw = (UINT*)buffer;
-   ndw = (len>>2);
-   for (i=ndw; i; i--) {
-      if (*pdw++) return FALSE;
-   }
-   buffer = (BYTE*)pdw;
-   len &= 3;
-   for (i=len; i; i--) {
-      if (*buffer++) return FALSE;
-   }
-   return TRUE;
+/*.....................................................*/
+
+PUBLIC HUGE
+VDIW_FileSize(UINT BlockSize, UINT nBlocks, UINT nBlocksUsed)
+{
+   HUGE size = nBlocksUsed;
+   hugeop_shl(size,size,PowerOfTwo(BlockSize));
+   return size + ImageOffset(nBlocks) + 4096; // WriteHeader() may move the image by up to 4K.
 }
 
 /*.....................................................*/
 
 static BOOL
-CheckDiskSpace(CPFN pfn, UINT BlockSize, UINT nBlocks)
+CheckDiskSpace(CPFN pfn, UINT BlockSize, UINT nBlocks, UINT nBlocksUsed)
 {
    HUGE freespace;
    FNCHAR path[1024];
@@ -149,8 +194,9 @@ CheckDiskSpace(CPFN pfn, UINT BlockSize, UINT nBlocks)
    if (Env_GetDiskFreeSpace(path,&freespace)) {
       HUGE sizerequired;
 
-      sizerequired = nBlocks+2; // +2 for header etc.
-      hugeop_shl(sizerequired,sizerequired,PowerOfTwo(BlockSize));
+      // this used to allow two blocks for the header and blockmap, which isn't enough
+      // for the blockmap of a very large drive.
+      sizerequired = VDIW_FileSize(BlockSize,nBlocks,nBlocksUsed);
       hugeop_sub(freespace, freespace, sizerequired); // this calculates free space remaining after cloning.
       if (HI32(freespace)&0x80000000) { // if freespace went negative...
          LastError = VDIW_ERR_NOSPACE;
@@ -216,7 +262,7 @@ InitHeader(PVDI pVDI, UINT BlockSize, UINT nBlocks)
    pVDI->hdr.vdi_flags = 0;
    pVDI->hdr.vdi_comment[0] = (char)0;
    pVDI->hdr.offset_Blocks = ((sizeof(VDI_HEADER) + 511) & ~511);
-   pVDI->hdr.offset_Image = (((pVDI->hdr.offset_Blocks + nBlocks*sizeof(UINT)) + 511) & ~511);
+   pVDI->hdr.offset_Image = ImageOffset(nBlocks);
    pVDI->AlignLBA         = 63;
 
    pVDI->hdr.LegacyGeometry.cCylinders       = 0;
@@ -240,11 +286,63 @@ InitHeader(PVDI pVDI, UINT BlockSize, UINT nBlocks)
 
 /*.....................................................*/
 
+static void
+JournalName(PFN jfn, CPFN fn)
+{
+   Filename_Copy(jfn, fn, FN_MAX-16);
+   Filename_AddExtension(jfn, "journal");
+}
+
+/*.....................................................*/
+
+static void
+EraseJournal(PVDI pVDI)
+{
+   FNCHAR jfn[FN_MAX];
+   JournalName(jfn,pVDI->fn);
+   File_Erase(jfn);
+}
+
+/*.....................................................*/
+
+static UINT
+FileFlags(UINT flags)
+// Translates VDIW_Create() flags into the File_Create() flags for the main handle.
+{
+   UINT fflags = DJFILE_FLAG_SEQUENTIAL;
+   if (!(flags & VDIW_SYNC_FLAGS)) fflags |= DJFILE_FLAG_WRITETHROUGH;
+   if (flags & VDIW_FLAG_DIRECTIO) fflags |= DJFILE_FLAG_SHAREWRITE; // so that I can open the unbuffered handle too.
+   return fflags;
+}
+
+/*.....................................................*/
+
+static void
+InitInfo(PVDI pVDI, CPFN fn, FILE f, UINT BlockSize, UINT flags)
+// Sets up the parts of a new VDIW_INFO which VDIW_Create(), VDIW_Resume() and VDIW_Open() share.
+{
+   String_Copy(pVDI->fn, fn, FN_MAX);
+   pVDI->f = f;
+   pVDI->fd = NULLFILE;
+   if (flags & VDIW_FLAG_DIRECTIO) pVDI->fd = File_OpenWriteDirect(fn,FileFlags(flags)); // failure just means buffered writes.
+   pVDI->BlockSizeShift = PowerOfTwo(BlockSize);
+   pVDI->SyncMode = (flags & VDIW_SYNC_FLAGS);
+   pVDI->bJournal = ((flags & VDIW_FLAG_JOURNAL)!=0);
+   VDIW_SetCheckpoint((HVDIW)pVDI, VDIW_DEFAULT_CHECKPOINT_MB);
+
+   // Module Random isn't thread safe, so the UUID which WriteHeader() (on a writer thread)
+   // or VDIW_Close() may need later is drawn now, while the caller serializes setup.
+   InitUUID(&pVDI->uuidFresh, FALSE);
+}
+
+/*.....................................................*/
+
 PUBLIC HVDIW
-VDIW_Create(CPFN fn, UINT BlockSize, UINT nBlocks, UINT nBlocksUsed)
+VDIW_Create(CPFN fn, UINT BlockSize, UINT nBlocks, UINT nBlocksUsed, UINT flags)
 {
-   if (CheckDiskSpace(fn,BlockSize,nBlocksUsed)) {
-      FILE f = File_Create(fn,DJFILE_FLAG_WRITETHROUGH|DJFILE_FLAG_SEQUENTIAL);
+   if (CheckDiskSpace(fn,BlockSize,nBlocks,nBlocksUsed)) {
+      UINT fflags = FileFlags(flags);
+      FILE f = File_Create(fn,fflags|((flags & VDIW_FLAG_OVERWRITE) ? DJFILE_FLAG_OVERWRITE : 0));
 //    FILE f = CreateFile(fn,GENERIC_WRITE,0,0,CREATE_NEW,FILE_FLAG_WRITE_THROUGH|FILE_FLAG_SEQUENTIAL_SCAN,0);
 _try_again:
       LastError = 0;
@@ -254,8 +352,8 @@ _try_again:
          else if (IOR == DJFILE_ERROR_WRITEPROTECT) LastError = VDIW_ERR_WPROTECT;
          else {
             LastError = VDIW_ERR_EXISTS;
-            if (Env_AskYN(RSTR(VWEXISTSQ), RSTR(VWEXISTSC))) {
-               f = File_Create(fn,DJFILE_FLAG_WRITETHROUGH|DJFILE_FLAG_SEQUENTIAL|DJFILE_FLAG_OVERWRITE);
+            if (!(flags & VDIW_FLAG_NOPROMPT) && Env_AskYN(RSTR(VWEXISTSQ), RSTR(VWEXISTSC))) {
+               f = File_Create(fn,fflags|DJFILE_FLAG_OVERWRITE);
 //             f = CreateFile(fn,GENERIC_WRITE,0,0,CREATE_ALWAYS,FILE_FLAG_WRITE_THROUGH|FILE_FLAG_SEQUENTIAL_SCAN,0);
                goto _try_again;
             }
@@ -263,10 +361,9 @@ _try_again:
       }
       if (!LastError) {
          PVDI pVDI = Mem_Alloc(MEMF_ZEROINIT, sizeof(VDIW_INFO));
-         String_Copy(pVDI->fn, fn, FN_MAX);
-         pVDI->f = f;
-         pVDI->BlockSizeShift = PowerOfTwo(BlockSize);
+         InitInfo(pVDI,fn,f,BlockSize,flags);
          InitHeader(pVDI,BlockSize,nBlocks);
+         if (pVDI->bJournal) EraseJournal(pVDI); // a stale journal would describe the old file.
          return (HVDIW)pVDI;
       }
    }
@@ -296,8 +393,10 @@ VDIW_SetDriveUUIDs(HANDLE hVDI, S_UUID *uuid, S_UUID *modifyUUID)
    if (hVDI) {
       PVDI pVDI = (PVDI)hVDI;
       Mem_Copy(&pVDI->hdr.uuidCreate, uuid, sizeof(S_UUID));
-      if (modifyUUID)
+      if (modifyUUID) {
          Mem_Copy(&pVDI->hdr.uuidModify, modifyUUID, sizeof(S_UUID));
+         pVDI->bModifySet = TRUE;
+      }
       LastError = 0;
    }
    return (LastError==0);
@@ -319,29 +418,31 @@ VDIW_SetParentUUIDs(HANDLE hVDI, S_UUID *parentUUID, S_UUID *parentModifyUUID)
 
 /*.....................................................*/
 
-static BYTE padding[4096];
+static const BYTE padding[4096]; // all zeros, and read only, so it is safe to share between threads.
 
-static void
-WritePadding(PVDI pVDI, UINT file_offset)
+static BOOL
+WritePadding(PVDI pVDI, UINT current_pos, UINT file_offset)
 {
-   UINT bytes,current_pos = File_GetPos(pVDI->f, NULL);
+   UINT bytes;
 
-   Mem_Zero(padding,4096);
    while (current_pos < file_offset) {
       bytes = file_offset - current_pos;
       if (bytes>4096) bytes = 4096;
-      File_WrBin(pVDI->f, padding, bytes);
+      if (File_WriteAt(pVDI->f, (PVOID)padding, bytes, current_pos)!=bytes) return FALSE;
       current_pos += bytes;
    }
+   return TRUE;
 }
 
 /*.....................................................*/
 
 static void
 WriteHeader(PVDI pVDI)
+// Writes the initial header and an empty block map. Sets LastError if that fails.
 {
    VDI_PREHEADER vph;
-   UINT i,LBA_boot_partition;
+   DJFILE_IOVEC iov[2];
+   UINT i,LBA_boot_partition,cbMap;
 
    // write pre-header first.
    Mem_Zero(&vph,sizeof(vph));
@@ -349,17 +450,25 @@ WriteHeader(PVDI pVDI)
    String_Copy(vph.szFileInfo,pszVdiInfoSlimVDI,64);
    vph.u32Signature = VDI_SIGNATURE;
    vph.u32Version = VDI_LATEST_VERSION;
-   File_WrBin(pVDI->f, &vph, sizeof(vph));
 
-   // then write the true header.
-   if (AllZero(pVDI->hdr.uuidCreate.au8,16)) InitUUID(&pVDI->hdr.uuidCreate,FALSE);
-   File_WrBin(pVDI->f, &pVDI->hdr, sizeof(VDI_HEADER));
+   // then the true header, which directly follows it.
+   if (Mem_IsZero(pVDI->hdr.uuidCreate.au8,16)) Mem_Copy(&pVDI->hdr.uuidCreate,&pVDI->uuidFresh,sizeof(S_UUID));
+   iov[0].buf = &vph;
+   iov[0].len = sizeof(vph);
+   iov[1].buf = &pVDI->hdr;
+   iov[1].len = sizeof(VDI_HEADER);
+   if (File_WriteAtV(pVDI->f, iov, 2, 0)!=(sizeof(vph)+sizeof(VDI_HEADER))) LastError = VDIW_ERR_WRITE;
 
    // alloc memory for the block map, then initialize it.
-   pVDI->blockmap = Mem_Alloc(0,pVDI->hdr.nBlocks*sizeof(UINT));
+   cbMap = pVDI->hdr.nBlocks*sizeof(UINT);
+   pVDI->blockmap = Mem_Alloc(0,cbMap);
+   if (!pVDI->blockmap) {
+      LastError = VDIW_ERR_NOMEM;
+      return;
+   }
    for (i=0; i<pVDI->hdr.nBlocks; i++) pVDI->blockmap[i] = VDI_PAGE_FREE;
-   WritePadding(pVDI, pVDI->hdr.offset_Blocks); // pad out to blockmap offset.
-   File_WrBin(pVDI->f, pVDI->blockmap, pVDI->hdr.nBlocks*sizeof(UINT));
+   if (!WritePadding(pVDI, sizeof(vph)+sizeof(VDI_HEADER), pVDI->hdr.offset_Blocks)) LastError = VDIW_ERR_WRITE; // pad out to blockmap offset.
+   if (File_WriteAt(pVDI->f, pVDI->blockmap, cbMap, pVDI->hdr.offset_Blocks)!=cbMap) LastError = VDIW_ERR_WRITE;
 
    // VirtualBox aligns the drive image data on a sector boundary within the VDI file. I also
    // want to align it such that the start sector of the boot partition is aligned on a
@@ -372,7 +481,7 @@ WriteHeader(PVDI pVDI)
    }
 
    // pad out to the image offset
-   WritePadding(pVDI, pVDI->hdr.offset_Image);
+   if (!WritePadding(pVDI, pVDI->hdr.offset_Blocks+cbMap, pVDI->hdr.offset_Image)) LastError = VDIW_ERR_WRITE;
 }
 
 /*.....................................................*/
@@ -516,8 +625,109 @@ VDIW_FixMBR(HVDIW hVDI, BYTE *MBR)
 
 /*.....................................................*/
 
+static BOOL
+SyncData(PVDI pVDI)
+// Flushes everything written so far to disk, through both handles.
+{
+   BOOL bOK = TRUE;
+   if (pVDI->fd!=NULLFILE && !File_Flush(pVDI->fd)) bOK = FALSE;
+   if (!File_Flush(pVDI->f)) bOK = FALSE;
+   pVDI->nUnsynced = 0;
+   return bOK;
+}
+
+/*.....................................................*/
+
+static UINT
+Checksum(UINT sum, void *buffer, UINT len)
+// FNV-1a hash, just to catch a journal which was only partly written or is corrupt.
+{
+   BYTE *p = (BYTE*)buffer;
+   while (len--) sum = (sum ^ *p++) * 16777619;
+   return sum;
+}
+
+
+/*.....................................................*/
+
+static BOOL
+WriteJournal(PVDI pVDI)
+// Saves the header and block map as they are now. The journal is written to a temp file
+// and then renamed over the old one, so that a crash at any point leaves a usable journal.
+{
+   VDIW_JOURNAL j;
+   FNCHAR jfn[FN_MAX],tmpfn[FN_MAX];
+   UINT cbMap = pVDI->hdr.nBlocks*sizeof(UINT);
+   BOOL bOK = FALSE;
+   FILE f;
+
+   Mem_Zero(&j,sizeof(j));
+   String_Copy(j.szSig,JOURNAL_SIG,16);
+   j.cbKey = pVDI->cbKey;
+   Mem_Copy(j.key,pVDI->key,pVDI->cbKey);
+   j.iNextPage = pVDI->iNextPage;
+   Mem_Copy(&j.hdr,&pVDI->hdr,sizeof(VDI_HEADER));
+   j.checksum = Checksum(Checksum(FNV_BASIS,&j,sizeof(j)),pVDI->blockmap,cbMap);
+
+   JournalName(jfn,pVDI->fn);
+   Filename_Copy(tmpfn,jfn,FN_MAX-8);
+   Filename_AddExtension(tmpfn,"new");
+   f = File_Create(tmpfn,DJFILE_FLAG_OVERWRITE|DJFILE_FLAG_WRITETHROUGH);
+   if (f!=NULLFILE) {
+      bOK = (File_WrBin(f,&j,sizeof(j))==sizeof(j) && File_WrBin(f,pVDI->blockmap,cbMap)==cbMap);
+      File_Close(f);
+      if (bOK) bOK = File_Replace(tmpfn,jfn);
+      if (!bOK) File_Erase(tmpfn);
+   }
+   if (bOK) pVDI->bJournaled = TRUE;
+   return bOK;
+}
+
+/*.....................................................*/
+
+static BOOL
+Checkpoint(PVDI pVDI)
+// Makes the blocks written so far durable, then records them in the journal (if any).
+// The order matters: the journal must never describe blocks which aren't on the disk.
+{
+   if (!SyncData(pVDI)) return FALSE;
+   return (!pVDI->bJournal || WriteJournal(pVDI));
+}
+
+/*.....................................................*/
+
+static BOOL
+WriteBlock(PVDI pVDI, void *buffer, UINT sid)
+// Writes image block sid, which may be a new block (sid==nBlocksAllocated-1) or a rewrite.
+// If there is an unbuffered handle and the buffer is aligned then the block goes through
+// that instead, so that it doesn't push other data out of the OS file cache.
+{
+   UINT BlockSize = pVDI->hdr.BlockSize;
+   HUGE pos = (((HUGE)sid)<<pVDI->BlockSizeShift) + pVDI->hdr.offset_Image;
+   if (pVDI->fd!=NULLFILE && (((UINT_PTR)buffer) & 4095)==0) {
+      if (File_WriteAt(pVDI->fd,buffer,BlockSize,pos)==BlockSize) return TRUE;
+      // most likely the image offset isn't a multiple of the sector size. That won't
+      // change, so stop trying.
+      File_Close(pVDI->fd);
+      pVDI->fd = NULLFILE;
+   }
+   return (File_WriteAt(pVDI->f,buffer,BlockSize,pos)==BlockSize);
+}
+
+/*.....................................................*/
+
+static BOOL
+ReadBlockAt(PVDI pVDI, void *buffer, UINT sid)
+{
+   UINT BlockSize = pVDI->hdr.BlockSize;
+   HUGE pos = (((HUGE)sid)<<pVDI->BlockSizeShift) + pVDI->hdr.offset_Image;
+   return (File_ReadAt(pVDI->f,buffer,BlockSize,pos)==BlockSize);
+}
+
+/*.....................................................*/
+
 PUBLIC BOOL
-VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, BOOL bAllZero)
+VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, UINT ZeroState)
 {
    LastError = VDIW_ERR_HANDLE;
    if (hVDI) {
@@ -530,32 +740,122 @@ VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, BOOL bAllZero)
             WriteHeader(pVDI);
          }
          if (LastError==0) {
+            if (iPage>=pVDI->iNextPage) pVDI->iNextPage = iPage+1;
             if (!buffer) {
                LastError = 0;
             } else if (!VDI_BLOCK_ALLOCATED(pVDI->blockmap[iPage])) {
-               if (bAllZero || AllZero(buffer,pVDI->hdr.BlockSize)) {
+               if (ZeroState==VDIW_ZERO_YES || (ZeroState==VDIW_ZERO_UNKNOWN && Mem_IsZero(buffer,pVDI->hdr.BlockSize))) {
                   pVDI->blockmap[iPage] = VDI_PAGE_ZERO;
                } else {
                   // we need to allocate and write a new block.
                   pVDI->blockmap[iPage] = pVDI->hdr.nBlocksAllocated;
                   pVDI->hdr.nBlocksAllocated++;
                   LastError = VDIW_ERR_WRITE;
-                  if (File_WrBin(pVDI->f,buffer,pVDI->hdr.BlockSize)==pVDI->hdr.BlockSize) {
+                  if (WriteBlock(pVDI,buffer,pVDI->blockmap[iPage])) {
                      LastError = 0;
+                     if ((pVDI->SyncMode==VDIW_FLAG_SYNC_CHECKPOINT || pVDI->bJournal) &&
+                         ++pVDI->nUnsynced>=pVDI->CheckpointBlocks) {
+                        if (!Checkpoint(pVDI)) LastError = VDIW_ERR_WRITE;
+                     }
                   }
+                  if (LastError) pVDI->bFailed = TRUE;
+               }
+            } else {
+               // an already allocated block is being rewritten, wherever the block map put it.
+               if (ZeroState==VDIW_ZERO_YES) Mem_Zero(buffer,pVDI->hdr.BlockSize);
+               if (!WriteBlock(pVDI,buffer,pVDI->blockmap[iPage])) LastError = VDIW_ERR_WRITE;
+            }
+         }
+      }
+   }
+   return (LastError==0);
+}
+
+/*.....................................................*/
+
+static UINT
+FreePage(PVDI pVDI, UINT iPage, UINT NewState)
+// Makes a page free or zero, keeping its block (if it had one) for reuse.
+{
+   UINT sid = pVDI->blockmap[iPage];
+   pVDI->blockmap[iPage] = NewState;
+   if (!VDI_BLOCK_ALLOCATED(sid)) return VDIW_UPDATE_MAPPED;
+   // neither list can overflow: VDIW_Open() checked that no two pages share a block.
+   pVDI->freelist[pVDI->nFree++] = sid;
+   pVDI->pending[pVDI->nPending++] = iPage;
+   return VDIW_UPDATE_FREED;
+}
+
+/*.....................................................*/
+
+static BOOL
+WriteMapEntry(PVDI pVDI, UINT iPage)
+{
+   HUGE pos = pVDI->hdr.offset_Blocks + ((HUGE)iPage)*sizeof(UINT);
+   return (File_WriteAt(pVDI->f,pVDI->blockmap+iPage,sizeof(UINT),pos)==sizeof(UINT));
+}
+
+/*.....................................................*/
+
+static BOOL
+CommitFrees(PVDI pVDI)
+// The block map on the disk still gives each released block to the page which released it,
+// so before any of those blocks is overwritten the new map entries of those pages have to
+// be on the disk. Otherwise a crash would leave the old map pointing a page at another
+// page's data. All pending entries are written together, with one flush.
+{
+   UINT i;
+   for (i=0; i<pVDI->nPending; i++) {
+      if (!WriteMapEntry(pVDI,pVDI->pending[i])) return FALSE;
+   }
+   if (pVDI->SyncMode && !SyncData(pVDI)) return FALSE; // write-through mode keeps the order anyway.
+   pVDI->nPending = 0;
+   return TRUE;
+}
+
+/*.....................................................*/
+
+PUBLIC BOOL
+VDIW_UpdatePage(HVDIW hVDI, void *buffer, UINT iPage, UINT ZeroState, UINT *pAction)
+{
+   *pAction = VDIW_UPDATE_SAME;
+   LastError = VDIW_ERR_HANDLE;
+   if (hVDI && ((PVDI)hVDI)->bUpdate) {
+      PVDI pVDI = (PVDI)hVDI;
+      LastError = VDIW_ERR_BLOCKNO;
+      if (iPage<pVDI->hdr.nBlocks) {
+         UINT sid = pVDI->blockmap[iPage];
+         LastError = 0;
+         if (!buffer) {
+            if (sid!=VDI_PAGE_FREE) *pAction = FreePage(pVDI,iPage,VDI_PAGE_FREE);
+         } else if (ZeroState==VDIW_ZERO_YES || (ZeroState==VDIW_ZERO_UNKNOWN && Mem_IsZero(buffer,pVDI->hdr.BlockSize))) {
+            if (sid!=VDI_PAGE_ZERO) *pAction = FreePage(pVDI,iPage,VDI_PAGE_ZERO);
+         } else if (VDI_BLOCK_ALLOCATED(sid)) {
+            LastError = VDIW_ERR_READ;
+            if (ReadBlockAt(pVDI,pVDI->scratch,sid)) {
+               LastError = 0;
+               if (Mem_Compare(buffer,pVDI->scratch,pVDI->hdr.BlockSize)!=0) {
+                  *pAction = VDIW_UPDATE_WRITTEN;
+                  if (!WriteBlock(pVDI,buffer,sid)) LastError = VDIW_ERR_WRITE;
                }
+            }
+         } else {
+            // a newly allocated page takes a released block if there is one. The page's own
+            // map entry only reaches the disk in VDIW_Close(), until then it stays unallocated.
+            *pAction = VDIW_UPDATE_WRITTEN;
+            if (pVDI->nFree && pVDI->nPending && !CommitFrees(pVDI)) {
+               LastError = VDIW_ERR_WRITE;
             } else {
-               // an already allocated block is being rewritten.
-               HUGE seekpos;
-               if (bAllZero) Mem_Zero(buffer,pVDI->hdr.BlockSize);
-               seekpos = (((HUGE)iPage)<<pVDI->BlockSizeShift);
-               seekpos += pVDI->hdr.offset_Image;
-               File_Seek(pVDI->f,seekpos);
-               File_Size(pVDI->f,&seekpos);
-               File_WrBin(pVDI->f,buffer,pVDI->hdr.BlockSize);
-               File_Seek(pVDI->f,seekpos);
+               if (pVDI->nFree) {
+                  sid = pVDI->freelist[--pVDI->nFree];
+               } else {
+                  sid = pVDI->hdr.nBlocksAllocated++;
+               }
+               if (!WriteBlock(pVDI,buffer,sid)) LastError = VDIW_ERR_WRITE;
+               pVDI->blockmap[iPage] = sid;
             }
          }
+         if (*pAction!=VDIW_UPDATE_SAME) pVDI->bChanged = TRUE;
       }
    }
    return (LastError==0);
@@ -563,6 +863,53 @@ VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, BOOL bAllZero)
 
 /*.....................................................*/
 
+static BOOL
+FillHoles(PVDI pVDI)
+// Moves blocks from the end of the image into the blocks which an update released and
+// didn't reuse, and reduces nBlocksAllocated to match. As in VDIW_UpdatePage(), the holes
+// are only written to once the map entries which released them are on the disk, and the
+// moved pages' entries are only written once their blocks are. If this fails part way
+// then the holes which are left are harmless, the file just isn't as small as it could be.
+{
+   UINT i,lo,hi,nMoved=0,*owner,*moved,nAlloc = pVDI->hdr.nBlocksAllocated;
+   BOOL bOK = TRUE;
+
+   if (!CommitFrees(pVDI)) return FALSE;
+   owner = Mem_Alloc(0,2*(nAlloc+1)*sizeof(UINT)); // the page using each block, then the pages moved.
+   if (!owner) return FALSE;
+   moved = owner+nAlloc+1;
+   for (i=0; i<nAlloc; i++) owner[i] = VDI_PAGE_FREE;
+   for (i=0; i<pVDI->hdr.nBlocks; i++) {
+      if (VDI_BLOCK_ALLOCATED(pVDI->blockmap[i])) owner[pVDI->blockmap[i]] = i;
+   }
+   lo = 0;
+   hi = nAlloc;
+   for (;;) {
+      while (hi && owner[hi-1]==VDI_PAGE_FREE) hi--;
+      while (lo<hi && owner[lo]!=VDI_PAGE_FREE) lo++;
+      if (lo>=hi) break;
+      hi--; // move the last block into the first hole.
+      if (!ReadBlockAt(pVDI,pVDI->scratch,hi) || !WriteBlock(pVDI,pVDI->scratch,lo)) {
+         hi++;
+         bOK = FALSE;
+         break;
+      }
+      pVDI->blockmap[owner[hi]] = lo;
+      moved[nMoved++] = owner[hi];
+      owner[lo] = owner[hi];
+      owner[hi] = VDI_PAGE_FREE;
+   }
+   // the old blocks stay in the file until VDIW_Close() has written the new header.
+   if (nMoved && pVDI->SyncMode && !SyncData(pVDI)) bOK = FALSE;
+   for (i=0; bOK && i<nMoved; i++) bOK = WriteMapEntry(pVDI,moved[i]);
+   pVDI->hdr.nBlocksAllocated = hi;
+   pVDI->nFree = 0;
+   Mem_Free(owner);
+   return bOK;
+}
+
+/*.....................................................*/
+
 PUBLIC HVDIW
 VDIW_Close(HVDIW hVDI)
 {
@@ -570,16 +917,42 @@ VDIW_Close(HVDIW hVDI)
    if (hVDI) { // we silently handle closing of an already closed file.
       // write final header and block map.
       PVDI pVDI = (PVDI)hVDI;
-      if (!pVDI->blockmap) {
-         if (!pVDI->blockmap) WriteHeader(pVDI); // source VDI was empty.
+      UINT cbMap = pVDI->hdr.nBlocks*sizeof(UINT);
+      BOOL bSynced;
+      HUGE size;
+      if (pVDI->bUpdate) {
+         if (pVDI->nFree && !FillHoles(pVDI)) LastError = VDIW_ERR_WRITE;
+         if (pVDI->bChanged && !pVDI->bModifySet) Mem_Copy(&pVDI->hdr.uuidModify,&pVDI->uuidFresh,sizeof(S_UUID));
+      }
+      // the header must never point at blocks which are not on the disk yet, so make the
+      // data durable first (write-through mode has done that already). If that fails then
+      // the header on the disk is left as it was.
+      bSynced = (!pVDI->SyncMode || !pVDI->blockmap || SyncData(pVDI));
+      if (pVDI->fd!=NULLFILE) File_Close(pVDI->fd);
+      if (!bSynced) {
+         LastError = VDIW_ERR_WRITE;
       } else {
-         File_Seek(pVDI->f, sizeof(VDI_PREHEADER));
-         File_WrBin(pVDI->f, &pVDI->hdr, sizeof(VDI_HEADER));
-         File_Seek(pVDI->f, pVDI->hdr.offset_Blocks);
-         File_WrBin(pVDI->f, pVDI->blockmap, pVDI->hdr.nBlocks*sizeof(UINT));
+         if (!pVDI->blockmap) {
+            WriteHeader(pVDI); // source VDI was empty.
+         } else if (File_WriteAt(pVDI->f, &pVDI->hdr, sizeof(VDI_HEADER), sizeof(VDI_PREHEADER))!=sizeof(VDI_HEADER) ||
+                    File_WriteAt(pVDI->f, pVDI->blockmap, cbMap, pVDI->hdr.offset_Blocks)!=cbMap) {
+            LastError = VDIW_ERR_WRITE;
+         }
+         // trim any space left over from VDIW_SetFileSize(). Only once the new block map
+         // is written, since the old one may still use blocks past the new end.
+         if (LastError==0) {
+            size = pVDI->hdr.nBlocksAllocated;
+            size = (size<<pVDI->BlockSizeShift) + pVDI->hdr.offset_Image;
+            File_SetSize(pVDI->f, size);
+         }
+         if (pVDI->SyncMode && !File_Flush(pVDI->f)) LastError = VDIW_ERR_WRITE;
       }
       File_Close(pVDI->f);
+      if (pVDI->bJournal && LastError==0) EraseJournal(pVDI);
       Mem_Free(pVDI->blockmap);
+      Mem_Free(pVDI->freelist);
+      Mem_Free(pVDI->pending);
+      Mem_FreeAligned(pVDI->scratch);
       Mem_Free(pVDI);
    }
    return NULL;
@@ -593,34 +966,197 @@ VDIW_Discard(HVDIW hVDI)
    LastError = 0;
    if (hVDI) { // we silently handle closing of an already closed file.
       PVDI pVDI = (PVDI)hVDI;
+      if (pVDI->bUpdate) return VDIW_Close(hVDI); // the VDI was there before, keep it.
+      if (pVDI->fd!=NULLFILE) File_Close(pVDI->fd);
       File_Close(pVDI->f);
       File_Erase(pVDI->fn);
+      if (pVDI->bJournal) EraseJournal(pVDI);
+      Mem_Free(pVDI->blockmap);
+      Mem_Free(pVDI);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+PUBLIC HVDIW
+VDIW_Suspend(HVDIW hVDI)
+{
+   LastError = 0;
+   if (hVDI) {
+      PVDI pVDI = (PVDI)hVDI;
+      if (!pVDI->bJournal || !pVDI->blockmap) return VDIW_Discard(hVDI);
+      // after a failed write the block map doesn't match the file, so keep the last journal.
+      if (!pVDI->bFailed && !Checkpoint(pVDI)) LastError = VDIW_ERR_WRITE;
+      if (!pVDI->bJournaled) return VDIW_Discard(hVDI); // nothing to resume from.
+      if (pVDI->fd!=NULLFILE) File_Close(pVDI->fd);
+      File_Close(pVDI->f);
+      Mem_Free(pVDI->blockmap);
+      Mem_Free(pVDI);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+static BOOL
+ReadJournal(PVDI pVDI, CPFN fn, UINT BlockSize, UINT nBlocks, void *key, UINT cbKey)
+// Loads and checks the journal for VDIW_Resume().
+{
+   VDIW_JOURNAL j;
+   FNCHAR jfn[FN_MAX];
+   UINT sum,cbMap = nBlocks*sizeof(UINT);
+   BOOL bOK = FALSE;
+   FILE f;
+
+   JournalName(jfn,fn);
+   f = File_OpenRead(jfn);
+   if (f==NULLFILE) return FALSE;
+   if (File_RdBin(f,&j,sizeof(j))==sizeof(j) && String_Compare(j.szSig,JOURNAL_SIG)==0 &&
+       cbKey<=VDIW_MAX_JOURNAL_KEY && j.cbKey==cbKey && Mem_Compare(j.key,key,cbKey)==0 &&
+       j.hdr.BlockSize==BlockSize && j.hdr.nBlocks==nBlocks) {
+      pVDI->blockmap = Mem_Alloc(0,cbMap);
+      if (pVDI->blockmap && File_RdBin(f,pVDI->blockmap,cbMap)==cbMap) {
+         sum = j.checksum;
+         j.checksum = 0;
+         bOK = (Checksum(Checksum(FNV_BASIS,&j,sizeof(j)),pVDI->blockmap,cbMap)==sum);
+      }
+   }
+   File_Close(f);
+   if (bOK) {
+      Mem_Copy(&pVDI->hdr,&j.hdr,sizeof(VDI_HEADER));
+      pVDI->iNextPage = j.iNextPage;
+   }
+   return bOK;
+}
+
+/*.....................................................*/
+
+PUBLIC HVDIW
+VDIW_Resume(CPFN fn, UINT BlockSize, UINT nBlocks, UINT flags, void *key, UINT cbKey, UINT *piNextPage)
+{
+   PVDI pVDI = Mem_Alloc(MEMF_ZEROINIT, sizeof(VDIW_INFO));
+   LastError = VDIW_ERR_NOMEM;
+   if (pVDI) {
+      LastError = VDIW_ERR_JOURNAL;
+      if (ReadJournal(pVDI,fn,BlockSize,nBlocks,key,cbKey)) {
+         FILE f = File_Create(fn,FileFlags(flags)|DJFILE_FLAG_OPENEXISTING);
+         if (f!=NULLFILE) {
+            HUGE pos,size;
+            // carry on appending after the last block the journal knows about, which must
+            // still be in the file.
+            pos = pVDI->hdr.nBlocksAllocated;
+            pos = (pos<<PowerOfTwo(BlockSize)) + pVDI->hdr.offset_Image;
+            File_Size(f,&size);
+            if (size>=pos) {
+               InitInfo(pVDI,fn,f,BlockSize,flags);
+               pVDI->bJournaled = TRUE;
+               *piNextPage = pVDI->iNextPage;
+               LastError = 0;
+               return (HVDIW)pVDI;
+            }
+            File_Close(f);
+         }
+      }
+      Mem_Free(pVDI->blockmap);
+      Mem_Free(pVDI);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+PUBLIC HVDIW
+VDIW_Open(CPFN fn, UINT BlockSize, UINT nBlocks, UINT flags)
+{
+   VDI_PREHEADER vph;
+   UINT i,cbMap;
+   BYTE *inuse;
+   PVDI pVDI;
+   FILE f;
+
+   flags &= (~VDIW_FLAG_JOURNAL); // an interrupted update is simply run again, see vdiw.h.
+   f = File_Create(fn,FileFlags(flags)|DJFILE_FLAG_OPENEXISTING|DJFILE_FLAG_READWRITE);
+   if (f==NULLFILE) {
+      UINT IOR = File_IOresult();
+      if (IOR == DJFILE_ERROR_ACCESS_DENIED) LastError = VDIW_ERR_ACCDENY;
+      else if (IOR == DJFILE_ERROR_WRITEPROTECT) LastError = VDIW_ERR_WPROTECT;
+      else LastError = VDIW_ERR_BADPATH;
+      return NULL;
+   }
+   LastError = VDIW_ERR_NOMEM;
+   pVDI = Mem_Alloc(MEMF_ZEROINIT, sizeof(VDIW_INFO));
+   if (pVDI) {
+      InitInfo(pVDI,fn,f,BlockSize,flags);
+      pVDI->bUpdate = TRUE;
+      LastError = VDIW_ERR_NOTSAME;
+      if (File_RdBin(f,&vph,sizeof(vph))==sizeof(vph) && vph.u32Signature==VDI_SIGNATURE &&
+          File_RdBin(f,&pVDI->hdr,sizeof(VDI_HEADER))==sizeof(VDI_HEADER) &&
+          pVDI->hdr.cbSize==sizeof(VDI_HEADER) && pVDI->hdr.vdi_type==VDI_TYPE_DYNAMIC &&
+          pVDI->hdr.BlockSize==BlockSize && pVDI->hdr.nBlocks==nBlocks && pVDI->hdr.cbBlockExtra==0 &&
+          pVDI->hdr.nBlocksAllocated<=nBlocks) {
+         cbMap = nBlocks*sizeof(UINT);
+         pVDI->blockmap = Mem_Alloc(0,cbMap);
+         pVDI->freelist = Mem_Alloc(0,(pVDI->hdr.nBlocksAllocated+1)*sizeof(UINT));
+         pVDI->pending = Mem_Alloc(0,(pVDI->hdr.nBlocksAllocated+1)*sizeof(UINT));
+         pVDI->scratch = Mem_AllocAligned(BlockSize);
+         inuse = Mem_Alloc(MEMF_ZEROINIT,(pVDI->hdr.nBlocksAllocated>>3)+1);
+         LastError = VDIW_ERR_NOMEM;
+         if (pVDI->blockmap && pVDI->freelist && pVDI->pending && pVDI->scratch && inuse) {
+            LastError = VDIW_ERR_NOTSAME;
+            if (File_ReadAt(f,pVDI->blockmap,cbMap,pVDI->hdr.offset_Blocks)==cbMap) {
+               // a block map which points past the end would wreck FillHoles(), and one where two
+               // pages share a block would overflow the free list (see FreePage()).
+               for (i=0; i<nBlocks; i++) {
+                  UINT sid = pVDI->blockmap[i];
+                  if (!VDI_BLOCK_ALLOCATED(sid)) continue;
+                  if (sid>=pVDI->hdr.nBlocksAllocated || (inuse[sid>>3] & (1<<(sid&7)))) break;
+                  inuse[sid>>3] |= (BYTE)(1<<(sid&7));
+               }
+               if (i==nBlocks) LastError = 0;
+            }
+         }
+         Mem_Free(inuse);
+      }
+      if (!LastError) return (HVDIW)pVDI;
+      if (pVDI->fd!=NULLFILE) File_Close(pVDI->fd);
       Mem_Free(pVDI->blockmap);
+      Mem_Free(pVDI->freelist);
+      Mem_Free(pVDI->pending);
+      Mem_FreeAligned(pVDI->scratch);
       Mem_Free(pVDI);
    }
+   File_Close(f);
    return NULL;
 }
 
 /*.....................................................*/
 
 PUBLIC BOOL
-VDIW_SetFileSize(HVDIW hVDI, UINT nBlocks)
+VDIW_SetJournalKey(HVDIW hVDI, void *key, UINT cbKey)
 {
    LastError = VDIW_ERR_HANDLE;
-   if (hVDI) {
-      /*
+   if (hVDI && cbKey<=VDIW_MAX_JOURNAL_KEY) {
       PVDI pVDI = (PVDI)hVDI;
-      HUGE pos,old_pos;
+      Mem_Copy(pVDI->key,key,cbKey);
+      pVDI->cbKey = cbKey;
+      LastError = 0;
+   }
+   return (LastError==0);
+}
 
-      File_GetPos(pVDI->f, &old_pos);
+/*.....................................................*/
 
-      pos = nBlocks;
-      hugeop_shl(pos,pos,pVDI->BlockSizeShift);
-      hugeop_adduint(pos,pos,pVDI->hdr.offset_Image);
-      File_Seek(pVDI->f, pos);
-      SetEndOfFile(pVDI->f);
-      File_Seek(pVDI->f, old_pos);
-      */
+PUBLIC BOOL
+VDIW_SetCheckpoint(HVDIW hVDI, UINT nMB)
+{
+   LastError = VDIW_ERR_HANDLE;
+   if (hVDI) {
+      PVDI pVDI = (PVDI)hVDI;
+      if (nMB==0) nMB = VDIW_DEFAULT_CHECKPOINT_MB;
+      if (pVDI->BlockSizeShift>=20) pVDI->CheckpointBlocks = (nMB>>(pVDI->BlockSizeShift-20));
+      else pVDI->CheckpointBlocks = (nMB<<(20-pVDI->BlockSizeShift));
+      if (pVDI->CheckpointBlocks==0) pVDI->CheckpointBlocks = 1;
       LastError = 0;
    }
    return (LastError==0);
@@ -628,5 +1164,28 @@ VDIW_SetFileSize(HVDIW hVDI, UINT nBlocks)
 
 /*.....................................................*/
 
+PUBLIC BOOL
+VDIW_SetFileSize(HVDIW hVDI, UINT nBlocks, BOOL bKeepSize)
+{
+   LastError = VDIW_ERR_HANDLE;
+   if (hVDI) {
+      PVDI pVDI = (PVDI)hVDI;
+      HUGE size;
+
+      // WriteHeader() may still move the image offset by up to 4K to align the boot partition.
+      size = nBlocks;
+      size = (size<<pVDI->BlockSizeShift) + pVDI->hdr.offset_Image + 4096;
+      LastError = VDIW_ERR_WRITE;
+      if (bKeepSize) {
+         if (File_Reserve(pVDI->f, size)) LastError = 0;
+      } else {
+         if (File_SetSize(pVDI->f, size)) LastError = 0;
+      }
+   }
+   return (LastError==0);
+}
+
+/*.....................................................*/
+
 /* end of module vdiw.c */
 
@@ -26,6 +26,9 @@ typedef struct {UINT dummy;} *HVDIW;
 #define VDIW_ERR_NOMEM    7 /* ran out of memory */
 #define VDIW_ERR_WRITE    8 /* I/O error on write */
 #define VDIW_ERR_BLOCKNO  9 /* The write block number is more than the maximum set at creation time */
+#define VDIW_ERR_JOURNAL 10 /* no resume journal was found, or it doesn't match (see VDIW_Resume()) */
+#define VDIW_ERR_READ    11 /* I/O error reading back an existing VDI (see VDIW_UpdatePage()) */
+#define VDIW_ERR_NOTSAME 12 /* existing VDI isn't a dynamic VDI with the expected geometry (see VDIW_Open()) */
 
 UINT VDIW_GetLastError(void);
 /* All of the functions in this module set an error code to provide
@@ -40,10 +43,24 @@ PSTR VDIW_GetErrorString(UINT nErr);
  * (this will return NULL if lasterror is 0).
  */
 
-HVDIW VDIW_Create(CPFN fn, UINT BlockSize, UINT nBlocks, UINT nBlocksUsed);
+// flags for VDIW_Create().
+#define VDIW_FLAG_DIRECTIO         1 /* write blocks around the OS file cache, see below */
+#define VDIW_FLAG_SYNC_CHECKPOINT  2 /* no write-through, flush every so often and at close */
+#define VDIW_FLAG_SYNC_END         4 /* no write-through, flush only at close */
+#define VDIW_FLAG_JOURNAL          8 /* keep a resume journal at each checkpoint, see VDIW_Resume() */
+#define VDIW_FLAG_NOPROMPT        16 /* if the file exists then fail with VDIW_ERR_EXISTS, don't ask */
+#define VDIW_FLAG_OVERWRITE       32 /* if the file exists then overwrite it, don't ask */
+#define VDIW_SYNC_FLAGS            (VDIW_FLAG_SYNC_CHECKPOINT|VDIW_FLAG_SYNC_END)
+
+#define VDIW_DEFAULT_CHECKPOINT_MB 1024
+#define VDIW_MAX_JOURNAL_KEY       256
+
+HVDIW VDIW_Create(CPFN fn, UINT BlockSize, UINT nBlocks, UINT nBlocksUsed, UINT flags);
 /* Creates a VDI file, creating internal data structures that allow us to access
  * its contents efficiently. This function will prompt the user for confirmation
- * if the file exists already, and return NULL if the user refuses.
+ * if the file exists already, and return NULL if the user refuses. The
+ * VDIW_FLAG_NOPROMPT and VDIW_FLAG_OVERWRITE flags answer the question in advance,
+ * for callers which must not show a message box at that point.
  *
  *   fn          - Name of VDI file to create (including path).
  *   BlockSize   - The size of a VDI block. Must be a power of 2, 512 or greater. In fact please stick to
@@ -52,6 +69,26 @@ HVDIW VDIW_Create(CPFN fn, UINT BlockSize, UINT nBlocks, UINT nBlocksUsed);
  *   nBlocksUsed - The number of blocks you intend to allocate during creation (by calling VDIW_WritePage).
  *                 (This argument is only used to check disk space requirements, you are not strongly
  *                 committed to writing exactly that number of pages).
+ *   flags       - VDIW_FLAG_xxx flags. With VDIW_FLAG_DIRECTIO the blocks are written through a
+ *                 second, unbuffered, handle, so that a big clone doesn't flush everything else out
+ *                 of the OS file cache. The header and block map still go through the normal handle.
+ *                 Only buffers from Mem_AllocAligned() are written unbuffered, and if the volume
+ *                 rejects the first unbuffered write (image offset not sector aligned) then the
+ *                 writer quietly goes back to buffered writes.
+ *
+ *                 The durability policy is also set here. By default the file is opened in
+ *                 write-through mode, so each block is on the disk before the next is written.
+ *                 VDIW_FLAG_SYNC_CHECKPOINT instead lets Windows cache the writes and flushes them
+ *                 every so often (see VDIW_SetCheckpoint()), VDIW_FLAG_SYNC_END flushes only in
+ *                 VDIW_Close(). Either way VDIW_Close() flushes the data before it writes the final
+ *                 header and block map, and flushes again afterwards, so a crash never leaves a
+ *                 header which points at blocks that didn't make it to the disk.
+ *
+ *                 With VDIW_FLAG_JOURNAL the writer also saves a small journal file next to the
+ *                 VDI (the VDI name plus ".journal") at every checkpoint, after flushing the data.
+ *                 The journal holds the header, the block map so far and the next page to write,
+ *                 so that an interrupted job can carry on with VDIW_Resume(). This flag implies
+ *                 checkpoints whatever the durability policy, VDIW_Close() deletes the journal.
  *
  * Returns handle to internal data structures if successful. Success indicates
  * that the file was created - nothing is written to it yet. This function creates
@@ -68,10 +105,84 @@ BOOL VDIW_SetDriveUUID(HANDLE hVDI, S_UUID *drvuuid);
 BOOL VDIW_SetDriveUUIDs(HANDLE hVDI, S_UUID *uuid, S_UUID *modifyUUID);
 BOOL VDIW_SetParentUUIDs(HANDLE hVDI, S_UUID *parentUUID, S_UUID *parentModifyUUID);
 
-BOOL VDIW_SetFileSize(HVDIW hVDI, UINT nBlocks);
+BOOL VDIW_SetCheckpoint(HVDIW hVDI, UINT nMB);
+/* Sets how many MB of blocks may be written between flushes when the VDI was created with
+ * the VDIW_FLAG_SYNC_CHECKPOINT flag (0 means VDIW_DEFAULT_CHECKPOINT_MB). Has no effect
+ * with the other durability policies.
+ */
+
+BOOL VDIW_SetJournalKey(HVDIW hVDI, void *key, UINT cbKey);
+/* Sets the data which identifies the job to the resume journal (VDIW_FLAG_JOURNAL). This
+ * is opaque to this module, it is simply stored in the journal and compared by VDIW_Resume().
+ * The caller would normally put the source identity and any options which affect the output
+ * in here. cbKey can be up to VDIW_MAX_JOURNAL_KEY bytes.
+ */
+
+HVDIW VDIW_Resume(CPFN fn, UINT BlockSize, UINT nBlocks, UINT flags, void *key, UINT cbKey, UINT *piNextPage);
+/* Reopens a partly written VDI whose journal was left behind by a crash or by VDIW_Suspend().
+ * The journal must be intact and must match BlockSize, nBlocks and the key (see above),
+ * otherwise this returns NULL with error VDIW_ERR_JOURNAL and the caller should start again
+ * with VDIW_Create(). On success *piNextPage receives the first page which still needs to
+ * be written: pages below that were written before the journal was saved, and the caller
+ * should not pass them to VDIW_WritePage() again. Anything written after the last journal
+ * is forgotten and will be overwritten. The flags are as for VDIW_Create() and should
+ * normally include VDIW_FLAG_JOURNAL. Call VDIW_SetJournalKey() again after this.
+ */
+
+HVDIW VDIW_Open(CPFN fn, UINT BlockSize, UINT nBlocks, UINT flags);
+/* Opens an existing dynamic VDI (normally one which this module wrote earlier), so that it
+ * can be brought up to date with VDIW_UpdatePage(). The VDI must have the given block size
+ * and block count, otherwise this fails with error VDIW_ERR_NOTSAME. The flags are as for
+ * VDIW_Create(), except that VDIW_FLAG_JOURNAL is ignored. The header is left as it is,
+ * except that VDIW_Close() gives the VDI a new modify UUID if any page changed (unless
+ * VDIW_SetDriveUUIDs() sets one).
+ *
+ * Changed pages are rewritten in place, so an update which is interrupted leaves a VDI with
+ * some pages old and some new (and the page being written when it stopped may be half
+ * written). A block is never reused until the block map entry which released it is on the
+ * disk, and a page's new map entry is only written once its data is, so the block map never
+ * gives a page another page's data. Running the update again finishes the job, since every
+ * page is compared again.
+ */
+
+// values returned in *pAction by VDIW_UpdatePage().
+#define VDIW_UPDATE_SAME    0 /* the page was already up to date */
+#define VDIW_UPDATE_WRITTEN 1 /* the page data was rewritten, or the page was newly allocated */
+#define VDIW_UPDATE_FREED   2 /* the page became free or zero, releasing a block of the file */
+#define VDIW_UPDATE_MAPPED  3 /* the page switched between free and zero, only the block map changed */
+
+BOOL VDIW_UpdatePage(HVDIW hVDI, void *buffer, UINT iPage, UINT ZeroState, UINT *pAction);
+/* The VDIW_Open() equivalent of VDIW_WritePage(). Pass buffer=NULL for a page which is no
+ * longer in use (not allocated, or unused by the guest). A page whose block is allocated
+ * in the VDI is read back and compared, and only rewritten if it differs. A page which
+ * became zero or unused releases its block, and those blocks are reused for pages which
+ * weren't allocated before, after the released map entries have been written and flushed
+ * (one flush covers all of the blocks released so far). Any blocks still unused at the end
+ * are filled by moving blocks from the end of the file in VDIW_Close(), which then
+ * truncates the file. Pages may be
+ * passed in any order, but each page only once. *pAction receives a VDIW_UPDATE_xxx code.
+ */
+
+HVDIW VDIW_Suspend(HVDIW hVDI);
+/* Alternative to VDIW_Discard() for a journaled VDI: saves a final journal and closes the
+ * file without deleting it, so that the job can be resumed later. If the file never got
+ * as far as its first journal then it is discarded instead.
+ */
+
+HUGE VDIW_FileSize(UINT BlockSize, UINT nBlocks, UINT nBlocksUsed);
+/* Returns the size which VDIW_Create() with the same arguments would need on disk once
+ * nBlocksUsed blocks have been written (possibly up to 4K over). Lets a caller size a
+ * clone without creating anything.
+ */
+
+BOOL VDIW_SetFileSize(HVDIW hVDI, UINT nBlocks, BOOL bKeepSize);
 /* This function causes the output file to be immediately extended to its expected final
- * size. This hopefully eliminates the cluster allocation overhead while writing the
- * VDI.
+ * size, assuming nBlocks blocks will be allocated. This eliminates the cluster allocation
+ * overhead while writing the VDI, and lets the filesystem lay the file out in a few large
+ * extents instead of growing it 1MB at a time. If bKeepSize is TRUE then the disk space is
+ * only reserved and the file size is left alone (needs Vista or later). VDIW_Close()
+ * trims the file to its true size, so an overestimate costs nothing. Call this before
+ * writing the first page. Failure is harmless, the VDI just grows as it is written.
  */
 
 BOOL VDIW_FixMBR(HVDIW hVDI, BYTE *MBR);
@@ -81,7 +192,12 @@ BOOL VDIW_FixMBR(HVDIW hVDI, BYTE *MBR);
  * also fix other MBR problems.
  */
 
-BOOL VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, BOOL bAllZero);
+// values for the ZeroState argument of VDIW_WritePage().
+#define VDIW_ZERO_UNKNOWN 0 /* caller hasn't checked the block, VDIW_WritePage() will */
+#define VDIW_ZERO_YES     1 /* caller knows the block is filled with zeros */
+#define VDIW_ZERO_NO      2 /* caller already checked, the block is not all zeros */
+
+BOOL VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, UINT ZeroState);
 /* Writes one page (block) to the destination VDI. If this is the first page write then
  * this also causes an implied write of the header structures. Returns TRUE on success,
  * call GetLastError() if the return value is FALSE.
@@ -91,16 +207,21 @@ BOOL VDIW_WritePage(HVDIW hVDI, void *buffer, UINT iPage, BOOL bAllZero);
  *
  * This function need not be called for unallocated blocks. If you pass a block which is
  * filled with zeros then it is not written, instead a zero block marker is set in the
- * block map. If you know in advance that the block is zero filled then you can save
- * processing time by passing TRUE in the bAllZero argument.
+ * block map. If you already know whether the block is zero filled then you can save
+ * processing time by passing VDIW_ZERO_YES or VDIW_ZERO_NO in the ZeroState argument,
+ * otherwise pass VDIW_ZERO_UNKNOWN and the block will be checked here.
  */
 
 HVDIW VDIW_Close(HVDIW hVDI);
-/* Finishes up and then closes the newly created VDI file.
+/* Finishes up and then closes the newly created VDI file. Always returns NULL, so the
+ * caller must check VDIW_GetLastError() afterwards: if that isn't zero then the final
+ * header, the block map or the last flush failed, and the VDI can't be trusted. The
+ * resume journal (if any) is only deleted when the close succeeded.
  */
 
 HVDIW VDIW_Discard(HVDIW hVDI);
-/* Closes and discards the new file. Typically performed after an error.
+/* Closes and discards the new file. Typically performed after an error. A VDI opened with
+ * VDIW_Open() is never deleted, this just closes it like VDIW_Close().
  */
 
 /*----------------------------------------------------------------------*/
@@ -5,6 +5,8 @@
 /*================================================================================*/
 
 #include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
 #include "djtypes.h"
 #include "vhdr.h"
 #include "vhdstructs.h"
@@ -27,7 +29,16 @@
 #define VHDR_ERR_BLOCKMAP     ((VDD_TYPE_VHD<<16)+9)
 #define VHDR_ERR_SHARE        ((VDD_TYPE_VHD<<16)+10)
 
-static UINT OSLastError;
+static __declspec(thread) UINT OSLastError;
+
+// what the sector bitmap of a dynamic block says. The bitmaps are read on demand, a batch
+// of blocks at a time, and only those with a mix of written and unwritten sectors are kept.
+#define VHD_BM_UNKNOWN 0 /* bitmap not read yet */
+#define VHD_BM_FULL    1 /* every sector was written (or the bitmap could not be read) */
+#define VHD_BM_EMPTY   2 /* no sector was written */
+#define VHD_BM_PARTIAL 3 /* some were, see bitmap[] */
+
+#define VHD_BM_BATCH   64 /* bitmaps read at once, in blocks */
 
 typedef struct {
    CLASS(VDDR) Base;
@@ -35,6 +46,7 @@ typedef struct {
    VHD_DYN_HEADER hdr;
    HVDDR hVDIparent;
    FILE f;
+   FILE fa; // second handle on the same file, for the async reads used by LocatePage() callers.
    UINT nBlocks;
    UINT nBlocksAllocated;
    UINT BlockSize;
@@ -43,6 +55,10 @@ typedef struct {
    UINT SectorsPerBitmap;
    int  PageReadResult;
    UINT *blockmap;
+   BYTE *bmstate;     // VHD_BM_xxx for each block, NULL if there was no memory for it.
+   BYTE **bitmap;     // sector bitmap for each VHD_BM_PARTIAL block, NULL for the others.
+   UINT BitmapBytes;  // bytes of the bitmap which cover the block, the rest is padding.
+   CRITICAL_SECTION csBitmap; // the planner asks about blocks from several threads.
 } VHD_INFO, *PVHD;
 
 // localization strings
@@ -116,7 +132,7 @@ PUBLIC PSTR
 VHDR_GetErrorString(UINT nErr)
 {
    PSTR pszErr;
-   static char sz[256];
+   static __declspec(thread) char sz[256];
    if (nErr==0xFFFFFFFF) nErr = VDDR_LastError;
    if (nErr==VHDR_ERR_NONE) pszErr=RSTR(OK);
    else {
@@ -162,21 +178,6 @@ VHDR_GetErrorString(UINT nErr)
 
 /*.....................................................*/
 
-static UINT
-DoSeek(FILE f, HUGE pos)
-{
-   HUGE currpos;
-   UINT err = 0;
-   if (File_GetPos(f,&currpos)==0xFFFFFFFF) err = File_IOresult();
-   else if (pos!=currpos) {
-      File_Seek(f,pos);
-      err = File_IOresult();
-   }
-   return err;
-}
-
-/*.....................................................*/
-
 static UINT
 Checksum(BYTE *pb, UINT nb)
 {
@@ -215,11 +216,7 @@ ReadFooter(FILE f, VHD_FOOTER *ftr)
       HUGE fsize;
       bMustBeFixed = TRUE;
       File_Size(f,&fsize);
-      VDDR_LastError = VHDR_ERR_SEEK;
-      File_Seek(f, fsize-512);
-      if (File_IOresult()) return FALSE;
-      VDDR_LastError = VHDR_ERR_READ;
-      if (File_RdBin(f, ftr, sizeof(VHD_FOOTER)) != sizeof(VHD_FOOTER)) return FALSE;
+      if (File_ReadAt(f, ftr, sizeof(VHD_FOOTER), fsize-512) != sizeof(VHD_FOOTER)) return FALSE;
       if (!HasFooterSig(ftr)) {
          /* ok, not the last sector either. Really old VHDs had 511 byte footers - so try that instead. */
          Mem_Move(ftr, ((PSTR)ftr)+1, sizeof(VHD_FOOTER)-1);
@@ -314,6 +311,94 @@ ValidateMap(PVHD pVHD)
 
 /*.....................................................*/
 
+static _inline BOOL
+SectorWritten(BYTE *bitmap, UINT iSector)
+// Sector 0 of a block is the most significant bit of the first bitmap byte.
+{
+   return ((bitmap[iSector>>3] & (0x80>>(iSector&7)))!=0);
+}
+
+/*.....................................................*/
+
+static UINT
+ClassifyBitmap(PVHD pVHD, BYTE *bitmap)
+{
+   UINT i,nFull=0,nEmpty=0,n=pVHD->BitmapBytes;
+   BYTE mask = (BYTE)(pVHD->SectorsPerBlock<8 ? (0xFF00>>pVHD->SectorsPerBlock) : 0xFF);
+   for (i=0; i<n; i++) {
+      BYTE b = (BYTE)(bitmap[i] & mask);
+      if (b==mask) nFull++;
+      else if (b==0) nEmpty++;
+      else return VHD_BM_PARTIAL;
+   }
+   if (nFull==n) return VHD_BM_FULL;
+   if (nEmpty==n) return VHD_BM_EMPTY;
+   return VHD_BM_PARTIAL;
+}
+
+/*.....................................................*/
+
+static void
+LoadBitmaps(PVHD pVHD, UINT iBlock)
+// Reads the sector bitmaps of the allocated blocks in the batch which holds iBlock. Must be
+// called inside the critical section. A bitmap which can't be read, or kept, makes the block
+// VHD_BM_FULL, which is how every block was treated before the bitmaps were looked at.
+{
+   UINT i,iEnd,SID;
+   BYTE *buf = Mem_Alloc(0,pVHD->BitmapBytes);
+
+   i = iBlock & (~(VHD_BM_BATCH-1));
+   iEnd = i+VHD_BM_BATCH;
+   if (iEnd>pVHD->nBlocks) iEnd = pVHD->nBlocks;
+   for (; i<iEnd; i++) {
+      if (pVHD->bmstate[i]!=VHD_BM_UNKNOWN) continue;
+      SID = pVHD->blockmap[i];
+      pVHD->bmstate[i] = VHD_BM_FULL;
+      if (SID==VHD_PAGE_FREE || !buf) continue;
+      if (File_ReadAt(pVHD->f, buf, pVHD->BitmapBytes, ((HUGE)SID)<<9)!=pVHD->BitmapBytes) continue;
+      pVHD->bmstate[i] = (BYTE)ClassifyBitmap(pVHD,buf);
+      if (pVHD->bmstate[i]==VHD_BM_PARTIAL) {
+         pVHD->bitmap[i] = buf;
+         buf = Mem_Alloc(0,pVHD->BitmapBytes);
+      }
+   }
+   Mem_Free(buf);
+}
+
+/*.....................................................*/
+
+static int
+SectorState(PVHD pVHD, UINT iBlock, UINT SectorOffset, UINT nSectors, UINT *pnRun)
+// Returns VDDR_RSLT_NORMAL if sector SectorOffset of allocated block iBlock was ever written,
+// VDDR_RSLT_NOTALLOC if it wasn't. *pnRun gets the number of sectors, starting from that one
+// and up to nSectors, which are in the same state.
+{
+   UINT state = VHD_BM_FULL;
+   BYTE *bitmap = NULL;
+   BOOL bWritten;
+   UINT i;
+
+   *pnRun = nSectors;
+   if (pVHD->bmstate) {
+      EnterCriticalSection(&pVHD->csBitmap);
+      if (pVHD->bmstate[iBlock]==VHD_BM_UNKNOWN) LoadBitmaps(pVHD,iBlock);
+      state = pVHD->bmstate[iBlock];
+      bitmap = pVHD->bitmap[iBlock];
+      LeaveCriticalSection(&pVHD->csBitmap);
+   }
+   if (state==VHD_BM_FULL) return VDDR_RSLT_NORMAL;
+   if (state==VHD_BM_EMPTY) return VDDR_RSLT_NOTALLOC;
+
+   bWritten = SectorWritten(bitmap,SectorOffset);
+   for (i=1; i<nSectors; i++) {
+      if (SectorWritten(bitmap,SectorOffset+i)!=bWritten) break;
+   }
+   *pnRun = i;
+   return (bWritten ? VDDR_RSLT_NORMAL : VDDR_RSLT_NOTALLOC);
+}
+
+/*.....................................................*/
+
 PUBLIC HVDDR
 VHDR_Open(CPFN fn, UINT iChain)
 {
@@ -329,6 +414,7 @@ VHDR_Open(CPFN fn, UINT iChain)
          if (ftr.u32DiskType==VHD_TYPE_FIXED || ftr.u32DiskType==VHD_TYPE_DYNAMIC || ftr.u32DiskType==VHD_TYPE_DIFFERENCING) {
             pVHD = Mem_Alloc(MEMF_ZEROINIT,sizeof(VHD_INFO));
             pVHD->f = f;
+            InitializeCriticalSection(&pVHD->csBitmap);
             Mem_Copy(&pVHD->ftr, &ftr, sizeof(ftr));
 
             pVHD->Base.GetDriveType       = VHDR_GetDriveType;
@@ -340,6 +426,9 @@ VHDR_Open(CPFN fn, UINT iChain)
             pVHD->Base.ReadPage           = VHDR_ReadPage;
             pVHD->Base.ReadSectors        = VHDR_ReadSectors;
             pVHD->Base.Close              = VHDR_Close;
+            pVHD->Base.LocatePage         = VHDR_LocatePage;
+            pVHD->Base.ReadPages          = VHDR_ReadPages;
+            pVHD->fa = NULLFILE;
 
             if (pVHD->ftr.u32DiskType == VHD_TYPE_FIXED) {
                pVHD->BlockSize = 0;
@@ -364,19 +453,20 @@ VHDR_Open(CPFN fn, UINT iChain)
                pVHD->blockmap = Mem_Alloc(0, mapsize);
                VDDR_LastError = VHDR_ERR_OUTOFMEM;
                if (pVHD->blockmap) {
-                  VDDR_LastError = VHDR_ERR_SEEK;
-                  File_Seek(pVHD->f, pVHD->hdr.u64TableOffset);
-                  OSLastError = File_IOresult();
-                  if (OSLastError==0) {
-                     VDDR_LastError = VHDR_ERR_READ;
-                     if (File_RdBin(pVHD->f, pVHD->blockmap, mapsize)==mapsize) {
-                        pVHD->SectorsPerBitmap = ((pVHD->SectorsPerBlock+4095)>>12);
-                        VDDR_LastError = VHDR_ERR_BLOCKMAP;
-                        if (ValidateMap(pVHD)) VDDR_LastError = 0;
-                        pVHD->hdr.u32Reserved = pVHD->nBlocksAllocated; // put here so ShowHeader can access it.
-                     } else {
-                        OSLastError = File_IOresult();
-                     }
+                  VDDR_LastError = VHDR_ERR_READ;
+                  if (File_ReadAt(pVHD->f, pVHD->blockmap, mapsize, pVHD->hdr.u64TableOffset)==mapsize) {
+                     pVHD->SectorsPerBitmap = ((pVHD->SectorsPerBlock+4095)>>12);
+                     VDDR_LastError = VHDR_ERR_BLOCKMAP;
+                     if (ValidateMap(pVHD)) VDDR_LastError = 0;
+                     pVHD->hdr.u32Reserved = pVHD->nBlocksAllocated; // put here so ShowHeader can access it.
+
+                     // without memory for the bitmap tables, every allocated block is treated as fully written.
+                     pVHD->BitmapBytes = ((pVHD->SectorsPerBlock+7)>>3);
+                     pVHD->bmstate = Mem_Alloc(MEMF_ZEROINIT, pVHD->nBlocks);
+                     pVHD->bitmap  = Mem_Alloc(MEMF_ZEROINIT, pVHD->nBlocks*sizeof(BYTE*));
+                     if (!pVHD->bitmap) pVHD->bmstate = Mem_Free(pVHD->bmstate);
+                  } else {
+                     OSLastError = File_IOresult();
                   }
                }
             } else if (VDDR_LastError==0) {
@@ -390,8 +480,13 @@ VHDR_Open(CPFN fn, UINT iChain)
             }
 
             if (VDDR_LastError) {
+               Mem_Free(pVHD->bmstate);
+               Mem_Free(pVHD->bitmap);
                Mem_Free(pVHD->blockmap);
+               DeleteCriticalSection(&pVHD->csBitmap);
                pVHD = Mem_Free(pVHD);
+            } else {
+               pVHD->fa = File_OpenReadAsync(fn); // failure is not an error, LocatePage() just won't help.
             }
          }
       }
@@ -450,37 +545,38 @@ VHDR_GetHeader(HVDDR pThis, VHD_FOOTER *vhdf, VHD_DYN_HEADER *vhdh)
 /*.....................................................*/
 
 static int
-RawReadPage(PVHD pVHD, void *buffer, UINT iPage, UINT SectorOffset, UINT length)
+RawReadPage(PVHD pVHD, void *buffer, UINT iPage, UINT SectorOffset, UINT nSectors, UINT *pnRun)
 // Read a block/page using the native block size. This is an internal
 // function, so there's very little parameter checking. The calling
-// app must ensure that length<(native blocksize) and SectorOffset+length
-// does not go beyond the length of a block. Note that "blocks" don't
-// really apply to fixed VHDs, but we imagine they exist anyway...
+// app must ensure that SectorOffset+nSectors does not go beyond the
+// length of a block. Note that "blocks" don't really apply to fixed
+// VHDs, but we imagine they exist anyway... Only the first *pnRun
+// sectors are read: that many sectors share the block's sector bitmap
+// state, so they are either all read from this file or all not allocated.
 {
+   *pnRun = nSectors;
    VDDR_LastError = VHDR_ERR_INVBLOCK;
    if (iPage<pVHD->nBlocks) {
-      UINT SID;
+      UINT SID,length;
 
       VDDR_LastError = 0;
 
       if (pVHD->ftr.u32DiskType==VHD_TYPE_DYNAMIC || pVHD->ftr.u32DiskType==VHD_TYPE_DIFFERENCING) {
          SID = pVHD->blockmap[iPage];
          if (SID==VHD_PAGE_FREE) return VDDR_RSLT_NOTALLOC;
+         if (SectorState(pVHD,iPage,SectorOffset,nSectors,pnRun)==VDDR_RSLT_NOTALLOC) return VDDR_RSLT_NOTALLOC;
          SID += pVHD->SectorsPerBitmap;
       } else {
          SID = 0;
       }
+      length = ((*pnRun)<<9);
 
-      VDDR_LastError = VHDR_ERR_SEEK;
-      OSLastError = DoSeek(pVHD->f, (((HUGE)SID)+SectorOffset)<<9);
-      if (OSLastError==0) {
-         VDDR_LastError = VHDR_ERR_READ;
-         if (File_RdBin(pVHD->f, buffer, length)==length) {
-            VDDR_LastError = 0;
-            return VDDR_RSLT_NORMAL;
-         }
-         OSLastError = File_IOresult();
+      VDDR_LastError = VHDR_ERR_READ;
+      if (File_ReadAt(pVHD->f, buffer, length, (((HUGE)SID)+SectorOffset)<<9)==length) {
+         VDDR_LastError = 0;
+         return VDDR_RSLT_NORMAL;
       }
+      OSLastError = File_IOresult();
    }
    return VDDR_RSLT_FAIL;
 }
@@ -515,12 +611,12 @@ VHDR_ReadSectors(HVDDR pThis, void *buffer, HUGE LBA, UINT nSectors)
 
       while (nSectors) {
          SectorsToCopy = (SectorsLeft<=nSectors ? SectorsLeft : nSectors);
+         pVHD->PageReadResult = RawReadPage(pVHD, pDest, iPage, SectorOffset, SectorsToCopy, &SectorsToCopy);
          nSectors -= SectorsToCopy;
          BytesToCopy = (SectorsToCopy<<9);
 
-         pVHD->PageReadResult = RawReadPage(pVHD, pDest, iPage, SectorOffset, BytesToCopy);
          if (pVHD->PageReadResult==VDDR_RSLT_NOTALLOC && pVHD->hVDIparent) {
-            // reading from unallocated page in snapshot child: pass read request to parent.
+            // reading from unallocated page (or unwritten sectors) in snapshot child: pass read request to parent.
             pVHD->PageReadResult = pVHD->hVDIparent->ReadSectors(pVHD->hVDIparent,pDest,LBA,SectorsToCopy);
          }
          if (pVHD->PageReadResult == VDDR_RSLT_FAIL) return VDDR_RSLT_FAIL;
@@ -528,10 +624,14 @@ VHDR_ReadSectors(HVDDR pThis, void *buffer, HUGE LBA, UINT nSectors)
          if (rslt>pVHD->PageReadResult) rslt = pVHD->PageReadResult;
          pDest += BytesToCopy;
          LBA += SectorsToCopy;
-         SectorOffset = 0;
-         iPage++;
-         if (iPage==pVHD->nBlocks) return rslt; // return with partial result when we reach EOF.
-         SectorsLeft = pVHD->SectorsPerBlock;
+         SectorOffset += SectorsToCopy;
+         SectorsLeft -= SectorsToCopy;
+         if (SectorsLeft==0) { // on to the next block.
+            SectorOffset = 0;
+            iPage++;
+            if (iPage==pVHD->nBlocks) return rslt; // return with partial result when we reach EOF.
+            SectorsLeft = pVHD->SectorsPerBlock;
+         }
       }
       return rslt;
    }
@@ -597,18 +697,24 @@ static UINT
 BlockUsed(PVHD pVHD, HUGE LBA_start, HUGE LBA_end)
 {
    if (pVHD->ftr.u32DiskType==VHD_TYPE_DYNAMIC || pVHD->ftr.u32DiskType==VHD_TYPE_DIFFERENCING) {
-      UINT SID,LastSID, SPB;
+      UINT SID,LastSID,SPB,first,last,nRun;
       SID = LO32(LBA_start>>pVHD->SPBshift);   // convert first sector LBA into VHD block number.
       LastSID = LO32(LBA_end>>pVHD->SPBshift); // convert last sector LBA into a VHD block number.
       SPB = 1<<pVHD->SPBshift;
       for (; SID<=LastSID; SID++) {            // we now have a range of VHD blocks to test.
          if (SID>=pVHD->nBlocks) break;
-         if (pVHD->blockmap[SID]!=VHD_PAGE_FREE) return 1;
-         else if (pVHD->hVDIparent) {
-            UINT blks = pVHD->hVDIparent->BlockStatus(pVHD->hVDIparent,LBA_start,LBA_start+(SPB-1));
+         // the sectors of the range which fall in this block.
+         first = (UINT)(LBA_start & (SPB-1));
+         last  = (SID==LastSID ? (UINT)(LBA_end & (SPB-1)) : SPB-1);
+         if (pVHD->blockmap[SID]!=VHD_PAGE_FREE) {
+            // the block is used unless the sector bitmap says none of those sectors were written.
+            if (SectorState(pVHD,SID,first,last-first+1,&nRun)==VDDR_RSLT_NORMAL || nRun<=last-first) return 1;
+         }
+         if (pVHD->hVDIparent) {
+            UINT blks = pVHD->hVDIparent->BlockStatus(pVHD->hVDIparent,LBA_start,LBA_start+(last-first));
             if (blks==VDDR_RSLT_NORMAL) return blks;
          }
-         LBA_start += SPB;
+         LBA_start += (SPB-first);
       }
    } else if (LBA_start<pVHD->SectorsPerBlock) { // flat file
       return 1;
@@ -625,7 +731,15 @@ VHDR_Close(HVDDR pThis)
    if (pThis) { // we silently handle closing of an already closed file.
       PVHD pVHD = (PVHD)pThis;
       File_Close(pVHD->f);
+      if (pVHD->fa!=NULLFILE) File_Close(pVHD->fa);
+      if (pVHD->bitmap) {
+         UINT i;
+         for (i=0; i<pVHD->nBlocks; i++) Mem_Free(pVHD->bitmap[i]);
+         Mem_Free(pVHD->bitmap);
+      }
+      Mem_Free(pVHD->bmstate);
       Mem_Free(pVHD->blockmap);
+      DeleteCriticalSection(&pVHD->csBitmap);
       Mem_Free(pVHD);
    }
    return NULL;
@@ -666,4 +780,68 @@ VHDR_QuickGetUUID(CPFN fn, S_UUID *UUID)
 
 /*....................................................*/
 
+static int
+PageLocation(HVDDR pThis, UINT iPage, UINT SPBshift, FILE *pf, HUGE *pos)
+// Shared by LocatePage() and ReadPages(): finds the byte offset of a page in this file.
+// Pages which straddle a native block, or the end of the drive, or which have a mix of
+// written and unwritten sectors, give VDDR_RSLT_INDIRECT. Note that a free page (or one
+// with no written sectors) gives VDDR_RSLT_NOTALLOC even in a snapshot, the caller must
+// check for a parent.
+{
+   PVHD pVHD = (PVHD)pThis;
+   HUGE LBA = (((HUGE)iPage)<<SPBshift);
+
+   *pf = pVHD->f;
+   if (pVHD->ftr.u32DiskType==VHD_TYPE_FIXED) {
+      // the whole drive is one contiguous block, starting at file offset 0.
+      if ((LBA+(((HUGE)1)<<SPBshift))>pVHD->SectorsPerBlock) return VDDR_RSLT_INDIRECT;
+      *pos = (LBA<<9);
+   } else {
+      UINT iBlock,SectorOffset,SID,nRun;
+
+      if (SPBshift>pVHD->SPBshift) return VDDR_RSLT_INDIRECT;
+      iBlock = (iPage>>(pVHD->SPBshift-SPBshift));
+      if (iBlock>=pVHD->nBlocks) return VDDR_RSLT_INDIRECT;
+      SectorOffset = (UINT)(LBA & (pVHD->SectorsPerBlock-1));
+
+      SID = pVHD->blockmap[iBlock];
+      if (SID==VHD_PAGE_FREE) return VDDR_RSLT_NOTALLOC;
+      if (SectorState(pVHD,iBlock,SectorOffset,1<<SPBshift,&nRun)==VDDR_RSLT_NOTALLOC) {
+         return (nRun==(1U<<SPBshift) ? VDDR_RSLT_NOTALLOC : VDDR_RSLT_INDIRECT);
+      }
+      if (nRun<(1U<<SPBshift)) return VDDR_RSLT_INDIRECT;
+      *pos = ((((HUGE)SID)+pVHD->SectorsPerBitmap+SectorOffset)<<9);
+   }
+   return VDDR_RSLT_NORMAL;
+}
+
+/*....................................................*/
+
+PUBLIC int
+VHDR_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt)
+{
+   PVHD pVHD = (PVHD)pThis;
+   int rslt;
+
+   VDDR_LastError = 0;
+   if (pVHD->fa==NULLFILE) return VDDR_RSLT_INDIRECT;
+   rslt = PageLocation(pThis,iPage,SPBshift,&pExt->f,&pExt->pos);
+   if (rslt==VDDR_RSLT_NOTALLOC && pVHD->hVDIparent) {
+      if (pVHD->hVDIparent->LocatePage) return pVHD->hVDIparent->LocatePage(pVHD->hVDIparent,iPage,SPBshift,pExt);
+      return VDDR_RSLT_INDIRECT;
+   }
+   pExt->f = pVHD->fa;
+   return rslt;
+}
+
+/*....................................................*/
+
+PUBLIC int
+VHDR_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults)
+{
+   return VDDR_ReadPageRuns(pThis,buffer,iPage,nPages,SPBshift,pResults,PageLocation,VHDR_ERR_READ,&OSLastError);
+}
+
+/*....................................................*/
+
 /* end of module vhdr.c */
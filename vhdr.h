@@ -79,6 +79,16 @@ HVDDR VHDR_Close(HVDDR pThis);
  * when the file was opened.
  */
 
+int  VHDR_LocatePage(HVDDR pThis, UINT iPage, UINT SPBshift, VDDR_EXTENT *pExt);
+/* Returns the file position of a page instead of reading it, see the LocatePage
+ * method in vddr.h.
+ */
+
+int  VHDR_ReadPages(HVDDR pThis, void *buffer, UINT iPage, UINT nPages, UINT SPBshift, int *pResults);
+/* Reads a run of pages, see the ReadPages method in vddr.h. Pages which are stored
+ * consecutively in the VHD file are read together.
+ */
+
 BOOL VHDR_QuickGetUUID(CPFN fn, S_UUID *UUID);
 /* Allows the image UUID to be extracted without fully opening the VHD, i.e. without
  * resolving the snapshot chain.
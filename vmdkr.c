@@ -6,9 +6,12 @@
 
 /* Instance of VDDR class to handle reading of VMDK files */
 #include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
 #include "djtypes.h"
 #include "vmdkr.h"
 #include "vmdkstructs.h"
+#include "vmdkz.h"
 #include "mem.h"
 #include "djstring.h"
 #include "djfile.h"
@@ -36,7 +39,38 @@
 #define VMDKR_ERR_COMPRESSION   ((VDD_TYPE_VMDK<<16)+15)
 #define VMDKR_ERR_NOEXTENT      ((VDD_TYPE_VMDK<<16)+16)
 
-static UINT OSLastError;
+static __declspec(thread) UINT OSLastError;
+
+#define VMDK_GT_CACHE_KB  1024 /* most memory the grain table cache of one extent may use */
+#define VMDK_GT_MIN_SLOTS 8
+
+#define GT_UNKNOWN 0 /* grain table not read yet */
+#define GT_EMPTY   1 /* no grain is stored (including when the extent has no grain table here) */
+#define GT_FULL    2 /* every grain is stored */
+#define GT_PARTIAL 3 /* some are, the grain table has to be looked at */
+
+#define NO_GT   0xFFFFFFFF
+#define NO_SLOT 0xFFFFFFFF
+
+typedef struct {
+   UINT iGT;     // grain table held in the slot, or NO_GT.
+   UINT tUsed;   // use stamp, the smallest is evicted first.
+} GT_SLOT;
+
+typedef struct t_GRAINDIR {
+   HBUDGET hBudget;      // budget the grain table cache is charged to.
+   CRITICAL_SECTION cs;  // guards everything below, reads come from several threads.
+   UINT  nGTs;
+   UINT  GTEntries;      // grain table entries per grain table.
+   UINT  MaxSID;         // size of the extent file in sectors, a GTE at or past this is corrupt.
+   UINT  *gd;            // the grain directory: sector of each grain table, 0 if there isn't one.
+   BYTE  *gtstate;       // GT_xxx for each grain table, this outlives the table's stay in the cache.
+   UINT  *gtslot;        // cache slot holding each grain table, or NO_SLOT.
+   UINT  nSlots;
+   GT_SLOT *slot;
+   UINT  *gt;            // nSlots grain tables.
+   UINT  tNow;
+} GRAINDIR, *PGRAINDIR;
 
 typedef struct {
    CLASS(VDDR) Base;
@@ -49,8 +83,6 @@ typedef struct {
    VMDK_EXTENT extent[VMDK_MAX_EXTENTS]; // actually variable length
 } VMDK_INFO, *PVMDK;
 
-static BYTE *Template_MBR; // binary data (RCDATA) loaded from resource file.
-
 // localization strings
 static PSTR pszOK          /* = "Ok" */;
 static PSTR pszUNKERROR    /* = "Unknown Error" */;
@@ -68,7 +100,7 @@ static PSTR pszVDNODESC    /* = "VMDK incomplete - disk descriptor not found" */
 static PSTR pszVDINVDESC   /* = "Invalid VMDK disk descriptor" */;
 static PSTR pszVDBADVER    /* = "VMDK version number was not recognized" */;
 static PSTR pszVDMISSING   /* = "Required parameters are missing from the VMDK descriptor" */;
-static PSTR pszVDERRCOMP   /* = "Compressed VMDKs are not currently supported" */;
+static PSTR pszVDERRCOMP   /* = "This VMDK uses a compression algorithm which is not supported" */;
 static PSTR pszVDNOEXTENT  /* = "A descriptor referenced extent file is missing (renamed?)" */;
 
 /*.....................................................*/
@@ -101,7 +133,7 @@ PUBLIC PSTR
 VMDKR_GetErrorString(UINT nErr)
 {
    PSTR pszErr;
-   static char sz[256];
+   static __declspec(thread) char sz[256];
    if (nErr==0xFFFFFFFF) nErr = VDDR_LastError;
    if (nErr==VMDKR_ERR_NONE) pszErr=RSTR(OK);
    else {
@@ -165,21 +197,6 @@ VMDKR_GetErrorString(UINT nErr)
 
 /*.....................................................*/
 
-static UINT
-DoSeek(FILE f, HUGE pos)
-{
-   HUGE currpos;
-   UINT err = 0;
-   if (File_GetPos(f,&currpos)==0xFFFFFFFF) err = File_IOresult();
-   else if (pos!=currpos) {
-      File_Seek(f,pos);
-      err = File_IOresult();
-   }
-   return err;
-}
-
-/*.....................................................*/
-
 static UINT
 ReadTextLine(PSTR *ppsz, PSTR pszEnd, PSTR sz)
 {
@@ -567,6 +584,7 @@ ReadDescriptor(FILE f, UINT *bytes, BOOL *bEmbedded)
 // returns a pointer to the descriptor text buffer.
 {
    HUGE fsize;
+   HUGE pos = 0;
    PSTR pMem;
 
    *bEmbedded = FALSE;
@@ -586,13 +604,13 @@ ReadDescriptor(FILE f, UINT *bytes, BOOL *bEmbedded)
          VDDR_LastError = VMDKR_ERR_NODESCRIP;
          return NULL;
       }
-      File_Seek(f,hdr.descriptorOffset<<9);
+      pos = (hdr.descriptorOffset<<9);
       *bytes = LO32(hdr.descriptorSize<<9);
       *bEmbedded = TRUE;
    }
    VDDR_LastError = VMDKR_ERR_READ;
    pMem = Mem_Alloc(MEMF_ZEROINIT, *bytes);
-   if (File_RdBin(f,pMem,*bytes) != *bytes) OSLastError = File_IOresult();
+   if (File_ReadAt(f,pMem,*bytes,pos) != *bytes) OSLastError = File_IOresult();
    else {
       VDDR_LastError = 0;
       return pMem;
@@ -627,7 +645,6 @@ ParseDescriptor(VMDK_HEADER **ppvhdr, PSTR pMem, UINT bytes)
    if (VDDR_LastError==0) {
       if (((*ppvhdr)->flags & VMDK_HEADER_MUST_HAVE)!=VMDK_HEADER_MUST_HAVE) VDDR_LastError=VMDKR_ERR_MISSINGFIELDS;
       else if ((*ppvhdr)->version != VMDK_FORMAT_VER) VDDR_LastError=VMDKR_ERR_BADVERSION;
-      else if ((*ppvhdr)->CreateType==VMDK_CRTYPE_STREAMOPT) VDDR_LastError=VMDKR_ERR_COMPRESSION;
    }
    return (VDDR_LastError==0);
 }
@@ -648,7 +665,7 @@ ValidateMap(PEXTENT pe)
    nAlloc = nFree = 0;
    for (i=0; i<pe->nBlocks; i++) {
       sid = pe->blockmap[i];
-      if (sid == VMDK_PAGE_FREE) nFree++;
+      if (sid == VMDK_PAGE_FREE || sid == VMDK_GTE_ZEROED) nFree++; // a zeroed grain takes no space either.
       else if (sid<nSectors) nAlloc++;
       else {
          return FALSE; // SID out of range.
@@ -660,6 +677,322 @@ ValidateMap(PEXTENT pe)
 
 /*.....................................................*/
 
+static PGRAINDIR
+CloseGrainDir(PGRAINDIR pGD)
+// Frees a grain directory and its cache. Always returns NULL.
+{
+   if (pGD) {
+      DeleteCriticalSection(&pGD->cs);
+      if (pGD->gt) {
+         Mem_Free(pGD->gt);
+         Mem_Uncharge(pGD->hBudget,pGD->nSlots*pGD->GTEntries*sizeof(UINT));
+      }
+      Mem_Free(pGD->slot);
+      Mem_Free(pGD->gtslot);
+      Mem_Free(pGD->gtstate);
+      Mem_Free(pGD->gd);
+      Mem_Free(pGD);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+static BOOL
+OpenGrainDir(PEXTENT pe)
+// Reads the grain directory of a sparse extent whose grains aren't compressed. The grain
+// tables are only read when one of the grains they map is first asked about, into a cache
+// of at most VMDK_GT_CACHE_KB, so opening even a 2TB extent costs one small read. The grain
+// tables needn't be contiguous, or in any particular order.
+{
+   PGRAINDIR pGD;
+   UINT i,gdsize,GTBytes;
+   HUGE fsize;
+
+   VDDR_LastError = VMDKR_ERR_BADFORMAT;
+   if (pe->hdr.numGTEsPerGT==0 || pe->nBlocks==0) return FALSE;
+
+   VDDR_LastError = VMDKR_ERR_OUTOFMEM;
+   pGD = pe->pGD = Mem_Alloc(MEMF_ZEROINIT, sizeof(GRAINDIR));
+   if (!pGD) return FALSE;
+   InitializeCriticalSection(&pGD->cs);
+   pGD->GTEntries = pe->hdr.numGTEsPerGT;
+   pGD->nGTs = (pe->nBlocks + (pGD->GTEntries-1)) / pGD->GTEntries;
+   File_Size(pe->f,&fsize);
+   fsize >>= 9;
+   pGD->MaxSID = (fsize>0xFFFFFFFF ? 0xFFFFFFFF : LO32(fsize));
+
+   gdsize = pGD->nGTs*sizeof(UINT);
+   pGD->gd = Mem_Alloc(0, gdsize);
+   pGD->gtstate = Mem_Alloc(MEMF_ZEROINIT, pGD->nGTs);
+   pGD->gtslot = Mem_Alloc(0, pGD->nGTs*sizeof(UINT));
+   if (!pGD->gd || !pGD->gtstate || !pGD->gtslot) return FALSE;
+
+   VDDR_LastError = VMDKR_ERR_READ;
+   if (File_ReadAt(pe->f, pGD->gd, gdsize, pe->hdr.gdOffset<<9)!=gdsize) {
+      OSLastError = File_IOresult();
+      return FALSE;
+   }
+   VDDR_LastError = VMDKR_ERR_BLOCKMAP;
+   for (i=0; i<pGD->nGTs; i++) {
+      if (pGD->gd[i]>=pGD->MaxSID) return FALSE; // GT out of range.
+      if (pGD->gd[i]==0) pGD->gtstate[i] = GT_EMPTY;
+      pGD->gtslot[i] = NO_SLOT;
+   }
+
+   // settle for fewer slots if the memory budget won't run to the full cache.
+   GTBytes = pGD->GTEntries*sizeof(UINT);
+   pGD->nSlots = (VMDK_GT_CACHE_KB<<10) / GTBytes;
+   if (pGD->nSlots<VMDK_GT_MIN_SLOTS) pGD->nSlots = VMDK_GT_MIN_SLOTS;
+   if (pGD->nSlots>pGD->nGTs) pGD->nSlots = pGD->nGTs;
+   VDDR_LastError = VMDKR_ERR_OUTOFMEM;
+   pGD->hBudget = Mem_GetThreadBudget();
+   for (;;) {
+      if (Mem_Charge(pGD->hBudget,pGD->nSlots*GTBytes)) {
+         pGD->gt = Mem_Alloc(0,pGD->nSlots*GTBytes);
+         if (pGD->gt) break;
+         Mem_Uncharge(pGD->hBudget,pGD->nSlots*GTBytes);
+      }
+      if (pGD->nSlots<=VMDK_GT_MIN_SLOTS) return FALSE;
+      pGD->nSlots >>= 1;
+   }
+   pGD->slot = Mem_Alloc(0,pGD->nSlots*sizeof(GT_SLOT));
+   if (!pGD->slot) return FALSE;
+   for (i=0; i<pGD->nSlots; i++) {
+      pGD->slot[i].iGT = NO_GT;
+      pGD->slot[i].tUsed = 0;
+   }
+
+   // Counting the allocated grains would mean reading every grain table. Grains are appended
+   // to the file after the metadata, so the file size gives the count closely enough for the
+   // header display.
+   fsize = (fsize>pe->hdr.overHead ? (fsize-pe->hdr.overHead)>>pe->SPBshift : 0);
+   pe->nBlocksAllocated = (fsize<pe->nBlocks ? LO32(fsize) : pe->nBlocks);
+   VDDR_LastError = 0;
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static UINT *
+GrainTable(PEXTENT pe, UINT iGT)
+// Returns the cached copy of grain table iGT, reading it into the least recently used slot if
+// it isn't in the cache. Returns NULL, with VDDR_LastError set, if the grain table couldn't be
+// read or maps grains outside the file. Call with the grain directory lock held.
+{
+   PGRAINDIR pGD = pe->pGD;
+   UINT iSlot = pGD->gtslot[iGT];
+
+   if (iSlot==NO_SLOT) {
+      UINT i,nEntries,nStored,nFree,*gt;
+
+      iSlot = 0;
+      for (i=1; i<pGD->nSlots; i++) {
+         if (pGD->slot[i].tUsed<pGD->slot[iSlot].tUsed) iSlot = i;
+      }
+      if (pGD->slot[iSlot].iGT!=NO_GT) pGD->gtslot[pGD->slot[iSlot].iGT] = NO_SLOT;
+      pGD->slot[iSlot].iGT = NO_GT;
+
+      // the last grain table may map past the end of the extent, that part of it is ignored.
+      nEntries = pe->nBlocks - iGT*pGD->GTEntries;
+      if (nEntries>pGD->GTEntries) nEntries = pGD->GTEntries;
+      gt = pGD->gt + iSlot*pGD->GTEntries;
+      Mem_Zero(gt, pGD->GTEntries*sizeof(UINT));
+      VDDR_LastError = VMDKR_ERR_READ;
+      if (File_ReadAt(pe->f, gt, nEntries*sizeof(UINT), ((HUGE)pGD->gd[iGT])<<9)!=nEntries*sizeof(UINT)) {
+         OSLastError = File_IOresult();
+         return NULL;
+      }
+
+      nStored = nFree = 0;
+      for (i=0; i<nEntries; i++) {
+         if (gt[i]==VMDK_PAGE_FREE) nFree++;
+         else if (gt[i]==VMDK_GTE_ZEROED) continue;
+         else if (gt[i]<pGD->MaxSID) nStored++;
+         else {
+            VDDR_LastError = VMDKR_ERR_BLOCKMAP; // SID out of range.
+            return NULL;
+         }
+      }
+      if (nFree==nEntries) pGD->gtstate[iGT] = GT_EMPTY;
+      else if (nStored==nEntries) pGD->gtstate[iGT] = GT_FULL;
+      else pGD->gtstate[iGT] = GT_PARTIAL;
+
+      pGD->slot[iSlot].iGT = iGT;
+      pGD->gtslot[iGT] = iSlot;
+      VDDR_LastError = 0;
+   }
+   pGD->slot[iSlot].tUsed = ++pGD->tNow;
+   return pGD->gt + iSlot*pGD->GTEntries;
+}
+
+/*.....................................................*/
+
+static BOOL
+GrainSector(PEXTENT pe, UINT iGrain, UINT *pSID)
+// Looks up the grain table entry for grain iGrain: VMDK_PAGE_FREE, VMDK_GTE_ZEROED, or else
+// the sector the grain starts at. Returns FALSE if the grain table couldn't be read.
+{
+   PGRAINDIR pGD = pe->pGD;
+   UINT iGT = iGrain/pGD->GTEntries;
+   BOOL bOK = TRUE;
+
+   *pSID = VMDK_PAGE_FREE;
+   EnterCriticalSection(&pGD->cs);
+   if (pGD->gtstate[iGT]!=GT_EMPTY) {
+      UINT *gt = GrainTable(pe,iGT);
+      if (gt) *pSID = gt[iGrain-iGT*pGD->GTEntries];
+      else bOK = FALSE;
+   }
+   LeaveCriticalSection(&pGD->cs);
+   return bOK;
+}
+
+/*.....................................................*/
+
+static UINT
+GrainStatus(PEXTENT pe, UINT iGrain)
+// Returns VDDR_RSLT_NORMAL if grain iGrain is stored, VDDR_RSLT_BLANKPAGE if it is a zeroed
+// grain, or VDDR_RSLT_NOTALLOC if it is neither. Where the grain table summary already has the
+// answer no grain table is read, so a scan of a big, mostly empty extent stays cheap.
+{
+   UINT SID;
+
+   if (pe->blockmap) {
+      SID = pe->blockmap[iGrain];
+   } else {
+      PGRAINDIR pGD = pe->pGD;
+      UINT iGT = iGrain/pGD->GTEntries;
+
+      EnterCriticalSection(&pGD->cs);
+      if (pGD->gtstate[iGT]==GT_EMPTY) {
+         SID = VMDK_PAGE_FREE;
+      } else if (pGD->gtstate[iGT]==GT_FULL) {
+         LeaveCriticalSection(&pGD->cs);
+         return VDDR_RSLT_NORMAL;
+      } else {
+         UINT *gt = GrainTable(pe,iGT);
+         if (!gt) { // let the read report the problem.
+            LeaveCriticalSection(&pGD->cs);
+            return VDDR_RSLT_NORMAL;
+         }
+         SID = gt[iGrain-iGT*pGD->GTEntries];
+      }
+      LeaveCriticalSection(&pGD->cs);
+   }
+   if (SID==VMDK_PAGE_FREE) return VDDR_RSLT_NOTALLOC;
+   if (SID==VMDK_GTE_ZEROED) return VDDR_RSLT_BLANKPAGE;
+   return VDDR_RSLT_NORMAL;
+}
+
+/*.....................................................*/
+
+static BOOL
+ReadGrainTables(PEXTENT pe, HUGE gdOffset)
+// Fills in the block map of a stream optimized extent from its grain directory and grain
+// tables. Unlike a normal sparse extent, the grain tables here are scattered through the
+// file, each one written after the grains it maps.
+{
+   UINT i,nGTs,nEntries,gdsize,*gd;
+   BOOL bOK = FALSE;
+
+   if (pe->hdr.numGTEsPerGT==0) return FALSE;
+   nGTs = (pe->nBlocks + (pe->hdr.numGTEsPerGT-1)) / pe->hdr.numGTEsPerGT;
+   gdsize = nGTs*sizeof(UINT);
+   gd = Mem_Alloc(0,gdsize);
+   if (gd) {
+      if (File_ReadAt(pe->f, gd, gdsize, gdOffset<<9)==gdsize) {
+         for (i=0; i<nGTs; i++) {
+            nEntries = pe->nBlocks - i*pe->hdr.numGTEsPerGT;
+            if (nEntries>pe->hdr.numGTEsPerGT) nEntries = pe->hdr.numGTEsPerGT;
+            if (gd[i]==0) continue; // no grain table, so none of its grains are stored.
+            if (File_ReadAt(pe->f, pe->blockmap+i*pe->hdr.numGTEsPerGT, nEntries*sizeof(UINT), ((HUGE)gd[i])<<9)!=nEntries*sizeof(UINT)) break;
+         }
+         bOK = (i==nGTs);
+      }
+      if (!bOK) OSLastError = File_IOresult();
+      Mem_Free(gd);
+   }
+   return bOK;
+}
+
+/*.....................................................*/
+
+static BOOL
+ScanMarkers(PEXTENT pe)
+// Builds the block map of a stream optimized extent by walking the markers from the
+// first grain to the end of stream marker. Slower than reading the grain tables, but
+// works on a stream which was cut off before its grain directory was written.
+{
+   VMDK_MARKER mk;
+   HUGE pos,fsize;
+
+   File_Size(pe->f,&fsize);
+   pos = (pe->hdr.overHead<<9);
+   while (pos+512<=fsize) {
+      if (File_ReadAt(pe->f, &mk, sizeof(mk), pos)!=sizeof(mk)) {
+         OSLastError = File_IOresult();
+         return FALSE;
+      }
+      if (mk.size) { // a grain.
+         UINT iGrain = (UINT)(mk.val>>pe->SPBshift);
+         if (iGrain<pe->nBlocks && (mk.val & (pe->SectorsPerBlock-1))==0) pe->blockmap[iGrain] = (UINT)(pos>>9);
+         pos += ((((HUGE)mk.size)+12+511) & (~((HUGE)511)));
+      } else if (mk.type==VMDK_MARKER_EOS) {
+         break;
+      } else if (mk.type==VMDK_MARKER_GT || mk.type==VMDK_MARKER_GD || mk.type==VMDK_MARKER_FOOTER) {
+         pos += ((mk.val+1)<<9);
+      } else {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/*.....................................................*/
+
+static BOOL
+OpenStreamExtent(PEXTENT pe)
+// Builds the block map of an extent with compressed grains, and creates the grain reader.
+{
+   HUGE gdOffset = pe->hdr.gdOffset;
+   BOOL bMapped = FALSE;
+
+   VDDR_LastError = VMDKR_ERR_COMPRESSION;
+   if (pe->hdr.compressAlgorithm!=VMDK_COMPRESSION_DEFLATE || pe->hdr.compressAlgorithmHi!=0) return FALSE;
+
+   if (gdOffset==VMDK_GD_AT_END) {
+      // the real header is the footer, which is in the second last sector (the last one is
+      // the end of stream marker).
+      VMDK_SPARSE_HEADER ftr;
+      HUGE fsize;
+      File_Size(pe->f,&fsize);
+      gdOffset = 0;
+      if (fsize>=1536 && File_ReadAt(pe->f, &ftr, sizeof(ftr), fsize-1024)==sizeof(ftr) &&
+          ftr.magic==VMDK_MAGIC_NUM && ftr.gdOffset!=VMDK_GD_AT_END) gdOffset = ftr.gdOffset;
+   }
+   VDDR_LastError = VMDKR_ERR_READ;
+   if (gdOffset) bMapped = ReadGrainTables(pe,gdOffset);
+   if (!bMapped && (pe->hdr.flags & VMDK_FLAG_MARKERS)) {
+      Mem_Zero(pe->blockmap, pe->nBlocks*sizeof(UINT));
+      bMapped = ScanMarkers(pe);
+   }
+   if (!bMapped) return FALSE;
+
+   // zeroed grains stay in the map, so that they read as blank pages which hide the
+   // parent, the same as in an uncompressed sparse extent (see RawReadPage()).
+   VDDR_LastError = VMDKR_ERR_BLOCKMAP;
+   if (!ValidateMap(pe)) return FALSE;
+
+   VDDR_LastError = VMDKR_ERR_OUTOFMEM;
+   pe->hGrains = VMDKZ_Create(pe->f, pe->blockmap, pe->nBlocks, pe->SectorsPerBlock);
+   if (!pe->hGrains) return FALSE;
+   VDDR_LastError = 0;
+   return TRUE;
+}
+
+/*.....................................................*/
+
 static BOOL
 OpenExtent(CPFN fn, PVMDKED ped, VMDK_EXTENT *pe)
 {
@@ -678,42 +1011,24 @@ OpenExtent(CPFN fn, PVMDKED ped, VMDK_EXTENT *pe)
       if (ped->type==VMDK_EXT_TYPE_SPARSE) {
          VDDR_LastError = VMDKR_ERR_READ;
          if (File_RdBin(pe->f, &pe->hdr, sizeof(VMDK_SPARSE_HEADER))==sizeof(VMDK_SPARSE_HEADER)) {
-            VDDR_LastError = VMDKR_ERR_COMPRESSION;
-            if (pe->hdr.compressAlgorithm==0 && pe->hdr.compressAlgorithmHi==0) {
-               UINT mapsize;
-
-               pe->SectorsPerBlock = pe->hdr.grainSize;  // VMDK spec says that a sparse extent grain/block size is always a power of 2, >=4096.
-               pe->SPBshift = PowerOfTwo(pe->SectorsPerBlock);
-               pe->nBlocks = (pe->ExtentSize + (pe->SectorsPerBlock-1)) >> pe->SPBshift;
-               pe->nBlocksAllocated = 0; // TBD by ValidateMap.
-
-               mapsize = pe->nBlocks*sizeof(UINT);
-               pe->blockmap = Mem_Alloc(0, mapsize);
+            UINT mapsize;
+
+            pe->SectorsPerBlock = pe->hdr.grainSize;  // VMDK spec says that a sparse extent grain/block size is always a power of 2, >=4096.
+            pe->SPBshift = PowerOfTwo(pe->SectorsPerBlock);
+            pe->nBlocks = (pe->ExtentSize + (pe->SectorsPerBlock-1)) >> pe->SPBshift;
+            pe->nBlocksAllocated = 0; // TBD by ValidateMap.
+
+            mapsize = pe->nBlocks*sizeof(UINT);
+            VDDR_LastError = VMDKR_ERR_BADFORMAT;
+            if (pe->SPBshift==0xFFFFFFFF) {
+               // a grain size of zero, nothing more can be done with this extent.
+            } else if (pe->hdr.compressAlgorithm || pe->hdr.compressAlgorithmHi || (pe->hdr.flags & VMDK_FLAG_COMPRESSED)) {
+               // stream optimized (or otherwise compressed) extent.
+               pe->blockmap = Mem_Alloc(MEMF_ZEROINIT, mapsize);
                VDDR_LastError = VMDKR_ERR_OUTOFMEM;
-               if (pe->blockmap) {
-                  VDDR_LastError = VMDKR_ERR_SEEK;
-                  File_Seek(pe->f, pe->hdr.gdOffset<<9);
-                  OSLastError = File_IOresult();
-                  if (OSLastError==0) {
-                     HUGE gtoffset=0;
-                     VDDR_LastError = VMDKR_ERR_READ;
-                     if (File_RdBin(pe->f, &gtoffset, 4)==4) {
-                        VDDR_LastError = VMDKR_ERR_SEEK;
-                        File_Seek(pe->f, gtoffset<<9);
-                        OSLastError = File_IOresult();
-                        if (OSLastError==0) {
-                           VDDR_LastError = VMDKR_ERR_READ;
-                           if (File_RdBin(pe->f, pe->blockmap, mapsize)==mapsize) {
-                              VDDR_LastError = VMDKR_ERR_BLOCKMAP;
-                              if (ValidateMap(pe)) VDDR_LastError = 0;
-                           } else {
-                              OSLastError = File_IOresult();
-                           }
-                        }
-                     }
-                  }
-                  if (VDDR_LastError) pe->blockmap = Mem_Free(pe->blockmap);
-               }
+               if (pe->blockmap && !OpenStreamExtent(pe)) pe->blockmap = Mem_Free(pe->blockmap);
+            } else if (!OpenGrainDir(pe)) {
+               pe->pGD = CloseGrainDir(pe->pGD);
             }
          }
       } else {
@@ -734,7 +1049,7 @@ static void
 OpenCommon(CPFN fn, PVMDK pVMDK)
 // Open/init stuff common to VMDK and RAW.
 {
-   static char path[4096],extfn[4096];
+   char path[4096],extfn[4096];
    int i;
 
    VDDR_LastError = 0;
@@ -769,6 +1084,8 @@ OpenCommon(CPFN fn, PVMDK pVMDK)
          else {
             FILE f = pVMDK->extent[i].f;
             if (f==((FILE)0) || f==NULLFILE) break;
+            VMDKZ_Destroy(pVMDK->extent[i].hGrains); // before the close, the workers read from f.
+            CloseGrainDir(pVMDK->extent[i].pGD);
             File_Close(f);
             Mem_Free(pVMDK->extent[i].blockmap);
          }
@@ -879,12 +1196,28 @@ RawReadPage(PEXTENT pe, void *buffer, UINT iPage, UINT offset, UINT length)
       if (pe->type == VMDK_EXT_TYPE_ZERO) {
          return VDDR_RSLT_BLANKPAGE;
       } else if (pe->type == VMDK_EXT_TYPE_SPARSE) {
-         SID = pe->blockmap[iPage];
+         if (pe->blockmap) SID = pe->blockmap[iPage];
+         else if (!GrainSector(pe,iPage,&SID)) return VDDR_RSLT_FAIL;
          if (SID==VMDK_PAGE_FREE) return VDDR_RSLT_NOTALLOC;
+         if (SID==VMDK_GTE_ZEROED) return VDDR_RSLT_BLANKPAGE;
       } else { // flat
          SID = iPage;
       }
 
+      if (pe->hGrains) {
+         // compressed grain, SID is the sector holding its header, not its data.
+         UINT rslt, OSError = 0;
+         rslt = VMDKZ_Read(pe->hGrains, iPage, offset, buffer, length, &OSError);
+         if (rslt==VMDKZ_OK) return VDDR_RSLT_NORMAL;
+         if (rslt==VMDKZ_ERR_READ) {
+            VDDR_LastError = VMDKR_ERR_READ;
+            OSLastError = OSError;
+         } else {
+            VDDR_LastError = VMDKR_ERR_BLOCKMAP;
+         }
+         return VDDR_RSLT_FAIL;
+      }
+
       SID += offset;
       
       if (pe->buff) {
@@ -893,16 +1226,12 @@ RawReadPage(PEXTENT pe, void *buffer, UINT iPage, UINT offset, UINT length)
          Mem_Copy(buffer, pe->buff+(SID<<9), length);
          return VDDR_RSLT_NORMAL;
       } else {
-         VDDR_LastError = VMDKR_ERR_SEEK;
-         OSLastError = DoSeek(pe->f, ((HUGE)SID)<<9);
-         if (OSLastError==0) {
-            VDDR_LastError = VMDKR_ERR_READ;
-            if (File_RdBin(pe->f, buffer, length)==length) {
-               VDDR_LastError = 0;
-               return VDDR_RSLT_NORMAL;
-            }
-            OSLastError = File_IOresult();
+         VDDR_LastError = VMDKR_ERR_READ;
+         if (File_ReadAt(pe->f, buffer, length, ((HUGE)SID)<<9)==length) {
+            VDDR_LastError = 0;
+            return VDDR_RSLT_NORMAL;
          }
+         OSLastError = File_IOresult();
       }
    }
    return VDDR_RSLT_FAIL;
@@ -1085,9 +1414,11 @@ BlockStatus(PVMDK pVMDK, HUGE LBA_start, HUGE LBA_end)
          if (pe->type==VMDK_EXT_TYPE_FLAT) return VDDR_RSLT_NORMAL;
          if (pe->type==VMDK_EXT_TYPE_ZERO) rslt = VDDR_RSLT_BLANKPAGE;
          if (pe->type==VMDK_EXT_TYPE_SPARSE) {
-            UINT SID = LO32(LBA>>pe->SPBshift);
-            if (pe->blockmap[SID]!=VMDK_PAGE_FREE) return VDDR_RSLT_NORMAL;
-            if (pVMDK->hVDIparent) {
+            UINT grain = GrainStatus(pe, LO32(LBA>>pe->SPBshift));
+            if (grain==VDDR_RSLT_NORMAL) return VDDR_RSLT_NORMAL;
+            if (grain==VDDR_RSLT_BLANKPAGE) {
+               rslt = VDDR_RSLT_BLANKPAGE; // a zeroed grain hides the parent.
+            } else if (pVMDK->hVDIparent) {
                UINT sub_rslt = BlockStatus((PVMDK)(pVMDK->hVDIparent), LBA_start, LBA_start+stepsize-1);
                if (sub_rslt==VDDR_RSLT_NORMAL) return sub_rslt;
                if (rslt==VDDR_RSLT_NOTALLOC) rslt = sub_rslt;
@@ -1114,6 +1445,8 @@ VMDKR_Close(HVDDR pThis)
       for (i=0; i<pVMDK->hdr->nExtents; i++) {
          if (pVMDK->extent[i].buff) Mem_Free(pVMDK->extent[i].buff);
          else {
+            VMDKZ_Destroy(pVMDK->extent[i].hGrains);
+            CloseGrainDir(pVMDK->extent[i].pGD);
             File_Close(pVMDK->extent[i].f);
             Mem_Free(pVMDK->extent[i].blockmap);
          }
@@ -1261,10 +1594,8 @@ CheckRawFileType(PVMDK pVMDK, BYTE *MBR, UINT nSectors, UINT DiskSectors)
          if (FileSystem) {
             BYTE *pTrack0 = Mem_Alloc(MEMF_ZEROINIT, 63*512);
             PPART pPart;
+            BYTE *Template_MBR = Env_LoadBinData("MBR_TEMPLATE"); // binary data (RCDATA) loaded from resource file.
             UINT i;
-            if (!Template_MBR) {
-               Template_MBR = Env_LoadBinData("MBR_TEMPLATE");
-            }
             Mem_Copy(pTrack0, Template_MBR, 512);
             for (i=440; i<444; i++) pTrack0[i] = (BYTE)Random_Integer(256); // disk signature used by NT and others.
             pPart = (PPART)(pTrack0+446);
@@ -13,6 +13,7 @@
 
 #include "djtypes.h"
 #include "djfile.h"
+#include "vmdkz.h"
 
 #define VMDK_FORMAT_VER          1
 #define VMDK_MAGIC_NUM           0x564D444B /* 'VMDK' */
@@ -20,7 +21,25 @@
 #define VMDK_PAGE_FREE           0
 
 #define VMDK_COMPRESSION_NONE    0
-#define VMDK_COMPRESSION_DEFLATE 0
+#define VMDK_COMPRESSION_DEFLATE 1
+
+// sparse extent header flags, and other stream optimized format details.
+#define VMDK_FLAG_COMPRESSED     0x00010000 /* grains are compressed */
+#define VMDK_FLAG_MARKERS        0x00020000 /* metadata is preceded by markers */
+#define VMDK_GD_AT_END           ((HUGE)-1) /* gdOffset: the grain directory is given by the footer */
+#define VMDK_GTE_ZEROED          1          /* grain table entry for a grain which reads as zeros */
+
+#define VMDK_MARKER_EOS          0 /* end of stream */
+#define VMDK_MARKER_GT           1 /* grain table follows */
+#define VMDK_MARKER_GD           2 /* grain directory follows */
+#define VMDK_MARKER_FOOTER       3 /* footer (a copy of the header) follows */
+
+typedef struct { // marker which precedes each block of metadata in a stream optimized extent (one sector).
+   HUGE val;     // sectors of metadata which follow, or for a grain, its LBA.
+   UINT size;    // 0 for a metadata marker, or for a grain, the compressed size.
+   UINT type;    // VMDK_MARKER_xxx, only valid if size==0.
+   BYTE pad[496];
+} VMDK_MARKER;
 
 // parse flags, used to detect when something important is missing from descriptor.
 #define VMDK_PARSED_VERSION      0x0001
@@ -47,7 +66,7 @@
 #define VMDK_CRTYPE_2GBFLAT      4 /* split flat */
 #define VMDK_CRTYPE_FULLDEVICE   5 /* Direct access to a whole raw disk */
 #define VMDK_CRTYPE_PARTDEVICE   6 /* Direct access to a raw disk partition */
-#define VMDK_CRTYPE_STREAMOPT    7 /* Compressed data stream (not supported) */
+#define VMDK_CRTYPE_STREAMOPT    7 /* Compressed data stream (read only, see vmdkz.h) */
 
 // Extent I/O modes (first field of descriptor line.
 #define VMDK_EXT_IOMODE_RW       1
@@ -142,7 +161,9 @@ typedef struct { // runtime info about a descriptor.
    UINT SPBshift;                  // Only valid for sparse extents.
    int  PageReadResult;
    BYTE *buff;                     // only used by dummy extents built in memory.
-   UINT *blockmap;
+   UINT *blockmap;                 // whole block map, only built for extents with compressed grains.
+   HVMDKZ hGrains;                 // decoder for compressed grains, NULL if the grains are not compressed.
+   struct t_GRAINDIR *pGD;         // grain directory and grain table cache, for other sparse extents.
 } VMDK_EXTENT, *PEXTENT;
 
 #endif
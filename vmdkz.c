@@ -0,0 +1,422 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+/* Compressed grain reader. Decompressed grains are kept in a small set of slots. A
+ * read which misses the cache decodes the grain on the calling thread rather than
+ * waiting for a worker, then queues the grains after it (up to Depth grains ahead)
+ * for the workers, lowest grain first. A read which finds its grain queued but not
+ * yet started takes it over, and one which finds it being decoded waits for it.
+ * Slots which are queued or being decoded are never evicted, the rest go in least
+ * recently used order.
+ */
+
+#include "djwarning.h"
+#include <windef.h>
+#include <winbase.h>
+#include "vmdkz.h"
+#include "inflate.h"
+#include "mem.h"
+
+#define VMDKZ_MAX_WORKERS 8   /* most decompression threads per extent */
+#define VMDKZ_MIN_SLOTS   4   /* smallest cache worth having */
+#define VMDKZ_MAX_SLOTS   66  /* enough for VMDKZ_MAX_WORKERS*4 grains of read-ahead */
+#define VMDKZ_SPAN_SCAN   64  /* how far GrainSpan() looks for the next stored grain */
+#define VMDKZ_NOT_STORED  1   /* blockmap entries up to this (free or zeroed grains) have no data */
+
+#define GRAIN_FREE   0 /* slot holds nothing */
+#define GRAIN_QUEUED 1 /* waiting for a worker */
+#define GRAIN_BUSY   2 /* being decoded */
+#define GRAIN_DONE   3 /* decoded, or failed to */
+
+#define NO_GRAIN 0xFFFFFFFF
+
+typedef struct {
+   UINT iGrain;      // the grain this slot holds, NO_GRAIN if none.
+   UINT state;       // GRAIN_xxx.
+   UINT result;      // VMDKZ_xxx, once GRAIN_DONE.
+   UINT OSError;     // for VMDKZ_ERR_READ.
+   UINT tUsed;       // last use, or when queued. Lower is older.
+   HANDLE hDone;     // manual reset event, clear while the slot is queued or busy.
+   BYTE *data;       // the decompressed grain.
+} GRAIN_SLOT;
+
+typedef struct t_VMDKZ {
+   CRITICAL_SECTION cs;       // guards the slots and everything below.
+   FILE f;
+   UINT *blockmap;            // borrowed from the extent.
+   UINT nGrains;
+   UINT GrainBytes;
+   UINT SpanMax;              // in sectors: the most a compressed grain can take up.
+   UINT nSlots;
+   UINT Depth;                // how many grains are read ahead.
+   UINT iAhead;               // the last grain queued so far.
+   UINT tClock;
+   GRAIN_SLOT *slot;
+   BYTE *data;                // memory for all the slots.
+   HBUDGET hBudget;           // the budget data was charged to.
+   HANDLE hWorkSem;           // released once for each grain queued.
+   HANDLE hThread[VMDKZ_MAX_WORKERS];
+   UINT nWorkers;             // threads wanted ...
+   UINT nThreads;             // ... and started so far.
+   BOOL bStarted;
+   BOOL bStop;
+} VMDKZ_INFO, *PVMDKZ;
+
+/*.....................................................*/
+
+static UINT
+DefaultWorkerCount(void)
+// One thread per CPU, but none at all on one CPU: there read-ahead just competes
+// with the thread which wants the data.
+{
+   SYSTEM_INFO si;
+   UINT n;
+   GetSystemInfo(&si);
+   n = si.dwNumberOfProcessors;
+   if (n<2) n = 0;
+   if (n>VMDKZ_MAX_WORKERS) n = VMDKZ_MAX_WORKERS;
+   return n;
+}
+
+/*.....................................................*/
+
+static UINT
+GrainSpan(PVMDKZ h, UINT iGrain)
+// Guesses the sectors taken by grain iGrain from where the next stored grain starts. A
+// stream optimized file is written in grain order, so that is usually exact (or a grain
+// table too long). Anything else gives SpanMax, and DecodeGrain() copes with a guess
+// which is too small.
+{
+   UINT SID = h->blockmap[iGrain];
+   UINT j,jEnd = iGrain+VMDKZ_SPAN_SCAN;
+   if (jEnd>h->nGrains) jEnd = h->nGrains;
+   for (j=iGrain+1; j<jEnd; j++) {
+      if (h->blockmap[j]>SID) {
+         if (h->blockmap[j]-SID < h->SpanMax) return h->blockmap[j]-SID;
+         break;
+      }
+   }
+   return h->SpanMax;
+}
+
+/*.....................................................*/
+
+static UINT
+DecodeGrain(PVMDKZ h, UINT iGrain, BYTE *dest, BYTE **ppIn, UINT *pInSize, UINT *pOSError)
+// Reads and decompresses one grain into dest. *ppIn is the caller's input buffer, of
+// *pInSize bytes, which is grown if need be. Needs no lock.
+{
+   HUGE pos = ((HUGE)h->blockmap[iGrain])<<9;
+   UINT nRead,nWant,CompSize,nOut;
+   HUGE lba;
+
+   nWant = (GrainSpan(h,iGrain)<<9);
+   if (nWant>*pInSize) {
+      BYTE *p = Mem_ReAlloc(*ppIn,0,nWant);
+      if (!p) return VMDKZ_ERR_READ;
+      *ppIn = p;
+      *pInSize = nWant;
+   }
+   nRead = File_ReadAt(h->f,*ppIn,nWant,pos); // may be short at the end of the file.
+   if (nRead<12) {
+      *pOSError = File_IOresult();
+      return VMDKZ_ERR_READ;
+   }
+
+   // each grain starts with its LBA and the size of the compressed data.
+   Mem_Copy(&lba,*ppIn,8);
+   Mem_Copy(&CompSize,*ppIn+8,4);
+   if (lba != ((HUGE)iGrain)*(h->GrainBytes>>9) || CompSize==0 || CompSize>(h->SpanMax<<9)) return VMDKZ_ERR_CORRUPT;
+   if (CompSize+12>nRead) { // the guess was too small.
+      nWant = CompSize+12;
+      if (nWant>*pInSize) {
+         BYTE *p = Mem_ReAlloc(*ppIn,0,nWant);
+         if (!p) return VMDKZ_ERR_READ;
+         *ppIn = p;
+         *pInSize = nWant;
+      }
+      if (File_ReadAt(h->f,*ppIn,nWant,pos)!=nWant) {
+         *pOSError = File_IOresult();
+         return VMDKZ_ERR_READ;
+      }
+   }
+
+   nOut = h->GrainBytes;
+   if (Inflate_Zlib(dest,&nOut,*ppIn+12,CompSize)!=INFLATE_OK) return VMDKZ_ERR_CORRUPT;
+   if (nOut<h->GrainBytes) Mem_Zero(dest+nOut,h->GrainBytes-nOut); // the last grain of a disk may be short.
+   return VMDKZ_OK;
+}
+
+/*.....................................................*/
+
+static GRAIN_SLOT *
+FindSlot(PVMDKZ h, UINT iGrain)
+// Must be called inside the critical section.
+{
+   UINT i;
+   for (i=0; i<h->nSlots; i++) {
+      if (h->slot[i].iGrain==iGrain) return h->slot+i;
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+static GRAIN_SLOT *
+ClaimSlot(PVMDKZ h, UINT iGrain)
+// Takes the least recently used slot which isn't queued or busy, and gives it to iGrain.
+// Returns NULL if every slot is queued or busy. Must be called inside the critical section.
+{
+   GRAIN_SLOT *pSlot = NULL;
+   UINT i;
+   for (i=0; i<h->nSlots; i++) {
+      GRAIN_SLOT *p = h->slot+i;
+      if (p->state==GRAIN_FREE) {
+         pSlot = p;
+         break;
+      }
+      if (p->state==GRAIN_DONE && (!pSlot || p->tUsed<pSlot->tUsed)) pSlot = p;
+   }
+   if (pSlot) {
+      pSlot->iGrain = iGrain;
+      pSlot->state = GRAIN_FREE;
+   }
+   return pSlot;
+}
+
+/*.....................................................*/
+
+static DWORD WINAPI
+WorkerThread(LPVOID lpParam)
+{
+   PVMDKZ h = (PVMDKZ)lpParam;
+   GRAIN_SLOT *pSlot;
+   BYTE *pIn = NULL;
+   UINT InSize = 0;
+   UINT i,iGrain,rslt,OSError;
+
+   for (;;) {
+      WaitForSingleObject(h->hWorkSem,INFINITE);
+      EnterCriticalSection(&h->cs);
+      if (h->bStop) {
+         LeaveCriticalSection(&h->cs);
+         break;
+      }
+      // the oldest queued grain. There may be none, if readers took them over.
+      pSlot = NULL;
+      for (i=0; i<h->nSlots; i++) {
+         GRAIN_SLOT *p = h->slot+i;
+         if (p->state==GRAIN_QUEUED && (!pSlot || p->tUsed<pSlot->tUsed)) pSlot = p;
+      }
+      iGrain = NO_GRAIN;
+      if (pSlot) {
+         pSlot->state = GRAIN_BUSY;
+         iGrain = pSlot->iGrain;
+      }
+      LeaveCriticalSection(&h->cs);
+
+      if (pSlot) {
+         OSError = 0;
+         rslt = DecodeGrain(h,iGrain,pSlot->data,&pIn,&InSize,&OSError);
+         EnterCriticalSection(&h->cs);
+         pSlot->result = rslt;
+         pSlot->OSError = OSError;
+         pSlot->state = GRAIN_DONE;
+         SetEvent(pSlot->hDone);
+         LeaveCriticalSection(&h->cs);
+      }
+   }
+   Mem_Free(pIn);
+   return 0;
+}
+
+/*.....................................................*/
+
+static void
+ReadAhead(PVMDKZ h, UINT iGrain)
+// Queues the stored grains after iGrain which aren't cached yet. Must be called inside
+// the critical section.
+{
+   GRAIN_SLOT *pSlot;
+   UINT i,iEnd;
+
+   if (!h->nWorkers) return;
+   if (!h->bStarted) { // the workers start on the first read, so an extent which is only opened costs no threads.
+      DWORD tid;
+      h->bStarted = TRUE;
+      for (i=0; i<h->nWorkers; i++) {
+         HANDLE hThread = CreateThread(NULL,0,WorkerThread,h,0,&tid);
+         if (!hThread) break;
+         h->hThread[h->nThreads++] = hThread;
+      }
+   }
+   if (!h->nThreads) return;
+
+   iEnd = iGrain+1+h->Depth;
+   if (iEnd>h->nGrains) iEnd = h->nGrains;
+   i = iGrain+1;
+   if (h->iAhead!=NO_GRAIN && h->iAhead>=i && h->iAhead<iEnd) i = h->iAhead+1; // already queued up to there.
+   for (; i<iEnd; i++) {
+      if (h->blockmap[i]<=VMDKZ_NOT_STORED || FindSlot(h,i)) continue;
+      pSlot = ClaimSlot(h,i);
+      if (!pSlot) break;
+      pSlot->state = GRAIN_QUEUED;
+      pSlot->tUsed = ++h->tClock;
+      ResetEvent(pSlot->hDone);
+      ReleaseSemaphore(h->hWorkSem,1,NULL);
+   }
+   h->iAhead = i-1;
+}
+
+/*.....................................................*/
+
+PUBLIC HVMDKZ
+VMDKZ_Create(FILE f, UINT *blockmap, UINT nGrains, UINT SectorsPerGrain)
+{
+   PVMDKZ h = Mem_Alloc(MEMF_ZEROINIT,sizeof(VMDKZ_INFO));
+   UINT i;
+
+   if (!h) return NULL;
+   h->f = f;
+   h->blockmap = blockmap;
+   h->nGrains = nGrains;
+   h->GrainBytes = (SectorsPerGrain<<9);
+   h->SpanMax = SectorsPerGrain + (SectorsPerGrain>>6) + 2; // deflate's worst case expansion, plus the grain header.
+   h->iAhead = NO_GRAIN;
+   h->nWorkers = DefaultWorkerCount();
+   h->nSlots = h->nWorkers*8+2;
+   if (h->nSlots<VMDKZ_MIN_SLOTS) h->nSlots = VMDKZ_MIN_SLOTS;
+   if (h->nSlots>VMDKZ_MAX_SLOTS) h->nSlots = VMDKZ_MAX_SLOTS;
+   if (h->nSlots*(h->GrainBytes>>10) > VMDKZ_DEFAULT_KB) h->nSlots = VMDKZ_DEFAULT_KB/(h->GrainBytes>>10);
+   if (h->nSlots<VMDKZ_MIN_SLOTS) h->nSlots = VMDKZ_MIN_SLOTS;
+
+   // settle for fewer slots if the memory budget won't run to the full cache.
+   h->hBudget = Mem_GetThreadBudget();
+   for (;;) {
+      if (Mem_Charge(h->hBudget,h->nSlots*h->GrainBytes)) {
+         h->data = Mem_Alloc(0,h->nSlots*h->GrainBytes);
+         if (h->data) break;
+         Mem_Uncharge(h->hBudget,h->nSlots*h->GrainBytes);
+      }
+      if (h->nSlots<=VMDKZ_MIN_SLOTS) {
+         Mem_Free(h);
+         return NULL;
+      }
+      h->nSlots >>= 1;
+      if (h->nSlots<VMDKZ_MIN_SLOTS) h->nSlots = VMDKZ_MIN_SLOTS;
+   }
+   h->Depth = (h->nSlots-2)/2; // half the slots for read-ahead, the rest hold grains being re-read.
+
+   InitializeCriticalSection(&h->cs);
+   h->slot = Mem_Alloc(MEMF_ZEROINIT,h->nSlots*sizeof(GRAIN_SLOT));
+   h->hWorkSem = CreateSemaphore(NULL,0,h->nSlots+VMDKZ_MAX_WORKERS,NULL);
+   if (!h->slot || !h->hWorkSem) return VMDKZ_Destroy(h);
+   for (i=0; i<h->nSlots; i++) {
+      h->slot[i].iGrain = NO_GRAIN;
+      h->slot[i].data = h->data + i*h->GrainBytes;
+      h->slot[i].hDone = CreateEvent(NULL,TRUE,TRUE,NULL);
+      if (!h->slot[i].hDone) return VMDKZ_Destroy(h);
+   }
+   return h;
+}
+
+/*.....................................................*/
+
+PUBLIC UINT
+VMDKZ_Read(HVMDKZ h, UINT iGrain, UINT SectorOffset, PVOID dest, UINT nBytes, UINT *pOSError)
+{
+   GRAIN_SLOT *pSlot;
+   UINT rslt;
+
+   EnterCriticalSection(&h->cs);
+   for (;;) {
+      pSlot = FindSlot(h,iGrain);
+      if (!pSlot || pSlot->state!=GRAIN_BUSY) break;
+      // a worker is on it. By the time the wait is over the slot may hold another grain.
+      LeaveCriticalSection(&h->cs);
+      WaitForSingleObject(pSlot->hDone,INFINITE);
+      EnterCriticalSection(&h->cs);
+   }
+
+   if (!pSlot || pSlot->state!=GRAIN_DONE) {
+      // not cached, or queued but not started: decode it here rather than wait.
+      BYTE *pIn = NULL;
+      UINT InSize = 0;
+      UINT OSError = 0;
+
+      if (!pSlot) pSlot = ClaimSlot(h,iGrain);
+      if (pSlot) {
+         pSlot->state = GRAIN_BUSY;
+         ResetEvent(pSlot->hDone);
+      }
+      ReadAhead(h,iGrain);
+      LeaveCriticalSection(&h->cs);
+
+      if (!pSlot) { // every slot is spoken for, so decode into a buffer of our own.
+         BYTE *pGrain = Mem_Alloc(0,h->GrainBytes);
+         rslt = VMDKZ_ERR_READ;
+         if (pGrain) {
+            rslt = DecodeGrain(h,iGrain,pGrain,&pIn,&InSize,&OSError);
+            if (rslt==VMDKZ_OK) Mem_Copy(dest,pGrain+(SectorOffset<<9),nBytes);
+            Mem_Free(pGrain);
+         }
+         Mem_Free(pIn);
+         *pOSError = OSError;
+         return rslt;
+      }
+
+      rslt = DecodeGrain(h,iGrain,pSlot->data,&pIn,&InSize,&OSError);
+      Mem_Free(pIn);
+      EnterCriticalSection(&h->cs);
+      pSlot->result = rslt;
+      pSlot->OSError = OSError;
+      pSlot->state = GRAIN_DONE;
+      SetEvent(pSlot->hDone);
+   } else {
+      ReadAhead(h,iGrain); // a hit still moves the read-ahead window along.
+   }
+
+   rslt = pSlot->result;
+   *pOSError = pSlot->OSError;
+   if (rslt==VMDKZ_OK) Mem_Copy(dest,pSlot->data+(SectorOffset<<9),nBytes);
+   pSlot->tUsed = ++h->tClock;
+   LeaveCriticalSection(&h->cs);
+   return rslt;
+}
+
+/*.....................................................*/
+
+PUBLIC HVMDKZ
+VMDKZ_Destroy(HVMDKZ h)
+{
+   if (h) {
+      UINT i;
+      if (h->nThreads) {
+         EnterCriticalSection(&h->cs);
+         h->bStop = TRUE;
+         LeaveCriticalSection(&h->cs);
+         ReleaseSemaphore(h->hWorkSem,h->nThreads,NULL);
+         WaitForMultipleObjects(h->nThreads,h->hThread,TRUE,INFINITE);
+         for (i=0; i<h->nThreads; i++) CloseHandle(h->hThread[i]);
+      }
+      if (h->slot) {
+         for (i=0; i<h->nSlots; i++) {
+            if (h->slot[i].hDone) CloseHandle(h->slot[i].hDone);
+         }
+         Mem_Free(h->slot);
+      }
+      if (h->hWorkSem) CloseHandle(h->hWorkSem);
+      DeleteCriticalSection(&h->cs);
+      Mem_Free(h->data);
+      Mem_Uncharge(h->hBudget,h->nSlots*h->GrainBytes);
+      Mem_Free(h);
+   }
+   return NULL;
+}
+
+/*.....................................................*/
+
+/* end of vmdkz.c */
@@ -0,0 +1,49 @@
+/*================================================================================*/
+/* Copyright (C) 2009, Don Milne.                                                 */
+/* All rights reserved.                                                           */
+/* See LICENSE.TXT for conditions on copying, distribution, modification and use. */
+/*================================================================================*/
+
+#ifndef VMDKZ_H
+#define VMDKZ_H
+
+/*================================================================================*/
+/* Compressed grain reader for stream optimized VMDK extents. Each grain is a     */
+/* separate zlib stream, so grains can be decompressed independently: a pool of   */
+/* worker threads decompresses the grains which follow the one being read, into a */
+/* small cache, so that sequential reads (a clone) run at disk speed rather than  */
+/* at the speed of one core inflating.                                            */
+/*================================================================================*/
+
+#include "djtypes.h"
+#include "djfile.h"
+
+#define VMDKZ_OK          0
+#define VMDKZ_ERR_READ    1 /* I/O error reading the grain */
+#define VMDKZ_ERR_CORRUPT 2 /* bad grain header, or the compressed data is corrupt */
+
+#define VMDKZ_DEFAULT_KB  8192 /* most memory the cache of decompressed grains may use */
+
+typedef struct t_VMDKZ *HVMDKZ;
+
+HVMDKZ VMDKZ_Create(FILE f, UINT *blockmap, UINT nGrains, UINT SectorsPerGrain);
+/* Creates a reader for the compressed grains of one extent. blockmap[] gives the sector
+ * of each grain's header in file f (0 for a free grain or 1 for a zeroed one, neither of
+ * which is stored), and is borrowed: it must not change or be freed until the reader is
+ * destroyed. The cache is charged to the calling thread's memory budget (see Mem_Charge()),
+ * and is made smaller if the budget won't cover it. The worker threads aren't started until the first read. Returns NULL if
+ * out of memory.
+ */
+
+UINT VMDKZ_Read(HVMDKZ h, UINT iGrain, UINT SectorOffset, PVOID dest, UINT nBytes, UINT *pOSError);
+/* Copies nBytes of grain iGrain, starting SectorOffset sectors into the grain, to dest.
+ * The grain must be a stored one. Returns VMDKZ_OK or a VMDKZ_ERR_xxx code, and for
+ * VMDKZ_ERR_READ the OS error code goes to *pOSError. Also queues the next few grains for
+ * the workers. May be called from several threads at once.
+ */
+
+HVMDKZ VMDKZ_Destroy(HVMDKZ h);
+/* Stops the workers and frees the reader. h may be NULL. Always returns NULL. */
+
+#endif
+
@@ -39,7 +39,7 @@
 #define XML_ERR_IDMISMATCH   14 /* closing tag ident doesn't match opening tag */
 #define XML_ERR_EXPCLOSETAG  15 /* expected close tag '>' char */
 
-static UINT LastError;
+static __declspec(thread) UINT LastError;
 static WORD CRCtable[256];
 
 // file reading stuff - only valid while parsing a new file.